@@ -0,0 +1,133 @@
+#include "all_partitions.h"
+#include "partition.h"
+#include "fat_cache.h"
+#include "hash.h"
+#include "geometry.h"
+
+#include <pthread.h>
+
+typedef struct partition_job_t
+{
+    block_device *dev;
+    const disk_partition *partition;
+    size_t fat_memory;
+    int thread_count;
+    int hash;
+    int hash_partition;
+    char *output; // everything the worker printed
+    size_t output_size;
+    int status;
+} partition_job;
+
+static int analyze_partition(partition_job *job, FILE *out)
+{
+    const partition_entry *entry = &job->partition->entry;
+    if (entry->total_sectors == 0)
+    {
+        fprintf(stderr, "Error: partition %d lies beyond the 2 TiB addressable with 32-bit sectors\n", job->partition->number);
+        return 1;
+    }
+
+    boot_sector bs;
+    boot_sector_status bs_status = extract_bs(job->dev, entry, &bs);
+    if (bs_status != BOOT_SECTOR_OK)
+    {
+        fprintf(stderr, "Error: partition %d: %s\n", job->partition->number, boot_sector_strerror(bs_status));
+        return 1;
+    }
+    volume_geometry geometry;
+    geometry_init(&geometry, &bs, entry);
+    fat_table fat;
+    if (fat_table_load(job->dev, &bs, &geometry, job->fat_memory, &fat) != 0)
+    {
+        fprintf(stderr, "Error: partition %d: cannot load the FAT\n", job->partition->number);
+        return 1;
+    }
+
+    int status = 0;
+    if (job->hash)
+        status = hash_volume(job->dev, &fat, &bs, &geometry, job->thread_count, job->hash_partition, out);
+    else
+    {
+        print_bootsector(&bs, out);
+        fprintf(out, "\nfile / directory tree:\n");
+        status = print_tree(job->dev, &fat, bs.root_cluster, &geometry, job->thread_count, out);
+    }
+    fat_table_free(&fat);
+    return status;
+}
+
+static void *partition_worker(void *argument)
+{
+    partition_job *job = argument;
+    FILE *out = open_memstream(&job->output, &job->output_size);
+    if (!out)
+    {
+        perror("Error");
+        job->status = 1;
+        return NULL;
+    }
+
+    job->status = analyze_partition(job, out);
+    fclose(out);
+    return NULL;
+}
+
+int analyze_all_partitions(block_device *dev, const disk_layout *layout, size_t fat_memory, int thread_count, int hash, int hash_partition, FILE *out)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < layout->count; i++)
+        count += layout->partitions[i].filesystem == FILESYSTEM_FAT32;
+    if (count == 0)
+    {
+        fprintf(stderr, "Error: no FAT32 partition found\n");
+        return 1;
+    }
+
+    partition_job *jobs = calloc(count, sizeof(partition_job));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    int *started = calloc(count, sizeof(int));
+    if (!jobs || !threads || !started)
+    {
+        perror("Error");
+        free(jobs);
+        free(threads);
+        free(started);
+        return 1;
+    }
+
+    uint32_t job_count = 0;
+    for (uint32_t i = 0; i < layout->count; i++)
+    {
+        if (layout->partitions[i].filesystem != FILESYSTEM_FAT32)
+            continue;
+        partition_job *job = &jobs[job_count];
+        job->dev = dev;
+        job->partition = &layout->partitions[i];
+        job->fat_memory = fat_memory / count;
+        job->thread_count = thread_count / (int)count > 1 ? thread_count / (int)count : 1;
+        job->hash = hash;
+        job->hash_partition = hash_partition;
+        started[job_count] = pthread_create(&threads[job_count], NULL, partition_worker, job) == 0;
+        if (!started[job_count])
+            partition_worker(job);
+        job_count++;
+    }
+
+    int status = 0;
+    for (uint32_t i = 0; i < job_count; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        fprintf(out, "%s==> partition %d <==\n", i == 0 ? "" : "\n", jobs[i].partition->number);
+        if (jobs[i].output)
+            fwrite(jobs[i].output, 1, jobs[i].output_size, out);
+        free(jobs[i].output);
+        status |= jobs[i].status;
+    }
+
+    free(jobs);
+    free(threads);
+    free(started);
+    return status;
+}
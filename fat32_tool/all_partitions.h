@@ -0,0 +1,17 @@
+#ifndef ALL_PARTITIONS_H
+#define ALL_PARTITIONS_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "disk_layout.h"
+
+/*
+ * analyze every FAT32 partition of the layout concurrently, one worker thread per partition: the boot sector and
+ * the tree, or the hash manifest with hash (and the partition range with hash_partition). Each worker writes into
+ * its own memory buffer, and the buffers are written to out in partition order, each after a
+ * "==> partition <number> <==" header, so the output does not depend on scheduling. fat_memory and thread_count
+ * are shared between the workers. Return non-zero if a partition could not be analyzed completely.
+ */
+int analyze_all_partitions(block_device *dev, const disk_layout *layout, size_t fat_memory, int thread_count, int hash, int hash_partition, FILE *out);
+
+#endif
@@ -0,0 +1,427 @@
+#include "async_io.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// io_uring is used through its system calls, older C libraries do not name them
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+enum
+{
+    SLOT_FREE,
+    SLOT_IN_FLIGHT,
+    SLOT_DONE,
+    SLOT_FAILED,
+};
+
+/*
+ * submission and completion rings shared with the kernel
+ */
+typedef struct uring_t
+{
+    int fd;
+    int image_fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned unsubmitted; // entries queued in the ring and not handed to the kernel yet
+} uring;
+
+typedef struct thread_pool_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t queued;   // a request was submitted, or the pool is closing
+    pthread_cond_t finished; // a request completed
+    uint64_t next;           // number of the next request a worker takes
+    int closing;
+    int thread_count;
+    pthread_t threads[ASYNC_IO_POOL_THREADS];
+} thread_pool;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_close(uring *ring)
+{
+    // closing the ring waits for the reads the kernel still holds, so the buffers can be freed afterwards
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+/*
+ * create a ring of at least depth entries, NULL if the kernel does not support or allow io_uring
+ */
+static uring *uring_open(int image_fd, uint32_t depth)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = uring_setup(depth, &params);
+    if (fd < 0)
+        return NULL;
+
+    uring *ring = calloc(1, sizeof(uring));
+    if (!ring)
+    {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->image_fd = image_fd;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // recent kernels map both rings at once
+    int single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map && ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+
+    void *sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->sq_ring = sq_ring == MAP_FAILED ? NULL : sq_ring;
+    void *cq_ring = single_map ? sq_ring : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->cq_ring = cq_ring == MAP_FAILED ? NULL : cq_ring;
+    void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ring->sqes = sqes == MAP_FAILED ? NULL : sqes;
+    if (!ring->sq_ring || !ring->cq_ring || !ring->sqes)
+    {
+        uring_close(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    uint8_t *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return ring;
+}
+
+/*
+ * queue the part of a request not read yet. There are never more requests in flight than slots, and the ring has
+ * at least as many entries, so it cannot be full.
+ */
+static void uring_queue(uring *ring, async_io_request *request, uint32_t slot)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    request->iov.iov_base = request->buffer + request->done;
+    request->iov.iov_len = request->size - request->done;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = ring->image_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&request->iov;
+    sqe->len = 1;
+    sqe->off = request->offset + request->done;
+    sqe->user_data = slot;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+}
+
+/*
+ * process the completions posted so far, queueing the rest of short reads again. Return the number processed.
+ */
+static unsigned uring_reap(async_io *io, uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+    for (; head != tail; head++, count++)
+    {
+        const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uint32_t slot = (uint32_t)cqe->user_data;
+        async_io_request *request = &io->requests[slot];
+        int result = cqe->res;
+
+        if (result == -EINTR || result == -EAGAIN)
+            uring_queue(ring, request, slot);
+        else if (result <= 0)
+            request->state = SLOT_FAILED;
+        else
+        {
+            stats_access(request->offset + request->done, (size_t)result, 0);
+            request->done += (size_t)result;
+            if (request->done < request->size)
+                uring_queue(ring, request, slot);
+            else
+                request->state = SLOT_DONE;
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+/*
+ * hand the queued entries to the kernel and wait until the request has completed
+ */
+static void uring_wait(async_io *io, uring *ring, async_io_request *request)
+{
+    while (request->state == SLOT_IN_FLIGHT)
+    {
+        if (uring_reap(io, ring) > 0)
+            continue;
+
+        int submitted = uring_enter(ring->fd, ring->unsubmitted, 1, IORING_ENTER_GETEVENTS);
+        if (submitted < 0 && errno == EINTR)
+            continue;
+        if (submitted < 0)
+        {
+            // the kernel holds nothing it will complete, every read in flight is lost
+            for (uint32_t i = 0; i < io->depth; i++)
+                if (io->requests[i].state == SLOT_IN_FLIGHT)
+                    io->requests[i].state = SLOT_FAILED;
+            ring->unsubmitted = 0;
+            return;
+        }
+        ring->unsubmitted -= (unsigned)submitted;
+    }
+}
+
+static void *pool_main(void *argument)
+{
+    async_io *io = argument;
+    thread_pool *pool = io->backend;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (!pool->closing && pool->next == io->submitted)
+            pthread_cond_wait(&pool->queued, &pool->lock);
+        if (pool->next == io->submitted)
+            break;
+
+        // requests failed at submission are only waiting for delivery
+        async_io_request *request = &io->requests[pool->next++ % io->depth];
+        if (request->state != SLOT_IN_FLIGHT)
+            continue;
+        pthread_mutex_unlock(&pool->lock);
+        int status = block_device_read(io->dev, request->offset, request->size, request->buffer);
+        pthread_mutex_lock(&pool->lock);
+        request->state = status == 0 ? SLOT_DONE : SLOT_FAILED;
+        pthread_cond_broadcast(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void pool_close(async_io *io, thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->queued);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    io->backend = NULL;
+}
+
+static int pool_open(async_io *io)
+{
+    thread_pool *pool = calloc(1, sizeof(thread_pool));
+    if (!pool)
+        return 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    io->backend = pool;
+
+    int wanted = io->depth < ASYNC_IO_POOL_THREADS ? (int)io->depth : ASYNC_IO_POOL_THREADS;
+    while (pool->thread_count < wanted && pthread_create(&pool->threads[pool->thread_count], NULL, pool_main, io) == 0)
+        pool->thread_count++;
+    if (pool->thread_count == 0)
+    {
+        pool_close(io, pool);
+        return 1;
+    }
+    return 0;
+}
+
+int async_io_init(async_io *io, block_device *dev, uint32_t depth, size_t buffer_size)
+{
+    memset(io, 0, sizeof(*io));
+    io->dev = dev;
+    io->depth = depth ? depth : 1;
+    io->buffer_size = buffer_size;
+
+    // a mapped image is read in place, there is nothing to wait for
+    if (dev->map || dev->queue == BLOCK_DEVICE_QUEUE_SYNC)
+    {
+        io->kind = dev->map ? ASYNC_IO_MAPPED : ASYNC_IO_SYNC;
+        io->depth = 1;
+        if (!dev->map && !(io->buffers = malloc(buffer_size)))
+        {
+            perror("Error");
+            return 1;
+        }
+        return 0;
+    }
+
+    io->buffers = malloc((size_t)io->depth * buffer_size);
+    io->requests = calloc(io->depth, sizeof(async_io_request));
+    if (!io->buffers || !io->requests)
+    {
+        perror("Error");
+        free(io->buffers);
+        free(io->requests);
+        return 1;
+    }
+    for (uint32_t i = 0; i < io->depth; i++)
+        io->requests[i].buffer = io->buffers + (size_t)i * buffer_size;
+
+    io->kind = ASYNC_IO_URING;
+    if (dev->queue != BLOCK_DEVICE_QUEUE_THREADS && block_device_fd(dev) >= 0)
+        io->backend = uring_open(block_device_fd(dev), io->depth);
+    if (!io->backend)
+    {
+        if (dev->queue == BLOCK_DEVICE_QUEUE_URING)
+            fprintf(stderr, "Warning: io_uring cannot be used with this image, reads are spread over a pool of threads\n");
+        io->kind = ASYNC_IO_THREADS;
+        if (pool_open(io) != 0)
+        {
+            fprintf(stderr, "Error: cannot start the read threads\n");
+            free(io->buffers);
+            free(io->requests);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * wait for the oldest request and run its callback, unless the engine is stopped
+ */
+static void deliver_oldest(async_io *io)
+{
+    async_io_request *request = &io->requests[io->delivered % io->depth];
+    if (io->kind == ASYNC_IO_URING)
+        uring_wait(io, io->backend, request);
+    else
+    {
+        thread_pool *pool = io->backend;
+        pthread_mutex_lock(&pool->lock);
+        while (request->state == SLOT_IN_FLIGHT)
+            pthread_cond_wait(&pool->finished, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    int failed = request->state == SLOT_FAILED;
+    io->failed += failed;
+    if (!io->stopped && request->callback(failed ? NULL : request->buffer, request->size, request->context) != 0)
+        io->stopped = 1;
+    request->state = SLOT_FREE;
+    io->delivered++;
+}
+
+int async_io_submit(async_io *io, uint64_t offset, size_t size, async_io_callback callback, void *context)
+{
+    if (io->stopped)
+        return 1;
+    int valid = size <= io->buffer_size && offset <= io->dev->size && size <= io->dev->size - offset;
+
+    if (io->kind == ASYNC_IO_MAPPED || io->kind == ASYNC_IO_SYNC)
+    {
+        const uint8_t *data = valid ? block_device_get(io->dev, offset, size, io->buffers) : NULL;
+        io->submitted++;
+        io->delivered++;
+        io->failed += !data;
+        if (callback(data, size, context) != 0)
+            io->stopped = 1;
+        return io->stopped;
+    }
+
+    // every slot is taken: the oldest read has to be delivered first
+    if (io->submitted - io->delivered == io->depth)
+    {
+        deliver_oldest(io);
+        if (io->stopped)
+            return 1;
+    }
+
+    uint32_t slot = (uint32_t)(io->submitted % io->depth);
+    async_io_request *request = &io->requests[slot];
+    request->offset = offset;
+    request->size = size;
+    request->done = 0;
+    request->callback = callback;
+    request->context = context;
+    request->state = valid ? SLOT_IN_FLIGHT : SLOT_FAILED;
+
+    if (io->kind == ASYNC_IO_URING)
+    {
+        if (valid)
+            uring_queue(io->backend, request, slot);
+        io->submitted++;
+    }
+    else
+    {
+        thread_pool *pool = io->backend;
+        pthread_mutex_lock(&pool->lock);
+        io->submitted++;
+        pthread_cond_signal(&pool->queued);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return 0;
+}
+
+int async_io_drain(async_io *io)
+{
+    while (io->delivered < io->submitted)
+        deliver_oldest(io);
+    return io->failed != 0;
+}
+
+void async_io_free(async_io *io)
+{
+    async_io_drain(io);
+    if (io->kind == ASYNC_IO_URING)
+        uring_close(io->backend);
+    else if (io->kind == ASYNC_IO_THREADS)
+        pool_close(io, io->backend);
+    free(io->buffers);
+    free(io->requests);
+    memset(io, 0, sizeof(*io));
+}
@@ -0,0 +1,81 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include "utils.h"
+#include "block_device.h"
+
+#include <sys/uio.h>
+
+#define ASYNC_IO_DEFAULT_DEPTH 64 // reads kept in flight
+#define ASYNC_IO_POOL_THREADS 8   // threads of the pread fallback
+
+typedef enum async_io_kind_t
+{
+    ASYNC_IO_MAPPED,  // the image is mapped, reads are delivered on submission without copying
+    ASYNC_IO_URING,   // reads are queued to the kernel through io_uring
+    ASYNC_IO_THREADS, // reads are blocking reads spread over a pool of threads
+    ASYNC_IO_SYNC,    // one blocking read per submission, on the caller's thread
+} async_io_kind;
+
+/*
+ * receive the data of a read, in submission order. data stays valid until the callback returns, and is NULL if the
+ * read failed. Returning non-zero stops the engine: the reads in flight are waited for and their callbacks, like
+ * those of later reads, are skipped.
+ */
+typedef int (*async_io_callback)(const uint8_t *data, size_t size, void *context);
+
+typedef struct async_io_request_t
+{
+    uint64_t offset;
+    size_t size;
+    size_t done; // bytes read so far, io_uring reads may come back short
+    int state;
+    async_io_callback callback;
+    void *context;
+    uint8_t *buffer; // buffer of the slot, NULL for mapped reads
+    struct iovec iov;
+} async_io_request;
+
+/*
+ * reads queued against an image. Requests go to a ring of depth slots, each owning a buffer of buffer_size bytes,
+ * so memory is bounded and a submission waits for the oldest read once every slot is taken. Callbacks always run on
+ * the submitting thread in submission order, whatever order the reads complete in, so output stays deterministic.
+ */
+typedef struct async_io_t
+{
+    block_device *dev;
+    async_io_kind kind;
+    uint32_t depth;
+    size_t buffer_size;
+    uint8_t *buffers;
+    async_io_request *requests; // request number n sits in slot n % depth
+    uint64_t submitted;
+    uint64_t delivered; // requests whose callback ran or was skipped
+    int stopped;        // a callback returned non-zero
+    uint64_t failed;    // reads that failed
+    void *backend;      // io_uring or thread pool state
+} async_io;
+
+/*
+ * set up an engine of the kind dev->queue asks for. io_uring falls back to the thread pool when the kernel refuses
+ * it, and images the kernel cannot read directly (compressed ones) always use the pool. Return 0 on success.
+ */
+int async_io_init(async_io *io, block_device *dev, uint32_t depth, size_t buffer_size);
+
+/*
+ * queue a read of size bytes (at most buffer_size) at an image offset. A read outside the image fails like a read
+ * error. Return non-zero once the engine is stopped, in which case nothing is queued.
+ */
+int async_io_submit(async_io *io, uint64_t offset, size_t size, async_io_callback callback, void *context);
+
+/*
+ * wait for every queued read and run the remaining callbacks. Return non-zero if a read failed.
+ */
+int async_io_drain(async_io *io);
+
+/*
+ * drain the engine and release it
+ */
+void async_io_free(async_io *io);
+
+#endif
@@ -0,0 +1,337 @@
+#include "batch.h"
+#include "extent.h"
+#include "extract.h"
+#include "file.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * node of the trie of requested paths: one per path component
+ */
+typedef struct batch_node_t
+{
+    char name[SHORT_NAME_MAX];
+    struct batch_node_t **children; // sorted by name once the trie is complete
+    uint32_t child_count;
+    uint32_t child_capacity;
+    uint32_t *requests; // requests whose path ends at this node
+    uint32_t request_count;
+    uint32_t request_capacity;
+    uint32_t unresolved; // children not matched by a directory entry yet
+    int resolved;
+} batch_node;
+
+typedef struct batch_t
+{
+    block_device *dev;
+    fat_table *fat;
+    const volume_geometry *geometry;
+    batch_request *requests;
+    uint32_t request_count;
+    uint32_t request_capacity;
+} batch;
+
+typedef struct resolve_context_t
+{
+    batch *job;
+    batch_node *node;
+} resolve_context;
+
+static int grow(void **array, uint32_t *capacity, uint32_t count, size_t item_size)
+{
+    if (count < *capacity)
+        return 0;
+    uint32_t grown = *capacity ? *capacity * 2 : 8;
+    void *items = realloc(*array, grown * item_size);
+    if (!items)
+        return 1;
+    *array = items;
+    *capacity = grown;
+    return 0;
+}
+
+static batch_node *child_node(batch_node *node, const char *name)
+{
+    for (uint32_t i = 0; i < node->child_count; i++)
+    {
+        if (strcmp(node->children[i]->name, name) == 0)
+            return node->children[i];
+    }
+
+    if (grow((void **)&node->children, &node->child_capacity, node->child_count, sizeof(batch_node *)) != 0)
+        return NULL;
+    batch_node *child = calloc(1, sizeof(batch_node));
+    if (!child)
+        return NULL;
+    strcpy(child->name, name);
+    node->children[node->child_count++] = child;
+    return child;
+}
+
+static int compare_nodes(const void *a, const void *b)
+{
+    return strcmp((*(batch_node *const *)a)->name, (*(batch_node *const *)b)->name);
+}
+
+static void sort_trie(batch_node *node)
+{
+    // leaves have no child array
+    if (node->child_count > 1)
+        qsort(node->children, node->child_count, sizeof(batch_node *), compare_nodes);
+    node->unresolved = node->child_count;
+    for (uint32_t i = 0; i < node->child_count; i++)
+        sort_trie(node->children[i]);
+}
+
+static void free_trie(batch_node *node)
+{
+    for (uint32_t i = 0; i < node->child_count; i++)
+    {
+        free_trie(node->children[i]);
+        free(node->children[i]);
+    }
+    free(node->children);
+    free(node->requests);
+}
+
+/*
+ * parse "<path>[\t<destination>]" lines into requests and insert their paths in the trie
+ */
+static int read_requests(FILE *input, batch *job, batch_node *root)
+{
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    int status = 0;
+
+    while ((length = getline(&line, &line_size, input)) != -1)
+    {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            line[--length] = '\0';
+        if (length == 0)
+            continue;
+
+        char *destination = strchr(line, '\t');
+        if (destination)
+            *destination++ = '\0';
+
+        char *tokenized = strdup(line);
+        int num_tokens;
+        char **tokens = tokenized ? tokenize_path(tokenized, &num_tokens) : NULL;
+        if (!tokens || num_tokens == 0)
+        {
+            fprintf(stderr, "Error: skipping invalid path '%s'\n", line);
+            if (tokens)
+                free_path_tokens(tokens, num_tokens);
+            free(tokenized);
+            status = 1;
+            continue;
+        }
+
+        batch_node *node = root;
+        for (int i = 0; i < num_tokens && node; i++)
+            node = child_node(node, tokens[i]);
+        free_path_tokens(tokens, num_tokens);
+        free(tokenized);
+
+        if (!node ||
+            grow((void **)&job->requests, &job->request_capacity, job->request_count, sizeof(batch_request)) != 0 ||
+            grow((void **)&node->requests, &node->request_capacity, node->request_count, sizeof(uint32_t)) != 0)
+        {
+            perror("Error");
+            status = 1;
+            break;
+        }
+
+        batch_request *request = &job->requests[job->request_count];
+        memset(request, 0, sizeof(*request));
+        request->path = strdup(line);
+        request->destination = destination ? strdup(destination) : NULL;
+        node->requests[node->request_count++] = job->request_count++;
+    }
+
+    free(line);
+    return status;
+}
+
+static void resolve_directory(batch *job, batch_node *node, uint32_t cluster);
+
+/*
+ * match the entries of a chunk of directory clusters against the requested children of the trie node.
+ * Return 1 once every child is matched or the end of the directory is reached.
+ */
+static int resolve_directory_chunk(const uint8_t *data, uint64_t position, size_t size, void *context)
+{
+    resolve_context *resolve = context;
+    batch_node *node = resolve->node;
+    (void)position;
+
+    const directory_table_entry *entries = (const directory_table_entry *)data;
+    size_t entry_count = size / sizeof(directory_table_entry);
+
+    for (size_t i = 0; i < entry_count && node->unresolved > 0; i++)
+    {
+        if (entries[i].name[0] == END_ENTRY_NAME)
+            return 1;
+        if (entries[i].name[0] == FREE_ENTRY_NAME || (entries[i].attributes & VOLUME_LABEL_ATTRIBUTE))
+            continue;
+
+        batch_node key;
+        batch_node *key_pointer = &key;
+        format_entry_name(&entries[i], key.name);
+        batch_node **match = bsearch(&key_pointer, node->children, node->child_count, sizeof(batch_node *), compare_nodes);
+        if (!match || (*match)->resolved)
+            continue;
+
+        batch_node *child = *match;
+        if (entries[i].attributes & DIRECTORY_ATTRIBUTE)
+        {
+            // requests ending at a directory stay unresolved, only its content can be extracted
+            if (child->child_count == 0 || strcmp(child->name, ".") == 0 || strcmp(child->name, "..") == 0)
+                continue;
+            child->resolved = 1;
+            node->unresolved--;
+            resolve_directory(resolve->job, child, entry_first_cluster(&entries[i]));
+        }
+        else if (child->request_count > 0)
+        {
+            child->resolved = 1;
+            node->unresolved--;
+            for (uint32_t j = 0; j < child->request_count; j++)
+            {
+                batch_request *request = &resolve->job->requests[child->requests[j]];
+                request->file = entries[i];
+                request->found = 1;
+            }
+        }
+    }
+    return node->unresolved == 0;
+}
+
+static void resolve_directory(batch *job, batch_node *node, uint32_t cluster)
+{
+    extent_list clusters;
+    if (extent_list_build(job->fat, cluster, CHAIN_UNBOUNDED, &clusters) != 0)
+        return;
+
+    resolve_context resolve = {job, node};
+    extent_list_read(job->dev, job->geometry, &clusters, UINT64_MAX, resolve_directory_chunk, &resolve);
+    extent_list_free(&clusters);
+}
+
+static void resolve_from_index(batch *job, const dir_index *index)
+{
+    for (uint32_t i = 0; i < job->request_count; i++)
+    {
+        batch_request *request = &job->requests[i];
+        char *tokenized = strdup(request->path);
+        int num_tokens;
+        char **tokens = tokenized ? tokenize_path(tokenized, &num_tokens) : NULL;
+        if (tokens)
+        {
+            // rebuild the normalized "/dir/file" key
+            char path[DIR_INDEX_PATH_MAX] = "";
+            size_t length = 0;
+            for (int j = 0; j < num_tokens && length < sizeof(path); j++)
+                length += snprintf(path + length, sizeof(path) - length, "/%s", tokens[j]);
+
+            request->found = dir_index_lookup(index, path, &request->file) && !(request->file.attributes & DIRECTORY_ATTRIBUTE);
+            free_path_tokens(tokens, num_tokens);
+        }
+        free(tokenized);
+    }
+}
+
+/*
+ * data clusters are laid out in cluster number order, so this is the on-disk order of the files. context is the
+ * request array.
+ */
+static int compare_disk_order(const void *a, const void *b, void *context)
+{
+    const batch_request *requests = context;
+    uint32_t cluster_a = entry_first_cluster(&requests[*(const uint32_t *)a].file);
+    uint32_t cluster_b = entry_first_cluster(&requests[*(const uint32_t *)b].file);
+    if (cluster_a != cluster_b)
+        return cluster_a < cluster_b ? -1 : 1;
+    return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+static int extract_request(batch *job, const batch_request *request, int raw)
+{
+    if (!request->destination)
+    {
+        printf("==> %s <==\n", request->path);
+        fflush(stdout);
+        if (!raw)
+            return print_file_content(job->dev, job->fat, job->geometry, &request->file);
+        return extract_file(job->dev, job->fat, job->geometry, &request->file, STDOUT_FILENO);
+    }
+
+    int out_fd = open(request->destination, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0)
+    {
+        fprintf(stderr, "Error: cannot create '%s'\n", request->destination);
+        return 1;
+    }
+    int status = extract_file(job->dev, job->fat, job->geometry, &request->file, out_fd);
+    close(out_fd);
+    return status;
+}
+
+int run_batch(FILE *input, block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, const dir_index *index, int raw)
+{
+    batch job;
+    memset(&job, 0, sizeof(job));
+    job.dev = dev;
+    job.fat = fat;
+    job.geometry = geometry;
+
+    batch_node root;
+    memset(&root, 0, sizeof(root));
+    int status = read_requests(input, &job, &root);
+
+    // resolve every path at once
+    sort_trie(&root);
+    if (index)
+        resolve_from_index(&job, index);
+    else
+        resolve_directory(&job, &root, bs->root_cluster);
+
+    // schedule the extractions in on-disk order
+    uint32_t *order = malloc((job.request_count + 1) * sizeof(uint32_t));
+    uint32_t found_count = 0;
+    if (!order)
+    {
+        perror("Error");
+        status = 1;
+    }
+    for (uint32_t i = 0; order && i < job.request_count; i++)
+    {
+        if (job.requests[i].found)
+            order[found_count++] = i;
+        else
+        {
+            fprintf(stderr, "Error: %s does not exist.\n", job.requests[i].path);
+            status = 1;
+        }
+    }
+    if (order)
+        qsort_r(order, found_count, sizeof(uint32_t), compare_disk_order, job.requests);
+
+    for (uint32_t i = 0; i < found_count; i++)
+    {
+        if (extract_request(&job, &job.requests[order[i]], raw) != 0)
+            status = 1;
+    }
+
+    free(order);
+    free_trie(&root);
+    for (uint32_t i = 0; i < job.request_count; i++)
+    {
+        free(job.requests[i].path);
+        free(job.requests[i].destination);
+    }
+    free(job.requests);
+    return status;
+}
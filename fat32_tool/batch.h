@@ -0,0 +1,30 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+#include "dir_index.h"
+
+/*
+ * one line of the batch list: "<absolute path>[<tab><destination>]"
+ */
+typedef struct batch_request_t
+{
+    char *path;        // as given, for messages
+    char *destination; // NULL to write to the standard output
+    directory_table_entry file;
+    int found;
+} batch_request;
+
+/*
+ * read the batch list from input, resolve every path and extract the files that exist.
+ * Paths are resolved together, either from the directory index when one is given or with a single walk that reads
+ * each directory needed by any of the paths once. Extractions then run in on-disk order of the files. Files without
+ * destination go to the standard output (raw or as a hex dump) after a "==> path <==" header.
+ * Return non-zero if any path could not be resolved or extracted.
+ */
+int run_batch(FILE *input, block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, const dir_index *index, int raw);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * micro-benchmark of the volume address arithmetic: the per-cluster cost of the former boot sector formula, of the
+ * generic kernel and of the shift kernel of geometry.c, for common and nonstandard layouts
+ * usage: geometry_bench [millions of clusters per run, default 64]
+ */
+
+#include "../geometry.h"
+
+#include <time.h>
+
+typedef struct layout_t
+{
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+} layout;
+
+static const layout layouts[] = {{512, 1}, {512, 8}, {512, 64}, {512, 128}, {4096, 1}, {4096, 8}, {512, 6}, {4096, 3}};
+
+#define LAYOUT_COUNT (sizeof(layouts) / sizeof(layouts[0]))
+#define CLUSTER_SPAN (1u << 20) // clusters visited, in a scrambled order
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * the formula cluster_offset used before geometry.c, recomputed from the boot sector on every call (with the
+ * sector size of the volume, which it took as SECTOR_SIZE)
+ */
+static uint64_t legacy_offset(const boot_sector *bs, const partition_entry *entry, uint32_t cluster)
+{
+    uint32_t first_data_sector = bs->reserved_sectors_count + (bs->num_fats * bs->fat_size_32);
+    return (uint64_t)entry->start_lba * SECTOR_SIZE + ((uint64_t)first_data_sector + (uint64_t)(cluster - 2) * bs->sectors_per_cluster) * bs->bytes_per_sector;
+}
+
+/*
+ * per cluster: its image offset, then the cluster and position of a byte inside it, and the clusters of a size,
+ * as the extent reads, --locate, --search and the chain walks do
+ */
+static uint64_t run_legacy(const boot_sector *bs, const partition_entry *entry, uint64_t count)
+{
+    uint64_t sum = 0;
+    uint32_t cluster_size = bs->sectors_per_cluster * bs->bytes_per_sector;
+    uint64_t data_offset = legacy_offset(bs, entry, 2);
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint32_t cluster = 2 + (uint32_t)((i * 2654435761u) & (CLUSTER_SPAN - 1));
+        uint64_t offset = legacy_offset(bs, entry, cluster) + (i & 511);
+        sum += offset + (uint32_t)((offset - data_offset) / cluster_size) + 2 + (offset - data_offset) % cluster_size + (offset + cluster_size - 1) / cluster_size;
+    }
+    return sum;
+}
+
+static uint64_t run_geometry(const volume_geometry *geometry, uint64_t count)
+{
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint32_t cluster = 2 + (uint32_t)((i * 2654435761u) & (CLUSTER_SPAN - 1));
+        uint64_t offset = geometry_cluster_offset(geometry, cluster) + (i & 511);
+        sum += offset + geometry_offset_cluster(geometry, offset) + geometry_offset_in_cluster(geometry, offset) + geometry_clusters(geometry, offset);
+    }
+    return sum;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t count = (uint64_t)(argc > 1 ? atoi(argv[1]) : 64) * 1000000;
+    if (count == 0)
+        count = 1;
+    partition_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.start_lba = 2048;
+    entry.total_sectors = UINT32_MAX - entry.start_lba;
+
+    printf("clusters per run: %lu\n", (unsigned long)count);
+    printf("layout (sector x spc)  kernel   boot sector  generic  shift    (ns per cluster)\n");
+    for (uint32_t l = 0; l < LAYOUT_COUNT; l++)
+    {
+        // read from volatile so the layout is not a compile-time constant
+        volatile uint16_t bytes_per_sector = layouts[l].bytes_per_sector;
+        volatile uint8_t sectors_per_cluster = layouts[l].sectors_per_cluster;
+        boot_sector bs;
+        memset(&bs, 0, sizeof(bs));
+        bs.bytes_per_sector = bytes_per_sector;
+        bs.sectors_per_cluster = sectors_per_cluster;
+        bs.reserved_sectors_count = 32;
+        bs.num_fats = 2;
+        bs.fat_size_32 = 8192;
+        bs.root_cluster = 2;
+        if (geometry_validate(&bs, &entry) != 0)
+            return 1;
+
+        volume_geometry geometry, generic;
+        geometry_init(&geometry, &bs, &entry);
+        generic = geometry;
+        generic.kernel = GEOMETRY_GENERIC;
+
+        double start = now();
+        uint64_t check = run_legacy(&bs, &entry, count);
+        double legacy = now() - start;
+
+        start = now();
+        uint64_t generic_check = run_geometry(&generic, count);
+        double generic_time = now() - start;
+
+        double shift_time = 0;
+        uint64_t shift_check = generic_check;
+        if (geometry.kernel == GEOMETRY_SHIFT)
+        {
+            start = now();
+            shift_check = run_geometry(&geometry, count);
+            shift_time = now() - start;
+        }
+        if (generic_check != shift_check || check != generic_check)
+        {
+            fprintf(stderr, "Error: kernels disagree on %u x %u\n", layouts[l].bytes_per_sector, layouts[l].sectors_per_cluster);
+            return 1;
+        }
+
+        printf("%4u x %-3u              %-8s %8.2f     %7.2f  ", layouts[l].bytes_per_sector, layouts[l].sectors_per_cluster,
+               geometry_kernel_name(geometry.kernel), legacy * 1e9 / count, generic_time * 1e9 / count);
+        if (geometry.kernel == GEOMETRY_SHIFT)
+            printf("%5.2f (x%.1f)\n", shift_time * 1e9 / count, generic_time / shift_time);
+        else
+            printf("    -\n");
+    }
+    return 0;
+}
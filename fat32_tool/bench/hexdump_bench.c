@@ -0,0 +1,103 @@
+/*
+ * micro-benchmark of the hex dump: the former fprintf-per-byte formatter against hexdump.c
+ * usage: hexdump_bench [MiB of data, default 16]
+ */
+
+#include "../hexdump.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CLUSTER_SIZE 4096
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * the formatter print_file_content used before hexdump.c, one cluster at a time
+ */
+static void legacy_dump(FILE *out, const uint8_t *data, size_t size)
+{
+    for (size_t offset = 0; offset < size; offset += CLUSTER_SIZE)
+    {
+        const uint8_t *cluster_buffer = data + offset;
+        for (uint32_t k = 0; k < CLUSTER_SIZE; k++)
+        {
+            if (k % 16 == 0)
+                fprintf(out, "\n%08X: ", k);
+
+            fprintf(out, "%02X ", cluster_buffer[k]);
+
+            if (k % 16 == 15)
+            {
+                fprintf(out, " | ");
+                for (uint32_t l = k - 15; l <= k; l++)
+                {
+                    if (isprint(cluster_buffer[l]))
+                        fprintf(out, "%c", cluster_buffer[l]);
+                    else
+                        fprintf(out, ".");
+                }
+            }
+        }
+    }
+}
+
+static int table_dump(int fd, const uint8_t *data, size_t size)
+{
+    hexdump dump;
+    if (hexdump_init(&dump, fd) != 0)
+        return 1;
+
+    // fed cluster by cluster, like extent_list_read would on a fragmented file
+    for (size_t offset = 0; offset < size; offset += CLUSTER_SIZE)
+        hexdump_write(&dump, data + offset, CLUSTER_SIZE);
+    return hexdump_finish(&dump);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 16) * 1024 * 1024;
+    uint8_t *data = malloc(size);
+    if (!data)
+    {
+        perror("Error");
+        return 1;
+    }
+
+    srand(42);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (uint8_t)rand();
+
+    FILE *null_file = fopen("/dev/null", "w");
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (!null_file || null_fd < 0)
+    {
+        perror("Error");
+        return 1;
+    }
+
+    double start = now();
+    legacy_dump(null_file, data, size);
+    fflush(null_file);
+    double legacy = now() - start;
+
+    start = now();
+    table_dump(null_fd, data, size);
+    double table = now() - start;
+
+    double mib = size / (1024.0 * 1024.0);
+    printf("input: %.0f MiB\n", mib);
+    printf("fprintf per byte: %8.3f s %10.1f MiB/s\n", legacy, mib / legacy);
+    printf("hexdump.c:        %8.3f s %10.1f MiB/s (x%.1f)\n", table, mib / table, legacy / table);
+
+    fclose(null_file);
+    close(null_fd);
+    free(data);
+    return 0;
+}
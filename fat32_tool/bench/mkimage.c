@@ -0,0 +1,529 @@
+/*
+ * synthetic FAT32 image generator for the benchmarks: one MBR partition holding a directory tree of the given
+ * depth and fan-out and a number of files spread over it, allocated with a tunable level of fragmentation.
+ * File content is left as holes of the sparse image unless -w is given, so 10-100 GB layouts are quick to build.
+ * usage: mkimage [options] <image>
+ */
+
+#include "../partition.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PARTITION_START 2048 // first LBA of the partition
+#define RESERVED_SECTORS 32
+#define NUM_FATS 2
+#define MAX_DIRECTORIES 1000000
+#define WRITE_BUFFER_SIZE (8 * 1024 * 1024)
+
+typedef struct generator_options_t
+{
+    uint64_t image_size;
+    uint32_t sector_size; // of the volume, the partition table stays in SECTOR_SIZE units
+    uint32_t cluster_size;
+    int depth;
+    int fanout;
+    uint32_t file_count;
+    uint64_t mean_file_size;
+    int fragmentation; // percent chance that the next cluster of a chain is not the following one
+    int write_content;
+    uint64_t seed;
+} generator_options;
+
+typedef struct generated_directory_t
+{
+    uint32_t parent;
+    uint32_t first_cluster;
+    directory_table_entry *entries;
+    uint32_t count;
+    uint32_t capacity;
+} generated_directory;
+
+typedef struct generator_t
+{
+    generator_options options;
+    int fd;
+    uint64_t random_state;
+    boot_sector bs;
+    uint32_t *fat;
+    uint32_t cluster_count; // data clusters, numbered from 2
+    uint32_t cursor;        // next cluster the allocator looks at
+    uint32_t allocated;
+    uint64_t fragments;
+    generated_directory *directories;
+    uint32_t directory_count;
+    uint8_t *content; // pattern written as file content with -w
+} generator;
+
+static uint64_t next_random(generator *g)
+{
+    // xorshift64*
+    g->random_state ^= g->random_state >> 12;
+    g->random_state ^= g->random_state << 25;
+    g->random_state ^= g->random_state >> 27;
+    return g->random_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t parse_size(const char *text)
+{
+    char *end;
+    uint64_t value = strtoull(text, &end, 10);
+    switch (toupper((unsigned char)*end))
+    {
+    case 'T':
+        value *= 1024;
+        /* fall through */
+    case 'G':
+        value *= 1024;
+        /* fall through */
+    case 'M':
+        value *= 1024;
+        /* fall through */
+    case 'K':
+        value *= 1024;
+        break;
+    }
+    return value;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options] <image>\n", program);
+    fprintf(stderr, "  -s <size>     image size, K/M/G/T suffixes allowed (default 4G)\n");
+    fprintf(stderr, "  -b <bytes>    volume sector size, 512 or 4096 (default 512)\n");
+    fprintf(stderr, "  -c <bytes>    cluster size, a multiple of the sector size up to 32K (default 4K); sizes that are not\n");
+    fprintf(stderr, "                powers of two give nonstandard volumes, read through the generic address arithmetic\n");
+    fprintf(stderr, "  -d <depth>    directory depth below the root (default 3)\n");
+    fprintf(stderr, "  -f <fanout>   subdirectories per directory (default 8)\n");
+    fprintf(stderr, "  -n <files>    number of files (default 10000)\n");
+    fprintf(stderr, "  -z <size>     mean file size, sizes are uniform in [0, 2 * mean] (default 64K)\n");
+    fprintf(stderr, "  -F <percent>  fragmentation: chance that a chain jumps after a cluster (default 0)\n");
+    fprintf(stderr, "  -w            write file content instead of leaving holes\n");
+    fprintf(stderr, "  -S <seed>     random seed (default 1)\n");
+}
+
+static int write_at(generator *g, uint64_t offset, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    while (size > 0)
+    {
+        ssize_t n = pwrite(g->fd, bytes, size, offset);
+        if (n <= 0)
+        {
+            perror("Error");
+            return 1;
+        }
+        bytes += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static uint64_t data_offset(const generator *g, uint32_t cluster)
+{
+    uint64_t first_data_sector = g->bs.reserved_sectors_count + (uint64_t)g->bs.num_fats * g->bs.fat_size_32;
+    return (uint64_t)PARTITION_START * SECTOR_SIZE + (first_data_sector + (uint64_t)(cluster - 2) * g->bs.sectors_per_cluster) * g->options.sector_size;
+}
+
+/*
+ * pick the largest FAT size whose clusters fit in the partition
+ */
+static int compute_geometry(generator *g)
+{
+    uint32_t sector_size = g->options.sector_size;
+    uint64_t partition_size = g->options.image_size > (uint64_t)PARTITION_START * SECTOR_SIZE ? g->options.image_size - (uint64_t)PARTITION_START * SECTOR_SIZE : 0;
+    uint64_t total_sectors = partition_size / sector_size;
+    uint32_t sectors_per_cluster = g->options.cluster_size / sector_size;
+    if (total_sectors <= RESERVED_SECTORS || total_sectors * sector_size / SECTOR_SIZE > UINT32_MAX)
+    {
+        fprintf(stderr, "Error: image size out of range\n");
+        return 1;
+    }
+
+    uint32_t fat_size = 1;
+    for (;;)
+    {
+        uint64_t data_sectors = total_sectors - RESERVED_SECTORS - (uint64_t)NUM_FATS * fat_size;
+        uint64_t clusters = data_sectors / sectors_per_cluster;
+        uint32_t needed = (uint32_t)(((clusters + 2) * 4 + sector_size - 1) / sector_size);
+        if (needed <= fat_size)
+        {
+            g->cluster_count = (uint32_t)clusters;
+            break;
+        }
+        fat_size = needed;
+    }
+    if (g->cluster_count < 65525 || g->cluster_count > 0x0FFFFFF5)
+    {
+        fprintf(stderr, "Error: %u clusters is not a FAT32 volume, change the size or the cluster size\n", g->cluster_count);
+        return 1;
+    }
+
+    boot_sector *bs = &g->bs;
+    memset(bs, 0, sizeof(*bs));
+    memcpy(bs->jmp_boot, "\xEB\x58\x90", 3);
+    memcpy(bs->oem_name, "MKIMAGE ", 8);
+    bs->bytes_per_sector = (uint16_t)sector_size;
+    bs->sectors_per_cluster = (uint8_t)sectors_per_cluster;
+    bs->reserved_sectors_count = RESERVED_SECTORS;
+    bs->num_fats = NUM_FATS;
+    bs->media = 0xF8;
+    bs->sectors_per_track = 63;
+    bs->num_heads = 255;
+    bs->hidden_sectors = (uint32_t)((uint64_t)PARTITION_START * SECTOR_SIZE / sector_size);
+    bs->total_sectors_32 = (uint32_t)total_sectors;
+    bs->fat_size_32 = fat_size;
+    bs->root_cluster = 2;
+    bs->fs_info = 1;
+    bs->backup_boot_sector = 6;
+    bs->drive_number = 0x80;
+    bs->boot_signature = 0x29;
+    bs->volume_id = (uint32_t)g->options.seed * 2654435761u;
+    memcpy(bs->volume_label, "BENCH      ", 11);
+    memcpy(bs->fs_type, "FAT32   ", 8);
+    return 0;
+}
+
+/*
+ * allocate a chain of count clusters and return its first cluster, 0 if the volume is full.
+ * With fragmentation, the allocator skips ahead after a cluster; skipped clusters are used once it wraps.
+ */
+static uint32_t allocate_chain(generator *g, uint32_t count)
+{
+    if (count == 0)
+        return 0;
+    if (g->cluster_count - g->allocated < count)
+        return 0;
+
+    uint32_t first = 0, previous = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        while (g->fat[g->cursor] != 0)
+            g->cursor = g->cursor + 1 < g->cluster_count + 2 ? g->cursor + 1 : 2;
+
+        uint32_t cluster = g->cursor;
+        g->fat[cluster] = 0x0FFFFFFF;
+        if (previous)
+        {
+            g->fat[previous] = cluster;
+            if (cluster != previous + 1)
+                g->fragments++;
+        }
+        else
+            first = cluster;
+        previous = cluster;
+        g->allocated++;
+
+        if (g->options.fragmentation > 0 && (int)(next_random(g) % 100) < g->options.fragmentation)
+            g->cursor += 1 + (uint32_t)(next_random(g) % 64);
+        if (g->cursor >= g->cluster_count + 2)
+            g->cursor = 2;
+    }
+    return first;
+}
+
+static directory_table_entry *add_entry(generated_directory *directory, const char *name, const char *extension, uint8_t attributes, uint32_t cluster, uint32_t size)
+{
+    if (directory->count == directory->capacity)
+    {
+        uint32_t capacity = directory->capacity ? directory->capacity * 2 : 16;
+        directory_table_entry *entries = realloc(directory->entries, capacity * sizeof(directory_table_entry));
+        if (!entries)
+            return NULL;
+        directory->entries = entries;
+        directory->capacity = capacity;
+    }
+
+    directory_table_entry *entry = &directory->entries[directory->count++];
+    memset(entry, 0, sizeof(*entry));
+    memset(entry->name, ' ', sizeof(entry->name) + sizeof(entry->extension));
+    memcpy(entry->name, name, strlen(name));
+    memcpy(entry->extension, extension, strlen(extension));
+    entry->attributes = attributes;
+    entry->create_date = entry->write_date = entry->last_access_date = (44 << 9) | (1 << 5) | 1; // 2024-01-01
+    entry->create_time = entry->write_time = (12 << 11);
+    entry->first_cluster_high = (uint16_t)(cluster >> 16);
+    entry->first_cluster_low = (uint16_t)cluster;
+    entry->file_size = size;
+    return entry;
+}
+
+/*
+ * the directory tree, breadth first: directory 0 is the root, each directory of a level below depth gets fanout
+ * subdirectories
+ */
+static int build_directories(generator *g)
+{
+    uint64_t total = 1, level = 1;
+    for (int i = 0; i < g->options.depth; i++)
+    {
+        level *= g->options.fanout;
+        total += level;
+        if (total > MAX_DIRECTORIES)
+        {
+            fprintf(stderr, "Error: more than %d directories\n", MAX_DIRECTORIES);
+            return 1;
+        }
+    }
+
+    g->directories = calloc(total, sizeof(generated_directory));
+    if (!g->directories)
+        return 1;
+    g->directory_count = 1;
+    uint32_t level_start = 0, level_end = 1;
+    for (int depth = 0; depth < g->options.depth; depth++)
+    {
+        for (uint32_t parent = level_start; parent < level_end; parent++)
+        {
+            for (int i = 0; i < g->options.fanout; i++)
+                g->directories[g->directory_count++].parent = parent;
+        }
+        level_start = level_end;
+        level_end = g->directory_count;
+    }
+    return 0;
+}
+
+/*
+ * give every directory its clusters, sized for ".", "..", its subdirectories and its share of the files
+ */
+static int allocate_directories(generator *g)
+{
+    uint32_t entries_per_cluster = g->options.cluster_size / sizeof(directory_table_entry);
+    for (uint32_t d = 0; d < g->directory_count; d++)
+    {
+        uint64_t entries = (d == 0 ? 0 : 2) + g->options.file_count / g->directory_count + 1;
+        entries += (d * (uint64_t)g->options.fanout + 1 < g->directory_count) ? g->options.fanout : 0;
+        uint32_t clusters = (uint32_t)((entries + entries_per_cluster - 1) / entries_per_cluster);
+        g->directories[d].first_cluster = allocate_chain(g, clusters);
+        if (g->directories[d].first_cluster == 0)
+        {
+            fprintf(stderr, "Error: volume full\n");
+            return 1;
+        }
+    }
+
+    // "." and ".." first, then the subdirectories in creation order
+    char name[16];
+    for (uint32_t d = 0; d < g->directory_count; d++)
+    {
+        generated_directory *directory = &g->directories[d];
+        if (d != 0)
+        {
+            uint32_t parent_cluster = directory->parent == 0 ? 0 : g->directories[directory->parent].first_cluster;
+            if (!add_entry(directory, ".", "", DIRECTORY_ATTRIBUTE, directory->first_cluster, 0) ||
+                !add_entry(directory, "..", "", DIRECTORY_ATTRIBUTE, parent_cluster, 0))
+                return 1;
+            snprintf(name, sizeof(name), "D%07u", d);
+            if (!add_entry(&g->directories[directory->parent], name, "", DIRECTORY_ATTRIBUTE, directory->first_cluster, 0))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static int write_content(generator *g, uint32_t first_cluster, uint64_t size)
+{
+    uint32_t cluster = first_cluster;
+    while (size > 0 && cluster >= 2 && cluster < END_OF_CLUSTER_CHAIN)
+    {
+        // one write per run of contiguous clusters
+        uint32_t run = 1;
+        while ((uint64_t)run * g->options.cluster_size < size && g->fat[cluster + run - 1] == cluster + run &&
+               (uint64_t)(run + 1) * g->options.cluster_size <= WRITE_BUFFER_SIZE)
+            run++;
+        uint64_t bytes = (uint64_t)run * g->options.cluster_size;
+        if (bytes > size)
+            bytes = size;
+        if (write_at(g, data_offset(g, cluster), g->content, bytes) != 0)
+            return 1;
+        size -= bytes;
+        cluster = g->fat[cluster + run - 1];
+    }
+    return 0;
+}
+
+/*
+ * file i goes to directory i % directory_count, so /F0000000.BIN is always in the root
+ */
+static int build_files(generator *g)
+{
+    char name[16];
+    for (uint32_t i = 0; i < g->options.file_count; i++)
+    {
+        uint64_t size = g->options.mean_file_size ? next_random(g) % (2 * g->options.mean_file_size + 1) : 0;
+        if (size > UINT32_MAX)
+            size = UINT32_MAX;
+        uint32_t clusters = (uint32_t)((size + g->options.cluster_size - 1) / g->options.cluster_size);
+        uint32_t first_cluster = allocate_chain(g, clusters);
+        if (clusters > 0 && first_cluster == 0)
+        {
+            fprintf(stderr, "Error: volume full after %u files\n", i);
+            return 1;
+        }
+
+        snprintf(name, sizeof(name), "F%07u", i);
+        if (!add_entry(&g->directories[i % g->directory_count], name, "BIN", 0x20, first_cluster, (uint32_t)size))
+            return 1;
+        if (g->options.write_content && write_content(g, first_cluster, size) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int write_directories(generator *g)
+{
+    uint8_t *buffer = calloc(1, g->options.cluster_size);
+    if (!buffer)
+        return 1;
+
+    for (uint32_t d = 0; d < g->directory_count; d++)
+    {
+        const generated_directory *directory = &g->directories[d];
+        uint32_t entries_per_cluster = g->options.cluster_size / sizeof(directory_table_entry);
+        uint32_t cluster = directory->first_cluster;
+        for (uint32_t done = 0; cluster >= 2 && cluster < END_OF_CLUSTER_CHAIN; cluster = g->fat[cluster])
+        {
+            uint32_t n = directory->count - done < entries_per_cluster ? directory->count - done : entries_per_cluster;
+            memset(buffer, 0, g->options.cluster_size);
+            memcpy(buffer, directory->entries + done, n * sizeof(directory_table_entry));
+            if (write_at(g, data_offset(g, cluster), buffer, g->options.cluster_size) != 0)
+            {
+                free(buffer);
+                return 1;
+            }
+            done += n;
+        }
+    }
+    free(buffer);
+    return 0;
+}
+
+static int write_metadata(generator *g)
+{
+    master_boot_record mbr;
+    memset(&mbr, 0, sizeof(mbr));
+    mbr.partition_table[0].system_id = PARTITION_TYPE;
+    mbr.partition_table[0].start_lba = PARTITION_START;
+    mbr.partition_table[0].total_sectors = (uint32_t)((uint64_t)g->bs.total_sectors_32 * g->options.sector_size / SECTOR_SIZE);
+    mbr.signature = 0xAA55;
+
+    uint8_t sector[SECTOR_SIZE];
+    memset(sector, 0, sizeof(sector));
+    memcpy(sector, &g->bs, sizeof(g->bs));
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+
+    uint64_t partition = (uint64_t)PARTITION_START * SECTOR_SIZE;
+    if (write_at(g, 0, &mbr, sizeof(mbr)) != 0 ||
+        write_at(g, partition, sector, sizeof(sector)) != 0 ||
+        write_at(g, partition + (uint64_t)g->bs.backup_boot_sector * g->options.sector_size, sector, sizeof(sector)) != 0)
+        return 1;
+
+    uint64_t fat_bytes = (uint64_t)(g->cluster_count + 2) * sizeof(uint32_t);
+    for (int i = 0; i < NUM_FATS; i++)
+    {
+        uint64_t fat_offset = partition + ((uint64_t)g->bs.reserved_sectors_count + (uint64_t)i * g->bs.fat_size_32) * g->options.sector_size;
+        if (write_at(g, fat_offset, g->fat, fat_bytes) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    generator g;
+    memset(&g, 0, sizeof(g));
+    generator_options defaults = {4ULL << 30, SECTOR_SIZE, 4096, 3, 8, 10000, 64 * 1024, 0, 0, 1};
+    g.options = defaults;
+
+    int option;
+    while ((option = getopt(argc, argv, "s:b:c:d:f:n:z:F:wS:")) != -1)
+    {
+        switch (option)
+        {
+        case 's':
+            g.options.image_size = parse_size(optarg);
+            break;
+        case 'b':
+            g.options.sector_size = (uint32_t)parse_size(optarg);
+            break;
+        case 'c':
+            g.options.cluster_size = (uint32_t)parse_size(optarg);
+            break;
+        case 'd':
+            g.options.depth = atoi(optarg);
+            break;
+        case 'f':
+            g.options.fanout = atoi(optarg);
+            break;
+        case 'n':
+            g.options.file_count = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            g.options.mean_file_size = parse_size(optarg);
+            break;
+        case 'F':
+            g.options.fragmentation = atoi(optarg);
+            break;
+        case 'w':
+            g.options.write_content = 1;
+            break;
+        case 'S':
+            g.options.seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    uint32_t cluster_size = g.options.cluster_size;
+    if (optind != argc - 1 || (g.options.sector_size != 512 && g.options.sector_size != 4096) || cluster_size < g.options.sector_size || cluster_size > 32768 || cluster_size % g.options.sector_size != 0 ||
+        g.options.depth < 0 || g.options.fanout < 1 || g.options.fragmentation < 0 || g.options.fragmentation > 100)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    g.random_state = g.options.seed ? g.options.seed : 1;
+
+    if (compute_geometry(&g) != 0)
+        return 1;
+    g.fat = calloc((size_t)g.cluster_count + 2, sizeof(uint32_t));
+    g.content = g.options.write_content ? malloc(WRITE_BUFFER_SIZE) : NULL;
+    if (!g.fat || (g.options.write_content && !g.content))
+    {
+        perror("Error");
+        return 1;
+    }
+    g.fat[0] = 0x0FFFFFF8;
+    g.fat[1] = 0x0FFFFFFF;
+    g.cursor = 2;
+    for (size_t i = 0; g.content && i < WRITE_BUFFER_SIZE; i++)
+        g.content[i] = (uint8_t)next_random(&g);
+
+    g.fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (g.fd < 0 || ftruncate(g.fd, (off_t)g.options.image_size) != 0)
+    {
+        perror("Error");
+        return 1;
+    }
+
+    int status = build_directories(&g) || allocate_directories(&g) || build_files(&g) ||
+                 write_directories(&g) || write_metadata(&g);
+    status = close(g.fd) != 0 || status;
+
+    if (status == 0)
+    {
+        printf("%s: %lu bytes, %u clusters of %u bytes (%u used), %u directories, %u files, %lu fragment breaks\n",
+               argv[optind], (unsigned long)g.options.image_size, g.cluster_count, cluster_size, g.allocated,
+               g.directory_count, g.options.file_count, (unsigned long)g.fragments);
+    }
+
+    for (uint32_t d = 0; d < g.directory_count; d++)
+        free(g.directories[d].entries);
+    free(g.directories);
+    free(g.fat);
+    free(g.content);
+    return status;
+}
@@ -0,0 +1,204 @@
+#include "block_device.h"
+#include "compressed_image.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+/*
+ * check that [offset, offset + size) lies inside the image, without overflowing
+ */
+static int in_range(const block_device *dev, uint64_t offset, size_t size)
+{
+    return offset <= dev->size && size <= dev->size - offset;
+}
+
+static int pread_read(block_device *dev, uint64_t offset, size_t size, void *buffer)
+{
+    uint8_t *out = buffer;
+    while (size > 0)
+    {
+        ssize_t n = pread(dev->fd, out, size, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        out += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static const void *pread_map(block_device *dev, uint64_t offset, size_t size)
+{
+    (void)dev;
+    (void)offset;
+    (void)size;
+    return NULL;
+}
+
+static void pread_close(block_device *dev)
+{
+    (void)dev;
+}
+
+static const block_device_ops pread_ops = {"pread", 1, pread_read, pread_map, pread_close};
+
+static int mmap_read(block_device *dev, uint64_t offset, size_t size, void *buffer)
+{
+    memcpy(buffer, dev->map + offset, size);
+    return 0;
+}
+
+static const void *mmap_map(block_device *dev, uint64_t offset, size_t size)
+{
+    (void)size;
+    return dev->map + offset;
+}
+
+static void mmap_close(block_device *dev)
+{
+    munmap((void *)dev->map, dev->size);
+}
+
+static const block_device_ops mmap_ops = {"mmap", 1, mmap_read, mmap_map, mmap_close};
+
+/*
+ * map the whole image read-only, return 0 on success
+ */
+static int open_mmap(block_device *dev)
+{
+    // the whole image must be addressable, which rules out large images on 32-bit hosts
+    if (dev->size == 0 || dev->size > (uint64_t)SIZE_MAX)
+        return 1;
+
+    void *map = mmap(NULL, (size_t)dev->size, PROT_READ, MAP_PRIVATE, dev->fd, 0);
+    if (map == MAP_FAILED)
+        return 1;
+
+    dev->map = map;
+    dev->ops = &mmap_ops;
+    return 0;
+}
+
+int block_device_open(const char *path, block_device_backend backend, block_device *dev)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->fd = open(path, O_RDONLY);
+    if (dev->fd < 0)
+    {
+        perror("Error");
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(dev->fd, &st) != 0)
+    {
+        perror("Error");
+        close(dev->fd);
+        return 1;
+    }
+    dev->size = (uint64_t)st.st_size;
+    // st_size is 0 for block devices, the kernel knows their size
+    if (S_ISBLK(st.st_mode) && ioctl(dev->fd, BLKGETSIZE64, &dev->size) != 0)
+    {
+        perror("Error");
+        close(dev->fd);
+        return 1;
+    }
+    dev->ops = &pread_ops;
+
+    // zip and gzip images are decompressed on the fly and cannot be mapped
+    int compressed = compressed_image_open(dev, path);
+    if (compressed >= 0)
+    {
+        if (compressed == 0 && backend == BLOCK_DEVICE_MMAP)
+        {
+            fprintf(stderr, "Error: a compressed disk image cannot be mapped\n");
+            dev->ops->close(dev);
+            compressed = 1;
+        }
+        if (compressed != 0)
+            close(dev->fd);
+        return compressed;
+    }
+
+    if (backend != BLOCK_DEVICE_PREAD && open_mmap(dev) != 0 && backend == BLOCK_DEVICE_MMAP)
+    {
+        fprintf(stderr, "Error: cannot map the disk image\n");
+        close(dev->fd);
+        return 1;
+    }
+    return 0;
+}
+
+int block_device_read(block_device *dev, uint64_t offset, size_t size, void *buffer)
+{
+    if (!in_range(dev, offset, size))
+        return 1;
+    stats_access(offset, size, 0);
+    return dev->ops->read(dev, offset, size, buffer);
+}
+
+const void *block_device_get(block_device *dev, uint64_t offset, size_t size, void *scratch)
+{
+    if (!in_range(dev, offset, size))
+        return NULL;
+
+    const void *data = dev->ops->map(dev, offset, size);
+    stats_access(offset, size, data != NULL);
+    if (data)
+        return data;
+
+    if (dev->ops->read(dev, offset, size, scratch) != 0)
+        return NULL;
+    return scratch;
+}
+
+void block_device_close(block_device *dev)
+{
+    dev->ops->close(dev);
+    if (dev->fd >= 0)
+        close(dev->fd);
+    memset(dev, 0, sizeof(*dev));
+    dev->fd = -1;
+}
+
+int block_device_fd(const block_device *dev)
+{
+    return dev->ops->direct ? dev->fd : -1;
+}
+
+int block_device_parse_backend(const char *name, block_device_backend *backend)
+{
+    if (strcmp(name, "auto") == 0)
+        *backend = BLOCK_DEVICE_AUTO;
+    else if (strcmp(name, "mmap") == 0)
+        *backend = BLOCK_DEVICE_MMAP;
+    else if (strcmp(name, "pread") == 0)
+        *backend = BLOCK_DEVICE_PREAD;
+    else
+        return -1;
+    return 0;
+}
+
+int block_device_parse_queue(const char *name, block_device_queue *queue)
+{
+    if (strcmp(name, "auto") == 0)
+        *queue = BLOCK_DEVICE_QUEUE_AUTO;
+    else if (strcmp(name, "io_uring") == 0)
+        *queue = BLOCK_DEVICE_QUEUE_URING;
+    else if (strcmp(name, "threads") == 0)
+        *queue = BLOCK_DEVICE_QUEUE_THREADS;
+    else if (strcmp(name, "sync") == 0)
+        *queue = BLOCK_DEVICE_QUEUE_SYNC;
+    else
+        return -1;
+    return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include "utils.h"
+
+typedef enum block_device_backend_t
+{
+    BLOCK_DEVICE_AUTO,  // mmap when possible, pread otherwise
+    BLOCK_DEVICE_MMAP,  // the whole image is mapped, reads are zero-copy
+    BLOCK_DEVICE_PREAD, // positioned reads, one syscall per request
+} block_device_backend;
+
+/*
+ * how readers that keep several reads in flight (async_io.h) queue them
+ */
+typedef enum block_device_queue_t
+{
+    BLOCK_DEVICE_QUEUE_AUTO,    // io_uring when the kernel allows it, a pool of pread threads otherwise
+    BLOCK_DEVICE_QUEUE_URING,
+    BLOCK_DEVICE_QUEUE_THREADS,
+    BLOCK_DEVICE_QUEUE_SYNC,    // one blocking read at a time
+} block_device_queue;
+
+typedef struct block_device_t block_device;
+struct cluster_cache_t; // cluster_cache.h
+
+/*
+ * operations implemented by each backend
+ */
+typedef struct block_device_ops_t
+{
+    const char *name;
+    int direct; // the image bytes are the bytes of fd, so the kernel can copy them without going through us
+    // copy size bytes at offset into buffer, return 0 on success
+    int (*read)(block_device *dev, uint64_t offset, size_t size, void *buffer);
+    // return a pointer to size bytes at offset without copying, or NULL if the backend cannot
+    const void *(*map)(block_device *dev, uint64_t offset, size_t size);
+    void (*close)(block_device *dev);
+} block_device_ops;
+
+struct block_device_t
+{
+    const block_device_ops *ops;
+    int fd;
+    uint64_t size;      // size of the image in bytes
+    const uint8_t *map; // mapping of the whole image (mmap backend)
+    void *context;      // backend private data
+    struct cluster_cache_t *cache; // cache of data clusters used by extent reads, NULL if none
+    block_device_queue queue;      // AUTO unless set after opening
+};
+
+/*
+ * open a disk image with the requested backend
+ */
+int block_device_open(const char *path, block_device_backend backend, block_device *dev);
+
+/*
+ * copy size bytes at a 64-bit image offset into a buffer, return 0 on success
+ */
+int block_device_read(block_device *dev, uint64_t offset, size_t size, void *buffer);
+
+/*
+ * return a pointer to size bytes at a 64-bit image offset. Backends that can map the image return a pointer
+ * into the mapping, the others read the data into scratch (at least size bytes) and return scratch.
+ * Return NULL if the range is outside the image or cannot be read.
+ */
+const void *block_device_get(block_device *dev, uint64_t offset, size_t size, void *scratch);
+
+/*
+ * release the backend resources and close the image
+ */
+void block_device_close(block_device *dev);
+
+/*
+ * return a file descriptor whose content is the image, usable for kernel-side copies, or -1 if the backend
+ * transforms the data
+ */
+int block_device_fd(const block_device *dev);
+
+/*
+ * parse a backend name ("auto", "mmap" or "pread"), return -1 if unknown
+ */
+int block_device_parse_backend(const char *name, block_device_backend *backend);
+
+/*
+ * parse a queue name ("auto", "io_uring", "threads" or "sync"), return -1 if unknown
+ */
+int block_device_parse_queue(const char *name, block_device_queue *queue);
+
+#endif
@@ -0,0 +1,316 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "carve.h"
+#include "fat_analysis.h"
+#include "extract.h"
+#include "geometry.h"
+
+#define CARVE_SIGNATURE_MAX 8 // longest header or footer
+
+typedef struct carve_signature_t
+{
+    const char *type;
+    uint8_t header[CARVE_SIGNATURE_MAX];
+    size_t header_length;
+    uint8_t footer[CARVE_SIGNATURE_MAX];
+    size_t footer_length;
+    size_t trailer; // bytes following the footer that still belong to the file
+    uint64_t max_size;
+} carve_signature;
+
+static const carve_signature signatures[] = {
+    {"jpg", {0xFF, 0xD8, 0xFF}, 3, {0xFF, 0xD9}, 2, 0, 32ULL << 20},
+    {"png", {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A}, 8, {'I', 'E', 'N', 'D', 0xAE, 0x42, 0x60, 0x82}, 8, 0, 64ULL << 20},
+    {"gif", {'G', 'I', 'F', '8', '7', 'a'}, 6, {0x00, 0x3B}, 2, 0, 16ULL << 20},
+    {"gif", {'G', 'I', 'F', '8', '9', 'a'}, 6, {0x00, 0x3B}, 2, 0, 16ULL << 20},
+    {"pdf", {'%', 'P', 'D', 'F', '-'}, 5, {'%', '%', 'E', 'O', 'F'}, 5, 0, 256ULL << 20},
+    // end of central directory record, 18 bytes long after its signature when the archive has no comment
+    {"zip", {'P', 'K', 0x03, 0x04}, 4, {'P', 'K', 0x05, 0x06}, 4, 18, 256ULL << 20},
+};
+
+#define SIGNATURE_COUNT (sizeof(signatures) / sizeof(signatures[0]))
+
+typedef struct carve_hit_t
+{
+    uint32_t cluster;
+    uint32_t signature;
+    uint64_t size;
+    int complete;
+} carve_hit;
+
+typedef struct carve_job_t
+{
+    block_device *dev;
+    const volume_geometry *geometry;
+    const fat_bitmap *bitmap;
+    const uint8_t *candidates; // signatures whose header starts with a byte, as a bit mask per byte value
+    uint32_t cluster_size;
+    uint32_t first; // headers are looked for in [first, last)
+    uint32_t last;
+    uint8_t *scratch;
+    carve_hit *hits;
+    uint32_t hit_count;
+    uint32_t hit_capacity;
+    int status;
+} carve_job;
+
+/*
+ * first cluster of [cluster, limit) whose used bit equals used, limit if there is none
+ */
+static uint32_t next_cluster(const fat_bitmap *bitmap, uint32_t cluster, uint32_t limit, int used)
+{
+    while (cluster < limit)
+    {
+        uint32_t word = cluster / FAT_BITMAP_WORD_BITS;
+        uint64_t bits = used ? bitmap->used[word] : ~bitmap->used[word];
+        bits &= ~(uint64_t)0 << (cluster % FAT_BITMAP_WORD_BITS);
+        if (bits)
+        {
+            uint32_t found = word * FAT_BITMAP_WORD_BITS + (uint32_t)__builtin_ctzll(bits);
+            return found < limit ? found : limit;
+        }
+        cluster = (word + 1) * FAT_BITMAP_WORD_BITS;
+    }
+    return limit;
+}
+
+/*
+ * size of the file starting at first_cluster, its footer being looked for in windows overlapping by the footer
+ * length so that a footer crossing a window boundary is found. Set complete if the footer was found.
+ */
+static uint64_t find_footer(carve_job *job, const carve_signature *signature, uint32_t first_cluster, int *complete)
+{
+    uint32_t run_end = next_cluster(job->bitmap, first_cluster, job->bitmap->end, 1);
+    uint64_t limit = (uint64_t)(run_end - first_cluster) * job->cluster_size;
+    if (limit > signature->max_size)
+        limit = signature->max_size;
+
+    uint64_t start = geometry_cluster_offset(job->geometry, first_cluster);
+    uint64_t position = signature->header_length;
+    *complete = 0;
+    while (position + signature->footer_length <= limit)
+    {
+        size_t size = limit - position < CARVE_READ_SIZE ? (size_t)(limit - position) : CARVE_READ_SIZE;
+        const uint8_t *data = block_device_get(job->dev, start + position, size, job->scratch);
+        if (!data)
+            return limit;
+
+        const uint8_t *footer = memmem(data, size, signature->footer, signature->footer_length);
+        if (footer)
+        {
+            uint64_t end = position + (uint64_t)(footer - data) + signature->footer_length + signature->trailer;
+            *complete = end <= limit;
+            return end <= limit ? end : limit;
+        }
+        if (position + size >= limit)
+            break;
+        position += size - (signature->footer_length - 1);
+    }
+    return limit;
+}
+
+static int add_hit(carve_job *job, uint32_t cluster, uint32_t signature, uint64_t size, int complete)
+{
+    if (job->hit_count == job->hit_capacity)
+    {
+        uint32_t capacity = job->hit_capacity ? job->hit_capacity * 2 : 64;
+        carve_hit *grown = realloc(job->hits, capacity * sizeof(carve_hit));
+        if (!grown)
+            return 1;
+        job->hits = grown;
+        job->hit_capacity = capacity;
+    }
+    carve_hit *hit = &job->hits[job->hit_count++];
+    hit->cluster = cluster;
+    hit->signature = signature;
+    hit->size = size;
+    hit->complete = complete;
+    return 0;
+}
+
+/*
+ * signature whose header starts the cluster data, -1 if none
+ */
+static int match_header(const carve_job *job, const uint8_t *data)
+{
+    uint8_t candidates = job->candidates[data[0]];
+    while (candidates)
+    {
+        int signature = __builtin_ctz(candidates);
+        if (memcmp(data, signatures[signature].header, signatures[signature].header_length) == 0)
+            return signature;
+        candidates &= candidates - 1;
+    }
+    return -1;
+}
+
+/*
+ * look for headers at the start of the free clusters of the job range, reading the free runs CARVE_READ_SIZE
+ * bytes at a time. The clusters of a carved file are skipped.
+ */
+static void *carve_worker(void *argument)
+{
+    carve_job *job = argument;
+    uint32_t chunk_clusters = CARVE_READ_SIZE / job->cluster_size ? CARVE_READ_SIZE / job->cluster_size : 1;
+    uint32_t cluster = next_cluster(job->bitmap, job->first, job->last, 0);
+    while (cluster < job->last)
+    {
+        uint32_t run_end = next_cluster(job->bitmap, cluster, job->last, 1);
+        uint32_t count = run_end - cluster < chunk_clusters ? run_end - cluster : chunk_clusters;
+        const uint8_t *data = block_device_get(job->dev, geometry_cluster_offset(job->geometry, cluster), (size_t)count * job->cluster_size, job->scratch);
+        if (!data)
+        {
+            job->status = 1;
+            return NULL;
+        }
+
+        uint32_t next = cluster + count;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            int signature = match_header(job, data + (size_t)i * job->cluster_size);
+            if (signature < 0)
+                continue;
+
+            // the footer search reuses the scratch buffer, the scan restarts after the carved file
+            int complete;
+            uint64_t size = find_footer(job, &signatures[signature], cluster + i, &complete);
+            if (add_hit(job, cluster + i, (uint32_t)signature, size, complete) != 0)
+            {
+                job->status = 1;
+                return NULL;
+            }
+            next = cluster + i + (uint32_t)geometry_clusters(job->geometry, size);
+            break;
+        }
+        cluster = next_cluster(job->bitmap, next, job->last, 0);
+    }
+    return NULL;
+}
+
+/*
+ * cut [2, end) into job_count ranges holding about as many free clusters each, at bitmap word boundaries
+ */
+static void split_ranges(const fat_bitmap *bitmap, carve_job *jobs, uint32_t job_count)
+{
+    uint32_t words = (bitmap->end + FAT_BITMAP_WORD_BITS - 1) / FAT_BITMAP_WORD_BITS;
+    uint64_t share = bitmap->free_count / job_count + 1;
+    uint64_t free_seen = 0;
+    uint32_t job = 0;
+    jobs[0].first = 2;
+    for (uint32_t word = 0; word < words && job + 1 < job_count; word++)
+    {
+        free_seen += (uint64_t)__builtin_popcountll(~bitmap->used[word]);
+        if (free_seen >= share * (job + 1))
+        {
+            uint32_t boundary = (word + 1) * FAT_BITMAP_WORD_BITS;
+            jobs[job].last = boundary < bitmap->end ? boundary : bitmap->end;
+            jobs[job + 1].first = jobs[job].last;
+            job++;
+        }
+    }
+    jobs[job].last = bitmap->end;
+    for (job++; job < job_count; job++)
+        jobs[job].first = jobs[job].last = bitmap->end;
+}
+
+static int write_carved(block_device *dev, const volume_geometry *geometry, const carve_hit *hit, const char *output_dir)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%u.%s", output_dir, hit->cluster, signatures[hit->signature].type);
+    int out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0)
+    {
+        fprintf(stderr, "Error: cannot create %s\n", path);
+        return 1;
+    }
+
+    uint32_t clusters = (uint32_t)geometry_clusters(geometry, hit->size);
+    extent run = {hit->cluster, clusters};
+    extent_list extents = {&run, 1, 1, clusters};
+    int status = extract_extents(dev, geometry, &extents, hit->size, out_fd);
+    if (close(out_fd) != 0)
+        status = 1;
+    if (status != 0)
+        fprintf(stderr, "Error: cannot write %s\n", path);
+    return status;
+}
+
+int carve_free_space(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, const char *output_dir, FILE *out)
+{
+    fat_bitmap bitmap;
+    if (fat_bitmap_build(fat, bs, &bitmap) != 0)
+        return 1;
+
+    uint8_t candidates[256] = {0};
+    for (uint32_t i = 0; i < SIGNATURE_COUNT; i++)
+        candidates[signatures[i].header[0]] |= (uint8_t)(1 << i);
+
+    uint32_t job_count = thread_count > 1 ? (uint32_t)thread_count : 1;
+    carve_job *jobs = calloc(job_count, sizeof(carve_job));
+    pthread_t *threads = calloc(job_count, sizeof(pthread_t));
+    int *started = calloc(job_count, sizeof(int));
+    if (!jobs || !threads || !started)
+    {
+        perror("Error");
+        free(jobs);
+        free(threads);
+        free(started);
+        fat_bitmap_free(&bitmap);
+        return 1;
+    }
+
+    split_ranges(&bitmap, jobs, job_count);
+    int status = 0;
+    for (uint32_t i = 0; i < job_count; i++)
+    {
+        carve_job *job = &jobs[i];
+        job->dev = dev;
+        job->geometry = geometry;
+        job->bitmap = &bitmap;
+        job->candidates = candidates;
+        job->cluster_size = geometry->cluster_size;
+        job->scratch = malloc(CARVE_READ_SIZE > job->cluster_size ? CARVE_READ_SIZE : job->cluster_size);
+        if (!job->scratch)
+        {
+            perror("Error");
+            job->status = 1;
+            continue;
+        }
+        started[i] = pthread_create(&threads[i], NULL, carve_worker, job) == 0;
+        if (!started[i])
+            carve_worker(job);
+    }
+
+    // the ranges are in cluster order, a hit starting inside the previous file comes from the next range
+    uint64_t carved = 0, complete = 0, end = 0;
+    fprintf(out, "# cluster\tsize\ttype\tstate\n");
+    for (uint32_t i = 0; i < job_count; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        status |= jobs[i].status;
+        for (uint32_t h = 0; h < jobs[i].hit_count; h++)
+        {
+            const carve_hit *hit = &jobs[i].hits[h];
+            if (hit->cluster < end)
+                continue;
+            end = hit->cluster + geometry_clusters(geometry, hit->size);
+            carved++;
+            complete += (uint64_t)hit->complete;
+            fprintf(out, "%u\t%lu\t%s\t%s\n", hit->cluster, (unsigned long)hit->size, signatures[hit->signature].type, hit->complete ? "complete" : "truncated");
+            if (output_dir && write_carved(dev, geometry, hit, output_dir) != 0)
+                status = 1;
+        }
+        free(jobs[i].hits);
+        free(jobs[i].scratch);
+    }
+    fprintf(out, "# %lu files carved from %lu free clusters, %lu complete\n", (unsigned long)carved, (unsigned long)bitmap.free_count, (unsigned long)complete);
+
+    free(jobs);
+    free(threads);
+    free(started);
+    fat_bitmap_free(&bitmap);
+    return status;
+}
@@ -0,0 +1,22 @@
+#ifndef CARVE_H
+#define CARVE_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+
+#define CARVE_READ_SIZE (4 * 1024 * 1024) // bytes of free space read at once when looking for headers or footers
+
+/*
+ * scan the unallocated clusters for the headers of known file types (JPEG, PNG, GIF, PDF, ZIP) and print one
+ * "cluster<tab>size<tab>type<tab>state" line per carved file, in cluster order. Headers are only looked for at
+ * cluster starts, where FAT stores the start of every file; a file then extends over free clusters up to its
+ * footer (state complete), or up to the next allocated cluster or the type's size limit (state truncated).
+ * The free clusters are split into thread_count ranges holding as many free clusters each, scanned in parallel.
+ * If output_dir is not NULL, every carved file is written there as "<cluster>.<type>".
+ * Return 1 if the volume could not be read or a file could not be written, 0 otherwise.
+ */
+int carve_free_space(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, const char *output_dir, FILE *out);
+
+#endif
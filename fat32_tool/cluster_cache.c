@@ -0,0 +1,253 @@
+#include "cluster_cache.h"
+#include "stats.h"
+
+#include <fcntl.h>
+
+static uint32_t bucket_of(const cluster_cache *cache, uint32_t cluster)
+{
+    return (cluster * 2654435761u) & cache->bucket_mask;
+}
+
+static uint8_t *slot_data(const cluster_cache *cache, uint32_t slot)
+{
+    return cache->memory + (size_t)slot * cache->cluster_size;
+}
+
+/*
+ * return the slot index + 1 holding cluster, 0 if it is not cached
+ */
+static uint32_t find_slot(const cluster_cache *cache, uint32_t cluster)
+{
+    uint32_t next = cache->buckets[bucket_of(cache, cluster)];
+    while (next != 0 && cache->slots[next - 1].cluster != cluster)
+        next = cache->slots[next - 1].next;
+    return next;
+}
+
+static void unlink_slot(cluster_cache *cache, uint32_t slot)
+{
+    uint32_t *link = &cache->buckets[bucket_of(cache, cache->slots[slot].cluster)];
+    while (*link != slot + 1)
+        link = &cache->slots[*link - 1].next;
+    *link = cache->slots[slot].next;
+}
+
+/*
+ * store a cluster read from the image, evicting the first unreferenced slot found by the clock hand
+ */
+static void insert_cluster(cluster_cache *cache, uint32_t cluster, const uint8_t *data)
+{
+    if (find_slot(cache, cluster) != 0)
+        return;
+
+    uint32_t slot;
+    for (;;)
+    {
+        slot = cache->clock_hand;
+        cache->clock_hand = (cache->clock_hand + 1) % cache->slot_count;
+        if (!cache->slots[slot].used || !cache->slots[slot].referenced)
+            break;
+        cache->slots[slot].referenced = 0;
+    }
+
+    if (cache->slots[slot].used)
+        unlink_slot(cache, slot);
+
+    uint32_t bucket = bucket_of(cache, cluster);
+    cache->slots[slot].cluster = cluster;
+    cache->slots[slot].used = 1;
+    cache->slots[slot].referenced = 1;
+    cache->slots[slot].next = cache->buckets[bucket];
+    cache->buckets[bucket] = slot + 1;
+    memcpy(slot_data(cache, slot), data, cache->cluster_size);
+}
+
+/*
+ * read clusters [first, first + count) of the image and cache them
+ */
+static int fill_run(cluster_cache *cache, uint32_t first, uint32_t count, uint8_t *buffer)
+{
+    if (block_device_read(cache->dev, geometry_cluster_offset(&cache->geometry, first), (size_t)count * cache->cluster_size, buffer) != 0)
+        return 1;
+
+    pthread_mutex_lock(&cache->lock);
+    for (uint32_t i = 0; i < count; i++)
+        insert_cluster(cache, first + i, buffer + (size_t)i * cache->cluster_size);
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+/*
+ * background thread: read ahead the clusters following the last requested one in its chain
+ */
+static void *prefetch_main(void *argument)
+{
+    cluster_cache *cache = argument;
+    uint32_t *clusters = malloc(cache->readahead * sizeof(uint32_t));
+    uint8_t *buffer = malloc((size_t)cache->readahead * cache->cluster_size);
+    int fd = block_device_fd(cache->dev);
+
+    pthread_mutex_lock(&cache->lock);
+    for (;;)
+    {
+        while (!cache->prefetch_pending && !cache->stopping)
+            pthread_cond_wait(&cache->prefetch_wake, &cache->lock);
+        if (cache->stopping)
+            break;
+        uint32_t cluster = cache->prefetch_from;
+        cache->prefetch_pending = 0;
+        pthread_mutex_unlock(&cache->lock);
+
+        // the next clusters of the chain that are not cached yet
+        uint32_t count = 0;
+        for (uint32_t i = 0; clusters && buffer && i < cache->readahead; i++)
+        {
+            cluster = fat_table_next(cache->fat, cluster);
+            if (cluster < 2 || cluster >= END_OF_CLUSTER_CHAIN)
+                break;
+            pthread_mutex_lock(&cache->lock);
+            int cached = find_slot(cache, cluster) != 0;
+            pthread_mutex_unlock(&cache->lock);
+            if (!cached)
+                clusters[count++] = cluster;
+        }
+
+        // announce every contiguous run to the kernel first so they are fetched concurrently, then read them
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (uint32_t i = 0; i < count;)
+            {
+                uint32_t run = 1;
+                while (i + run < count && clusters[i + run] == clusters[i] + run)
+                    run++;
+                if (pass == 0 && fd >= 0)
+                    posix_fadvise(fd, (off_t)geometry_cluster_offset(&cache->geometry, clusters[i]), (off_t)run * cache->cluster_size, POSIX_FADV_WILLNEED);
+                else if (pass == 1 && fill_run(cache, clusters[i], run, buffer) == 0)
+                    stats_add(STAT_CLUSTER_CACHE_PREFETCHED, run);
+                i += run;
+            }
+        }
+        pthread_mutex_lock(&cache->lock);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    free(clusters);
+    free(buffer);
+    return NULL;
+}
+
+int cluster_cache_init(cluster_cache *cache, block_device *dev, fat_table *fat, const volume_geometry *geometry, size_t memory_budget, uint32_t readahead)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->dev = dev;
+    cache->fat = fat;
+    cache->geometry = *geometry;
+    cache->cluster_size = cache->geometry.cluster_size;
+    cache->readahead = readahead;
+    if (cache->cluster_size == 0 || memory_budget / cache->cluster_size == 0)
+        return 1;
+
+    cache->slot_count = memory_budget / cache->cluster_size > UINT32_MAX / 2 ? UINT32_MAX / 2 : (uint32_t)(memory_budget / cache->cluster_size);
+    uint32_t bucket_count = 1;
+    while (bucket_count < cache->slot_count)
+        bucket_count *= 2;
+    cache->bucket_mask = bucket_count - 1;
+
+    cache->memory = malloc((size_t)cache->slot_count * cache->cluster_size);
+    cache->slots = calloc(cache->slot_count, sizeof(cluster_cache_slot));
+    cache->buckets = calloc(bucket_count, sizeof(uint32_t));
+    if (!cache->memory || !cache->slots || !cache->buckets)
+    {
+        free(cache->memory);
+        free(cache->slots);
+        free(cache->buckets);
+        memset(cache, 0, sizeof(*cache));
+        return 1;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->prefetch_wake, NULL);
+    cache->prefetching = readahead > 0 && pthread_create(&cache->prefetch_thread, NULL, prefetch_main, cache) == 0;
+    dev->cache = cache;
+    return 0;
+}
+
+int cluster_cache_read(cluster_cache *cache, uint32_t cluster, uint32_t count, uint8_t *buffer)
+{
+    if (count > CLUSTER_CACHE_MAX_RUN)
+        return block_device_read(cache->dev, geometry_cluster_offset(&cache->geometry, cluster), (size_t)count * cache->cluster_size, buffer);
+
+    // copy the cached clusters, remember the missing ones
+    uint32_t missing = 0;
+    pthread_mutex_lock(&cache->lock);
+    int sequential = cluster == cache->last_cluster + 1;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t slot = find_slot(cache, cluster + i);
+        if (slot == 0)
+        {
+            missing |= 1u << i;
+            continue;
+        }
+        cache->slots[slot - 1].referenced = 1;
+        memcpy(buffer + (size_t)i * cache->cluster_size, slot_data(cache, slot - 1), cache->cluster_size);
+    }
+    uint32_t previous = cache->last_cluster;
+    cache->last_cluster = cluster + count - 1;
+    pthread_mutex_unlock(&cache->lock);
+
+    stats_add(STAT_CLUSTER_CACHE_HITS, count - __builtin_popcount(missing));
+    stats_add(STAT_CLUSTER_CACHE_MISSES, __builtin_popcount(missing));
+
+    // one read per run of missing clusters
+    for (uint32_t i = 0; i < count;)
+    {
+        if (!(missing & (1u << i)))
+        {
+            i++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (i + run < count && (missing & (1u << (i + run))))
+            run++;
+        if (fill_run(cache, cluster + i, run, buffer + (size_t)i * cache->cluster_size) != 0)
+            return 1;
+        i += run;
+    }
+
+    // sequential along the chain: let the prefetch thread read what follows
+    if (!sequential && previous >= 2)
+        sequential = fat_table_next(cache->fat, previous) == cluster;
+    if (sequential && cache->prefetching)
+    {
+        pthread_mutex_lock(&cache->lock);
+        cache->prefetch_from = cluster + count - 1;
+        cache->prefetch_pending = 1;
+        pthread_cond_signal(&cache->prefetch_wake);
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return 0;
+}
+
+void cluster_cache_free(cluster_cache *cache)
+{
+    if (!cache->slots)
+        return;
+
+    if (cache->prefetching)
+    {
+        pthread_mutex_lock(&cache->lock);
+        cache->stopping = 1;
+        pthread_cond_signal(&cache->prefetch_wake);
+        pthread_mutex_unlock(&cache->lock);
+        pthread_join(cache->prefetch_thread, NULL);
+    }
+    pthread_cond_destroy(&cache->prefetch_wake);
+    pthread_mutex_destroy(&cache->lock);
+
+    cache->dev->cache = NULL;
+    free(cache->memory);
+    free(cache->slots);
+    free(cache->buckets);
+    memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,72 @@
+#ifndef CLUSTER_CACHE_H
+#define CLUSTER_CACHE_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+#include "geometry.h"
+
+#include <pthread.h>
+
+#define CLUSTER_CACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+#define CLUSTER_CACHE_DEFAULT_READAHEAD 8 // clusters prefetched along the chain once access is sequential
+#define CLUSTER_CACHE_MAX_RUN 32         // longer contiguous reads bypass the cache
+
+typedef struct cluster_cache_slot_t
+{
+    uint32_t cluster;
+    uint32_t next; // next slot (index + 1) of the same hash bucket, 0 ends the chain
+    uint8_t used;
+    uint8_t referenced; // second chance bit of the clock
+} cluster_cache_slot;
+
+/*
+ * fixed-size cache of data clusters for backends that cannot map the image, with CLOCK replacement. When a
+ * cluster is requested right after the one before it in its chain, a background thread reads the next clusters of
+ * the chain ahead (one read per contiguous run, all announced to the kernel first) so small chained reads do not
+ * each pay a round trip to the storage.
+ */
+struct cluster_cache_t
+{
+    block_device *dev;
+    fat_table *fat;
+    volume_geometry geometry;
+    uint32_t cluster_size;
+    uint32_t readahead;
+    uint8_t *memory; // slot_count clusters
+    cluster_cache_slot *slots;
+    uint32_t slot_count;
+    uint32_t *buckets; // slot index + 1 of the first slot of each bucket
+    uint32_t bucket_mask;
+    uint32_t clock_hand;
+    uint32_t last_cluster; // last cluster requested, to detect sequential access
+    pthread_mutex_t lock;
+    // read-ahead thread and its single pending request (a newer request replaces an older one)
+    pthread_t prefetch_thread;
+    pthread_cond_t prefetch_wake;
+    uint32_t prefetch_from;
+    int prefetch_pending;
+    int prefetching; // the thread is running
+    int stopping;
+};
+
+typedef struct cluster_cache_t cluster_cache;
+
+/*
+ * allocate a cache of memory_budget bytes for the data clusters of a partition and attach it to dev, so extent
+ * reads of dev go through it. Return 1 if the budget does not hold a cluster or on allocation failure.
+ */
+int cluster_cache_init(cluster_cache *cache, block_device *dev, fat_table *fat, const volume_geometry *geometry, size_t memory_budget, uint32_t readahead);
+
+/*
+ * copy count physically contiguous clusters starting at cluster into buffer, return 0 on success
+ */
+int cluster_cache_read(cluster_cache *cache, uint32_t cluster, uint32_t count, uint8_t *buffer);
+
+/*
+ * detach the cache from its device and release it
+ */
+void cluster_cache_free(cluster_cache *cache);
+
+#endif
@@ -0,0 +1,596 @@
+#include "compressed_image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define ZIP_LOCAL_HEADER 0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP_END_OF_CENTRAL_DIRECTORY 0x06054b50
+#define ZIP64_END_LOCATOR 0x07064b50
+#define ZIP64_END_OF_CENTRAL_DIRECTORY 0x06064b50
+#define ZIP_MAX_COMMENT 65535
+
+typedef struct compressed_image_t
+{
+    uint64_t data_start; // offset of the compressed stream (or stored content) in the file
+    int stored;
+    compressed_index_header header;
+    compressed_point *points;
+    uint8_t *windows; // deflated windows of the points
+    uint64_t windows_size;
+    // decompression stream kept between reads, so sequential reads continue where the previous one stopped
+    z_stream stream;
+    int stream_active;
+    uint64_t stream_out; // uncompressed offset of the next byte the stream produces
+    uint64_t stream_in;  // file offset of the next compressed bytes to feed
+    uint8_t *input;
+    uint8_t *window; // uncompressed window of a point, also used to discard output when skipping
+    pthread_mutex_t lock;
+} compressed_image;
+
+static uint16_t le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t le64(const uint8_t *p)
+{
+    return (uint64_t)le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+static int read_exact(int fd, uint64_t offset, void *buffer, size_t size)
+{
+    uint8_t *out = buffer;
+    while (size > 0)
+    {
+        ssize_t n = pread(fd, out, size, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        out += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * skip the gzip member header (RFC 1952) and return the offset of the deflate stream
+ */
+static int parse_gzip(int fd, uint64_t file_size, uint64_t *data_start)
+{
+    uint8_t header[10];
+    if (file_size < 18 || read_exact(fd, 0, header, sizeof(header)) != 0 || header[2] != 8)
+        return 1;
+
+    uint8_t flags = header[3];
+    uint64_t offset = sizeof(header);
+    if (flags & 0x04) // FEXTRA
+    {
+        uint8_t length[2];
+        if (read_exact(fd, offset, length, sizeof(length)) != 0)
+            return 1;
+        offset += 2 + le16(length);
+    }
+    for (int field = 0x08; field <= 0x10; field <<= 1) // FNAME then FCOMMENT, null terminated
+    {
+        if (!(flags & field))
+            continue;
+        uint8_t c;
+        do
+        {
+            if (read_exact(fd, offset++, &c, 1) != 0)
+                return 1;
+        } while (c != 0);
+    }
+    if (flags & 0x02) // FHCRC
+        offset += 2;
+
+    *data_start = offset;
+    return offset < file_size ? 0 : 1;
+}
+
+/*
+ * read the zip64 extended information of a central directory entry
+ */
+static void parse_zip64_extra(const uint8_t *extra, size_t size, uint64_t *uncompressed, uint64_t *compressed, uint64_t *local_offset)
+{
+    while (size >= 4)
+    {
+        uint16_t id = le16(extra), length = le16(extra + 2);
+        if (4 + (size_t)length > size)
+            return;
+        if (id == 0x0001)
+        {
+            const uint8_t *field = extra + 4;
+            const uint8_t *end = field + length;
+            if (*uncompressed == 0xFFFFFFFF && field + 8 <= end)
+                *uncompressed = le64(field), field += 8;
+            if (*compressed == 0xFFFFFFFF && field + 8 <= end)
+                *compressed = le64(field), field += 8;
+            if (*local_offset == 0xFFFFFFFF && field + 8 <= end)
+                *local_offset = le64(field);
+            return;
+        }
+        extra += 4 + length;
+        size -= 4 + length;
+    }
+}
+
+/*
+ * find the first member of a zip archive through its central directory (zip64 included)
+ */
+static int parse_zip(int fd, uint64_t file_size, uint64_t *data_start, int *method, uint64_t *uncompressed_size)
+{
+    // the end of central directory record is in the last 22 + 65535 bytes
+    size_t tail_size = file_size < 22 + ZIP_MAX_COMMENT ? (size_t)file_size : 22 + ZIP_MAX_COMMENT;
+    uint8_t *tail = malloc(tail_size);
+    if (!tail || read_exact(fd, file_size - tail_size, tail, tail_size) != 0)
+    {
+        free(tail);
+        return 1;
+    }
+
+    int64_t end = -1;
+    for (int64_t i = (int64_t)tail_size - 22; i >= 0 && end < 0; i--)
+    {
+        if (le32(tail + i) == ZIP_END_OF_CENTRAL_DIRECTORY)
+            end = i;
+    }
+    if (end < 0)
+    {
+        free(tail);
+        return 1;
+    }
+
+    uint64_t entries = le16(tail + end + 10);
+    uint64_t directory_offset = le32(tail + end + 16);
+    uint64_t end_offset = file_size - tail_size + (uint64_t)end;
+    free(tail);
+
+    if ((entries == 0xFFFF || directory_offset == 0xFFFFFFFF) && end_offset >= 20)
+    {
+        uint8_t locator[20], record[56];
+        if (read_exact(fd, end_offset - 20, locator, sizeof(locator)) != 0 || le32(locator) != ZIP64_END_LOCATOR ||
+            read_exact(fd, le64(locator + 8), record, sizeof(record)) != 0 || le32(record) != ZIP64_END_OF_CENTRAL_DIRECTORY)
+            return 1;
+        entries = le64(record + 32);
+        directory_offset = le64(record + 48);
+    }
+    if (entries == 0)
+        return 1;
+
+    uint8_t central[46];
+    if (read_exact(fd, directory_offset, central, sizeof(central)) != 0 || le32(central) != ZIP_CENTRAL_HEADER)
+        return 1;
+    if (le16(central + 8) & 0x0001)
+    {
+        fprintf(stderr, "Error: encrypted zip archives are not supported\n");
+        return 1;
+    }
+
+    *method = le16(central + 10);
+    uint64_t compressed = le32(central + 20);
+    *uncompressed_size = le32(central + 24);
+    uint64_t local_offset = le32(central + 42);
+    uint16_t name_length = le16(central + 28), extra_length = le16(central + 30);
+
+    uint8_t *extra = malloc(extra_length + 1);
+    if (!extra || read_exact(fd, directory_offset + sizeof(central) + name_length, extra, extra_length) != 0)
+    {
+        free(extra);
+        return 1;
+    }
+    parse_zip64_extra(extra, extra_length, uncompressed_size, &compressed, &local_offset);
+    free(extra);
+
+    uint8_t local[30];
+    if (read_exact(fd, local_offset, local, sizeof(local)) != 0 || le32(local) != ZIP_LOCAL_HEADER)
+        return 1;
+    *data_start = local_offset + sizeof(local) + le16(local + 26) + le16(local + 28);
+
+    if (*method != 0 && *method != Z_DEFLATED)
+    {
+        fprintf(stderr, "Error: zip compression method %d is not supported\n", *method);
+        return 1;
+    }
+    return 0;
+}
+
+static void index_path_of(const char *path, char *index_path, size_t size)
+{
+    snprintf(index_path, size, "%s.zidx", path);
+}
+
+/*
+ * load a saved seek index, return 1 if missing, stale or damaged
+ */
+static int load_index(compressed_image *image, const char *path, const struct stat *st)
+{
+    char index_path[4096];
+    index_path_of(path, index_path, sizeof(index_path));
+    int fd = open(index_path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    struct stat index_st;
+    compressed_index_header *header = &image->header;
+    int status = fstat(fd, &index_st) != 0 || read_exact(fd, 0, header, sizeof(*header)) != 0 ||
+                 memcmp(header->magic, COMPRESSED_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+                 header->image_size != (uint64_t)st->st_size || header->image_mtime_sec != st->st_mtim.tv_sec ||
+                 header->image_mtime_nsec != st->st_mtim.tv_nsec || header->point_count == 0;
+
+    uint64_t points_size = (uint64_t)header->point_count * sizeof(compressed_point);
+    if (status == 0 && (uint64_t)index_st.st_size < sizeof(*header) + points_size)
+        status = 1;
+    if (status == 0)
+    {
+        image->windows_size = (uint64_t)index_st.st_size - sizeof(*header) - points_size;
+        image->points = malloc(points_size);
+        image->windows = malloc(image->windows_size + 1);
+        status = !image->points || !image->windows ||
+                 read_exact(fd, sizeof(*header), image->points, points_size) != 0 ||
+                 read_exact(fd, sizeof(*header) + points_size, image->windows, image->windows_size) != 0;
+    }
+    for (uint32_t i = 0; status == 0 && i < header->point_count; i++)
+    {
+        const compressed_point *point = &image->points[i];
+        status = point->window_offset + point->window_size > image->windows_size || point->bits > 7 ||
+                 (i > 0 && point->out < image->points[i - 1].out);
+    }
+    close(fd);
+
+    if (status != 0)
+    {
+        free(image->points);
+        free(image->windows);
+        image->points = NULL;
+        image->windows = NULL;
+        memset(header, 0, sizeof(*header));
+    }
+    return status;
+}
+
+static void save_index(const compressed_image *image, const char *path)
+{
+    char index_path[4096], temporary_path[4104];
+    index_path_of(path, index_path, sizeof(index_path));
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", index_path);
+
+    FILE *out = fopen(temporary_path, "wb");
+    if (!out)
+        return;
+    int status = fwrite(&image->header, sizeof(image->header), 1, out) != 1 ||
+                 fwrite(image->points, sizeof(compressed_point), image->header.point_count, out) != image->header.point_count ||
+                 fwrite(image->windows, 1, image->windows_size, out) != image->windows_size;
+    status = fclose(out) != 0 || status;
+    if (status == 0)
+        status = rename(temporary_path, index_path) != 0;
+    if (status != 0)
+        unlink(temporary_path);
+}
+
+/*
+ * record a checkpoint: the 32 KiB window ends left bytes before the end of the circular buffer
+ */
+static int add_point(compressed_image *image, uint32_t *capacity, uint64_t in, uint64_t out, int bits, const uint8_t *window, unsigned left, uint64_t *windows_capacity)
+{
+    if (image->header.point_count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        compressed_point *points = realloc(image->points, *capacity * sizeof(compressed_point));
+        if (!points)
+            return 1;
+        image->points = points;
+    }
+
+    // unroll the circular window, then deflate it
+    if (left)
+        memcpy(image->window, window + COMPRESSED_WINDOW_SIZE - left, left);
+    if (left < COMPRESSED_WINDOW_SIZE)
+        memcpy(image->window + left, window, COMPRESSED_WINDOW_SIZE - left);
+
+    uLongf packed_size = compressBound(COMPRESSED_WINDOW_SIZE);
+    while (image->windows_size + packed_size > *windows_capacity)
+    {
+        *windows_capacity = *windows_capacity ? *windows_capacity * 2 : 1024 * 1024;
+        uint8_t *windows = realloc(image->windows, *windows_capacity);
+        if (!windows)
+            return 1;
+        image->windows = windows;
+    }
+    if (compress2(image->windows + image->windows_size, &packed_size, image->window, COMPRESSED_WINDOW_SIZE, 1) != Z_OK)
+        return 1;
+
+    compressed_point *point = &image->points[image->header.point_count++];
+    point->in = in;
+    point->out = out;
+    point->bits = (uint8_t)bits;
+    point->window_size = (uint32_t)packed_size;
+    point->window_offset = image->windows_size;
+    image->windows_size += packed_size;
+    return 0;
+}
+
+/*
+ * decompress the whole stream once, recording a checkpoint at the first block boundary after every span bytes
+ */
+static int build_index(compressed_image *image, int fd)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, -15) != Z_OK)
+        return 1;
+
+    uint8_t *window = calloc(1, COMPRESSED_WINDOW_SIZE);
+    uint32_t capacity = 0;
+    uint64_t windows_capacity = 0;
+    uint64_t total_in = 0, total_out = 0, last = 0, next_in = image->data_start;
+    int ret = Z_OK;
+    // the start of the stream is a checkpoint with an empty history
+    int status = window == NULL || add_point(image, &capacity, 0, 0, 0, window, 0, &windows_capacity);
+
+    stream.avail_out = 0;
+    while (status == 0 && ret != Z_STREAM_END)
+    {
+        if (stream.avail_in == 0)
+        {
+            ssize_t n = pread(fd, image->input, COMPRESSED_INPUT_SIZE, (off_t)next_in);
+            if (n <= 0)
+            {
+                fprintf(stderr, "Error: compressed image is truncated\n");
+                status = 1;
+                break;
+            }
+            next_in += n;
+            stream.next_in = image->input;
+            stream.avail_in = (uInt)n;
+        }
+        if (stream.avail_out == 0)
+        {
+            stream.next_out = window;
+            stream.avail_out = COMPRESSED_WINDOW_SIZE;
+        }
+
+        total_in += stream.avail_in;
+        total_out += stream.avail_out;
+        ret = inflate(&stream, Z_BLOCK);
+        total_in -= stream.avail_in;
+        total_out -= stream.avail_out;
+        if (ret != Z_OK && ret != Z_STREAM_END)
+        {
+            fprintf(stderr, "Error: compressed image is corrupted\n");
+            status = 1;
+            break;
+        }
+
+        // end of a deflate block that is not the last one
+        if ((stream.data_type & 128) && !(stream.data_type & 64) && total_out - last >= COMPRESSED_SPAN)
+        {
+            status = add_point(image, &capacity, total_in, total_out, stream.data_type & 7, window, stream.avail_out, &windows_capacity);
+            last = total_out;
+        }
+    }
+
+    inflateEnd(&stream);
+    free(window);
+    image->header.uncompressed_size = total_out;
+    image->header.span = COMPRESSED_SPAN;
+    return status || image->header.point_count == 0;
+}
+
+/*
+ * restart the stream at the last checkpoint before offset
+ */
+static int seek_stream(compressed_image *image, int fd, uint64_t offset)
+{
+    uint32_t low = 0, high = image->header.point_count;
+    while (high - low > 1)
+    {
+        uint32_t middle = (low + high) / 2;
+        if (image->points[middle].out <= offset)
+            low = middle;
+        else
+            high = middle;
+    }
+    const compressed_point *point = &image->points[low];
+
+    if (inflateReset(&image->stream) != Z_OK)
+        return 1;
+    image->stream.avail_in = 0;
+    image->stream_in = image->data_start + point->in;
+    if (point->bits)
+    {
+        // the point starts inside the byte before in
+        uint8_t byte;
+        if (read_exact(fd, image->stream_in - 1, &byte, 1) != 0)
+            return 1;
+        inflatePrime(&image->stream, point->bits, byte >> (8 - point->bits));
+    }
+
+    uLongf window_size = COMPRESSED_WINDOW_SIZE;
+    if (uncompress(image->window, &window_size, image->windows + point->window_offset, point->window_size) != Z_OK ||
+        inflateSetDictionary(&image->stream, image->window, (uInt)window_size) != Z_OK)
+        return 1;
+
+    image->stream_out = point->out;
+    return 0;
+}
+
+/*
+ * inflate size bytes into out (NULL to discard them)
+ */
+static int inflate_into(compressed_image *image, int fd, uint8_t *out, uint64_t size)
+{
+    z_stream *stream = &image->stream;
+    while (size > 0)
+    {
+        uint8_t *target = out ? out : image->window;
+        uint64_t chunk = out ? size : (size < COMPRESSED_WINDOW_SIZE ? size : COMPRESSED_WINDOW_SIZE);
+        if (chunk > UINT32_MAX)
+            chunk = UINT32_MAX;
+        stream->next_out = target;
+        stream->avail_out = (uInt)chunk;
+
+        while (stream->avail_out > 0)
+        {
+            if (stream->avail_in == 0)
+            {
+                ssize_t n = pread(fd, image->input, COMPRESSED_INPUT_SIZE, (off_t)image->stream_in);
+                if (n <= 0)
+                    return 1;
+                image->stream_in += n;
+                stream->next_in = image->input;
+                stream->avail_in = (uInt)n;
+            }
+            int ret = inflate(stream, Z_NO_FLUSH);
+            if (ret != Z_OK && !(ret == Z_STREAM_END && stream->avail_out == 0))
+                return 1;
+        }
+
+        image->stream_out += chunk;
+        size -= chunk;
+        if (out)
+            out += chunk;
+    }
+    return 0;
+}
+
+static int compressed_read(block_device *dev, uint64_t offset, size_t size, void *buffer)
+{
+    compressed_image *image = dev->context;
+    if (image->stored)
+        return read_exact(dev->fd, image->data_start + offset, buffer, size);
+
+    pthread_mutex_lock(&image->lock);
+    int status = 0;
+
+    // continue the current stream when the read is ahead of it and no checkpoint is closer
+    int resume = image->stream_active && offset >= image->stream_out && offset - image->stream_out < image->header.span;
+    if (!resume)
+    {
+        status = seek_stream(image, dev->fd, offset);
+        image->stream_active = status == 0;
+    }
+    if (status == 0)
+        status = inflate_into(image, dev->fd, NULL, offset - image->stream_out);
+    if (status == 0)
+        status = inflate_into(image, dev->fd, buffer, size);
+    if (status != 0)
+        image->stream_active = 0;
+
+    pthread_mutex_unlock(&image->lock);
+    return status;
+}
+
+static const void *compressed_map(block_device *dev, uint64_t offset, size_t size)
+{
+    (void)dev;
+    (void)offset;
+    (void)size;
+    return NULL;
+}
+
+static void free_image(compressed_image *image)
+{
+    if (!image->stored)
+    {
+        inflateEnd(&image->stream);
+        pthread_mutex_destroy(&image->lock);
+    }
+    free(image->points);
+    free(image->windows);
+    free(image->input);
+    free(image->window);
+    free(image);
+}
+
+static void compressed_close(block_device *dev)
+{
+    free_image(dev->context);
+}
+
+static const block_device_ops compressed_ops = {"compressed", 0, compressed_read, compressed_map, compressed_close};
+
+int compressed_image_open(block_device *dev, const char *path)
+{
+    struct stat st;
+    uint8_t magic[4];
+    if (fstat(dev->fd, &st) != 0 || st.st_size < 4 || read_exact(dev->fd, 0, magic, sizeof(magic)) != 0)
+        return -1;
+
+    int gzip = magic[0] == 0x1F && magic[1] == 0x8B;
+    if (!gzip && le32(magic) != ZIP_LOCAL_HEADER)
+        return -1;
+
+    compressed_image *image = calloc(1, sizeof(compressed_image));
+    if (!image)
+        return 1;
+
+    int method = Z_DEFLATED;
+    uint64_t uncompressed_size = 0;
+    int status = gzip ? parse_gzip(dev->fd, (uint64_t)st.st_size, &image->data_start)
+                      : parse_zip(dev->fd, (uint64_t)st.st_size, &image->data_start, &method, &uncompressed_size);
+    if (status != 0)
+    {
+        fprintf(stderr, "Error: cannot read the %s header of the image\n", gzip ? "gzip" : "zip");
+        free(image);
+        return 1;
+    }
+
+    if (method == 0)
+    {
+        // stored member: the image is a plain range of the archive
+        image->stored = 1;
+        dev->size = uncompressed_size;
+    }
+    else
+    {
+        image->input = malloc(COMPRESSED_INPUT_SIZE);
+        image->window = malloc(COMPRESSED_WINDOW_SIZE);
+        if (!image->input || !image->window || inflateInit2(&image->stream, -15) != Z_OK)
+        {
+            free(image->input);
+            free(image->window);
+            free(image);
+            return 1;
+        }
+        pthread_mutex_init(&image->lock, NULL);
+
+        if (load_index(image, path, &st) != 0)
+        {
+            fprintf(stderr, "Building the seek index of %s...\n", path);
+            if (build_index(image, dev->fd) != 0)
+            {
+                free_image(image);
+                return 1;
+            }
+            memcpy(image->header.magic, COMPRESSED_INDEX_MAGIC, sizeof(image->header.magic));
+            image->header.image_size = (uint64_t)st.st_size;
+            image->header.image_mtime_sec = st.st_mtim.tv_sec;
+            image->header.image_mtime_nsec = st.st_mtim.tv_nsec;
+            save_index(image, path);
+        }
+        if (!gzip && image->header.uncompressed_size != uncompressed_size)
+        {
+            fprintf(stderr, "Error: the zip member size does not match its content\n");
+            free_image(image);
+            return 1;
+        }
+        dev->size = image->header.uncompressed_size;
+    }
+
+    dev->ops = &compressed_ops;
+    dev->context = image;
+    return 0;
+}
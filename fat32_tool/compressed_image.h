@@ -0,0 +1,48 @@
+#ifndef COMPRESSED_IMAGE_H
+#define COMPRESSED_IMAGE_H
+
+#include "utils.h"
+#include "block_device.h"
+
+#define COMPRESSED_INDEX_MAGIC "F32ZIDX1"
+#define COMPRESSED_WINDOW_SIZE 32768              // deflate history needed to resume at a checkpoint
+#define COMPRESSED_SPAN (4 * 1024 * 1024)         // uncompressed bytes between two checkpoints
+#define COMPRESSED_INPUT_SIZE (256 * 1024)        // compressed bytes read at once
+
+/*
+ * The seek index is saved next to the image as <image>.zidx:
+ * header | points | compressed windows. Each point is a deflate block boundary where decompression can resume
+ * given the 32 KiB of output before it, stored deflated (disk images are mostly zeros).
+ */
+#pragma pack(push, 1)
+typedef struct compressed_index_header_t
+{
+    char magic[8];
+    // the index is only valid for the compressed file it was built from
+    uint64_t image_size;
+    int64_t image_mtime_sec;
+    int64_t image_mtime_nsec;
+    uint64_t uncompressed_size;
+    uint32_t span;
+    uint32_t point_count;
+} compressed_index_header;
+
+typedef struct compressed_point_t
+{
+    uint64_t in;  // offset of the first full byte after the point in the deflate stream
+    uint64_t out; // offset in the uncompressed image
+    uint8_t bits; // bits of the byte before in that belong to the point, 0 if it starts on a byte
+    uint32_t window_size; // size of the deflated window
+    uint64_t window_offset; // offset of the deflated window in the window area
+} compressed_point;
+#pragma pack(pop)
+
+/*
+ * if path is a gzip file or a zip archive whose first member is a stored or deflated image, make dev serve the
+ * uncompressed image. Deflated content is read through the seek index, loaded from <path>.zidx or built by one
+ * pass over the stream and saved there (kept in memory only if it cannot be written).
+ * Return 0 if dev now reads the compressed image, -1 if the file is not compressed, 1 on error.
+ */
+int compressed_image_open(block_device *dev, const char *path);
+
+#endif
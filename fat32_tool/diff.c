@@ -0,0 +1,653 @@
+#include "diff.h"
+#include "fat32_internal.h"
+#include "walker.h"
+#include "digest.h"
+#include "fat_analysis.h"
+#include "file.h"
+
+/*
+ * entry present in one snapshot only, candidate for a move
+ */
+typedef struct diff_file_t
+{
+    char *path;
+    directory_table_entry entry;
+    const walk_entry *item;
+    uint32_t parent; // 1 + index of the directory it was listed below, 0 if none
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+    int hashed;      // 1 once hashed, -1 if its content could not be read
+    int moved;
+} diff_file;
+
+typedef struct diff_list_t
+{
+    diff_file *items;
+    uint32_t count;
+    uint32_t capacity;
+} diff_list;
+
+typedef struct diff_context_t
+{
+    fat32_volume *volumes[2]; // before, after
+    FILE *out;
+    int comparable;        // same volume id, cluster size and FAT size: cluster numbers can be compared
+    uint64_t *changed;     // clusters whose FAT entry differs between the snapshots
+    uint32_t changed_end;  // number of clusters the bitmap covers
+    uint64_t changed_entries;
+    uint64_t fat_blocks;
+    uint64_t changed_blocks;
+    uint64_t changed_directories;
+    uint64_t hashed_bytes;
+    uint64_t modified;
+    uint64_t moved;
+    diff_list removed;
+    diff_list added;
+    int failed;
+} diff_context;
+
+typedef struct hash_reader_t
+{
+    digest state;
+    uint64_t size;
+} hash_reader;
+
+static void mark_changed(diff_context *diff, uint32_t cluster)
+{
+    diff->changed[cluster / FAT_BITMAP_WORD_BITS] |= (uint64_t)1 << (cluster % FAT_BITMAP_WORD_BITS);
+    diff->changed_entries++;
+}
+
+static int is_changed(const diff_context *diff, uint32_t cluster)
+{
+    return cluster < diff->changed_end && (diff->changed[cluster / FAT_BITMAP_WORD_BITS] >> (cluster % FAT_BITMAP_WORD_BITS)) & 1;
+}
+
+/*
+ * whether both snapshots are of the same volume, so that a cluster number designates the same data in both
+ */
+static int same_volume(fat32_volume *before, fat32_volume *after)
+{
+    return fat32_volume_boot_sector(before)->volume_id == fat32_volume_boot_sector(after)->volume_id &&
+           fat32_volume_geometry(before)->cluster_size == fat32_volume_geometry(after)->cluster_size &&
+           fat32_volume_fat(before)->entry_count == fat32_volume_fat(after)->entry_count;
+}
+
+/*
+ * read both active FATs sequentially and mark the clusters whose entry differs, comparing entries only in the
+ * blocks that differ. Entries beyond the end of the smaller FAT count as changed.
+ */
+static int compare_fats(diff_context *diff)
+{
+    fat_table *fats[2] = {fat32_volume_fat(diff->volumes[0]), fat32_volume_fat(diff->volumes[1])};
+    uint64_t starts[2] = {fat32_volume_geometry(diff->volumes[0])->fat_offset, fat32_volume_geometry(diff->volumes[1])->fat_offset};
+    uint32_t common = fats[0]->entry_count < fats[1]->entry_count ? fats[0]->entry_count : fats[1]->entry_count;
+    diff->changed_end = fats[0]->entry_count > fats[1]->entry_count ? fats[0]->entry_count : fats[1]->entry_count;
+
+    diff->changed = calloc(((uint64_t)diff->changed_end + FAT_BITMAP_WORD_BITS - 1) / FAT_BITMAP_WORD_BITS, sizeof(uint64_t));
+    uint8_t *scratch[2] = {malloc(DIFF_FAT_READ), malloc(DIFF_FAT_READ)};
+    int status = !diff->changed || !scratch[0] || !scratch[1];
+    if (status)
+        perror("Error");
+
+    uint64_t size = (uint64_t)common * sizeof(uint32_t);
+    for (uint64_t position = 0; position < size && status == 0; position += DIFF_FAT_READ)
+    {
+        size_t chunk = size - position < DIFF_FAT_READ ? (size_t)(size - position) : DIFF_FAT_READ;
+        const uint8_t *data[2];
+        for (int i = 0; i < 2; i++)
+            data[i] = block_device_get(fat32_volume_device(diff->volumes[i]), starts[i] + position, chunk, scratch[i]);
+        if (!data[0] || !data[1])
+        {
+            fprintf(stderr, "Error: cannot read the FAT\n");
+            status = 1;
+            break;
+        }
+
+        for (size_t block = 0; block < chunk; block += DIFF_FAT_BLOCK)
+        {
+            size_t block_size = chunk - block < DIFF_FAT_BLOCK ? chunk - block : DIFF_FAT_BLOCK;
+            diff->fat_blocks++;
+            if (memcmp(data[0] + block, data[1] + block, block_size) == 0)
+                continue;
+
+            int changed = 0;
+            for (size_t offset = block; offset < block + block_size; offset += sizeof(uint32_t))
+            {
+                uint32_t entries[2];
+                memcpy(&entries[0], data[0] + offset, sizeof(uint32_t));
+                memcpy(&entries[1], data[1] + offset, sizeof(uint32_t));
+                if ((entries[0] ^ entries[1]) & 0x0FFFFFFF)
+                {
+                    mark_changed(diff, (uint32_t)((position + offset) / sizeof(uint32_t)));
+                    changed = 1;
+                }
+            }
+            diff->changed_blocks += changed;
+        }
+    }
+
+    for (uint32_t cluster = common; cluster < diff->changed_end && status == 0; cluster++)
+        mark_changed(diff, cluster);
+    free(scratch[0]);
+    free(scratch[1]);
+    return status;
+}
+
+static int hash_chunk(const uint8_t *data, uint64_t position, size_t size, void *context)
+{
+    hash_reader *reader = context;
+    (void)position;
+    digest_update(&reader->state, data, size);
+    reader->size += size;
+    return 0;
+}
+
+/*
+ * SHA-256 of the content of a file of a snapshot, return 0 on success
+ */
+static int hash_content(diff_context *diff, int side, const directory_table_entry *item, uint8_t sha256[SHA256_DIGEST_SIZE])
+{
+    fat32_volume *volume = diff->volumes[side];
+    extent_list extents;
+    if (build_file_extents(fat32_volume_fat(volume), fat32_volume_layout(volume), item, &extents) != 0)
+        return 1;
+
+    hash_reader reader;
+    digest_init(&reader.state);
+    reader.size = 0;
+    int status = extent_list_read_queued(fat32_volume_device(volume), fat32_volume_layout(volume), &extents, item->file_size, hash_chunk, &reader);
+    extent_list_free(&extents);
+    diff->hashed_bytes += reader.size;
+    if (status != 0 || reader.size != item->file_size)
+        return 1;
+
+    digest_result result;
+    digest_final(&reader.state, &result);
+    memcpy(sha256, result.sha256, SHA256_DIGEST_SIZE);
+    return 0;
+}
+
+/*
+ * whether a chain of the before snapshot goes through a cluster whose FAT entry changed. Following a chain reads
+ * the FAT at random, so it is only done for the files of directories whose entries changed.
+ */
+static int chain_changed(const diff_context *diff, const directory_table_entry *item)
+{
+    if (diff->changed_entries == 0)
+        return 0;
+
+    fat32_volume *volume = diff->volumes[0];
+    uint32_t cluster_size = fat32_volume_geometry(volume)->cluster_size;
+    uint64_t clusters = ((uint64_t)item->file_size + cluster_size - 1) / cluster_size;
+    uint32_t cluster = entry_first_cluster(item);
+    for (uint64_t i = 0; i < clusters && cluster >= 2 && cluster < END_OF_CLUSTER_CHAIN; i++)
+    {
+        if (is_changed(diff, cluster))
+            return 1;
+        cluster = fat_table_next(fat32_volume_fat(volume), cluster);
+    }
+    return 0;
+}
+
+static int same_times(const directory_table_entry *a, const directory_table_entry *b)
+{
+    return a->created_time_tenths == b->created_time_tenths && a->create_time == b->create_time && a->create_date == b->create_date &&
+           a->last_access_date == b->last_access_date && a->write_time == b->write_time && a->write_date == b->write_date;
+}
+
+/*
+ * report a file present at the same path in both snapshots if it changed
+ */
+static void compare_files(diff_context *diff, const directory_table_entry *before, const directory_table_entry *after, const char *path)
+{
+    char detail[64] = "";
+    size_t length = 0;
+    if (before->file_size != after->file_size)
+        length += snprintf(detail + length, sizeof(detail) - length, ",size");
+    else if (!diff->comparable || memcmp(before, after, sizeof(*before)) != 0 || chain_changed(diff, before))
+    {
+        // same size, but the data may have been rewritten or moved
+        uint8_t hashes[2][SHA256_DIGEST_SIZE];
+        if (hash_content(diff, 0, before, hashes[0]) != 0 || hash_content(diff, 1, after, hashes[1]) != 0 ||
+            memcmp(hashes[0], hashes[1], SHA256_DIGEST_SIZE) != 0)
+            length += snprintf(detail + length, sizeof(detail) - length, ",content");
+    }
+    if (!same_times(before, after))
+        length += snprintf(detail + length, sizeof(detail) - length, ",times");
+    if (before->attributes != after->attributes)
+        length += snprintf(detail + length, sizeof(detail) - length, ",attributes");
+
+    if (length > 0)
+    {
+        fprintf(diff->out, "modified\t%s\t%u\t%s\n", path, after->file_size, detail + 1);
+        diff->modified++;
+    }
+}
+
+/*
+ * append an entry to a list, return 1 + its index, 0 on failure
+ */
+static uint32_t add_file(diff_context *diff, diff_list *list, const walk_entry *item, const char *path, uint32_t parent)
+{
+    if (list->count == list->capacity)
+    {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 256;
+        diff_file *items = realloc(list->items, capacity * sizeof(diff_file));
+        if (!items)
+        {
+            diff->failed = 1;
+            return 0;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    diff_file *file = &list->items[list->count];
+    memset(file, 0, sizeof(*file));
+    file->path = strdup(path);
+    file->entry = item->entry;
+    file->item = item;
+    file->parent = parent;
+    if (!file->path)
+    {
+        diff->failed = 1;
+        return 0;
+    }
+    return ++list->count;
+}
+
+static int is_dot(const walk_entry *item)
+{
+    return strcmp(item->name, ".") == 0 || strcmp(item->name, "..") == 0;
+}
+
+/*
+ * record a directory and everything below it as present in one snapshot only
+ */
+static void add_subtree(diff_context *diff, diff_list *list, const walk_entry *item, char *path, size_t length, uint32_t parent)
+{
+    uint32_t index = add_file(diff, list, item, path, parent);
+    if (index == 0 || !item->sub)
+        return;
+
+    for (uint32_t i = 0; i < item->sub->count; i++)
+    {
+        const walk_entry *child = &item->sub->entries[i];
+        size_t name_length = strlen(child->name);
+        if (is_dot(child) || length + 1 + name_length >= WALK_PATH_MAX)
+            continue;
+        path[length] = '/';
+        memcpy(path + length + 1, child->name, name_length + 1);
+        add_subtree(diff, list, child, path, length + 1 + name_length, index);
+        path[length] = '\0';
+    }
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp((*(const walk_entry *const *)a)->name, (*(const walk_entry *const *)b)->name);
+}
+
+/*
+ * visible entries of a directory other than "." and "..", sorted by name
+ */
+static const walk_entry **sorted_entries(const walk_directory *directory, uint32_t *count)
+{
+    const walk_entry **sorted = malloc((directory->count + 1) * sizeof(walk_entry *));
+    *count = 0;
+    if (!sorted)
+        return NULL;
+    for (uint32_t i = 0; i < directory->count; i++)
+        if (!is_dot(&directory->entries[i]))
+            sorted[(*count)++] = &directory->entries[i];
+    qsort(sorted, *count, sizeof(walk_entry *), compare_names);
+    return sorted;
+}
+
+static int same_entries(const walk_directory *before, const walk_directory *after)
+{
+    if (before->count != after->count)
+        return 0;
+    for (uint32_t i = 0; i < before->count; i++)
+        if (memcmp(&before->entries[i].entry, &after->entries[i].entry, sizeof(directory_table_entry)) != 0)
+            return 0;
+    return 1;
+}
+
+static void compare_directories(diff_context *diff, const walk_directory *before, const walk_directory *after, char *path, size_t length);
+
+/*
+ * compare the entries of the same name in both snapshots
+ */
+static void compare_entries(diff_context *diff, const walk_entry *before, const walk_entry *after, char *path, size_t length)
+{
+    int directories[2] = {(before->entry.attributes & DIRECTORY_ATTRIBUTE) != 0, (after->entry.attributes & DIRECTORY_ATTRIBUTE) != 0};
+    if (directories[0] != directories[1])
+    {
+        add_subtree(diff, &diff->removed, before, path, length, 0);
+        add_subtree(diff, &diff->added, after, path, length, 0);
+    }
+    else if (directories[0])
+    {
+        if (before->sub && after->sub)
+            compare_directories(diff, before->sub, after->sub, path, length);
+    }
+    else
+        compare_files(diff, &before->entry, &after->entry, path);
+}
+
+static void compare_directories(diff_context *diff, const walk_directory *before, const walk_directory *after, char *path, size_t length)
+{
+    // identical entries: nothing changed here but maybe in the subdirectories, or in the content of the files of
+    // another volume
+    if (same_entries(before, after))
+    {
+        for (uint32_t i = 0; i < before->count && !diff->failed; i++)
+        {
+            const walk_entry *item = &before->entries[i];
+            size_t name_length = strlen(item->name);
+            if (is_dot(item) || length + 1 + name_length >= WALK_PATH_MAX)
+                continue;
+            path[length] = '/';
+            memcpy(path + length + 1, item->name, name_length + 1);
+            if (item->entry.attributes & DIRECTORY_ATTRIBUTE)
+                compare_entries(diff, item, &after->entries[i], path, length + 1 + name_length);
+            else if (!diff->comparable)
+                compare_files(diff, &item->entry, &after->entries[i].entry, path);
+            path[length] = '\0';
+        }
+        return;
+    }
+
+    diff->changed_directories++;
+    uint32_t counts[2];
+    const walk_entry **sorted[2] = {sorted_entries(before, &counts[0]), sorted_entries(after, &counts[1])};
+    if (!sorted[0] || !sorted[1])
+        diff->failed = 1;
+
+    // merge the two sorted lists
+    uint32_t i = 0, j = 0;
+    while (!diff->failed && (i < counts[0] || j < counts[1]))
+    {
+        int order = i == counts[0] ? 1 : j == counts[1] ? -1 : strcmp(sorted[0][i]->name, sorted[1][j]->name);
+        const walk_entry *item = order <= 0 ? sorted[0][i] : sorted[1][j];
+        size_t name_length = strlen(item->name);
+        if (length + 1 + name_length < WALK_PATH_MAX)
+        {
+            path[length] = '/';
+            memcpy(path + length + 1, item->name, name_length + 1);
+            if (order < 0)
+                add_subtree(diff, &diff->removed, item, path, length + 1 + name_length, 0);
+            else if (order > 0)
+                add_subtree(diff, &diff->added, item, path, length + 1 + name_length, 0);
+            else
+                compare_entries(diff, sorted[0][i], sorted[1][j], path, length + 1 + name_length);
+            path[length] = '\0';
+        }
+        i += order <= 0;
+        j += order >= 0;
+    }
+    free(sorted[0]);
+    free(sorted[1]);
+}
+
+static int is_directory(const diff_file *file)
+{
+    return (file->entry.attributes & DIRECTORY_ATTRIBUTE) != 0;
+}
+
+/*
+ * whether an entry was listed below a directory matched as a move, which compared it at its new location
+ */
+static int below_move(const diff_list *list, const diff_file *file)
+{
+    for (uint32_t parent = file->parent; parent != 0; parent = list->items[parent - 1].parent)
+        if (list->items[parent - 1].moved)
+            return 1;
+    return 0;
+}
+
+static int hash_file(diff_context *diff, int side, diff_file *file)
+{
+    if (file->hashed == 0)
+        file->hashed = hash_content(diff, side, &file->entry, file->sha256) == 0 ? 1 : -1;
+    return file->hashed == 1;
+}
+
+typedef struct directory_key_t
+{
+    uint32_t cluster;
+    uint32_t index;
+} directory_key;
+
+static int compare_directory_keys(const void *a, const void *b)
+{
+    const directory_key *keys[2] = {a, b};
+    if (keys[0]->cluster != keys[1]->cluster)
+        return keys[0]->cluster > keys[1]->cluster ? 1 : -1;
+    return (keys[0]->index > keys[1]->index) - (keys[0]->index < keys[1]->index);
+}
+
+/*
+ * first clusters of the directories of a list that are not matched yet, sorted. Indices rather than pointers are
+ * kept since comparing a moved directory appends to the lists.
+ */
+static directory_key *directory_keys(const diff_list *list, uint32_t *count)
+{
+    directory_key *keys = malloc((list->count + 1) * sizeof(directory_key));
+    *count = 0;
+    if (!keys)
+        return NULL;
+    for (uint32_t i = 0; i < list->count; i++)
+        if (is_directory(&list->items[i]) && !list->items[i].moved)
+        {
+            keys[*count].cluster = entry_first_cluster(&list->items[i].entry);
+            keys[*count].index = i;
+            (*count)++;
+        }
+    qsort(keys, *count, sizeof(directory_key), compare_directory_keys);
+    return keys;
+}
+
+/*
+ * match the removed and added directories of the same first cluster, then compare their content as if they had
+ * stayed in place, so that their subtrees are not listed entry by entry. Comparing a moved directory can list new
+ * directories, so the matching is repeated until it finds no move.
+ */
+static void match_directory_moves(diff_context *diff)
+{
+    uint32_t matched = 1;
+    while (matched > 0 && !diff->failed)
+    {
+        matched = 0;
+        uint32_t counts[2];
+        directory_key *keys[2] = {directory_keys(&diff->removed, &counts[0]), directory_keys(&diff->added, &counts[1])};
+        if (!keys[0] || !keys[1])
+            diff->failed = 1;
+
+        // merge the two sorted lists
+        uint32_t i = 0, j = 0;
+        while (!diff->failed && i < counts[0] && j < counts[1])
+        {
+            diff_file *removed = &diff->removed.items[keys[0][i].index];
+            diff_file *added = &diff->added.items[keys[1][j].index];
+            int order = keys[0][i].cluster < keys[1][j].cluster ? -1 : keys[0][i].cluster > keys[1][j].cluster;
+            if (order == 0 && below_move(&diff->removed, removed))
+                order = -1;
+            else if (order == 0 && below_move(&diff->added, added))
+                order = 1;
+            i += order <= 0;
+            j += order >= 0;
+            if (order != 0)
+                continue;
+
+            removed->moved = added->moved = 1;
+            fprintf(diff->out, "moved\t%s\t%u\t%s\n", added->path, added->entry.file_size, removed->path);
+            diff->moved++;
+            matched++;
+            if (removed->item->sub && added->item->sub)
+            {
+                char path[WALK_PATH_MAX];
+                snprintf(path, sizeof(path), "%s", added->path);
+                compare_directories(diff, removed->item->sub, added->item->sub, path, strlen(path));
+            }
+        }
+        free(keys[0]);
+        free(keys[1]);
+    }
+}
+
+/*
+ * a non-empty file moved if its content is the same. Files are only hashed when both lists hold a file of their
+ * size.
+ */
+static int is_move(diff_context *diff, diff_file *removed, diff_file *added)
+{
+    return !added->moved && removed->entry.file_size > 0 && removed->entry.file_size == added->entry.file_size &&
+           hash_file(diff, 0, removed) && hash_file(diff, 1, added) && memcmp(removed->sha256, added->sha256, SHA256_DIGEST_SIZE) == 0;
+}
+
+/*
+ * whether an entry of a list still has to be matched as a file move
+ */
+static int unmatched_file(const diff_list *list, const diff_file *file)
+{
+    return !is_directory(file) && !file->moved && !below_move(list, file);
+}
+
+static int compare_sizes(const void *a, const void *b)
+{
+    uint32_t sizes[2] = {(*(const diff_file *const *)a)->entry.file_size, (*(const diff_file *const *)b)->entry.file_size};
+    return (sizes[0] > sizes[1]) - (sizes[0] < sizes[1]);
+}
+
+/*
+ * match every removed file against the added files of the same size, found by a binary search of the added files
+ * sorted by size
+ */
+static void match_moves(diff_context *diff)
+{
+    if (diff->removed.count == 0 || diff->added.count == 0)
+        return;
+
+    diff_file **sorted = malloc(diff->added.count * sizeof(diff_file *));
+    if (!sorted)
+    {
+        diff->failed = 1;
+        return;
+    }
+    uint32_t count = 0;
+    for (uint32_t j = 0; j < diff->added.count; j++)
+        if (unmatched_file(&diff->added, &diff->added.items[j]))
+            sorted[count++] = &diff->added.items[j];
+    qsort(sorted, count, sizeof(diff_file *), compare_sizes);
+
+    for (uint32_t i = 0; i < diff->removed.count; i++)
+    {
+        diff_file *removed = &diff->removed.items[i];
+        if (!unmatched_file(&diff->removed, removed))
+            continue;
+        uint32_t size = removed->entry.file_size;
+        uint32_t low = 0, high = count;
+        while (low < high)
+        {
+            uint32_t middle = low + (high - low) / 2;
+            if (sorted[middle]->entry.file_size < size)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        for (uint32_t j = low; j < count && sorted[j]->entry.file_size == size; j++)
+        {
+            diff_file *added = sorted[j];
+            if (!is_move(diff, removed, added))
+                continue;
+            removed->moved = added->moved = 1;
+            fprintf(diff->out, "moved\t%s\t%u\t%s\n", added->path, added->entry.file_size, removed->path);
+            diff->moved++;
+            break;
+        }
+    }
+    free(sorted);
+}
+
+static void free_list(diff_list *list)
+{
+    for (uint32_t i = 0; i < list->count; i++)
+        free(list->items[i].path);
+    free(list->items);
+}
+
+int diff_volumes(fat32_volume *before, fat32_volume *after, int thread_count, FILE *out)
+{
+    diff_context diff;
+    memset(&diff, 0, sizeof(diff));
+    diff.volumes[0] = before;
+    diff.volumes[1] = after;
+    diff.out = out;
+    diff.comparable = same_volume(before, after);
+    if (diff.comparable && compare_fats(&diff) != 0)
+    {
+        free(diff.changed);
+        return 1;
+    }
+
+    walk_tree trees[2];
+    for (int i = 0; i < 2; i++)
+    {
+        fat32_volume *volume = diff.volumes[i];
+        const boot_sector *bs = fat32_volume_boot_sector(volume);
+        if (walk_tree_build(fat32_volume_device(volume), fat32_volume_fat(volume), fat32_volume_layout(volume), bs->root_cluster, thread_count, &trees[i]) != 0)
+        {
+            if (i == 1)
+                walk_tree_free(&trees[0]);
+            free(diff.changed);
+            return 1;
+        }
+    }
+
+    fprintf(out, "# state\tpath\tsize\tdetail\n");
+    char path[WALK_PATH_MAX] = "";
+    compare_directories(&diff, trees[0].root, trees[1].root, path, 0);
+    if (diff.comparable)
+        match_directory_moves(&diff);
+    if (!diff.failed)
+        match_moves(&diff);
+
+    uint64_t counts[2] = {0, 0};
+    const char *states[2] = {"removed", "added"};
+    diff_list *lists[2] = {&diff.removed, &diff.added};
+    for (int side = 0; side < 2 && !diff.failed; side++)
+        for (uint32_t i = 0; i < lists[side]->count; i++)
+        {
+            const diff_file *file = &lists[side]->items[i];
+            if (file->moved || below_move(lists[side], file))
+                continue;
+            fprintf(out, "%s\t%s\t%u\t-\n", states[side], file->path, file->entry.file_size);
+            counts[side]++;
+        }
+
+    if (diff.failed)
+        fprintf(stderr, "Error: not enough memory to compare the snapshots\n");
+    else
+    {
+        if (diff.comparable)
+            fprintf(out, "\nFAT blocks:         %lu (%lu changed, %lu entries)\n", (unsigned long)diff.fat_blocks, (unsigned long)diff.changed_blocks, (unsigned long)diff.changed_entries);
+        else
+            fprintf(out, "\nFAT blocks:         not compared (different volumes)\n");
+        fprintf(out, "Directories:        %lu (%lu changed)\n", (unsigned long)trees[1].directory_count, (unsigned long)diff.changed_directories);
+        fprintf(out, "Bytes hashed:       %lu\n", (unsigned long)diff.hashed_bytes);
+        fprintf(out, "Added:              %lu\n", (unsigned long)counts[1]);
+        fprintf(out, "Removed:            %lu\n", (unsigned long)counts[0]);
+        fprintf(out, "Modified:           %lu\n", (unsigned long)diff.modified);
+        fprintf(out, "Moved:              %lu\n", (unsigned long)diff.moved);
+    }
+
+    walk_tree_free(&trees[0]);
+    walk_tree_free(&trees[1]);
+    free_list(&diff.removed);
+    free_list(&diff.added);
+    free(diff.changed);
+    return diff.failed;
+}
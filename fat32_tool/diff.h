@@ -0,0 +1,29 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include "utils.h"
+#include "fat32.h"
+
+#define DIFF_FAT_BLOCK 512                // FAT bytes compared at once
+#define DIFF_FAT_READ (4 * 1024 * 1024)   // size of the sequential reads of the two FATs
+
+/*
+ * compare two snapshots of a volume and print "state<tab>path<tab>size<tab>detail" lines, then a summary:
+ * - modified: a file present at the same path in both, detail listing what changed (size, content, times,
+ *   attributes); printed as the trees are compared;
+ * - moved: a file removed from a path and added at another with the same content (detail is the old path), or a
+ *   directory whose first cluster is the same at both paths; the content of a moved directory is then compared
+ *   with its old content and reported under its new path instead of being listed as removed and added;
+ * - removed, added: the other entries present in one snapshot only, removed ones with their size in before.
+ * The active FATs are compared block by block, and the entries of the blocks that differ mark the clusters whose
+ * chain changed. Directories whose entries are identical in both snapshots are only descended into. File content
+ * is hashed only for files whose entry changed, for the files of changed directories whose chain goes through a
+ * marked cluster, and for the removed and added files of equal size when looking for moves, so the data read
+ * grows with the amount of change.
+ * Snapshots of different volumes (volume id, cluster size or FAT size) are compared by content only: their FATs are
+ * not compared, every file of equal size at the same path is hashed, and directories are never matched as moves.
+ * Return 1 if a snapshot could not be read, 0 otherwise.
+ */
+int diff_volumes(fat32_volume *before, fat32_volume *after, int thread_count, FILE *out);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include "utils.h"
+
+#define MD5_DIGEST_SIZE 16
+#define SHA1_DIGEST_SIZE 20
+#define SHA256_DIGEST_SIZE 32
+
+/*
+ * MD5 (RFC 1321), SHA-1 and SHA-256 (FIPS 180-4) computed together over the same stream
+ */
+typedef struct digest_t
+{
+    uint32_t md5[4];
+    uint32_t sha1[5];
+    uint32_t sha256[8];
+    uint64_t length; // bytes hashed so far
+    uint8_t block[64];
+    size_t block_used;
+} digest;
+
+typedef struct digest_result_t
+{
+    uint8_t md5[MD5_DIGEST_SIZE];
+    uint8_t sha1[SHA1_DIGEST_SIZE];
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+} digest_result;
+
+void digest_init(digest *d);
+
+void digest_update(digest *d, const uint8_t *data, size_t size);
+
+void digest_final(digest *d, digest_result *result);
+
+/*
+ * write the lowercase hex form of size bytes into hex (2 * size + 1 bytes)
+ */
+void digest_hex(const uint8_t *bytes, size_t size, char *hex);
+
+#endif
@@ -0,0 +1,243 @@
+#include "dir_index.h"
+#include "walker.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct index_builder_t
+{
+    dir_index_record *records;
+    uint32_t record_count;
+    uint32_t record_capacity;
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+} index_builder;
+
+/*
+ * FNV-1a, 64 bits
+ */
+static uint64_t hash_path(const char *path)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (; *path; path++)
+    {
+        hash ^= (uint8_t)*path;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static int add_record(index_builder *builder, const char *path, const directory_table_entry *entry)
+{
+    if (builder->record_count == builder->record_capacity)
+    {
+        uint32_t capacity = builder->record_capacity ? builder->record_capacity * 2 : 1024;
+        dir_index_record *records = realloc(builder->records, capacity * sizeof(dir_index_record));
+        if (!records)
+            return 1;
+        builder->records = records;
+        builder->record_capacity = capacity;
+    }
+
+    size_t length = strlen(path) + 1;
+    while (builder->strings_size + length > builder->strings_capacity)
+    {
+        size_t capacity = builder->strings_capacity ? builder->strings_capacity * 2 : 65536;
+        char *strings = realloc(builder->strings, capacity);
+        if (!strings)
+            return 1;
+        builder->strings = strings;
+        builder->strings_capacity = capacity;
+    }
+
+    dir_index_record *record = &builder->records[builder->record_count++];
+    record->hash = hash_path(path);
+    record->path_offset = (uint32_t)builder->strings_size;
+    record->next = 0;
+    record->entry = *entry;
+    memcpy(builder->strings + builder->strings_size, path, length);
+    builder->strings_size += length;
+    return 0;
+}
+
+/*
+ * add every entry of the tree but "." and ".." to the index
+ */
+static int index_entry(const walk_entry *entry, const char *path, int depth, void *context)
+{
+    (void)depth;
+    if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0)
+        return 0;
+
+    if (add_record(context, path, &entry->entry) != 0)
+    {
+        perror("Error");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * chain the records into a power of two bucket array and write the sidecar, through a temporary file renamed
+ * at the end so a reader never sees a partial index
+ */
+static int write_index(const index_builder *builder, const struct stat *image, const boot_sector *bs, const partition_entry *entry, const char *index_path)
+{
+    uint32_t bucket_count = 1;
+    while (bucket_count < builder->record_count * 2)
+        bucket_count *= 2;
+
+    uint32_t *buckets = calloc(bucket_count, sizeof(uint32_t));
+    if (!buckets)
+        return 1;
+    for (uint32_t i = 0; i < builder->record_count; i++)
+    {
+        uint32_t bucket = builder->records[i].hash & (bucket_count - 1);
+        builder->records[i].next = buckets[bucket];
+        buckets[bucket] = i + 1;
+    }
+
+    dir_index_header header;
+    memset(&header, 0, sizeof(header));
+    sidecar_identity_init(&header.identity, DIR_INDEX_MAGIC, image, bs, entry);
+    header.bucket_count = bucket_count;
+    header.record_count = builder->record_count;
+    header.strings_size = builder->strings_size;
+
+    char temporary_path[DIR_INDEX_PATH_MAX + 8];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", index_path);
+    int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        free(buckets);
+        return 1;
+    }
+
+    int status = write_all(fd, &header, sizeof(header)) ||
+                 write_all(fd, buckets, bucket_count * sizeof(uint32_t)) ||
+                 write_all(fd, builder->records, builder->record_count * sizeof(dir_index_record)) ||
+                 write_all(fd, builder->strings, builder->strings_size);
+    status = close(fd) != 0 || status;
+    if (status == 0)
+        status = rename(temporary_path, index_path) != 0;
+    else
+        unlink(temporary_path);
+
+    free(buckets);
+    return status;
+}
+
+void dir_index_path(const char *image_path, int partition_number, char *index_path, size_t size)
+{
+    snprintf(index_path, size, "%s.p%d.idx", image_path, partition_number);
+}
+
+int dir_index_build(block_device *dev, fat_table *fat, const boot_sector *bs, const partition_entry *entry, const volume_geometry *geometry, const char *image_path, const char *index_path, int thread_count)
+{
+    struct stat image;
+    if (stat(image_path, &image) != 0)
+    {
+        perror("Error");
+        return 1;
+    }
+
+    walk_tree tree;
+    if (walk_tree_build(dev, fat, geometry, bs->root_cluster, thread_count, &tree) != 0)
+        return 1;
+
+    index_builder builder;
+    memset(&builder, 0, sizeof(builder));
+    int status = walk_tree_visit(&tree, index_entry, &builder);
+    walk_tree_free(&tree);
+    if (status == 0 && write_index(&builder, &image, bs, entry, index_path) != 0)
+    {
+        perror("Error");
+        status = 1;
+    }
+
+    free(builder.records);
+    free(builder.strings);
+    return status;
+}
+
+int dir_index_open(const char *index_path, const char *image_path, const boot_sector *bs, const partition_entry *entry, dir_index *index)
+{
+    memset(index, 0, sizeof(*index));
+
+    struct stat image;
+    if (stat(image_path, &image) != 0)
+        return 1;
+
+    int fd = open(index_path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(dir_index_header))
+    {
+        close(fd);
+        return 1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 1;
+
+    index->map = map;
+    index->map_size = st.st_size;
+    index->header = map;
+
+    // reject sidecars of another image, volume or version of the image, and truncated ones
+    const dir_index_header *header = index->header;
+    uint64_t expected_size = sizeof(dir_index_header) + (uint64_t)header->bucket_count * sizeof(uint32_t) +
+                             (uint64_t)header->record_count * sizeof(dir_index_record) + header->strings_size;
+    if (!sidecar_identity_matches(&header->identity, DIR_INDEX_MAGIC, &image, bs, entry) ||
+        header->bucket_count == 0 || (header->bucket_count & (header->bucket_count - 1)) != 0 ||
+        expected_size != index->map_size)
+    {
+        dir_index_close(index);
+        return 1;
+    }
+
+    index->buckets = (const uint32_t *)(index->map + sizeof(dir_index_header));
+    index->records = (const dir_index_record *)(index->buckets + header->bucket_count);
+    index->strings = (const char *)(index->records + header->record_count);
+
+    // every path is NUL terminated, so strcmp in dir_index_lookup cannot run past the mapping
+    if (header->strings_size == 0 || index->strings[header->strings_size - 1] != '\0')
+    {
+        dir_index_close(index);
+        return 1;
+    }
+    return 0;
+}
+
+int dir_index_lookup(const dir_index *index, const char *path, directory_table_entry *file)
+{
+    uint64_t hash = hash_path(path);
+    uint32_t next = index->buckets[hash & (index->header->bucket_count - 1)];
+    // a chain visits each record at most once, a longer one loops through a damaged next field
+    for (uint32_t steps = 0; next != 0 && next <= index->header->record_count && steps < index->header->record_count; steps++)
+    {
+        const dir_index_record *record = &index->records[next - 1];
+        if (record->hash == hash && record->path_offset < index->header->strings_size &&
+            strcmp(index->strings + record->path_offset, path) == 0)
+        {
+            *file = record->entry;
+            return 1;
+        }
+        next = record->next;
+    }
+    return 0;
+}
+
+void dir_index_close(dir_index *index)
+{
+    if (index->map)
+        munmap((void *)index->map, index->map_size);
+    memset(index, 0, sizeof(*index));
+}
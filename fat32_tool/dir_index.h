@@ -0,0 +1,68 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+#include "sidecar.h"
+
+#define DIR_INDEX_MAGIC "F32IDX01"
+#define DIR_INDEX_PATH_MAX 4096
+
+/*
+ * The sidecar file is laid out as: header | buckets | records | path strings.
+ * buckets[hash & (bucket_count - 1)] holds the index + 1 of the first record of a chain (0 if empty),
+ * records are chained through next (index + 1, 0 ends the chain). Everything is mmap-able as is.
+ */
+#pragma pack(push, 1)
+typedef struct dir_index_header_t
+{
+    sidecar_identity identity; // the sidecar is only valid for the image and volume it was built from
+    uint32_t bucket_count; // power of two
+    uint32_t record_count;
+    uint64_t strings_size;
+} dir_index_header;
+
+typedef struct dir_index_record_t
+{
+    uint64_t hash;
+    uint32_t path_offset; // offset of the null terminated full path in the string table
+    uint32_t next;
+    directory_table_entry entry; // first cluster, size, attributes and timestamps as stored on disk
+} dir_index_record;
+#pragma pack(pop)
+
+typedef struct dir_index_t
+{
+    const uint8_t *map;
+    size_t map_size;
+    const dir_index_header *header;
+    const uint32_t *buckets;
+    const dir_index_record *records;
+    const char *strings;
+} dir_index;
+
+/*
+ * default sidecar location for a partition: <image>.p<partition_number>.idx
+ */
+void dir_index_path(const char *image_path, int partition_number, char *index_path, size_t size);
+
+/*
+ * walk the whole volume once (on thread_count threads) and write the sidecar of every file and directory to index_path
+ */
+int dir_index_build(block_device *dev, fat_table *fat, const boot_sector *bs, const partition_entry *entry, const volume_geometry *geometry, const char *image_path, const char *index_path, int thread_count);
+
+/*
+ * map a sidecar. Return 1 if it does not exist or was built from another image, volume or image version.
+ */
+int dir_index_open(const char *index_path, const char *image_path, const boot_sector *bs, const partition_entry *entry, dir_index *index);
+
+/*
+ * look up a full lowercase path ("/dir/file.txt"), copy its directory entry into file and return 1 if found
+ */
+int dir_index_lookup(const dir_index *index, const char *path, directory_table_entry *file);
+
+void dir_index_close(dir_index *index);
+
+#endif
@@ -0,0 +1,363 @@
+#include "disk_layout.h"
+
+#include <stddef.h>
+#include <zlib.h>
+
+static const struct
+{
+    const char *guid;
+    const char *name;
+} gpt_type_names[] = {
+    {"C12A7328-F81F-11D2-BA4B-00A0C93EC93B", "EFI system"},
+    {"EBD0A0A2-B9E5-4433-87C0-68B6B72699C7", "Microsoft basic data"},
+    {"E3C9E316-0B5C-4DB8-817D-F92DF00215AE", "Microsoft reserved"},
+    {"0FC63DAF-8483-4772-8E79-3D69D8477DE4", "Linux filesystem"},
+    {"0657FD6D-A4AB-43C4-84E5-0933C84B4F4F", "Linux swap"},
+    {"E6D6D379-F507-44C2-A23C-238F2A3DF928", "Linux LVM"},
+};
+
+const char *filesystem_name(filesystem_type filesystem)
+{
+    static const char *const names[] = {"unknown", "FAT12", "FAT16", "FAT32", "exFAT", "NTFS", "ext2/3/4"};
+    return names[filesystem];
+}
+
+/*
+ * format a GUID in its registry form, the first three fields being little-endian on disk
+ */
+static void format_guid(const uint8_t *guid, char *text)
+{
+    sprintf(text, "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+            guid[3], guid[2], guid[1], guid[0], guid[5], guid[4], guid[7], guid[6],
+            guid[8], guid[9], guid[10], guid[11], guid[12], guid[13], guid[14], guid[15]);
+}
+
+/*
+ * tell the filesystem of a partition from its boot sector (and the ext superblock 1 KiB further)
+ */
+static filesystem_type sniff_filesystem(block_device *dev, uint64_t start_lba, uint64_t total_sectors)
+{
+    uint8_t sector[SECTOR_SIZE];
+    uint64_t offset = start_lba * SECTOR_SIZE;
+    if (total_sectors == 0 || block_device_read(dev, offset, sizeof(sector), sector) != 0)
+        return FILESYSTEM_UNKNOWN;
+
+    if (memcmp(sector + 3, "NTFS    ", 8) == 0)
+        return FILESYSTEM_NTFS;
+    if (memcmp(sector + 3, "EXFAT   ", 8) == 0)
+        return FILESYSTEM_EXFAT;
+    if (memcmp(sector + 82, "FAT32", 5) == 0)
+        return FILESYSTEM_FAT32;
+    if (memcmp(sector + 54, "FAT12", 5) == 0)
+        return FILESYSTEM_FAT12;
+    if (memcmp(sector + 54, "FAT16", 5) == 0)
+        return FILESYSTEM_FAT16;
+
+    uint8_t magic[2];
+    if (block_device_read(dev, offset + 1024 + 56, sizeof(magic), magic) == 0 && magic[0] == 0x53 && magic[1] == 0xEF)
+        return FILESYSTEM_EXT;
+    return FILESYSTEM_UNKNOWN;
+}
+
+static disk_partition *add_partition(block_device *dev, disk_layout *layout, int number, partition_scheme scheme, uint64_t start_lba, uint64_t total_sectors)
+{
+    if (layout->count == layout->capacity)
+    {
+        uint32_t capacity = layout->capacity ? layout->capacity * 2 : 8;
+        disk_partition *partitions = realloc(layout->partitions, capacity * sizeof(disk_partition));
+        if (!partitions)
+            return NULL;
+        layout->partitions = partitions;
+        layout->capacity = capacity;
+    }
+
+    uint64_t image_sectors = dev->size / SECTOR_SIZE;
+    if (start_lba > image_sectors || total_sectors > image_sectors - start_lba)
+        fprintf(stderr, "Warning: partition %d extends past the end of the image\n", number);
+
+    disk_partition *partition = &layout->partitions[layout->count++];
+    memset(partition, 0, sizeof(*partition));
+    partition->number = number;
+    partition->scheme = scheme;
+    partition->start_lba = start_lba;
+    partition->total_sectors = total_sectors;
+    // the FAT32 code addresses partitions with 32-bit sector numbers
+    if (start_lba + total_sectors <= UINT32_MAX)
+    {
+        partition->entry.start_lba = (uint32_t)start_lba;
+        partition->entry.total_sectors = (uint32_t)total_sectors;
+    }
+    partition->filesystem = sniff_filesystem(dev, start_lba, total_sectors);
+    return partition;
+}
+
+/*
+ * keep the type and CHS fields of an MBR or EBR entry, with the absolute position computed by add_partition
+ */
+static void copy_mbr_entry(disk_partition *partition, const partition_entry *entry)
+{
+    uint32_t start_lba = partition->entry.start_lba, total_sectors = partition->entry.total_sectors;
+    partition->entry = *entry;
+    partition->entry.start_lba = start_lba;
+    partition->entry.total_sectors = total_sectors;
+}
+
+/*
+ * follow the EBR chain of an extended partition. Each EBR holds a logical partition relative to itself and the
+ * next EBR relative to the start of the extended partition.
+ */
+static void scan_extended(block_device *dev, disk_layout *layout, const partition_entry *extended, int *next_number)
+{
+    uint64_t scale = layout->sector_size / SECTOR_SIZE;
+    uint64_t base = extended->start_lba, ebr_lba = base;
+    uint64_t *visited = malloc(EBR_MAX_CHAIN * sizeof(uint64_t));
+    if (!visited)
+        return;
+
+    for (int i = 0; i < EBR_MAX_CHAIN; i++)
+    {
+        master_boot_record ebr;
+        if (block_device_read(dev, ebr_lba * layout->sector_size, sizeof(ebr), &ebr) != 0 || ebr.signature != 0xAA55)
+        {
+            fprintf(stderr, "Warning: invalid EBR at LBA %lu, the logical partitions after it are ignored\n", (unsigned long)ebr_lba);
+            break;
+        }
+        visited[i] = ebr_lba;
+
+        const partition_entry *logical = &ebr.partition_table[0];
+        if (logical->system_id != 0 && logical->total_sectors != 0)
+        {
+            disk_partition *partition = add_partition(dev, layout, (*next_number)++, PARTITION_SCHEME_LOGICAL, (ebr_lba + logical->start_lba) * scale, (uint64_t)logical->total_sectors * scale);
+            if (!partition)
+                break;
+            copy_mbr_entry(partition, logical);
+        }
+
+        const partition_entry *next = &ebr.partition_table[1];
+        if (next->system_id == 0 || next->start_lba == 0)
+            break;
+        ebr_lba = base + next->start_lba;
+
+        int loop = 0;
+        for (int j = 0; j <= i && !loop; j++)
+            loop = visited[j] == ebr_lba;
+        if (loop)
+        {
+            fprintf(stderr, "Warning: the EBR chain at LBA %lu loops\n", (unsigned long)ebr_lba);
+            break;
+        }
+    }
+    free(visited);
+}
+
+/*
+ * read and check a GPT header and its partition array, with LBAs of sector_size bytes: signature, header CRC,
+ * position and array CRC
+ */
+static int read_gpt(block_device *dev, uint32_t sector_size, uint64_t lba, gpt_header *header, uint8_t **entries)
+{
+    uint8_t sector[LARGE_SECTOR_SIZE];
+    if ((lba + 1) * sector_size > dev->size || block_device_read(dev, lba * sector_size, sector_size, sector) != 0)
+        return 1;
+    memcpy(header, sector, sizeof(*header));
+    if (memcmp(header->signature, GPT_SIGNATURE, 8) != 0 || header->header_size < sizeof(*header) || header->header_size > sector_size)
+        return 1;
+
+    memset(sector + offsetof(gpt_header, header_crc32), 0, sizeof(uint32_t));
+    if (crc32(0, sector, header->header_size) != header->header_crc32 || header->my_lba != lba)
+        return 1;
+
+    if (header->entry_size < sizeof(gpt_entry) || header->entry_size > SECTOR_SIZE || header->entry_size % 8 != 0 ||
+        header->entry_count > GPT_MAX_ENTRIES)
+        return 1;
+
+    size_t size = (size_t)header->entry_count * header->entry_size;
+    *entries = malloc(size + 1);
+    if (!*entries)
+        return 1;
+    if (block_device_read(dev, header->entries_lba * sector_size, size, *entries) != 0 ||
+        crc32(0, *entries, (uInt)size) != header->entries_crc32)
+    {
+        free(*entries);
+        *entries = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * find the GPT header in LBA 1 with 512 then 4096-byte sectors, else in the last LBA, and set the sector size of
+ * the layout to the one it was found with
+ */
+static int find_gpt(block_device *dev, disk_layout *layout, gpt_header *header, uint8_t **entries)
+{
+    static const uint32_t sector_sizes[] = {SECTOR_SIZE, LARGE_SECTOR_SIZE};
+    for (int i = 0; i < 2; i++)
+    {
+        layout->sector_size = sector_sizes[i];
+        if (read_gpt(dev, layout->sector_size, 1, header, entries) == 0)
+            return 0;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        layout->sector_size = sector_sizes[i];
+        if (dev->size >= 2 * layout->sector_size && read_gpt(dev, layout->sector_size, dev->size / layout->sector_size - 1, header, entries) == 0)
+        {
+            fprintf(stderr, "Warning: the primary GPT header is damaged, using the backup header\n");
+            return 0;
+        }
+    }
+    layout->sector_size = SECTOR_SIZE;
+    return 1;
+}
+
+static void scan_gpt(block_device *dev, disk_layout *layout)
+{
+    gpt_header header;
+    uint8_t *entries = NULL;
+    if (find_gpt(dev, layout, &header, &entries) != 0)
+    {
+        fprintf(stderr, "Warning: protective MBR but no valid GPT header\n");
+        return;
+    }
+    layout->gpt = 1;
+    uint64_t scale = layout->sector_size / SECTOR_SIZE;
+
+    for (uint32_t i = 0; i < header.entry_count; i++)
+    {
+        gpt_entry entry;
+        memcpy(&entry, entries + (size_t)i * header.entry_size, sizeof(entry));
+
+        static const uint8_t unused[16] = {0};
+        if (memcmp(entry.type_guid, unused, sizeof(unused)) == 0)
+            continue;
+        if (entry.last_lba < entry.first_lba)
+        {
+            fprintf(stderr, "Warning: GPT entry %u ends before it starts\n", i + 1);
+            continue;
+        }
+
+        disk_partition *partition = add_partition(dev, layout, (int)i + 1, PARTITION_SCHEME_GPT, entry.first_lba * scale, (entry.last_lba - entry.first_lba + 1) * scale);
+        if (!partition)
+            break;
+        memcpy(partition->type_guid, entry.type_guid, sizeof(entry.type_guid));
+        int length = 0;
+        for (int c = 0; c < 36 && entry.name[c] != 0; c++)
+            partition->name[length++] = entry.name[c] < 0x80 && isprint(entry.name[c]) ? (char)entry.name[c] : '?';
+        partition->name[length] = '\0';
+        if (partition->filesystem == FILESYSTEM_FAT32)
+            partition->entry.system_id = PARTITION_TYPE;
+    }
+    free(entries);
+}
+
+/*
+ * LBA unit of an MBR: LARGE_SECTOR_SIZE when the first primary partition with a known filesystem only has it at its
+ * LBA times 4096, SECTOR_SIZE otherwise
+ */
+static uint32_t mbr_sector_size(block_device *dev, const master_boot_record *mbr)
+{
+    uint64_t scale = LARGE_SECTOR_SIZE / SECTOR_SIZE;
+    for (int i = 0; i < N_PARTITION; i++)
+    {
+        const partition_entry *entry = &mbr->partition_table[i];
+        if (entry->system_id == 0 || entry->total_sectors == 0 || is_extended_partition(entry->system_id))
+            continue;
+        if (sniff_filesystem(dev, entry->start_lba, entry->total_sectors) != FILESYSTEM_UNKNOWN)
+            return SECTOR_SIZE;
+        if (sniff_filesystem(dev, entry->start_lba * scale, entry->total_sectors * scale) != FILESYSTEM_UNKNOWN)
+            return LARGE_SECTOR_SIZE;
+    }
+    return SECTOR_SIZE;
+}
+
+int disk_layout_scan(block_device *dev, const master_boot_record *mbr, disk_layout *layout)
+{
+    memset(layout, 0, sizeof(*layout));
+    layout->sector_size = SECTOR_SIZE;
+
+    for (int i = 0; i < N_PARTITION; i++)
+    {
+        if (mbr->partition_table[i].system_id == GPT_PROTECTIVE_TYPE)
+        {
+            scan_gpt(dev, layout);
+            return 0;
+        }
+    }
+
+    // primary partitions keep their slot number, logical ones follow in chain order
+    layout->sector_size = mbr_sector_size(dev, mbr);
+    uint64_t scale = layout->sector_size / SECTOR_SIZE;
+    int next_logical = FIRST_LOGICAL_NUMBER;
+    for (int i = 0; i < N_PARTITION; i++)
+    {
+        const partition_entry *entry = &mbr->partition_table[i];
+        if (entry->system_id == 0 || entry->total_sectors == 0 || is_extended_partition(entry->system_id))
+            continue;
+        disk_partition *partition = add_partition(dev, layout, i + 1, PARTITION_SCHEME_PRIMARY, entry->start_lba * scale, entry->total_sectors * scale);
+        if (!partition)
+            return 1;
+        copy_mbr_entry(partition, entry);
+    }
+    for (int i = 0; i < N_PARTITION; i++)
+    {
+        if (is_extended_partition(mbr->partition_table[i].system_id))
+            scan_extended(dev, layout, &mbr->partition_table[i], &next_logical);
+    }
+    return 0;
+}
+
+const disk_partition *disk_layout_find(const disk_layout *layout, int number)
+{
+    for (uint32_t i = 0; i < layout->count; i++)
+    {
+        if (layout->partitions[i].number == number)
+            return &layout->partitions[i];
+    }
+    return NULL;
+}
+
+static void print_gpt_partition(const disk_partition *partition, uint32_t sector_size)
+{
+    char guid[37];
+    format_guid(partition->type_guid, guid);
+    const char *type = "unknown";
+    for (size_t i = 0; i < sizeof(gpt_type_names) / sizeof(gpt_type_names[0]); i++)
+    {
+        if (strcmp(guid, gpt_type_names[i].guid) == 0)
+            type = gpt_type_names[i].name;
+    }
+
+    // the LBAs are shown in the unit of the partition table
+    uint64_t scale = sector_size / SECTOR_SIZE;
+    uint64_t size_bytes = partition->total_sectors * SECTOR_SIZE;
+    printf("Partition %d:\n", partition->number);
+    printf("  Type GUID:    %s (%s)\n", guid, type);
+    printf("  Name:         %s\n", partition->name);
+    printf("  Sector size:  %u bytes\n", sector_size);
+    printf("  Start LBA:    %lu\n", (unsigned long)(partition->start_lba / scale));
+    printf("  Start Byte:   %lu\n", (unsigned long)(partition->start_lba * SECTOR_SIZE));
+    printf("  End Byte:     %lu\n", (unsigned long)(partition->start_lba * SECTOR_SIZE + size_bytes - 1));
+    printf("  Size:         %lu sectors (%lu bytes)\n", (unsigned long)(partition->total_sectors / scale), (unsigned long)size_bytes);
+}
+
+void disk_layout_print(const disk_layout *layout)
+{
+    if (layout->gpt)
+        printf("GUID Partition Table\n");
+    for (uint32_t i = 0; i < layout->count; i++)
+    {
+        const disk_partition *partition = &layout->partitions[i];
+        if (partition->scheme == PARTITION_SCHEME_GPT)
+            print_gpt_partition(partition, layout->sector_size);
+        else
+            print_partition(&partition->entry, partition->number);
+        printf("  Filesystem:   %s\n", filesystem_name(partition->filesystem));
+    }
+}
+
+void disk_layout_free(disk_layout *layout)
+{
+    free(layout->partitions);
+    memset(layout, 0, sizeof(*layout));
+}
@@ -0,0 +1,108 @@
+#ifndef DISK_LAYOUT_H
+#define DISK_LAYOUT_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "master_boot_record.h"
+
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_PROTECTIVE_TYPE 0xEE
+#define EBR_MAX_CHAIN 4096     // logical partitions followed before the chain is considered looping
+#define GPT_MAX_ENTRIES 16384 // entries read from a partition array
+#define FIRST_LOGICAL_NUMBER 5 // logical partitions are numbered after the four primary slots
+#define LARGE_SECTOR_SIZE 4096 // logical sector of 4Kn disks, the unit of their partition tables
+
+#pragma pack(push, 1)
+typedef struct gpt_header_t
+{
+    char signature[8];
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32; // of header_size bytes, computed with this field zeroed
+    uint32_t reserved;
+    uint64_t my_lba;
+    uint64_t alternate_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t entries_lba;
+    uint32_t entry_count;
+    uint32_t entry_size;
+    uint32_t entries_crc32;
+} gpt_header; // size: 92 bytes
+
+typedef struct gpt_entry_t
+{
+    uint8_t type_guid[16]; // all zero for an unused entry
+    uint8_t unique_guid[16];
+    uint64_t first_lba;
+    uint64_t last_lba; // inclusive
+    uint64_t attributes;
+    uint16_t name[36]; // UTF-16LE
+} gpt_entry; // size: 128 bytes
+#pragma pack(pop)
+
+typedef enum partition_scheme_t
+{
+    PARTITION_SCHEME_PRIMARY, // slot of the MBR
+    PARTITION_SCHEME_LOGICAL, // inside an extended partition, found through its EBR chain
+    PARTITION_SCHEME_GPT,
+} partition_scheme;
+
+typedef enum filesystem_type_t
+{
+    FILESYSTEM_UNKNOWN,
+    FILESYSTEM_FAT12,
+    FILESYSTEM_FAT16,
+    FILESYSTEM_FAT32,
+    FILESYSTEM_EXFAT,
+    FILESYSTEM_NTFS,
+    FILESYSTEM_EXT,
+} filesystem_type;
+
+typedef struct disk_partition_t
+{
+    int number; // primary slots 1-4, logical partitions from 5 in chain order, GPT entries by index + 1
+    partition_scheme scheme;
+    partition_entry entry; // MBR form used by the FAT32 code; start_lba and total_sectors are 0 past 2 TiB
+    uint64_t start_lba;    // in SECTOR_SIZE units, whatever the sector size of the partition table
+    uint64_t total_sectors;
+    uint8_t type_guid[16]; // GPT only
+    char name[37];         // GPT only, non-ASCII characters replaced by '?'
+    filesystem_type filesystem;
+} disk_partition;
+
+typedef struct disk_layout_t
+{
+    disk_partition *partitions; // in number order
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t sector_size; // LBA unit of the partition table: SECTOR_SIZE, or LARGE_SECTOR_SIZE on 4Kn disks
+    int gpt;
+} disk_layout;
+
+/*
+ * enumerate every partition of the disk: the primary slots of the MBR, the logical partitions of each extended
+ * partition (walking its EBR chain) and, behind a protective MBR, the GPT entries (primary header, backup header
+ * if the primary one fails its CRC checks). The first sectors of each partition are read to tell its filesystem.
+ * The tables of 4Kn disks count in 4096-byte LBAs: a GPT header at byte 4096, or MBR partitions whose filesystem
+ * is only found at their LBA times 4096, switch the layout to that unit and the positions are scaled to SECTOR_SIZE.
+ * Damaged chains and tables are reported on stderr and enumeration keeps what could be read.
+ */
+int disk_layout_scan(block_device *dev, const master_boot_record *mbr, disk_layout *layout);
+
+/*
+ * return the partition of the given number, NULL if there is none
+ */
+const disk_partition *disk_layout_find(const disk_layout *layout, int number);
+
+/*
+ * print every partition with its position, type and filesystem
+ */
+void disk_layout_print(const disk_layout *layout);
+
+const char *filesystem_name(filesystem_type filesystem);
+
+void disk_layout_free(disk_layout *layout);
+
+#endif
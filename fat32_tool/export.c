@@ -0,0 +1,674 @@
+#include "export.h"
+#include "extent.h"
+#include "walker.h"
+#include "geometry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef struct export_file_t
+{
+    char *path; // relative to the output directory, starting with '/'
+    directory_table_entry entry;
+    uint64_t length;    // bytes the chain holds, file_size unless the chain is short
+    uint32_t remaining; // pieces left to write, the writer of the last one finishes the file
+} export_file;
+
+/*
+ * contiguous part of a file, at most one read long
+ */
+typedef struct export_piece_t
+{
+    uint32_t cluster;
+    uint32_t file;
+    uint64_t file_offset;
+    uint32_t size; // in bytes
+} export_piece;
+
+/*
+ * one read of the image covering consecutive pieces of the sorted plan
+ */
+typedef struct export_job_t
+{
+    uint32_t first_piece;
+    uint32_t piece_count;
+    uint32_t first_cluster;
+    uint32_t cluster_count;
+    uint8_t *buffer; // owned copy of the data, NULL when data points into the mapped image
+    const uint8_t *data;
+} export_job;
+
+typedef struct export_queue_t
+{
+    uint32_t items[EXPORT_QUEUE_DEPTH];
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} export_queue;
+
+typedef struct export_context_t
+{
+    const char *output_dir;
+    const volume_geometry *geometry;
+    uint32_t cluster_size;
+    export_file *files;
+    uint32_t file_count;
+    uint32_t file_capacity;
+    export_piece *pieces;
+    uint32_t piece_count;
+    uint32_t piece_capacity;
+    export_job *jobs;
+    uint32_t job_count;
+    export_file *directories; // in tree order, their times are set once everything below them is written
+    uint32_t directory_count;
+    uint32_t directory_capacity;
+    export_queue queue;
+    uint32_t short_files; // files written with less than their size because their chain ends early
+    // progress, under progress_lock
+    pthread_mutex_t progress_lock;
+    uint8_t *job_done;
+    uint32_t done_prefix; // jobs before it are all written
+    uint64_t bytes_written;
+    uint32_t files_written;
+    int failed;
+} export_context;
+
+static void queue_push(export_queue *queue, uint32_t job)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == EXPORT_QUEUE_DEPTH)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    queue->items[(queue->head + queue->count) % EXPORT_QUEUE_DEPTH] = job;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ * return 0 once the queue is closed and drained
+ */
+static int queue_pop(export_queue *queue, uint32_t *job)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    int available = queue->count > 0;
+    if (available)
+    {
+        *job = queue->items[queue->head];
+        queue->head = (queue->head + 1) % EXPORT_QUEUE_DEPTH;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return available;
+}
+
+static void queue_close(export_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ * FAT timestamp as a timespec, an unset date leaves the time unchanged
+ */
+static struct timespec fat_timestamp(uint16_t date, uint16_t time)
+{
+    struct timespec result = {0, UTIME_OMIT};
+    struct tm local;
+    if (!fat_decode_time(date, time, &local))
+        return result;
+
+    time_t seconds = mktime(&local);
+    if (seconds != (time_t)-1)
+    {
+        result.tv_sec = seconds;
+        result.tv_nsec = 0;
+    }
+    return result;
+}
+
+/*
+ * access time from last_access_date (FAT keeps no access time of day), modification time from write_date and
+ * write_time. Linux offers no way to set the creation time.
+ */
+static void entry_times(const directory_table_entry *entry, struct timespec times[2])
+{
+    times[0] = fat_timestamp(entry->last_access_date, 0);
+    times[1] = fat_timestamp(entry->write_date, entry->write_time);
+}
+
+static void output_path(const export_context *export, const char *path, char *full_path, size_t size)
+{
+    snprintf(full_path, size, "%s%s", export->output_dir, path);
+}
+
+static export_file *append_file(export_file **files, uint32_t *count, uint32_t *capacity)
+{
+    if (*count == *capacity)
+    {
+        uint32_t grown_capacity = *capacity ? *capacity * 2 : 256;
+        export_file *grown = realloc(*files, grown_capacity * sizeof(export_file));
+        if (!grown)
+            return NULL;
+        *files = grown;
+        *capacity = grown_capacity;
+    }
+    export_file *file = &(*files)[(*count)++];
+    memset(file, 0, sizeof(*file));
+    return file;
+}
+
+static export_piece *append_piece(export_context *export)
+{
+    if (export->piece_count == export->piece_capacity)
+    {
+        uint32_t capacity = export->piece_capacity ? export->piece_capacity * 2 : 1024;
+        export_piece *grown = realloc(export->pieces, capacity * sizeof(export_piece));
+        if (!grown)
+            return NULL;
+        export->pieces = grown;
+        export->piece_capacity = capacity;
+    }
+    return &export->pieces[export->piece_count++];
+}
+
+typedef struct plan_builder_t
+{
+    export_context *export;
+    fat_table *fat;
+    int failed;
+} plan_builder;
+
+static int add_pieces(export_context *export, fat_table *fat, uint32_t file_index)
+{
+    export_file *file = &export->files[file_index];
+    uint32_t first_cluster = entry_first_cluster(&file->entry);
+    uint32_t clusters = (uint32_t)geometry_clusters(export->geometry, file->entry.file_size);
+    uint32_t max_clusters = EXPORT_READ_SIZE / export->cluster_size ? EXPORT_READ_SIZE / export->cluster_size : 1;
+
+    extent_list extents;
+    if (clusters == 0)
+        return 0;
+    if (extent_list_build(fat, first_cluster, clusters, &extents) != 0)
+        return 1;
+
+    for (uint32_t i = 0; i < extents.count; i++)
+    {
+        for (uint32_t done = 0; done < extents.items[i].length && file->length < file->entry.file_size; done += max_clusters)
+        {
+            uint32_t length = extents.items[i].length - done < max_clusters ? extents.items[i].length - done : max_clusters;
+            uint64_t size = (uint64_t)length * export->cluster_size;
+            if (size > file->entry.file_size - file->length)
+                size = file->entry.file_size - file->length;
+            export_piece *piece = append_piece(export);
+            if (!piece)
+            {
+                extent_list_free(&extents);
+                return 1;
+            }
+            piece->cluster = extents.items[i].start_cluster + done;
+            piece->file = file_index;
+            piece->file_offset = file->length;
+            piece->size = (uint32_t)size;
+            file->length += size;
+        }
+    }
+    extent_list_free(&extents);
+    return 0;
+}
+
+/*
+ * create every directory and empty file right away, and plan the pieces of the other files
+ */
+static int plan_entry(const walk_entry *item, const char *path, int depth, void *context)
+{
+    (void)depth;
+    plan_builder *builder = context;
+    export_context *export = builder->export;
+    if (strcmp(item->name, ".") == 0 || strcmp(item->name, "..") == 0)
+        return 0;
+
+    char full_path[WALK_PATH_MAX * 2];
+    output_path(export, path, full_path, sizeof(full_path));
+    int directory = (item->entry.attributes & DIRECTORY_ATTRIBUTE) != 0;
+    export_file *file = directory ? append_file(&export->directories, &export->directory_count, &export->directory_capacity)
+                                  : append_file(&export->files, &export->file_count, &export->file_capacity);
+    if (!file)
+    {
+        builder->failed = 1;
+        return 1;
+    }
+    file->entry = item->entry;
+    file->path = strdup(path);
+    if (!file->path)
+    {
+        builder->failed = 1;
+        return 1;
+    }
+
+    if (directory)
+    {
+        if (mkdir(full_path, 0755) != 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "Error: cannot create %s\n", full_path);
+            builder->failed = 1;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (add_pieces(export, builder->fat, export->file_count - 1) != 0)
+    {
+        builder->failed = 1;
+        return 1;
+    }
+    if (file->length < file->entry.file_size)
+    {
+        fprintf(stderr, "Error: %s: the chain holds %lu of its %u bytes\n", path, (unsigned long)file->length, file->entry.file_size);
+        export->short_files++;
+    }
+    if (file->length == 0)
+    {
+        int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        struct timespec times[2];
+        entry_times(&file->entry, times);
+        if (fd < 0 || futimens(fd, times) != 0)
+        {
+            fprintf(stderr, "Error: cannot create %s\n", full_path);
+            builder->failed = 1;
+        }
+        if (fd >= 0)
+            close(fd);
+        export->files_written++;
+    }
+    return builder->failed;
+}
+
+static int compare_pieces(const void *a, const void *b)
+{
+    const export_piece *x = a, *y = b;
+    if (x->cluster != y->cluster)
+        return x->cluster < y->cluster ? -1 : 1;
+    if (x->file != y->file)
+        return x->file < y->file ? -1 : 1;
+    return x->file_offset < y->file_offset ? -1 : x->file_offset > y->file_offset;
+}
+
+/*
+ * group the sorted pieces into reads: a piece joins the current read when it starts inside or right after it and
+ * the read stays within EXPORT_READ_SIZE
+ */
+static int plan_jobs(export_context *export)
+{
+    uint32_t max_clusters = EXPORT_READ_SIZE / export->cluster_size ? EXPORT_READ_SIZE / export->cluster_size : 1;
+    export->jobs = malloc(((size_t)export->piece_count + 1) * sizeof(export_job));
+    if (!export->jobs)
+        return 1;
+
+    for (uint32_t i = 0; i < export->piece_count; i++)
+    {
+        const export_piece *piece = &export->pieces[i];
+        uint32_t clusters = (uint32_t)geometry_clusters(export->geometry, piece->size);
+        export_job *job = export->job_count > 0 ? &export->jobs[export->job_count - 1] : NULL;
+        if (job && piece->cluster <= job->first_cluster + job->cluster_count &&
+            (uint64_t)piece->cluster + clusters - job->first_cluster <= max_clusters)
+        {
+            job->piece_count++;
+            if (piece->cluster + clusters > job->first_cluster + job->cluster_count)
+                job->cluster_count = piece->cluster + clusters - job->first_cluster;
+            continue;
+        }
+
+        job = &export->jobs[export->job_count++];
+        memset(job, 0, sizeof(*job));
+        job->first_piece = i;
+        job->piece_count = 1;
+        job->first_cluster = piece->cluster;
+        job->cluster_count = clusters;
+    }
+    return 0;
+}
+
+static int write_all_at(int fd, const uint8_t *data, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t n = pwrite(fd, data, size, (off_t)offset);
+        if (n <= 0)
+            return 1;
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * write the pieces of a read to their files. The writer of the last piece of a file sets its length and times.
+ */
+static int write_job(export_context *export, const export_job *job)
+{
+    int status = 0;
+    for (uint32_t i = job->first_piece; i < job->first_piece + job->piece_count; i++)
+    {
+        const export_piece *piece = &export->pieces[i];
+        export_file *file = &export->files[piece->file];
+        char full_path[WALK_PATH_MAX * 2];
+        output_path(export, file->path, full_path, sizeof(full_path));
+
+        int fd = open(full_path, O_WRONLY | O_CREAT, 0644);
+        const uint8_t *data = job->data + (size_t)(piece->cluster - job->first_cluster) * export->cluster_size;
+        int failed = fd < 0 || write_all_at(fd, data, piece->size, piece->file_offset) != 0;
+        if (!failed && __sync_sub_and_fetch(&file->remaining, 1) == 0)
+        {
+            struct timespec times[2];
+            entry_times(&file->entry, times);
+            failed = ftruncate(fd, (off_t)file->length) != 0 || futimens(fd, times) != 0;
+            pthread_mutex_lock(&export->progress_lock);
+            export->files_written++;
+            pthread_mutex_unlock(&export->progress_lock);
+        }
+        if (fd >= 0 && close(fd) != 0)
+            failed = 1;
+        if (failed)
+        {
+            fprintf(stderr, "Error: cannot write %s\n", full_path);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+static void *export_writer_main(void *argument)
+{
+    export_context *export = argument;
+    uint32_t index;
+    while (queue_pop(&export->queue, &index))
+    {
+        export_job *job = &export->jobs[index];
+        int status = write_job(export, job);
+        uint64_t bytes = 0;
+        for (uint32_t i = job->first_piece; i < job->first_piece + job->piece_count; i++)
+            bytes += export->pieces[i].size;
+        free(job->buffer);
+        job->buffer = NULL;
+        job->data = NULL;
+
+        pthread_mutex_lock(&export->progress_lock);
+        export->failed |= status;
+        export->bytes_written += bytes;
+        export->job_done[index] = status == 0; // a failed read stops the prefix a checkpoint resumes from
+        while (export->done_prefix < export->job_count && export->job_done[export->done_prefix])
+            export->done_prefix++;
+        pthread_mutex_unlock(&export->progress_lock);
+    }
+    return NULL;
+}
+
+static void checkpoint_path(const export_context *export, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%s", export->output_dir, EXPORT_CHECKPOINT_NAME);
+}
+
+static void fill_checkpoint(const export_context *export, const struct stat *image, const boot_sector *bs, const partition_entry *entry, export_checkpoint *checkpoint)
+{
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    sidecar_identity_init(&checkpoint->identity, EXPORT_CHECKPOINT_MAGIC, image, bs, entry);
+    checkpoint->piece_count = export->piece_count;
+}
+
+/*
+ * record the written prefix of the plan, through a temporary file renamed over the previous checkpoint
+ */
+static void save_checkpoint(export_context *export, const export_checkpoint *identity)
+{
+    export_checkpoint checkpoint = *identity;
+    pthread_mutex_lock(&export->progress_lock);
+    uint32_t prefix = export->done_prefix;
+    pthread_mutex_unlock(&export->progress_lock);
+    checkpoint.pieces_done = prefix < export->job_count ? export->jobs[prefix].first_piece : export->piece_count;
+    for (uint32_t i = 0; i < checkpoint.pieces_done; i++)
+        checkpoint.bytes_done += export->pieces[i].size;
+
+    char path[WALK_PATH_MAX * 2], temporary_path[WALK_PATH_MAX * 2 + 8];
+    checkpoint_path(export, path, sizeof(path));
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+    FILE *file = fopen(temporary_path, "wb");
+    int written = file && fwrite(&checkpoint, sizeof(checkpoint), 1, file) == 1;
+    if (file && fclose(file) != 0)
+        written = 0;
+    if (!written || rename(temporary_path, path) != 0)
+    {
+        fprintf(stderr, "Warning: cannot write the checkpoint %s\n", path);
+        unlink(temporary_path);
+    }
+}
+
+/*
+ * first job to read: the one after the written prefix of a matching checkpoint, 0 without one
+ */
+static uint32_t load_checkpoint(const export_context *export, const export_checkpoint *identity, uint64_t *bytes_done)
+{
+    char path[WALK_PATH_MAX * 2];
+    checkpoint_path(export, path, sizeof(path));
+    FILE *file = fopen(path, "rb");
+    export_checkpoint checkpoint;
+    int loaded = file && fread(&checkpoint, sizeof(checkpoint), 1, file) == 1;
+    if (file)
+        fclose(file);
+    *bytes_done = 0;
+    if (!loaded || memcmp(&checkpoint, identity, offsetof(export_checkpoint, pieces_done)) != 0)
+        return 0;
+
+    for (uint32_t job = 0; job < export->job_count; job++)
+        if (export->jobs[job].first_piece == checkpoint.pieces_done)
+        {
+            *bytes_done = checkpoint.bytes_done;
+            return job;
+        }
+    return 0;
+}
+
+static double elapsed_seconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void print_progress(export_context *export, uint64_t total_bytes, uint32_t total_files)
+{
+    pthread_mutex_lock(&export->progress_lock);
+    uint64_t bytes = export->bytes_written;
+    uint32_t files = export->files_written;
+    pthread_mutex_unlock(&export->progress_lock);
+    fprintf(stderr, "\rExported %lu/%lu MiB, %u/%u files", (unsigned long)(bytes >> 20), (unsigned long)(total_bytes >> 20), files, total_files);
+}
+
+/*
+ * read the plan in disk order from first_job and hand every read to the writers
+ */
+static int read_jobs(export_context *export, block_device *dev, uint32_t first_job, const export_checkpoint *identity, uint64_t total_bytes)
+{
+    int show_progress = isatty(STDERR_FILENO);
+    struct timespec last_progress, last_checkpoint;
+    clock_gettime(CLOCK_MONOTONIC, &last_progress);
+    last_checkpoint = last_progress;
+
+    int status = 0;
+    for (uint32_t index = first_job; index < export->job_count; index++)
+    {
+        export_job *job = &export->jobs[index];
+        size_t size = (size_t)job->cluster_count * export->cluster_size;
+        job->buffer = malloc(size);
+        job->data = job->buffer ? block_device_get(dev, geometry_cluster_offset(export->geometry, job->first_cluster), size, job->buffer) : NULL;
+        if (!job->data)
+        {
+            fprintf(stderr, "Error: cannot read clusters %u-%u\n", job->first_cluster, job->first_cluster + job->cluster_count - 1);
+            free(job->buffer);
+            job->buffer = NULL;
+            status = 1;
+            break;
+        }
+        if (job->data != job->buffer)
+        {
+            free(job->buffer);
+            job->buffer = NULL;
+        }
+        queue_push(&export->queue, index);
+
+        if (show_progress && elapsed_seconds(&last_progress) >= 1)
+        {
+            print_progress(export, total_bytes, export->file_count);
+            clock_gettime(CLOCK_MONOTONIC, &last_progress);
+        }
+        if (elapsed_seconds(&last_checkpoint) >= EXPORT_CHECKPOINT_INTERVAL)
+        {
+            save_checkpoint(export, identity);
+            clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+        }
+    }
+    return status;
+}
+
+static void free_export(export_context *export)
+{
+    for (uint32_t i = 0; i < export->file_count; i++)
+        free(export->files[i].path);
+    for (uint32_t i = 0; i < export->directory_count; i++)
+        free(export->directories[i].path);
+    free(export->files);
+    free(export->directories);
+    free(export->pieces);
+    free(export->jobs);
+    free(export->job_done);
+}
+
+int export_volume(block_device *dev, fat_table *fat, const boot_sector *bs, const partition_entry *entry, const volume_geometry *geometry, const char *image_path, int thread_count, const char *output_dir, FILE *out)
+{
+    struct stat image;
+    if (stat(image_path, &image) != 0 || (mkdir(output_dir, 0755) != 0 && errno != EEXIST))
+    {
+        perror("Error");
+        return 1;
+    }
+
+    walk_tree tree;
+    if (walk_tree_build(dev, fat, geometry, bs->root_cluster, thread_count, &tree) != 0)
+        return 1;
+
+    export_context export;
+    memset(&export, 0, sizeof(export));
+    export.output_dir = output_dir;
+    export.geometry = geometry;
+    export.cluster_size = geometry->cluster_size;
+    plan_builder builder = {&export, fat, 0};
+    walk_tree_visit(&tree, plan_entry, &builder);
+    walk_tree_free(&tree);
+    if (builder.failed)
+    {
+        if (errno == ENOMEM)
+            perror("Error");
+        free_export(&export);
+        return 1;
+    }
+    qsort(export.pieces, export.piece_count, sizeof(export_piece), compare_pieces);
+    if (plan_jobs(&export) != 0 || !(export.job_done = calloc((size_t)export.job_count + 1, 1)))
+    {
+        perror("Error");
+        free_export(&export);
+        return 1;
+    }
+
+    // a matching checkpoint skips the reads already written, the files they completed are left as they are
+    export_checkpoint identity;
+    fill_checkpoint(&export, &image, bs, entry, &identity);
+    uint64_t bytes_done;
+    uint32_t first_job = load_checkpoint(&export, &identity, &bytes_done);
+    uint64_t total_bytes = 0;
+    for (uint32_t i = 0; i < export.piece_count; i++)
+        total_bytes += export.pieces[i].size;
+    for (uint32_t job = first_job; job < export.job_count; job++)
+        for (uint32_t i = export.jobs[job].first_piece; i < export.jobs[job].first_piece + export.jobs[job].piece_count; i++)
+            export.files[export.pieces[i].file].remaining++;
+    for (uint32_t i = 0; i < export.file_count; i++)
+        if (export.files[i].remaining == 0 && export.files[i].length > 0)
+            export.files_written++;
+    export.done_prefix = first_job;
+    export.bytes_written = bytes_done;
+    if (first_job > 0)
+        fprintf(stderr, "Resuming the export at %lu of %lu bytes\n", (unsigned long)bytes_done, (unsigned long)total_bytes);
+
+    pthread_mutex_init(&export.progress_lock, NULL);
+    pthread_mutex_init(&export.queue.lock, NULL);
+    pthread_cond_init(&export.queue.not_empty, NULL);
+    pthread_cond_init(&export.queue.not_full, NULL);
+    int writer_count = thread_count > 1 ? thread_count : 1;
+    pthread_t *writers = calloc((size_t)writer_count, sizeof(pthread_t));
+    int started = 0;
+    while (writers && started < writer_count && pthread_create(&writers[started], NULL, export_writer_main, &export) == 0)
+        started++;
+
+    int status = 0;
+    if (started == 0)
+    {
+        perror("Error");
+        status = 1;
+    }
+    else
+        status = read_jobs(&export, dev, first_job, &identity, total_bytes);
+    queue_close(&export.queue);
+    for (int i = 0; i < started; i++)
+        pthread_join(writers[i], NULL);
+    free(writers);
+    status |= export.failed;
+    if (isatty(STDERR_FILENO))
+    {
+        print_progress(&export, total_bytes, export.file_count);
+        fprintf(stderr, "\n");
+    }
+
+    char path[WALK_PATH_MAX * 2];
+    if (status != 0)
+        save_checkpoint(&export, &identity);
+    else
+    {
+        // deepest directories first, since creating their content changed their modification time
+        for (uint32_t i = export.directory_count; i-- > 0;)
+        {
+            struct timespec times[2];
+            entry_times(&export.directories[i].entry, times);
+            output_path(&export, export.directories[i].path, path, sizeof(path));
+            utimensat(AT_FDCWD, path, times, 0);
+        }
+        checkpoint_path(&export, path, sizeof(path));
+        unlink(path);
+        fprintf(out, "Exported %u files (%lu bytes) and %u directories to %s\n", export.file_count, (unsigned long)total_bytes, export.directory_count, output_dir);
+
+        // the export is complete, but not every file could be copied in full
+        if (export.short_files > 0)
+        {
+            fprintf(stderr, "Error: %u files are shorter than their size\n", export.short_files);
+            status = 1;
+        }
+    }
+
+    pthread_cond_destroy(&export.queue.not_empty);
+    pthread_cond_destroy(&export.queue.not_full);
+    pthread_mutex_destroy(&export.queue.lock);
+    pthread_mutex_destroy(&export.progress_lock);
+    free_export(&export);
+    return status;
+}
@@ -0,0 +1,39 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+#include "sidecar.h"
+
+#define EXPORT_READ_SIZE (8 * 1024 * 1024) // largest read of the image, covering the pieces of several files
+#define EXPORT_QUEUE_DEPTH 8               // reads waiting for a writer, bounding the memory in flight
+#define EXPORT_CHECKPOINT_INTERVAL 5       // seconds between two checkpoint updates
+#define EXPORT_CHECKPOINT_NAME ".fat32_tool.checkpoint" // in the output directory, FAT names never start with a dot
+#define EXPORT_CHECKPOINT_MAGIC "F32EXP01"
+
+/*
+ * position of an interrupted export: the read plan is rebuilt identically from the same volume, and the reads
+ * before pieces_done, all written, are skipped
+ */
+#pragma pack(push, 1)
+typedef struct export_checkpoint_t
+{
+    sidecar_identity identity;
+    uint64_t piece_count;
+    uint64_t pieces_done;
+    uint64_t bytes_done;
+} export_checkpoint;
+#pragma pack(pop)
+
+/*
+ * copy every file and directory of the volume below output_dir, with the modification and access times of their
+ * entries. The extents of all files are collected first and cut into pieces sorted by cluster, so the image is
+ * read in disk order, in reads of up to EXPORT_READ_SIZE bytes that are handed to thread_count writer threads.
+ * Progress is shown on stderr when it is a terminal, and a checkpoint kept in output_dir lets a later run of
+ * the same export resume where an interrupted one stopped. Return 0 once everything is written.
+ */
+int export_volume(block_device *dev, fat_table *fat, const boot_sector *bs, const partition_entry *entry, const volume_geometry *geometry, const char *image_path, int thread_count, const char *output_dir, FILE *out);
+
+#endif
@@ -0,0 +1,224 @@
+#include "extent.h"
+#include "cluster_cache.h"
+#include "async_io.h"
+#include "geometry.h"
+
+/*
+ * append a cluster to the list, extending the last extent when the cluster follows it on disk
+ */
+static int append_cluster(extent_list *list, uint32_t cluster)
+{
+    if (list->count > 0)
+    {
+        extent *last = &list->items[list->count - 1];
+        if (last->start_cluster + last->length == cluster)
+        {
+            last->length++;
+            list->clusters++;
+            return 0;
+        }
+    }
+
+    if (list->count == list->capacity)
+    {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 8;
+        extent *items = realloc(list->items, capacity * sizeof(extent));
+        if (!items)
+            return 1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count].start_cluster = cluster;
+    list->items[list->count].length = 1;
+    list->count++;
+    list->clusters++;
+    return 0;
+}
+
+int extent_list_build(fat_table *fat, uint32_t first_cluster, uint32_t max_clusters, extent_list *list)
+{
+    memset(list, 0, sizeof(*list));
+
+    uint32_t cluster = first_cluster;
+    while (cluster >= 2 && cluster < END_OF_CLUSTER_CHAIN && list->clusters < max_clusters && list->clusters < fat->entry_count)
+    {
+        // a bad cluster marker or a number past the data area would be read as content from outside the volume
+        if (cluster >= fat->cluster_end)
+        {
+            fprintf(stderr, "Error: the cluster chain starting at %u reaches invalid cluster %u\n", first_cluster, cluster);
+            extent_list_free(list);
+            return 1;
+        }
+        if (append_cluster(list, cluster) != 0)
+        {
+            perror("Error");
+            extent_list_free(list);
+            return 1;
+        }
+        cluster = fat_table_next(fat, cluster);
+    }
+    if (cluster == FAT_READ_ERROR)
+    {
+        fprintf(stderr, "Error: cannot read the FAT in the chain starting at %u\n", first_cluster);
+        extent_list_free(list);
+        return 1;
+    }
+    return 0;
+}
+
+int extent_list_read(block_device *dev, const volume_geometry *geometry, const extent_list *list, uint64_t limit, extent_callback callback, void *context)
+{
+    uint32_t cluster_size = geometry->cluster_size;
+    uint32_t clusters_per_read = EXTENT_MAX_READ / cluster_size;
+    if (clusters_per_read == 0)
+        clusters_per_read = 1;
+
+    // no read is larger than the longest extent
+    uint32_t longest = 0;
+    for (uint32_t i = 0; i < list->count; i++)
+    {
+        if (list->items[i].length > longest)
+            longest = list->items[i].length;
+    }
+    if (longest == 0)
+        return 0;
+    if (longest < clusters_per_read)
+        clusters_per_read = longest;
+
+    // the scratch buffer is only touched by backends that cannot hand out pointers into the image
+    uint8_t *scratch = malloc((size_t)clusters_per_read * cluster_size);
+    if (!scratch)
+    {
+        perror("Error");
+        return 1;
+    }
+
+    int status = 0;
+    int stopped = 0;
+    uint64_t position = 0;
+    for (uint32_t i = 0; i < list->count && position < limit && status == 0 && !stopped; i++)
+    {
+        uint32_t cluster = list->items[i].start_cluster;
+        uint32_t remaining = list->items[i].length;
+        while (remaining > 0 && position < limit)
+        {
+            uint32_t count = remaining < clusters_per_read ? remaining : clusters_per_read;
+            if ((uint64_t)count * cluster_size > limit - position)
+                count = (uint32_t)geometry_clusters(geometry, limit - position);
+            size_t size = (size_t)count * cluster_size;
+            const uint8_t *data;
+            if (dev->cache && count <= CLUSTER_CACHE_MAX_RUN)
+                data = cluster_cache_read(dev->cache, cluster, count, scratch) == 0 ? scratch : NULL;
+            else
+                data = block_device_get(dev, geometry_cluster_offset(geometry, cluster), size, scratch);
+            if (!data)
+            {
+                status = 1;
+                break;
+            }
+
+            if (size > limit - position)
+                size = limit - position;
+            if (callback(data, position, size, context) != 0)
+            {
+                stopped = 1;
+                break;
+            }
+
+            position += size;
+            cluster += count;
+            remaining -= count;
+        }
+    }
+
+    free(scratch);
+    return status;
+}
+
+typedef struct queued_read_t
+{
+    extent_callback callback;
+    void *context;
+    uint64_t position; // of the next chunk delivered
+    int failed;
+} queued_read;
+
+static int deliver_queued_chunk(const uint8_t *data, size_t size, void *context)
+{
+    queued_read *read = context;
+    if (!data)
+    {
+        read->failed = 1;
+        return 1;
+    }
+    if (read->callback(data, read->position, size, read->context) != 0)
+        return 1;
+    read->position += size;
+    return 0;
+}
+
+int extent_list_read_queued(block_device *dev, const volume_geometry *geometry, const extent_list *list, uint64_t limit, extent_callback callback, void *context)
+{
+    uint32_t cluster_size = geometry->cluster_size;
+    uint64_t read_size = EXTENT_QUEUED_READ < cluster_size ? cluster_size : EXTENT_QUEUED_READ / cluster_size * cluster_size;
+
+    // one read per extent piece, up to limit
+    uint64_t reads = 0;
+    uint64_t longest = 0;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < list->count && total < limit; i++)
+    {
+        uint64_t size = (uint64_t)list->items[i].length * cluster_size;
+        if (size > limit - total)
+            size = limit - total;
+        reads += (size + read_size - 1) / read_size;
+        total += size;
+        if (size > longest)
+            longest = size;
+    }
+    if (dev->map || reads < 2)
+        return extent_list_read(dev, geometry, list, limit, callback, context);
+
+    async_io io;
+    uint32_t depth = reads < ASYNC_IO_DEFAULT_DEPTH ? (uint32_t)reads : ASYNC_IO_DEFAULT_DEPTH;
+    if (async_io_init(&io, dev, depth, (size_t)(longest < read_size ? longest : read_size)) != 0)
+        return 1;
+
+    queued_read read = {callback, context, 0, 0};
+    uint64_t queued = 0; // bytes submitted so far, the callback stops at limit
+    for (uint32_t i = 0; i < list->count && queued < limit && !io.stopped; i++)
+    {
+        uint64_t offset = geometry_cluster_offset(geometry, list->items[i].start_cluster);
+        uint64_t size = (uint64_t)list->items[i].length * cluster_size;
+        if (size > limit - queued)
+            size = limit - queued;
+        for (uint64_t done = 0; done < size; done += read_size)
+        {
+            size_t chunk = size - done < read_size ? (size_t)(size - done) : (size_t)read_size;
+            if (async_io_submit(&io, offset + done, chunk, deliver_queued_chunk, &read) != 0)
+                break;
+        }
+        queued += size;
+    }
+    async_io_free(&io);
+    return read.failed;
+}
+
+void print_extents(const extent_list *list, const volume_geometry *geometry)
+{
+    printf("%u extent(s), %u cluster(s)\n", list->count, list->clusters);
+    for (uint32_t i = 0; i < list->count; i++)
+    {
+        uint64_t start_byte = geometry_cluster_offset(geometry, list->items[i].start_cluster);
+        uint64_t end_byte = start_byte + (uint64_t)list->items[i].length * geometry->cluster_size - 1;
+        printf("  Cluster %u-%u (%u clusters): bytes %lu-%lu\n", list->items[i].start_cluster,
+               list->items[i].start_cluster + list->items[i].length - 1, list->items[i].length, start_byte, end_byte);
+    }
+}
+
+void extent_list_free(extent_list *list)
+{
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
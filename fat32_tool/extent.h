@@ -0,0 +1,64 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+
+#define EXTENT_MAX_READ (8 * 1024 * 1024) // largest single read issued for an extent
+#define EXTENT_QUEUED_READ (1024 * 1024)  // size of the reads kept in flight by extent_list_read_queued
+#define CHAIN_UNBOUNDED UINT32_MAX        // follow a chain until its end-of-chain marker
+
+/*
+ * run of physically contiguous clusters of a chain
+ */
+typedef struct extent_t
+{
+    uint32_t start_cluster;
+    uint32_t length; // in clusters
+} extent;
+
+typedef struct extent_list_t
+{
+    extent *items;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t clusters; // total number of clusters in the list
+} extent_list;
+
+/*
+ * callback receiving the content of a chain chunk by chunk, in chain order. position is the byte offset of data
+ * from the start of the chain. Returning non-zero stops the iteration.
+ */
+typedef int (*extent_callback)(const uint8_t *data, uint64_t position, size_t size, void *context);
+
+/*
+ * follow the cluster chain starting at first_cluster for at most max_clusters clusters and merge it into extents.
+ * The walk stops at the end-of-chain marker, at a free cluster number, or after as many clusters as the FAT
+ * holds, so a cyclic chain cannot loop forever. Return 1, after printing the error, if the chain reaches a bad
+ * cluster or a cluster past the data area, or if the list cannot be allocated or the FAT read.
+ */
+int extent_list_build(fat_table *fat, uint32_t first_cluster, uint32_t max_clusters, extent_list *list);
+
+/*
+ * read the content described by an extent list with one read per extent (split in EXTENT_MAX_READ chunks),
+ * passing at most limit bytes to the callback. Return non-zero on read error.
+ */
+int extent_list_read(block_device *dev, const volume_geometry *geometry, const extent_list *list, uint64_t limit, extent_callback callback, void *context);
+
+/*
+ * same as extent_list_read, with the reads of every extent queued at once (async_io.h) so that fragmented content
+ * keeps up to ASYNC_IO_DEFAULT_DEPTH reads of EXTENT_QUEUED_READ bytes in flight. The callback still receives the
+ * chunks in chain order. Mapped images and single reads go through extent_list_read.
+ */
+int extent_list_read_queued(block_device *dev, const volume_geometry *geometry, const extent_list *list, uint64_t limit, extent_callback callback, void *context);
+
+/*
+ * print one line per extent: start cluster, length and byte range in the image
+ */
+void print_extents(const extent_list *list, const volume_geometry *geometry);
+
+void extent_list_free(extent_list *list);
+
+#endif
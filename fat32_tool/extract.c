@@ -0,0 +1,182 @@
+#include "extract.h"
+#include "file.h"
+#include "stats.h"
+#include "geometry.h"
+#include "sidecar.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+typedef enum copy_mode_t
+{
+    COPY_FILE_RANGE, // file to file, may share blocks on filesystems supporting reflinks
+    COPY_SENDFILE,   // file to pipe or socket
+    COPY_WRITE,      // through user space, the only option for terminals or transformed images
+} copy_mode;
+
+/*
+ * pick the fastest copy path the output supports
+ */
+static copy_mode initial_mode(block_device *dev, int out_fd)
+{
+    struct stat st;
+    if (block_device_fd(dev) < 0 || fstat(out_fd, &st) != 0 || isatty(out_fd))
+        return COPY_WRITE;
+    if (S_ISREG(st.st_mode))
+        return COPY_FILE_RANGE;
+    return COPY_SENDFILE;
+}
+
+/*
+ * errors meaning the kernel copy path is not supported for this pair of files, not that the copy failed
+ */
+static int unsupported(int error)
+{
+    return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == EBADF;
+}
+
+/*
+ * copy size bytes at an image offset through user space: straight from the mapping when there is one.
+ * Each failure is reported here, where errno still belongs to the call that failed.
+ */
+static int copy_with_write(block_device *dev, uint64_t offset, uint64_t size, int out_fd, uint8_t **scratch)
+{
+    while (size > 0)
+    {
+        size_t chunk = size < EXTRACT_WRITE_SIZE ? (size_t)size : EXTRACT_WRITE_SIZE;
+        if (!*scratch && !(*scratch = malloc(EXTRACT_WRITE_SIZE)))
+        {
+            perror("Error");
+            return 1;
+        }
+
+        const uint8_t *data = block_device_get(dev, offset, chunk, *scratch);
+        if (!data)
+        {
+            fprintf(stderr, "Error: cannot read %lu bytes of the image at offset %lu\n", (unsigned long)chunk, (unsigned long)offset);
+            return 1;
+        }
+        if (write_all(out_fd, data, chunk) != 0)
+        {
+            perror("Error");
+            return 1;
+        }
+        offset += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+/*
+ * copy bytes at an image offset with the kernel, advancing offset and size as data is copied. If the path turns
+ * out to be unsupported, the mode is downgraded and whatever is left is for the next mode to copy.
+ */
+static int copy_with_kernel(int in_fd, uint64_t *offset, uint64_t *size, int out_fd, copy_mode *mode)
+{
+    while (*size > 0 && *mode != COPY_WRITE)
+    {
+        size_t chunk = *size < 0x40000000 ? (size_t)*size : 0x40000000;
+        off_t in_offset = (off_t)*offset;
+        ssize_t n;
+        if (*mode == COPY_FILE_RANGE)
+            n = copy_file_range(in_fd, &in_offset, out_fd, NULL, chunk, 0);
+        else
+            n = sendfile(out_fd, in_fd, &in_offset, chunk);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && unsupported(errno))
+        {
+            *mode = *mode == COPY_FILE_RANGE ? COPY_SENDFILE : COPY_WRITE;
+            continue;
+        }
+        if (n < 0)
+        {
+            perror("Error");
+            return 1;
+        }
+        if (n == 0)
+        {
+            fprintf(stderr, "Error: the image ends at offset %lu, inside the file content\n", (unsigned long)*offset);
+            return 1;
+        }
+        stats_access(*offset, (size_t)n, 0);
+        *offset += n;
+        *size -= n;
+    }
+    return 0;
+}
+
+typedef struct queued_write_t
+{
+    int out_fd;
+    int failed;
+} queued_write;
+
+static int write_chunk(const uint8_t *data, uint64_t position, size_t size, void *context)
+{
+    queued_write *write = context;
+    (void)position;
+    write->failed = write_all(write->out_fd, data, size);
+    if (write->failed)
+        perror("Error");
+    return write->failed;
+}
+
+int extract_extents(block_device *dev, const volume_geometry *geometry, const extent_list *extents, uint64_t size, int out_fd)
+{
+    uint64_t cluster_size = geometry->cluster_size;
+    uint64_t remaining = size;
+    copy_mode mode = initial_mode(dev, out_fd);
+    uint8_t *scratch = NULL;
+    int status = 0;
+
+    // nothing for the kernel to copy and no mapping to write from: keep the reads of all extents in flight
+    int queued = mode == COPY_WRITE && !dev->map;
+    if (queued)
+    {
+        queued_write write = {out_fd, 0};
+        uint64_t available = (uint64_t)extents->clusters * cluster_size;
+        status = extent_list_read_queued(dev, geometry, extents, size, write_chunk, &write) != 0 || write.failed;
+        // a failed write was reported by write_chunk
+        if (status != 0 && !write.failed)
+            fprintf(stderr, "Error: cannot read the file content\n");
+        remaining = available < size ? size - available : 0;
+    }
+
+    for (uint32_t i = 0; i < extents->count && remaining > 0 && status == 0 && !queued; i++)
+    {
+        uint64_t offset = geometry_cluster_offset(geometry, extents->items[i].start_cluster);
+        uint64_t chunk = extents->items[i].length * cluster_size;
+        if (chunk > remaining)
+            chunk = remaining;
+
+        remaining -= chunk;
+        if (mode != COPY_WRITE)
+            status = copy_with_kernel(block_device_fd(dev), &offset, &chunk, out_fd, &mode);
+        if (status == 0 && chunk > 0)
+            status = copy_with_write(dev, offset, chunk, out_fd, &scratch);
+    }
+
+    if (status == 0 && remaining > 0)
+    {
+        fprintf(stderr, "Error: cluster chain is shorter than the file size\n");
+        status = 1;
+    }
+
+    free(scratch);
+    return status;
+}
+
+int extract_file(block_device *dev, fat_table *fat, const volume_geometry *geometry, const directory_table_entry *file, int out_fd)
+{
+    extent_list extents;
+    if (build_file_extents(fat, geometry, file, &extents) != 0)
+        return 1;
+
+    int status = extract_extents(dev, geometry, &extents, file->file_size, out_fd);
+    extent_list_free(&extents);
+    return status;
+}
@@ -0,0 +1,25 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+#include "extent.h"
+
+#define EXTRACT_WRITE_SIZE (8 * 1024 * 1024) // size of the buffered writes used when no kernel copy is possible
+
+/*
+ * write the first size bytes of the content described by an extent list to out_fd, each extent being copied by
+ * the kernel when possible. Return 0 on success, 1 after printing what failed.
+ */
+int extract_extents(block_device *dev, const volume_geometry *geometry, const extent_list *extents, uint64_t size, int out_fd);
+
+/*
+ * write exactly file_size bytes of a file's binary content to out_fd. Each extent is copied by the kernel
+ * (copy_file_range to a regular file, sendfile to a pipe or socket) when possible, and with large write()s otherwise.
+ * Return 0 on success.
+ */
+int extract_file(block_device *dev, fat_table *fat, const volume_geometry *geometry, const directory_table_entry *file, int out_fd);
+
+#endif
@@ -0,0 +1,392 @@
+#include "fat32_internal.h"
+#include "cluster_cache.h"
+#include "disk_layout.h"
+#include "master_boot_record.h"
+#include "stats.h"
+#include "geometry.h"
+
+#include <errno.h>
+
+struct fat32_volume_t
+{
+    block_device dev;
+    boot_sector bs;
+    partition_entry entry;
+    fat_table fat;
+    cluster_cache cache; // attached to dev when the image is not mapped
+    volume_geometry layout; // address arithmetic
+    fat32_geometry geometry;
+};
+
+static const char *error_messages[] = {
+    "no error",
+    "cannot read the image",
+    "out of memory",
+    "partition does not exist",
+    "partition lies beyond the 2 TiB addressable with 32-bit sectors",
+    "partition is not properly FAT32 formatted",
+    "invalid path",
+    "specified path does not exist",
+    "a path component is not a directory",
+    "path is a directory",
+    "cluster chain shorter than the file",
+    "no valid Master Boot Record",
+    "boot sector describes an unsupported or inconsistent layout",
+    "cannot open the image",
+};
+
+void fat32_default_options(fat32_options *options)
+{
+    options->backend = BLOCK_DEVICE_AUTO;
+    options->fat_memory = FAT_DEFAULT_BUDGET;
+    options->cache_memory = CLUSTER_CACHE_DEFAULT_BUDGET;
+    options->readahead = CLUSTER_CACHE_DEFAULT_READAHEAD;
+    options->queue = BLOCK_DEVICE_QUEUE_AUTO;
+}
+
+const char *fat32_strerror(fat32_error error)
+{
+    if ((unsigned)error >= sizeof(error_messages) / sizeof(error_messages[0]))
+        return "unknown error";
+    return error_messages[error];
+}
+
+/*
+ * find the partition in the primary, logical and GPT partitions of the image
+ */
+static fat32_error find_partition(block_device *dev, int partition_number, partition_entry *entry)
+{
+    master_boot_record mbr;
+    disk_layout layout;
+    stats_phase_begin(STAT_PHASE_MBR);
+    int mbr_status = extract_mbr(dev, &mbr);
+    int layout_status = mbr_status == 0 && disk_layout_scan(dev, &mbr, &layout) != 0;
+    stats_phase_end(STAT_PHASE_MBR);
+    if (mbr_status)
+        return FAT32_ERROR_NO_PARTITION_TABLE;
+    if (layout_status)
+        return FAT32_ERROR_IO;
+
+    const disk_partition *partition = disk_layout_find(&layout, partition_number);
+    fat32_error error = !partition ? FAT32_ERROR_NO_PARTITION : partition->entry.total_sectors == 0 ? FAT32_ERROR_UNADDRESSABLE : FAT32_OK;
+    if (error == FAT32_OK)
+        *entry = partition->entry;
+    disk_layout_free(&layout);
+    return error;
+}
+
+static void compute_geometry(fat32_volume *volume)
+{
+    const volume_geometry *layout = &volume->layout;
+    fat32_geometry *geometry = &volume->geometry;
+    geometry->partition_offset = layout->partition_offset;
+    geometry->fat_offset = volume->fat.fat_start;
+    geometry->data_offset = layout->data_offset;
+    geometry->sector_size = layout->sector_size;
+    geometry->cluster_size = layout->cluster_size;
+    geometry->root_cluster = volume->bs.root_cluster;
+    geometry->cluster_count = volume->fat.cluster_end > 2 ? volume->fat.cluster_end - 2 : 0;
+}
+
+fat32_error fat32_open(const char *image_path, int partition_number, const fat32_options *options, fat32_volume **volume)
+{
+    fat32_options defaults;
+    if (!options)
+    {
+        fat32_default_options(&defaults);
+        options = &defaults;
+    }
+
+    fat32_volume *opened = calloc(1, sizeof(fat32_volume));
+    if (!opened)
+        return FAT32_ERROR_NO_MEMORY;
+    if (block_device_open(image_path, options->backend, &opened->dev) != 0)
+    {
+        free(opened);
+        return FAT32_ERROR_OPEN;
+    }
+    opened->dev.queue = options->queue;
+
+    fat32_error error = find_partition(&opened->dev, partition_number, &opened->entry);
+    if (error == FAT32_OK)
+    {
+        stats_phase_begin(STAT_PHASE_BOOT_SECTOR);
+        boot_sector_status bs_status = extract_bs(&opened->dev, &opened->entry, &opened->bs);
+        stats_phase_end(STAT_PHASE_BOOT_SECTOR);
+        error = bs_status == BOOT_SECTOR_UNREADABLE ? FAT32_ERROR_IO :
+                bs_status == BOOT_SECTOR_NOT_FAT32 ? FAT32_ERROR_NOT_FAT32 :
+                bs_status == BOOT_SECTOR_INVALID_GEOMETRY ? FAT32_ERROR_INVALID_GEOMETRY : FAT32_OK;
+    }
+    if (error == FAT32_OK)
+        geometry_init(&opened->layout, &opened->bs, &opened->entry);
+    if (error == FAT32_OK)
+    {
+        // load the FAT once, every cluster chain walk is served from it
+        stats_phase_begin(STAT_PHASE_FAT_LOAD);
+        errno = 0;
+        if (fat_table_load(&opened->dev, &opened->bs, &opened->layout, options->fat_memory, &opened->fat) != 0)
+            error = errno == ENOMEM ? FAT32_ERROR_NO_MEMORY : FAT32_ERROR_IO;
+        stats_phase_end(STAT_PHASE_FAT_LOAD);
+    }
+    if (error != FAT32_OK)
+    {
+        block_device_close(&opened->dev);
+        free(opened);
+        return error;
+    }
+
+    // directory and small file reads go through a cluster cache when the image is not mapped
+    if (!opened->dev.map && options->cache_memory > 0)
+        cluster_cache_init(&opened->cache, &opened->dev, &opened->fat, &opened->layout, options->cache_memory, options->readahead);
+    compute_geometry(opened);
+    *volume = opened;
+    return FAT32_OK;
+}
+
+void fat32_close(fat32_volume *volume)
+{
+    if (!volume)
+        return;
+    cluster_cache_free(&volume->cache);
+    fat_table_free(&volume->fat);
+    block_device_close(&volume->dev);
+    free(volume);
+}
+
+const fat32_geometry *fat32_volume_geometry(const fat32_volume *volume)
+{
+    return &volume->geometry;
+}
+
+uint64_t fat32_cluster_offset(const fat32_volume *volume, uint32_t cluster)
+{
+    return geometry_cluster_offset(&volume->layout, cluster);
+}
+
+block_device *fat32_volume_device(fat32_volume *volume)
+{
+    return &volume->dev;
+}
+
+fat_table *fat32_volume_fat(fat32_volume *volume)
+{
+    return &volume->fat;
+}
+
+const volume_geometry *fat32_volume_layout(const fat32_volume *volume)
+{
+    return &volume->layout;
+}
+
+const boot_sector *fat32_volume_boot_sector(const fat32_volume *volume)
+{
+    return &volume->bs;
+}
+
+const partition_entry *fat32_volume_partition(const fat32_volume *volume)
+{
+    return &volume->entry;
+}
+
+static int is_data_cluster(const fat32_volume *volume, uint32_t cluster)
+{
+    return cluster >= 2 && cluster - 2 < volume->geometry.cluster_count;
+}
+
+void fat32_chain_begin(fat32_volume *volume, uint32_t first_cluster, fat32_chain *chain)
+{
+    chain->volume = volume;
+    chain->cluster = is_data_cluster(volume, first_cluster) ? first_cluster : 0;
+    chain->remaining = volume->geometry.cluster_count;
+    chain->failed = 0;
+}
+
+int fat32_chain_next(fat32_chain *chain, fat32_run *run)
+{
+    if (chain->cluster == 0 || chain->remaining == 0)
+        return 0;
+
+    run->start_cluster = chain->cluster;
+    run->length = 0;
+    uint32_t cluster = chain->cluster;
+    uint32_t next;
+    do
+    {
+        run->length++;
+        chain->remaining--;
+        next = fat_table_next(&chain->volume->fat, cluster);
+    } while (next == cluster + 1 && is_data_cluster(chain->volume, next) && chain->remaining > 0 && (cluster = next));
+
+    chain->cluster = next != cluster + 1 && is_data_cluster(chain->volume, next) ? next : 0;
+    chain->failed = next == FAT_READ_ERROR;
+    return 1;
+}
+
+/*
+ * read the next cluster of the directory into its buffer, return 0 at the end of the chain or on a read error
+ */
+static int load_cluster(fat32_directory *directory)
+{
+    fat32_volume *volume = directory->chain.volume;
+    if (directory->run.length == 0 && !fat32_chain_next(&directory->chain, &directory->run))
+    {
+        if (directory->chain.failed)
+            directory->error = FAT32_ERROR_IO;
+        return 0;
+    }
+
+    uint32_t cluster = directory->run.start_cluster;
+    int status = volume->dev.cache ? cluster_cache_read(volume->dev.cache, cluster, 1, directory->buffer)
+                                   : block_device_read(&volume->dev, fat32_cluster_offset(volume, cluster), volume->geometry.cluster_size, directory->buffer);
+    if (status != 0)
+    {
+        directory->error = FAT32_ERROR_IO;
+        return 0;
+    }
+    directory->run.start_cluster++;
+    directory->run.length--;
+    directory->index = 0;
+    directory->count = volume->geometry.cluster_size / sizeof(directory_table_entry);
+    return 1;
+}
+
+fat32_error fat32_directory_open(fat32_volume *volume, uint32_t cluster, fat32_directory *directory)
+{
+    memset(directory, 0, sizeof(*directory));
+    directory->buffer = malloc(volume->geometry.cluster_size);
+    if (!directory->buffer)
+        return FAT32_ERROR_NO_MEMORY;
+    fat32_chain_begin(volume, cluster, &directory->chain);
+    return FAT32_OK;
+}
+
+int fat32_directory_next(fat32_directory *directory, fat32_dirent *dirent)
+{
+    while (!directory->done)
+    {
+        if (directory->index == directory->count && !load_cluster(directory))
+        {
+            directory->done = 1;
+            break;
+        }
+
+        const directory_table_entry *item = (const directory_table_entry *)directory->buffer + directory->index++;
+        if (item->name[0] == END_ENTRY_NAME)
+        {
+            directory->done = 1;
+            break;
+        }
+        // long name parts are flagged as volume labels
+        if (item->name[0] == FREE_ENTRY_NAME || (item->attributes & VOLUME_LABEL_ATTRIBUTE))
+            continue;
+
+        dirent->entry = *item;
+        format_entry_name(item, dirent->name);
+        dirent->directory = (item->attributes & DIRECTORY_ATTRIBUTE) != 0;
+        dirent->first_cluster = entry_first_cluster(item);
+        if (dirent->directory && dirent->first_cluster == 0)
+            dirent->first_cluster = directory->chain.volume->geometry.root_cluster;
+        return 1;
+    }
+    return 0;
+}
+
+void fat32_directory_close(fat32_directory *directory)
+{
+    free(directory->buffer);
+    memset(directory, 0, sizeof(*directory));
+}
+
+/*
+ * look for name in the directory starting at cluster
+ */
+static fat32_error find_in_directory(fat32_volume *volume, uint32_t cluster, const char *name, fat32_dirent *dirent)
+{
+    fat32_directory directory;
+    fat32_error error = fat32_directory_open(volume, cluster, &directory);
+    if (error != FAT32_OK)
+        return error;
+
+    error = FAT32_ERROR_NOT_FOUND;
+    while (fat32_directory_next(&directory, dirent))
+        if (strcmp(dirent->name, name) == 0)
+        {
+            error = FAT32_OK;
+            break;
+        }
+    if (error != FAT32_OK && directory.error != FAT32_OK)
+        error = directory.error;
+    fat32_directory_close(&directory);
+    return error;
+}
+
+fat32_error fat32_lookup(fat32_volume *volume, const char *path, fat32_dirent *dirent)
+{
+    size_t length = strlen(path);
+    if (path[0] != '/' || (length > 1 && path[length - 1] == '/'))
+        return FAT32_ERROR_INVALID_PATH;
+
+    // the root directory has no entry of its own
+    memset(dirent, 0, sizeof(*dirent));
+    strcpy(dirent->name, "/");
+    dirent->entry.attributes = DIRECTORY_ATTRIBUTE;
+    dirent->directory = 1;
+    dirent->first_cluster = volume->geometry.root_cluster;
+
+    const char *component = path + 1;
+    while (*component)
+    {
+        size_t component_length = strcspn(component, "/");
+        if (component_length == 0 || component_length > SHORT_NAME_MAX - 1)
+            return FAT32_ERROR_INVALID_PATH;
+        if (!dirent->directory)
+            return FAT32_ERROR_NOT_A_DIRECTORY;
+
+        // names are compared in lowercase, like the tree shows them
+        char name[SHORT_NAME_MAX];
+        for (size_t i = 0; i < component_length; i++)
+            name[i] = (char)tolower((unsigned char)component[i]);
+        name[component_length] = '\0';
+
+        fat32_error error = find_in_directory(volume, dirent->first_cluster, name, dirent);
+        if (error != FAT32_OK)
+            return error;
+        component += component_length + (component[component_length] == '/');
+    }
+    return FAT32_OK;
+}
+
+fat32_error fat32_read(fat32_volume *volume, const fat32_dirent *file, uint64_t offset, void *buffer, size_t size, size_t *done)
+{
+    *done = 0;
+    if (file->directory)
+        return FAT32_ERROR_IS_A_DIRECTORY;
+    if (offset >= file->entry.file_size)
+        return FAT32_OK;
+    if (size > file->entry.file_size - offset)
+        size = (size_t)(file->entry.file_size - offset);
+
+    // skip the runs before offset, then read run by run
+    uint32_t cluster_size = volume->geometry.cluster_size;
+    fat32_chain chain;
+    fat32_run run;
+    uint64_t run_start = 0; // file offset of the current run
+    fat32_chain_begin(volume, file->first_cluster, &chain);
+    while (*done < size)
+    {
+        if (!fat32_chain_next(&chain, &run))
+            return chain.failed ? FAT32_ERROR_IO : FAT32_ERROR_CORRUPT;
+        uint64_t run_size = (uint64_t)run.length * cluster_size;
+        uint64_t position = offset + *done;
+        if (position < run_start + run_size)
+        {
+            size_t chunk = run_start + run_size - position < size - *done ? (size_t)(run_start + run_size - position) : size - *done;
+            uint64_t image_offset = fat32_cluster_offset(volume, run.start_cluster) + (position - run_start);
+            if (block_device_read(&volume->dev, image_offset, chunk, (uint8_t *)buffer + *done) != 0)
+                return FAT32_ERROR_IO;
+            *done += chunk;
+        }
+        run_start += run_size;
+    }
+    return FAT32_OK;
+}
@@ -0,0 +1,150 @@
+#ifndef FAT32_H
+#define FAT32_H
+
+/*
+ * libfat32: read-only access to a FAT32 volume of a disk image through an opaque handle. Every function taking a
+ * volume may be called from several threads at once; iterators belong to the thread using them.
+ */
+
+#include "utils.h"
+#include "block_device.h" // backend and queue choices of the options
+#include "partition.h"    // on-disk boot sector and directory entries
+
+typedef enum fat32_error_t
+{
+    FAT32_OK = 0,
+    FAT32_ERROR_IO,             // the image cannot be opened or read
+    FAT32_ERROR_NO_MEMORY,
+    FAT32_ERROR_NO_PARTITION,   // no partition of that number
+    FAT32_ERROR_UNADDRESSABLE,  // the partition lies beyond the 2 TiB addressable with 32-bit sectors
+    FAT32_ERROR_NOT_FAT32,      // the boot sector is not the one of a FAT32 volume
+    FAT32_ERROR_INVALID_PATH,   // not absolute, ends with a slash, or a component longer than a short name
+    FAT32_ERROR_NOT_FOUND,
+    FAT32_ERROR_NOT_A_DIRECTORY, // a path component before the last one is a file
+    FAT32_ERROR_IS_A_DIRECTORY,
+    FAT32_ERROR_CORRUPT,        // a chain ends before the size its entry gives
+    FAT32_ERROR_NO_PARTITION_TABLE, // no Master Boot Record signature at the start of the image
+    FAT32_ERROR_INVALID_GEOMETRY, // the boot sector describes a layout the volume cannot have
+    FAT32_ERROR_OPEN,           // the image cannot be opened, reported on stderr when opening it
+} fat32_error;
+
+typedef struct fat32_options_t
+{
+    block_device_backend backend;
+    size_t fat_memory;   // bytes the FAT cache may use
+    size_t cache_memory; // cluster cache of the backends that do not map the image, 0 disables it
+    uint32_t readahead;  // clusters read ahead by the cluster cache
+    block_device_queue queue; // how tree walks and file reads keep several reads in flight
+} fat32_options;
+
+/*
+ * geometry of the volume, computed once when it is opened
+ */
+typedef struct fat32_geometry_t
+{
+    uint64_t partition_offset; // image offset of the boot sector
+    uint64_t fat_offset;       // image offset of the active FAT
+    uint64_t data_offset;      // image offset of cluster 2
+    uint32_t sector_size;      // in bytes, the LBAs of the partition table being 512-byte units
+    uint32_t cluster_size;     // in bytes
+    uint32_t cluster_count;    // data clusters, numbered from 2
+    uint32_t root_cluster;
+} fat32_geometry;
+
+typedef struct fat32_volume_t fat32_volume;
+
+/*
+ * run of physically contiguous clusters
+ */
+typedef struct fat32_run_t
+{
+    uint32_t start_cluster;
+    uint32_t length; // in clusters
+} fat32_run;
+
+/*
+ * contiguous runs of a cluster chain, followed through the FAT. The walk ends at the end of the chain, at an entry
+ * outside the data area, or after as many clusters as the volume holds when the chain loops.
+ */
+typedef struct fat32_chain_t
+{
+    fat32_volume *volume;
+    uint32_t cluster;   // next cluster to return, 0 at the end
+    uint32_t remaining; // clusters that may still be returned
+    int failed;         // the FAT could not be read
+} fat32_chain;
+
+typedef struct fat32_dirent_t
+{
+    char name[SHORT_NAME_MAX]; // lowercase "name.ext"
+    directory_table_entry entry;
+    uint32_t first_cluster; // the root cluster for the ".." entries pointing to the root directory
+    int directory;
+} fat32_dirent;
+
+/*
+ * entries of a directory, read one cluster at a time
+ */
+typedef struct fat32_directory_t
+{
+    fat32_chain chain;
+    fat32_run run;   // clusters of the current run not read yet
+    uint8_t *buffer; // the cluster being listed
+    uint32_t index;  // next entry of buffer
+    uint32_t count;  // entries in buffer
+    int done;
+    fat32_error error;
+} fat32_directory;
+
+void fat32_default_options(fat32_options *options);
+
+/*
+ * open partition partition_number of an image (primary, logical or GPT, numbered as the partition listing shows)
+ * and load its FAT. Failures are only reported through the returned error, except for the system error of an image
+ * that cannot be opened, the format errors of compressed images and the warnings about damaged partition tables,
+ * which the image and partition table readers shared with the tool print on stderr.
+ */
+fat32_error fat32_open(const char *image_path, int partition_number, const fat32_options *options, fat32_volume **volume);
+
+void fat32_close(fat32_volume *volume);
+
+const char *fat32_strerror(fat32_error error);
+
+const fat32_geometry *fat32_volume_geometry(const fat32_volume *volume);
+
+/*
+ * image offset of a data cluster
+ */
+uint64_t fat32_cluster_offset(const fat32_volume *volume, uint32_t cluster);
+
+const boot_sector *fat32_volume_boot_sector(const fat32_volume *volume);
+const partition_entry *fat32_volume_partition(const fat32_volume *volume);
+
+void fat32_chain_begin(fat32_volume *volume, uint32_t first_cluster, fat32_chain *chain);
+
+/*
+ * next run of the chain, return 0 once the chain is over, with failed set if the FAT could not be read
+ */
+int fat32_chain_next(fat32_chain *chain, fat32_run *run);
+
+fat32_error fat32_directory_open(fat32_volume *volume, uint32_t cluster, fat32_directory *directory);
+
+/*
+ * next visible entry ("." and ".." included, deleted entries, long name parts and volume labels skipped). Return 0
+ * at the end of the directory or on a read error, which is then left in directory->error.
+ */
+int fat32_directory_next(fat32_directory *directory, fat32_dirent *dirent);
+
+void fat32_directory_close(fat32_directory *directory);
+
+/*
+ * resolve an absolute path, compared in lowercase like the tree shows names ("/" is the root directory)
+ */
+fat32_error fat32_lookup(fat32_volume *volume, const char *path, fat32_dirent *dirent);
+
+/*
+ * read up to size bytes of a file from offset, set *done to the number of bytes read (0 past the end of the file)
+ */
+fat32_error fat32_read(fat32_volume *volume, const fat32_dirent *file, uint64_t offset, void *buffer, size_t size, size_t *done);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef FAT32_INTERNAL_H
+#define FAT32_INTERNAL_H
+
+/*
+ * parts of an open volume, for the analyses of the tool built directly on them. Not part of the library interface.
+ */
+
+#include "fat32.h"
+#include "block_device.h"
+#include "fat_cache.h"
+#include "geometry.h"
+
+block_device *fat32_volume_device(fat32_volume *volume);
+fat_table *fat32_volume_fat(fat32_volume *volume);
+const volume_geometry *fat32_volume_layout(const fat32_volume *volume);
+
+#endif
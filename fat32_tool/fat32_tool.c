@@ -4,81 +4,551 @@
  */
 
 #include "utils.h"
+#include "fat32_internal.h"
 #include "master_boot_record.h"
+#include "disk_layout.h"
+#include "all_partitions.h"
 #include "partition.h"
 #include "file.h"
+#include "fat_cache.h"
+#include "extract.h"
+#include "dir_index.h"
+#include "work_pool.h"
+#include "batch.h"
+#include "hash.h"
+#include "stats.h"
+#include "cluster_cache.h"
+#include "fat_analysis.h"
+#include "fat_check.h"
+#include "recover.h"
+#include "carve.h"
+#include "search.h"
+#include "locate.h"
+#include "export.h"
+#include "timeline.h"
+#include "diff.h"
 
-int main(int argc, char *argv[])
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+// long options without a short form
+enum
 {
-	// check if right number of arguments
-	if (argc < 2 || argc > 4)
+	OPTION_INDEX_FILE = 256,
+	OPTION_NO_INDEX,
+	OPTION_BATCH,
+	OPTION_HASH,
+	OPTION_HASH_PARTITION,
+	OPTION_STATS,
+	OPTION_CACHE_MEMORY,
+	OPTION_READAHEAD,
+	OPTION_ALL_PARTITIONS,
+	OPTION_FAT_REPORT,
+	OPTION_CHECK,
+	OPTION_DELETED,
+	OPTION_CARVE,
+	OPTION_RECOVER_TO,
+	OPTION_SEARCH,
+	OPTION_LOCATE,
+	OPTION_EXPORT,
+	OPTION_IO,
+	OPTION_TIMELINE,
+	OPTION_DIFF,
+};
+
+typedef struct tool_options_t
+{
+	size_t fat_memory;
+	block_device_backend backend;
+	int show_extents;
+	int raw;
+	const char *output_path;
+	int build_index;
+	int use_index;
+	const char *index_path;
+	int threads;
+	const char *batch_path;
+	int hash;
+	int hash_partition;
+	int stats;
+	size_t cache_memory;
+	uint32_t readahead;
+	int all_partitions;
+	int fat_report;
+	int check;
+	int deleted;
+	int carve;
+	const char *recover_dir;
+	const char *search_path;
+	const char *locate_path;
+	const char *export_dir;
+	block_device_queue queue;
+	int timeline;
+	timeline_format timeline_format;
+	const char *diff_path;
+} tool_options;
+
+static void print_usage(const char *program)
+{
+	fprintf(stderr, "Usage 1: %s [options] <disk_image.img>\n", program);
+	fprintf(stderr, "Usage 2: %s [options] <disk_image.img> <partition_number>\n", program);
+	fprintf(stderr, "Usage 3: %s [options] <disk_image.img> <partition_number> <absolute_path>\n", program);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -m, --fat-memory <MiB>  memory allowed for the FAT cache (default %d MiB)\n", FAT_DEFAULT_BUDGET / (1024 * 1024));
+	fprintf(stderr, "  -b, --backend <name>    image access: auto, mmap or pread (default auto)\n");
+	fprintf(stderr, "      --cache-memory <MiB> cluster cache of the pread backend (default %d MiB, 0 disables it)\n", CLUSTER_CACHE_DEFAULT_BUDGET / (1024 * 1024));
+	fprintf(stderr, "      --readahead <n>     clusters read ahead along a chain read sequentially (default %d)\n", CLUSTER_CACHE_DEFAULT_READAHEAD);
+	fprintf(stderr, "      --io <name>         reads kept in flight when not mapped: auto, io_uring, threads or sync (default auto)\n");
+	fprintf(stderr, "  -j, --threads <n>       threads used to read the directory tree, unless queued by --io (default: one per processor)\n");
+	fprintf(stderr, "  -e, --extents           with usage 3, list the contiguous extents of the file instead of its content\n");
+	fprintf(stderr, "  -r, --raw               with usage 3, write the binary content of the file instead of a hex dump\n");
+	fprintf(stderr, "  -o, --output <file>     with usage 3, write the binary content of the file to <file> (implies --raw)\n");
+	fprintf(stderr, "  -i, --build-index       with usage 2, write the directory index sidecar instead of printing the tree\n");
+	fprintf(stderr, "      --index-file <file> sidecar location (default <disk_image.img>.p<partition_number>.idx)\n");
+	fprintf(stderr, "      --no-index          with usage 3, --batch or --locate, ignore the sidecars and walk the tree\n");
+	fprintf(stderr, "      --hash              with usage 2, print the MD5, SHA-1 and SHA-256 of every file\n");
+	fprintf(stderr, "      --hash-partition    with --hash, also hash the whole partition range\n");
+	fprintf(stderr, "      --fat-report        with usage 2, print cluster allocation and file fragmentation statistics\n");
+	fprintf(stderr, "      --check             with usage 2, check FAT copies, chains and directory entries (exit status 1 on problems)\n");
+	fprintf(stderr, "      --deleted           with usage 2, list deleted entries and whether their contiguous clusters are still free\n");
+	fprintf(stderr, "      --carve             with usage 2, carve JPEG, PNG, GIF, PDF and ZIP files from the unallocated clusters\n");
+	fprintf(stderr, "      --recover-to <dir>  with --deleted or --carve, write the recoverable and carved files to <dir>\n");
+	fprintf(stderr, "      --search <file>     with usage 2, find every keyword of <file> (one per line, - for stdin) in the data region\n");
+	fprintf(stderr, "      --locate <file>     with usage 1, print the partition, cluster, file and file offset of every image offset of <file>\n");
+	fprintf(stderr, "      --export <dir>      with usage 2, copy every file and directory to <dir> in disk order (resumable)\n");
+	fprintf(stderr, "      --timeline <format> with usage 2, print the creation, modification and access times of every entry, deleted ones\n");
+	fprintf(stderr, "                          included: csv (one row per timestamp, sorted by time) or body (Sleuth Kit bodyfile)\n");
+	fprintf(stderr, "      --diff <image2>     with usage 2, list the files added, removed, modified and moved from the partition to the same one of <image2>\n");
+	fprintf(stderr, "      --stats             print I/O counters and phase timings as JSON on stderr\n");
+	fprintf(stderr, "      --all-partitions    with usage 1, analyze every FAT32 partition concurrently (tree, or manifest with --hash)\n");
+	fprintf(stderr, "      --batch <file>      with usage 2, extract every \"<absolute_path>[<tab><output_file>]\" line of <file> (- for stdin)\n");
+}
+
+/*
+ * join path tokens back into the normalized "/dir/file" form used as index key
+ */
+static void join_path(char **path_tokens, int num_tokens, char *path, size_t size)
+{
+	size_t length = 0;
+	path[0] = '\0';
+	for (int i = 0; i < num_tokens && length < size; i++)
+		length += snprintf(path + length, size - length, "/%s", path_tokens[i]);
+}
+
+/*
+ * look for a file, in the directory index sidecar when there is an up to date one, by walking the tree otherwise
+ */
+static int lookup_file(const tool_options *options, const char *image_path, fat32_volume *volume, char **path_tokens, int num_tokens, directory_table_entry *file)
+{
+	char path[DIR_INDEX_PATH_MAX];
+	join_path(path_tokens, num_tokens, path, sizeof(path));
+
+	dir_index index;
+	if (options->use_index && dir_index_open(options->index_path, image_path, fat32_volume_boot_sector(volume), fat32_volume_partition(volume), &index) == 0)
+	{
+		int found = dir_index_lookup(&index, path, file) && !(file->attributes & DIRECTORY_ATTRIBUTE);
+		dir_index_close(&index);
+		return found;
+	}
+
+	fat32_dirent dirent;
+	if (fat32_lookup(volume, path, &dirent) != FAT32_OK || dirent.directory)
+		return 0;
+	*file = dirent.entry;
+	return 1;
+}
+
+/*
+ * usage 2 with --batch: resolve and extract every path of the list
+ */
+static int batch_mode(const tool_options *options, const char *image_path, block_device *disk_image, fat_table *fat, const boot_sector *bs, const partition_entry *entry, const volume_geometry *geometry)
+{
+	FILE *input = strcmp(options->batch_path, "-") == 0 ? stdin : fopen(options->batch_path, "r");
+	if (!input)
+	{
+		perror("Error");
+		return 1;
+	}
+
+	dir_index index;
+	int indexed = options->use_index && dir_index_open(options->index_path, image_path, bs, entry, &index) == 0;
+	int status = run_batch(input, disk_image, fat, bs, geometry, indexed ? &index : NULL, options->raw);
+
+	if (indexed)
+		dir_index_close(&index);
+	if (input != stdin)
+		fclose(input);
+	return status;
+}
+
+/*
+ * usage 3: print, extract or locate a file
+ */
+static int file_mode(const tool_options *options, const char *image_path, fat32_volume *volume, char *path)
+{
+	block_device *disk_image = fat32_volume_device(volume);
+	fat_table *fat = fat32_volume_fat(volume);
+	const volume_geometry *geometry = fat32_volume_layout(volume);
+	int num_tokens;
+	char **path_tokens = tokenize_path(path, &num_tokens);
+	directory_table_entry file;
+	if (!path_tokens)
+		return 1;
+
+	int found = lookup_file(options, image_path, volume, path_tokens, num_tokens, &file);
+	free_path_tokens(path_tokens, num_tokens);
+
+	if (!found)
 	{
-		fprintf(stderr, "Usage 1: %s <disk_image.img>\n", argv[0]);
-		fprintf(stderr, "Usage 2: %s <disk_image.img> <partition_number>\n", argv[0]);
-		fprintf(stderr, "Usage 3: %s <disk_image.img> <partition_number> <absolute_path>\n", argv[0]);
+		fprintf(stderr, "Error: specified path does not exist.\n");
 		return 1;
 	}
 
-	// open the disk image
-	FILE *disk_image = fopen(argv[1], "rb");
-	if (!disk_image)
+	if (options->show_extents)
+	{
+		return print_file_extents(fat, geometry, &file);
+	}
+
+	if (!options->raw)
+	{
+		return print_file_content(disk_image, fat, geometry, &file);
+	}
+
+	int out_fd = options->output_path ? open(options->output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+	if (out_fd < 0)
 	{
 		perror("Error");
 		return 1;
 	}
 
-	// extract master boot record
-	master_boot_record mbr;
-	if (extract_mbr(disk_image, &mbr) == 1)
+	int status = extract_file(disk_image, fat, geometry, &file, out_fd);
+	if (options->output_path)
+		close(out_fd);
+	return status;
+}
+
+/*
+ * usage 2 with --diff: compare the partition with the same partition of the second image
+ */
+static int diff_mode(const tool_options *options, const fat32_options *volume_options, int partition_number, fat32_volume *volume)
+{
+	fat32_volume *other;
+	fat32_error error = fat32_open(options->diff_path, partition_number, volume_options, &other);
+	if (error != FAT32_OK)
 	{
-		fclose(disk_image);
+		// an image that cannot be opened has already been reported by block_device_open
+		if (error != FAT32_ERROR_OPEN)
+			fprintf(stderr, "Error: %s: %s\n", options->diff_path, fat32_strerror(error));
+		return 1;
+	}
+
+	int status = diff_volumes(volume, other, options->threads, stdout);
+	fat32_close(other);
+	return status;
+}
+
+/*
+ * --stats: the report goes to stderr once everything written to stdout is out
+ */
+static void print_stats(void)
+{
+	fflush(stdout);
+	stats_print_json(stderr);
+}
+
+int main(int argc, char *argv[])
+{
+	tool_options options = {FAT_DEFAULT_BUDGET, BLOCK_DEVICE_AUTO, 0, 0, NULL, 0, 1, NULL, work_pool_default_threads(), NULL, 0, 0, 0, CLUSTER_CACHE_DEFAULT_BUDGET, CLUSTER_CACHE_DEFAULT_READAHEAD, 0, 0, 0, 0, 0, NULL, NULL, NULL, NULL, BLOCK_DEVICE_QUEUE_AUTO, 0, TIMELINE_CSV, NULL};
+
+	static const struct option long_options[] = {
+		{"fat-memory", required_argument, NULL, 'm'},
+		{"backend", required_argument, NULL, 'b'},
+		{"threads", required_argument, NULL, 'j'},
+		{"extents", no_argument, NULL, 'e'},
+		{"raw", no_argument, NULL, 'r'},
+		{"output", required_argument, NULL, 'o'},
+		{"build-index", no_argument, NULL, 'i'},
+		{"index-file", required_argument, NULL, OPTION_INDEX_FILE},
+		{"no-index", no_argument, NULL, OPTION_NO_INDEX},
+		{"batch", required_argument, NULL, OPTION_BATCH},
+		{"hash", no_argument, NULL, OPTION_HASH},
+		{"hash-partition", no_argument, NULL, OPTION_HASH_PARTITION},
+		{"stats", no_argument, NULL, OPTION_STATS},
+		{"cache-memory", required_argument, NULL, OPTION_CACHE_MEMORY},
+		{"readahead", required_argument, NULL, OPTION_READAHEAD},
+		{"all-partitions", no_argument, NULL, OPTION_ALL_PARTITIONS},
+		{"fat-report", no_argument, NULL, OPTION_FAT_REPORT},
+		{"check", no_argument, NULL, OPTION_CHECK},
+		{"deleted", no_argument, NULL, OPTION_DELETED},
+		{"carve", no_argument, NULL, OPTION_CARVE},
+		{"recover-to", required_argument, NULL, OPTION_RECOVER_TO},
+		{"search", required_argument, NULL, OPTION_SEARCH},
+		{"locate", required_argument, NULL, OPTION_LOCATE},
+		{"export", required_argument, NULL, OPTION_EXPORT},
+		{"io", required_argument, NULL, OPTION_IO},
+		{"timeline", required_argument, NULL, OPTION_TIMELINE},
+		{"diff", required_argument, NULL, OPTION_DIFF},
+		{NULL, 0, NULL, 0}};
+
+	int option;
+	while ((option = getopt_long(argc, argv, "m:b:j:ero:i", long_options, NULL)) != -1)
+	{
+		switch (option)
+		{
+		case 'm':
+			options.fat_memory = (size_t)strtoul(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'b':
+			if (block_device_parse_backend(optarg, &options.backend) != 0)
+			{
+				fprintf(stderr, "Error: unknown backend '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'j':
+			options.threads = atoi(optarg);
+			break;
+		case 'e':
+			options.show_extents = 1;
+			break;
+		case 'r':
+			options.raw = 1;
+			break;
+		case 'o':
+			options.raw = 1;
+			options.output_path = optarg;
+			break;
+		case 'i':
+			options.build_index = 1;
+			break;
+		case OPTION_INDEX_FILE:
+			options.index_path = optarg;
+			break;
+		case OPTION_NO_INDEX:
+			options.use_index = 0;
+			break;
+		case OPTION_BATCH:
+			options.batch_path = optarg;
+			break;
+		case OPTION_HASH:
+			options.hash = 1;
+			break;
+		case OPTION_HASH_PARTITION:
+			options.hash = 1;
+			options.hash_partition = 1;
+			break;
+		case OPTION_STATS:
+			options.stats = 1;
+			break;
+		case OPTION_CACHE_MEMORY:
+			options.cache_memory = (size_t)strtoul(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case OPTION_READAHEAD:
+			options.readahead = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case OPTION_ALL_PARTITIONS:
+			options.all_partitions = 1;
+			break;
+		case OPTION_FAT_REPORT:
+			options.fat_report = 1;
+			break;
+		case OPTION_CHECK:
+			options.check = 1;
+			break;
+		case OPTION_DELETED:
+			options.deleted = 1;
+			break;
+		case OPTION_CARVE:
+			options.carve = 1;
+			break;
+		case OPTION_RECOVER_TO:
+			options.recover_dir = optarg;
+			break;
+		case OPTION_SEARCH:
+			options.search_path = optarg;
+			break;
+		case OPTION_LOCATE:
+			options.locate_path = optarg;
+			break;
+		case OPTION_EXPORT:
+			options.export_dir = optarg;
+			break;
+		case OPTION_IO:
+			if (block_device_parse_queue(optarg, &options.queue) != 0)
+			{
+				fprintf(stderr, "Error: unknown I/O queue '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case OPTION_TIMELINE:
+			if (timeline_parse_format(optarg, &options.timeline_format) != 0)
+			{
+				fprintf(stderr, "Error: unknown timeline format '%s'\n", optarg);
+				return 1;
+			}
+			options.timeline = 1;
+			break;
+		case OPTION_DIFF:
+			options.diff_path = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	// only the positional arguments are left
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	// check if right number of arguments
+	if (argc < 2 || argc > 4)
+	{
+		print_usage(argv[0]);
 		return 1;
 	}
 
 	// PART 1
 	if (argc == 2)
 	{
-		print_partitions(&mbr);
-		fclose(disk_image);
-		return 0;
+		// open the disk image
+		block_device disk_image;
+		if (block_device_open(argv[1], options.backend, &disk_image) == 1)
+			return 1;
+		disk_image.queue = options.queue;
+
+		// extract master boot record
+		master_boot_record mbr;
+		stats_phase_begin(STAT_PHASE_MBR);
+		int mbr_status = extract_mbr(&disk_image, &mbr);
+		stats_phase_end(STAT_PHASE_MBR);
+		if (mbr_status == 1)
+		{
+			fprintf(stderr, "Error: no valid Master Boot Record\n");
+			block_device_close(&disk_image);
+			return 1;
+		}
+
+		// primary, logical and GPT partitions
+		disk_layout layout;
+		stats_phase_begin(STAT_PHASE_MBR);
+		int layout_status = disk_layout_scan(&disk_image, &mbr, &layout);
+		stats_phase_end(STAT_PHASE_MBR);
+		if (layout_status == 1)
+		{
+			block_device_close(&disk_image);
+			return 1;
+		}
+
+		int status = 0;
+		if (options.locate_path)
+		{
+			stats_phase_begin(STAT_PHASE_EXTRACTION);
+			status = locate_offsets(&disk_image, argv[1], &layout, options.fat_memory, options.threads, options.use_index, options.locate_path, stdout);
+			stats_phase_end(STAT_PHASE_EXTRACTION);
+		}
+		else if (options.all_partitions)
+		{
+			stat_phase phase = options.hash ? STAT_PHASE_EXTRACTION : STAT_PHASE_TREE_WALK;
+			stats_phase_begin(phase);
+			status = analyze_all_partitions(&disk_image, &layout, options.fat_memory, options.threads, options.hash, options.hash_partition, stdout);
+			stats_phase_end(phase);
+		}
+		else
+			disk_layout_print(&layout);
+		disk_layout_free(&layout);
+		block_device_close(&disk_image);
+		if (options.stats)
+			print_stats();
+		return status;
 	}
 
 	// PART 2 & 3
-	// extract boot sector from partition
-	boot_sector bs;
-	int partition_number = atoi(argv[2]) - 1;
-	if (extract_bs(disk_image, &mbr.partition_table[partition_number], &bs) == 1)
+	// open the partition through the library: boot sector, FAT and cluster cache
+	char *number_end;
+	long partition_number = strtol(argv[2], &number_end, 10);
+	if (*number_end != '\0' || partition_number <= 0 || partition_number > INT32_MAX)
 	{
-		fclose(disk_image);
+		fprintf(stderr, "Error: partition %s does not exist\n", argv[2]);
 		return 1;
 	}
 
+	fat32_options volume_options = {options.backend, options.fat_memory, options.cache_memory, options.readahead, options.queue};
+	fat32_volume *volume;
+	fat32_error error = fat32_open(argv[1], (int)partition_number, &volume_options, &volume);
+	if (error != FAT32_OK)
+	{
+		// an image that cannot be opened has already been reported by block_device_open
+		if (error == FAT32_ERROR_NO_PARTITION)
+			fprintf(stderr, "Error: partition %s does not exist\n", argv[2]);
+		else if (error == FAT32_ERROR_UNADDRESSABLE)
+			fprintf(stderr, "Error: partition %s lies beyond the 2 TiB addressable with 32-bit sectors\n", argv[2]);
+		else if (error != FAT32_ERROR_OPEN)
+			fprintf(stderr, "Error: %s\n", fat32_strerror(error));
+		return 1;
+	}
+	block_device *device = fat32_volume_device(volume);
+	fat_table *fat = fat32_volume_fat(volume);
+	const boot_sector *bs = fat32_volume_boot_sector(volume);
+	const partition_entry *entry = fat32_volume_partition(volume);
+	const volume_geometry *geometry = fat32_volume_layout(volume);
+
+	char default_index_path[DIR_INDEX_PATH_MAX];
+	if (!options.index_path)
+	{
+		dir_index_path(argv[1], (int)partition_number, default_index_path, sizeof(default_index_path));
+		options.index_path = default_index_path;
+	}
+
+	int status = 0;
+	stat_phase phase = argc == 3 && !options.hash && !options.batch_path && !options.export_dir ? STAT_PHASE_TREE_WALK : STAT_PHASE_EXTRACTION;
+	stats_phase_begin(phase);
+
 	// PART 2
-	if (argc == 3)
+	if (argc == 3 && options.build_index)
+	{
+		status = dir_index_build(device, fat, bs, entry, geometry, argv[1], options.index_path, options.threads);
+		if (status == 0)
+			printf("Directory index written to %s\n", options.index_path);
+	}
+	else if (argc == 3 && options.hash)
+		status = hash_volume(device, fat, bs, geometry, options.threads, options.hash_partition, stdout);
+	else if (argc == 3 && options.check)
+		status = check_volume(device, fat, bs, geometry, options.threads, stdout);
+	else if (argc == 3 && options.fat_report)
+		status = print_fat_report(device, fat, bs, geometry, options.threads, stdout);
+	else if (argc == 3 && options.export_dir)
+		status = export_volume(device, fat, bs, entry, geometry, argv[1], options.threads, options.export_dir, stdout);
+	else if (argc == 3 && options.diff_path)
+		status = diff_mode(&options, &volume_options, (int)partition_number, volume);
+	else if (argc == 3 && options.timeline)
+		status = timeline_volume(device, fat, bs, geometry, options.threads, options.timeline_format, stdout);
+	else if (argc == 3 && options.search_path)
+		status = search_volume(device, fat, bs, geometry, options.threads, options.search_path, stdout);
+	else if (argc == 3 && (options.deleted || options.carve))
+	{
+		if (options.deleted)
+			status = recover_deleted(device, fat, bs, geometry, options.threads, options.recover_dir, stdout);
+		if (options.carve)
+			status |= carve_free_space(device, fat, bs, geometry, options.threads, options.recover_dir, stdout);
+	}
+	else if (argc == 3 && options.batch_path)
+		status = batch_mode(&options, argv[1], device, fat, bs, entry, geometry);
+	else if (argc == 3)
 	{
-		print_bootsector(&bs);
+		print_bootsector(bs, stdout);
 		printf("\nfile / directory tree:\n");
-		print_tree(disk_image, bs.root_cluster, &bs, &mbr.partition_table[partition_number], 0);
-		fclose(disk_image);
-		return 0;
+		status = print_tree(device, fat, bs->root_cluster, geometry, options.threads, stdout);
 	}
 
 	// PART 3
 	if (argc == 4)
-	{
-		int num_tokens;
-		char** path_tokens = tokenize_path(argv[3], &num_tokens);
-		int found = 0;
-			
-		print_file_content(disk_image, bs.root_cluster, &bs, &mbr.partition_table[partition_number], 0, path_tokens, num_tokens, 0, &found);
-		if (!found)
-		{
-			fprintf(stderr, "Error: specified path does not exist.\n");
-			fclose(disk_image);
-			return 1;
-		}
-	}
+		status = file_mode(&options, argv[1], volume, argv[3]);
+	stats_phase_end(phase);
 
-	fclose(disk_image);
-	return 0;
-}
\ No newline at end of file
+	fat32_close(volume);
+	if (options.stats)
+		print_stats();
+	return status;
+}
@@ -0,0 +1,398 @@
+#include "fat_analysis.h"
+#include "walker.h"
+#include "geometry.h"
+
+static int add_jump(fat_bitmap *bitmap, uint32_t from, uint32_t to)
+{
+    if (bitmap->jump_count == bitmap->jump_capacity)
+    {
+        uint32_t capacity = bitmap->jump_capacity ? bitmap->jump_capacity * 2 : 1024;
+        uint32_t *jump_from = realloc(bitmap->jump_from, capacity * sizeof(uint32_t));
+        if (!jump_from)
+            return 1;
+        bitmap->jump_from = jump_from;
+        uint32_t *jump_to = realloc(bitmap->jump_to, capacity * sizeof(uint32_t));
+        if (!jump_to)
+            return 1;
+        bitmap->jump_to = jump_to;
+        bitmap->jump_capacity = capacity;
+    }
+    bitmap->jump_from[bitmap->jump_count] = from;
+    bitmap->jump_to[bitmap->jump_count] = to;
+    bitmap->jump_count++;
+    return 0;
+}
+
+/*
+ * classify the entries of the count (at most 64) clusters starting at first, a multiple of 64. Blocks that are
+ * entirely free or entirely one contiguous run are recognised with two OR reductions the compiler vectorizes, the
+ * others are classified entry by entry.
+ */
+static int classify_block(fat_bitmap *bitmap, const uint32_t *entries, uint32_t first, uint32_t count)
+{
+    uint32_t any = 0, chained = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t value = entries[i] & FAT_ENTRY_MASK;
+        any |= value;
+        chained |= value ^ (first + i + 1);
+    }
+
+    uint32_t word = first / FAT_BITMAP_WORD_BITS;
+    if (count == FAT_BITMAP_WORD_BITS && first > 0 && any == 0)
+    {
+        bitmap->run_end[word] = ~0ULL;
+        bitmap->free_count += FAT_BITMAP_WORD_BITS;
+        return 0;
+    }
+    if (count == FAT_BITMAP_WORD_BITS && first > 0 && chained == 0 && first + FAT_BITMAP_WORD_BITS < bitmap->end)
+    {
+        bitmap->used[word] = ~0ULL;
+        bitmap->used_count += FAT_BITMAP_WORD_BITS;
+        return 0;
+    }
+
+    uint64_t used = 0, run_end = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t cluster = first + i, value = entries[i] & FAT_ENTRY_MASK;
+        uint64_t bit = 1ULL << i;
+        if (cluster < 2) // reserved entries
+        {
+            used |= bit;
+            run_end |= bit;
+            continue;
+        }
+        if (value == 0)
+        {
+            run_end |= bit;
+            bitmap->free_count++;
+            continue;
+        }
+
+        used |= bit;
+        bitmap->used_count++;
+        if (value == cluster + 1 && value < bitmap->end)
+            continue;
+
+        run_end |= bit;
+        if (value == BAD_CLUSTER)
+            bitmap->bad_count++;
+        else if (value >= END_OF_CLUSTER_CHAIN)
+            bitmap->end_of_chain_count++;
+        else if (value >= 2 && value < bitmap->end)
+        {
+            if (add_jump(bitmap, cluster, value) != 0)
+                return 1;
+        }
+        else
+            bitmap->invalid_count++;
+    }
+    bitmap->used[word] = used;
+    bitmap->run_end[word] = run_end;
+    return 0;
+}
+
+static int classify_entries(fat_bitmap *bitmap, const uint32_t *entries, uint32_t first, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i += FAT_BITMAP_WORD_BITS)
+    {
+        uint32_t block = count - i < FAT_BITMAP_WORD_BITS ? count - i : FAT_BITMAP_WORD_BITS;
+        if (classify_block(bitmap, entries + i, first + i, block) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * count the runs of free clusters and find the largest one, a whole word at a time when it is all free or all used
+ */
+static void scan_free_runs(fat_bitmap *bitmap, uint32_t words)
+{
+    uint32_t run = 0, run_start = 0;
+    for (uint32_t w = 0; w <= words; w++)
+    {
+        uint64_t bits = w < words ? bitmap->used[w] : ~0ULL; // a used sentinel closes the last run
+        for (uint32_t b = 0; b < FAT_BITMAP_WORD_BITS; b++)
+        {
+            if (bits == 0)
+            {
+                if (run == 0)
+                    run_start = w * FAT_BITMAP_WORD_BITS;
+                run += FAT_BITMAP_WORD_BITS;
+                break;
+            }
+            if (!(bits & (1ULL << b)))
+            {
+                if (run == 0)
+                    run_start = w * FAT_BITMAP_WORD_BITS + b;
+                run++;
+                continue;
+            }
+            if (run > 0)
+            {
+                bitmap->free_runs++;
+                if (run > bitmap->largest_free_run)
+                {
+                    bitmap->largest_free_run = run;
+                    bitmap->largest_free_start = run_start;
+                }
+                run = 0;
+            }
+            if (bits == ~0ULL)
+                break;
+        }
+    }
+}
+
+int fat_bitmap_build(fat_table *fat, const boot_sector *bs, fat_bitmap *bitmap)
+{
+    memset(bitmap, 0, sizeof(*bitmap));
+
+    // the FAT may have more entries than the volume has clusters, the extra ones are ignored
+    uint64_t metadata_sectors = bs->reserved_sectors_count + (uint64_t)bs->num_fats * bs->fat_size_32;
+    uint64_t data_clusters = bs->total_sectors_32 > metadata_sectors && bs->sectors_per_cluster ? (bs->total_sectors_32 - metadata_sectors) / bs->sectors_per_cluster : 0;
+    bitmap->end = data_clusters + 2 < fat->entry_count ? (uint32_t)(data_clusters + 2) : fat->entry_count;
+    if (bitmap->end <= 2)
+    {
+        fprintf(stderr, "Error: the volume has no data cluster\n");
+        return 1;
+    }
+
+    uint32_t words = (bitmap->end + FAT_BITMAP_WORD_BITS - 1) / FAT_BITMAP_WORD_BITS;
+    bitmap->used = calloc(words, sizeof(uint64_t));
+    bitmap->run_end = calloc(words, sizeof(uint64_t));
+    if (!bitmap->used || !bitmap->run_end)
+    {
+        perror("Error");
+        fat_bitmap_free(bitmap);
+        return 1;
+    }
+
+    int status = 0;
+    if (fat->entries)
+        status = classify_entries(bitmap, fat->entries, 0, bitmap->end);
+    else
+    {
+        // paged FAT: stream the table once in large sequential reads (zero-copy when the image is mapped)
+        uint32_t chunk_entries = FAT_READ_CHUNK / sizeof(uint32_t);
+        uint32_t *scratch = malloc(FAT_READ_CHUNK);
+        status = scratch == NULL;
+        for (uint32_t first = 0; status == 0 && first < bitmap->end; first += chunk_entries)
+        {
+            uint32_t count = bitmap->end - first < chunk_entries ? bitmap->end - first : chunk_entries;
+            const uint32_t *entries = block_device_get(fat->dev, fat->fat_start + (uint64_t)first * sizeof(uint32_t), (size_t)count * sizeof(uint32_t), scratch);
+            status = entries == NULL || classify_entries(bitmap, entries, first, count) != 0;
+        }
+        free(scratch);
+    }
+    if (status != 0)
+    {
+        fprintf(stderr, "Error: cannot read the FAT\n");
+        fat_bitmap_free(bitmap);
+        return 1;
+    }
+
+    // the bits past the last cluster are neither free nor part of a run
+    for (uint32_t cluster = bitmap->end; cluster < words * FAT_BITMAP_WORD_BITS; cluster++)
+    {
+        bitmap->used[cluster / FAT_BITMAP_WORD_BITS] |= 1ULL << (cluster % FAT_BITMAP_WORD_BITS);
+        bitmap->run_end[cluster / FAT_BITMAP_WORD_BITS] |= 1ULL << (cluster % FAT_BITMAP_WORD_BITS);
+    }
+    scan_free_runs(bitmap, words);
+    return 0;
+}
+
+uint32_t fat_bitmap_run_last(const fat_bitmap *bitmap, uint32_t cluster)
+{
+    uint32_t word = cluster / FAT_BITMAP_WORD_BITS;
+    uint64_t bits = bitmap->run_end[word] & (~0ULL << (cluster % FAT_BITMAP_WORD_BITS));
+    while (bits == 0)
+        bits = bitmap->run_end[++word];
+    return word * FAT_BITMAP_WORD_BITS + (uint32_t)__builtin_ctzll(bits);
+}
+
+uint32_t fat_bitmap_jump(const fat_bitmap *bitmap, uint32_t cluster)
+{
+    uint32_t low = 0, high = bitmap->jump_count;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (bitmap->jump_from[middle] < cluster)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < bitmap->jump_count && bitmap->jump_from[low] == cluster ? bitmap->jump_to[low] : 0;
+}
+
+uint32_t fat_bitmap_fragments(const fat_bitmap *bitmap, uint32_t first_cluster, uint32_t *clusters)
+{
+    uint32_t fragments = 0;
+    uint64_t length = 0;
+    uint32_t cluster = first_cluster;
+    while (cluster >= 2 && cluster < bitmap->end && length < bitmap->end)
+    {
+        uint32_t last = fat_bitmap_run_last(bitmap, cluster);
+        fragments++;
+        length += last - cluster + 1;
+        cluster = fat_bitmap_jump(bitmap, last);
+    }
+
+    if (clusters)
+        *clusters = length < bitmap->end ? (uint32_t)length : bitmap->end;
+    return fragments;
+}
+
+void fat_bitmap_free(fat_bitmap *bitmap)
+{
+    free(bitmap->used);
+    free(bitmap->run_end);
+    free(bitmap->jump_from);
+    free(bitmap->jump_to);
+    memset(bitmap, 0, sizeof(*bitmap));
+}
+
+typedef struct fragmented_file_t
+{
+    uint32_t fragments;
+    char *path;
+} fragmented_file;
+
+typedef struct report_context_t
+{
+    const fat_bitmap *bitmap;
+    uint64_t files;
+    uint64_t fragmented_files;
+    uint64_t file_fragments;
+    uint64_t directories;
+    uint64_t fragmented_directories;
+    uint64_t histogram[FRAGMENT_HISTOGRAM_BUCKETS];
+    fragmented_file top[FAT_REPORT_TOP_FILES]; // most fragmented first
+    uint32_t top_count;
+} report_context;
+
+/*
+ * keep the path if the file is among the most fragmented ones seen so far
+ */
+static void rank_file(report_context *report, const char *path, uint32_t fragments)
+{
+    if (report->top_count == FAT_REPORT_TOP_FILES && fragments <= report->top[FAT_REPORT_TOP_FILES - 1].fragments)
+        return;
+    char *copy = strdup(path);
+    if (!copy)
+        return;
+
+    if (report->top_count == FAT_REPORT_TOP_FILES)
+        free(report->top[--report->top_count].path);
+    uint32_t i = report->top_count++;
+    while (i > 0 && report->top[i - 1].fragments < fragments)
+    {
+        report->top[i] = report->top[i - 1];
+        i--;
+    }
+    report->top[i].fragments = fragments;
+    report->top[i].path = copy;
+}
+
+static int report_entry(const walk_entry *entry, const char *path, int depth, void *context)
+{
+    (void)depth;
+    report_context *report = context;
+    if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0)
+        return 0;
+
+    uint32_t first_cluster = entry_first_cluster(&entry->entry);
+    if (first_cluster == 0)
+        return 0;
+    uint32_t fragments = fat_bitmap_fragments(report->bitmap, first_cluster, NULL);
+
+    if (entry->entry.attributes & DIRECTORY_ATTRIBUTE)
+    {
+        report->directories++;
+        report->fragmented_directories += fragments > 1;
+        return 0;
+    }
+
+    int bucket = 0;
+    while (bucket < FRAGMENT_HISTOGRAM_BUCKETS - 1 && (1u << bucket) < fragments)
+        bucket++;
+    report->histogram[bucket]++;
+    report->files++;
+    report->file_fragments += fragments;
+    if (fragments > 1)
+    {
+        report->fragmented_files++;
+        rank_file(report, path, fragments);
+    }
+    return 0;
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+int print_fat_report(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, FILE *out)
+{
+    fat_bitmap bitmap;
+    if (fat_bitmap_build(fat, bs, &bitmap) != 0)
+        return 1;
+
+    walk_tree tree;
+    if (walk_tree_build(dev, fat, geometry, bs->root_cluster, thread_count, &tree) != 0)
+    {
+        fat_bitmap_free(&bitmap);
+        return 1;
+    }
+
+    report_context report;
+    memset(&report, 0, sizeof(report));
+    report.bitmap = &bitmap;
+    walk_tree_visit(&tree, report_entry, &report);
+    walk_tree_free(&tree);
+
+    // the root directory has no entry of its own
+    report.directories++;
+    report.fragmented_directories += fat_bitmap_fragments(&bitmap, bs->root_cluster, NULL) > 1;
+
+    uint32_t cluster_size = geometry->cluster_size;
+    uint64_t data_clusters = bitmap.end - 2;
+    fprintf(out, "Cluster size:       %u bytes\n", cluster_size);
+    fprintf(out, "Data clusters:      %lu\n", (unsigned long)data_clusters);
+    fprintf(out, "Used clusters:      %lu (%.2f%%)\n", (unsigned long)bitmap.used_count, percent(bitmap.used_count, data_clusters));
+    fprintf(out, "Free clusters:      %lu (%lu bytes)\n", (unsigned long)bitmap.free_count, (unsigned long)(bitmap.free_count * cluster_size));
+    fprintf(out, "Bad clusters:       %lu\n", (unsigned long)bitmap.bad_count);
+    fprintf(out, "Chains:             %lu\n", (unsigned long)bitmap.end_of_chain_count);
+    fprintf(out, "Invalid entries:    %lu\n", (unsigned long)bitmap.invalid_count);
+    fprintf(out, "Free runs:          %lu\n", (unsigned long)bitmap.free_runs);
+    if (bitmap.largest_free_run > 0)
+        fprintf(out, "Largest free run:   %u clusters at cluster %u\n", bitmap.largest_free_run, bitmap.largest_free_start);
+    fprintf(out, "Directories:        %lu (%lu fragmented)\n", (unsigned long)report.directories, (unsigned long)report.fragmented_directories);
+    fprintf(out, "Files:              %lu (%lu fragmented, %.2f%%)\n", (unsigned long)report.files, (unsigned long)report.fragmented_files, percent(report.fragmented_files, report.files));
+    fprintf(out, "Fragments:          %lu (%.2f per file)\n", (unsigned long)report.file_fragments, report.files ? (double)report.file_fragments / report.files : 0.0);
+
+    fprintf(out, "\nfragments per file:\n");
+    for (int i = 0; i < FRAGMENT_HISTOGRAM_BUCKETS; i++)
+    {
+        char label[32];
+        if (i < 2)
+            snprintf(label, sizeof(label), "%u", i + 1);
+        else if (i < FRAGMENT_HISTOGRAM_BUCKETS - 1)
+            snprintf(label, sizeof(label), "%u-%u", (1u << (i - 1)) + 1, 1u << i);
+        else
+            snprintf(label, sizeof(label), ">%u", 1u << (i - 1));
+        fprintf(out, "  %-10s %lu\n", label, (unsigned long)report.histogram[i]);
+    }
+
+    if (report.top_count > 0)
+        fprintf(out, "\nmost fragmented files:\n");
+    for (uint32_t i = 0; i < report.top_count; i++)
+    {
+        fprintf(out, "  %-10u %s\n", report.top[i].fragments, report.top[i].path);
+        free(report.top[i].path);
+    }
+
+    fat_bitmap_free(&bitmap);
+    return 0;
+}
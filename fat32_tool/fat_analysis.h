@@ -0,0 +1,70 @@
+#ifndef FAT_ANALYSIS_H
+#define FAT_ANALYSIS_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+
+#define FAT_ENTRY_MASK 0x0FFFFFFF   // the upper 4 bits of a FAT32 entry are reserved
+#define FRAGMENT_HISTOGRAM_BUCKETS 12 // 1, 2, 3-4, 5-8, ... fragments, the last bucket holding the rest
+#define FAT_REPORT_TOP_FILES 10      // most fragmented files listed by the report
+#define FAT_BITMAP_WORD_BITS 64      // clusters per bitmap word, bit i of word w is cluster w * 64 + i
+
+/*
+ * state of every data cluster, built in one sequential pass over the FAT. Chains are kept as runs: a cluster whose
+ * entry points to the next cluster continues its run, any other cluster ends one, and the entries pointing
+ * elsewhere (the jumps between fragments) are kept sorted by cluster. A chain can then be followed run by run
+ * with bit scans, without looking at the FAT again.
+ */
+typedef struct fat_bitmap_t
+{
+    uint32_t end;      // one past the last data cluster, clusters are [2, end)
+    uint64_t *used;    // bit set for allocated clusters, bad ones included
+    uint64_t *run_end; // bit set for clusters whose entry does not point to the next cluster
+    uint32_t *jump_from; // clusters pointing to a cluster other than the next one, ascending
+    uint32_t *jump_to;
+    uint32_t jump_count;
+    uint32_t jump_capacity;
+    uint64_t used_count;
+    uint64_t free_count;
+    uint64_t bad_count;
+    uint64_t end_of_chain_count;
+    uint64_t invalid_count; // entries pointing outside the data area or holding a reserved value
+    uint64_t free_runs;
+    uint32_t largest_free_run;
+    uint32_t largest_free_start;
+} fat_bitmap;
+
+/*
+ * classify every entry of the active FAT, from memory if the whole table is loaded, otherwise by streaming it from
+ * the image in FAT_READ_CHUNK pieces
+ */
+int fat_bitmap_build(fat_table *fat, const boot_sector *bs, fat_bitmap *bitmap);
+
+/*
+ * last cluster of the run containing cluster. The last data cluster always ends a run, so the scan stops there.
+ */
+uint32_t fat_bitmap_run_last(const fat_bitmap *bitmap, uint32_t cluster);
+
+/*
+ * cluster a run end points to when it is not the next one, 0 if the chain ends there (end of chain, bad, free or
+ * invalid entry)
+ */
+uint32_t fat_bitmap_jump(const fat_bitmap *bitmap, uint32_t cluster);
+
+/*
+ * number of fragments (runs of contiguous clusters) of the chain starting at first_cluster, and its length in
+ * clusters if clusters is not NULL. The walk ends after as many clusters as the volume holds.
+ */
+uint32_t fat_bitmap_fragments(const fat_bitmap *bitmap, uint32_t first_cluster, uint32_t *clusters);
+
+void fat_bitmap_free(fat_bitmap *bitmap);
+
+/*
+ * print the allocation report of the volume: cluster states, free space runs, and the fragment count histogram of
+ * the files found by one walk of the directory tree (on thread_count threads)
+ */
+int print_fat_report(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, FILE *out);
+
+#endif
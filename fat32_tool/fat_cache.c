@@ -0,0 +1,167 @@
+#include "fat_cache.h"
+#include "stats.h"
+#include "geometry.h"
+
+/*
+ * index of the FAT copy the driver keeps up to date: when mirroring is disabled (bit 7 of ext_flags),
+ * bits 0-3 give the only active FAT, otherwise every copy is identical and the first one is used.
+ */
+static uint32_t active_fat(const boot_sector *bs)
+{
+    if ((bs->ext_flags & 0x80) && (uint32_t)(bs->ext_flags & 0x0F) < bs->num_fats)
+        return bs->ext_flags & 0x0F;
+    return 0;
+}
+
+/*
+ * read count FAT entries starting at entry first into a buffer, in chunks of FAT_READ_CHUNK bytes
+ */
+static int read_entries(fat_table *fat, uint32_t first, uint32_t count, uint32_t *buffer)
+{
+    uint64_t offset = fat->fat_start + (uint64_t)first * sizeof(uint32_t);
+    size_t remaining = (size_t)count * sizeof(uint32_t);
+    uint8_t *out = (uint8_t *)buffer;
+
+    while (remaining > 0)
+    {
+        size_t chunk = remaining < FAT_READ_CHUNK ? remaining : FAT_READ_CHUNK;
+        if (block_device_read(fat->dev, offset, chunk, out) != 0)
+            return 1;
+        out += chunk;
+        offset += chunk;
+        remaining -= chunk;
+    }
+    return 0;
+}
+
+/*
+ * make a FAT page resident and return its slot, evicting the first unreferenced page found by the clock hand
+ */
+static fat_page *load_page(fat_table *fat, uint32_t page_index)
+{
+    uint32_t slot = fat->page_slot[page_index];
+    if (slot != 0)
+    {
+        stats_add(STAT_FAT_PAGE_HITS, 1);
+        fat->pages[slot - 1].referenced = 1;
+        return &fat->pages[slot - 1];
+    }
+
+    stats_add(STAT_FAT_PAGE_MISSES, 1);
+    fat_page *victim;
+    for (;;)
+    {
+        victim = &fat->pages[fat->clock_hand];
+        fat->clock_hand = (fat->clock_hand + 1) % fat->page_count;
+        if (!victim->used || !victim->referenced)
+            break;
+        victim->referenced = 0;
+    }
+
+    if (victim->used)
+        fat->page_slot[victim->index] = 0;
+
+    uint32_t first = page_index * FAT_PAGE_ENTRIES;
+    uint32_t count = fat->entry_count - first < FAT_PAGE_ENTRIES ? fat->entry_count - first : FAT_PAGE_ENTRIES;
+    if (read_entries(fat, first, count, victim->entries) != 0)
+    {
+        victim->used = 0;
+        return NULL;
+    }
+
+    victim->index = page_index;
+    victim->referenced = 1;
+    victim->used = 1;
+    fat->page_slot[page_index] = (uint32_t)(victim - fat->pages) + 1;
+    return victim;
+}
+
+int fat_table_load(block_device *dev, const boot_sector *bs, const volume_geometry *geometry, size_t memory_budget, fat_table *fat)
+{
+    memset(fat, 0, sizeof(*fat));
+    fat->dev = dev;
+    fat->entry_count = (uint32_t)(geometry->fat_size / sizeof(uint32_t));
+    fat->fat_start = geometry->fat_offset + active_fat(bs) * geometry->fat_size;
+
+    if (fat->entry_count == 0)
+        return 1;
+
+    // the data area ends with the partition or with the FAT, whichever comes first
+    uint64_t cluster_end = (geometry->partition_end - geometry->data_offset) / geometry->cluster_size + 2;
+    if (cluster_end > fat->entry_count)
+        cluster_end = fat->entry_count;
+    fat->cluster_end = cluster_end < BAD_CLUSTER ? (uint32_t)cluster_end : BAD_CLUSTER;
+
+    size_t table_size = (size_t)fat->entry_count * sizeof(uint32_t);
+    if (table_size <= memory_budget)
+    {
+        fat->entries = malloc(table_size);
+        if (fat->entries && read_entries(fat, 0, fat->entry_count, fat->entries) == 0)
+            return 0;
+        if (fat->entries)
+        {
+            fat_table_free(fat);
+            return 1;
+        }
+        // not enough memory after all: fall back to the paged mode below
+    }
+
+    uint32_t total_pages = (fat->entry_count + FAT_PAGE_ENTRIES - 1) / FAT_PAGE_ENTRIES;
+    fat->page_count = memory_budget / (FAT_PAGE_ENTRIES * sizeof(uint32_t));
+    if (fat->page_count == 0)
+        fat->page_count = 1;
+    if (fat->page_count > total_pages)
+        fat->page_count = total_pages;
+
+    pthread_mutex_init(&fat->lock, NULL);
+    fat->page_slot = calloc(total_pages, sizeof(uint32_t));
+    fat->pages = calloc(fat->page_count, sizeof(fat_page));
+    if (!fat->page_slot || !fat->pages)
+    {
+        fat_table_free(fat);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < fat->page_count; i++)
+    {
+        fat->pages[i].entries = malloc(FAT_PAGE_ENTRIES * sizeof(uint32_t));
+        if (!fat->pages[i].entries)
+        {
+            fat_table_free(fat);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint32_t fat_table_next(fat_table *fat, uint32_t cluster)
+{
+    // an out of range cluster number can only come from a corrupted chain, end it there
+    if (cluster >= fat->entry_count)
+        return END_OF_CLUSTER_CHAIN;
+
+    stats_add(STAT_FAT_LOOKUPS, 1);
+    if (fat->entries)
+        return fat->entries[cluster] & 0x0FFFFFFF;
+
+    pthread_mutex_lock(&fat->lock);
+    fat_page *page = load_page(fat, cluster / FAT_PAGE_ENTRIES);
+    // remove the upper 4 bits (reserved)
+    uint32_t next = page ? page->entries[cluster % FAT_PAGE_ENTRIES] & 0x0FFFFFFF : FAT_READ_ERROR;
+    pthread_mutex_unlock(&fat->lock);
+    return next;
+}
+
+void fat_table_free(fat_table *fat)
+{
+    free(fat->entries);
+    if (fat->pages)
+    {
+        for (uint32_t i = 0; i < fat->page_count; i++)
+            free(fat->pages[i].entries);
+        pthread_mutex_destroy(&fat->lock);
+    }
+    free(fat->pages);
+    free(fat->page_slot);
+    memset(fat, 0, sizeof(*fat));
+}
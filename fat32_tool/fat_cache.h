@@ -0,0 +1,59 @@
+#ifndef FAT_CACHE_H
+#define FAT_CACHE_H
+
+#include "utils.h"
+#include "master_boot_record.h"
+#include "partition.h"
+
+#include <pthread.h>
+
+#define FAT_PAGE_ENTRIES 16384                 // 64 KiB of FAT per page in paged mode
+#define FAT_READ_CHUNK (4 * 1024 * 1024)       // size of the sequential reads used to load the FAT
+#define FAT_DEFAULT_BUDGET (256 * 1024 * 1024) // default amount of memory the FAT cache may use
+#define FAT_READ_ERROR 0xFFFFFFFF              // next cluster when the FAT cannot be read, above every end of chain
+
+typedef struct fat_page_t
+{
+    uint32_t index; // index of the FAT page held in this slot
+    uint32_t *entries;
+    int referenced; // CLOCK reference bit
+    int used;
+} fat_page;
+
+struct fat_table_t
+{
+    block_device *dev;
+    uint64_t fat_start;   // byte offset of the active FAT in the image
+    uint32_t entry_count; // number of 32-bit entries in one FAT copy
+    uint32_t cluster_end; // first cluster number past the data area, the FAT and BAD_CLUSTER
+
+    // whole-table mode: every entry of the active FAT
+    uint32_t *entries;
+
+    // paged mode: fixed number of resident pages, replaced with CLOCK
+    fat_page *pages;
+    uint32_t page_count;
+    uint32_t clock_hand;
+    uint32_t *page_slot; // FAT page index -> slot + 1 (0 when not resident)
+    pthread_mutex_t lock; // serializes page replacement between walker threads
+};
+
+/*
+ * load the active FAT of a partition. The whole table is read in large sequential chunks if it fits in
+ * memory_budget bytes, otherwise the table is served from a bounded set of pages loaded on demand.
+ * Return 1 if the table cannot be allocated (errno is then ENOMEM) or read. Nothing is printed.
+ */
+int fat_table_load(block_device *dev, const boot_sector *bs, const volume_geometry *geometry, size_t memory_budget, fat_table *fat);
+
+/*
+ * return the FAT entry following a cluster, with the reserved upper 4 bits removed, or FAT_READ_ERROR if its page
+ * cannot be read. Safe to call from several threads.
+ */
+uint32_t fat_table_next(fat_table *fat, uint32_t cluster);
+
+/*
+ * release the memory held by the FAT cache
+ */
+void fat_table_free(fat_table *fat);
+
+#endif
@@ -0,0 +1,524 @@
+#include "fat_check.h"
+#include "fat_analysis.h"
+#include "walker.h"
+#include "geometry.h"
+
+typedef struct cross_link_t
+{
+    uint32_t cluster;
+    char *path;  // entry whose chain reached a cluster already claimed
+    char *owner; // first entry, in tree order, whose chain holds the cluster
+} cross_link;
+
+typedef struct check_context_t
+{
+    fat_table *fat;
+    const fat_bitmap *bitmap;
+    uint64_t *visited; // clusters claimed by a chain
+    uint32_t cluster_size;
+    FILE *out;
+    // runs of the chain being followed, to tell a cycle from a cross-link
+    uint32_t *runs;
+    uint32_t run_count;
+    uint32_t run_capacity;
+    cross_link *links;
+    uint32_t link_count;
+    uint32_t link_capacity;
+    uint64_t chains;
+    uint64_t cycles;
+    uint64_t entry_errors;
+} check_context;
+
+/*
+ * a range of entries where two FAT copies differ, reported when it closes
+ */
+typedef struct difference_range_t
+{
+    int open;
+    uint64_t start;
+    uint64_t count; // ranges reported so far
+} difference_range;
+
+static void close_range(difference_range *range, uint64_t end, int copy, int reference, FILE *out)
+{
+    if (!range->open)
+        return;
+    fprintf(out, "FAT %d differs from FAT %d: entries %lu-%lu (%lu entries)\n", copy + 1, reference + 1,
+            (unsigned long)range->start, (unsigned long)(end - 1), (unsigned long)(end - range->start));
+    range->open = 0;
+    range->count++;
+}
+
+/*
+ * locate the differing entries of a chunk, whole FAT_COMPARE_BLOCK blocks being skipped when they are equal
+ */
+static void compare_chunk(const uint8_t *a, const uint8_t *b, size_t size, uint64_t first_entry, difference_range *range, int copy, int reference, FILE *out)
+{
+    for (size_t block = 0; block < size; block += FAT_COMPARE_BLOCK)
+    {
+        size_t block_size = size - block < FAT_COMPARE_BLOCK ? size - block : FAT_COMPARE_BLOCK;
+        if (memcmp(a + block, b + block, block_size) == 0)
+        {
+            close_range(range, first_entry + block / sizeof(uint32_t), copy, reference, out);
+            continue;
+        }
+        for (size_t offset = block; offset < block + block_size; offset += sizeof(uint32_t))
+        {
+            uint64_t index = first_entry + offset / sizeof(uint32_t);
+            if (memcmp(a + offset, b + offset, sizeof(uint32_t)) == 0)
+                close_range(range, index, copy, reference, out);
+            else if (!range->open)
+            {
+                range->open = 1;
+                range->start = index;
+            }
+        }
+    }
+}
+
+/*
+ * compare every FAT copy with the active one, chunk by chunk, and print the differing ranges. Return the number of
+ * ranges, or -1 if a copy cannot be read.
+ */
+static int64_t compare_fat_copies(fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, FILE *out)
+{
+    uint64_t copy_size = geometry->fat_size;
+    uint64_t first_copy = geometry->fat_offset;
+    int reference = (int)((fat->fat_start - first_copy) / copy_size);
+    if (bs->num_fats < 2)
+        return 0;
+
+    uint8_t *scratch_a = malloc(FAT_READ_CHUNK), *scratch_b = malloc(FAT_READ_CHUNK);
+    int64_t ranges = scratch_a && scratch_b ? 0 : -1;
+    for (int copy = 0; ranges >= 0 && copy < bs->num_fats; copy++)
+    {
+        if (copy == reference)
+            continue;
+
+        difference_range range = {0, 0, 0};
+        uint64_t base = first_copy + (uint64_t)copy * copy_size;
+        for (uint64_t offset = 0; offset < copy_size; offset += FAT_READ_CHUNK)
+        {
+            size_t size = copy_size - offset < FAT_READ_CHUNK ? (size_t)(copy_size - offset) : FAT_READ_CHUNK;
+            const uint8_t *a = block_device_get(fat->dev, fat->fat_start + offset, size, scratch_a);
+            const uint8_t *b = block_device_get(fat->dev, base + offset, size, scratch_b);
+            if (!a || !b)
+            {
+                fprintf(stderr, "Error: cannot read FAT %d\n", a ? copy + 1 : reference + 1);
+                ranges = -1;
+                break;
+            }
+            if (memcmp(a, b, size) == 0)
+                close_range(&range, offset / sizeof(uint32_t), copy, reference, out);
+            else
+                compare_chunk(a, b, size, offset / sizeof(uint32_t), &range, copy, reference, out);
+        }
+        close_range(&range, copy_size / sizeof(uint32_t), copy, reference, out);
+        if (ranges >= 0)
+            ranges += range.count;
+    }
+
+    free(scratch_a);
+    free(scratch_b);
+    return ranges;
+}
+
+static int test_bit(const uint64_t *bits, uint32_t cluster)
+{
+    return (bits[cluster / FAT_BITMAP_WORD_BITS] >> (cluster % FAT_BITMAP_WORD_BITS)) & 1;
+}
+
+static void set_bit(uint64_t *bits, uint32_t cluster)
+{
+    bits[cluster / FAT_BITMAP_WORD_BITS] |= 1ULL << (cluster % FAT_BITMAP_WORD_BITS);
+}
+
+/*
+ * mark the clusters [first, last] as visited up to the first one already visited, which is returned (0 if none)
+ */
+static uint32_t claim_range(uint64_t *visited, uint32_t first, uint32_t last)
+{
+    for (uint32_t word = first / FAT_BITMAP_WORD_BITS; word <= last / FAT_BITMAP_WORD_BITS; word++)
+    {
+        uint64_t mask = ~0ULL;
+        if (word == first / FAT_BITMAP_WORD_BITS)
+            mask &= ~0ULL << (first % FAT_BITMAP_WORD_BITS);
+        if (word == last / FAT_BITMAP_WORD_BITS)
+            mask &= ~0ULL >> (FAT_BITMAP_WORD_BITS - 1 - last % FAT_BITMAP_WORD_BITS);
+
+        uint64_t taken = visited[word] & mask;
+        if (taken)
+        {
+            uint32_t bit = (uint32_t)__builtin_ctzll(taken);
+            visited[word] |= mask & ((1ULL << bit) - 1);
+            return word * FAT_BITMAP_WORD_BITS + bit;
+        }
+        visited[word] |= mask;
+    }
+    return 0;
+}
+
+static int add_run(check_context *check, uint32_t first, uint32_t last)
+{
+    if (check->run_count == check->run_capacity)
+    {
+        uint32_t capacity = check->run_capacity ? check->run_capacity * 2 : 64;
+        uint32_t *runs = realloc(check->runs, capacity * 2 * sizeof(uint32_t));
+        if (!runs)
+            return 1;
+        check->runs = runs;
+        check->run_capacity = capacity;
+    }
+    check->runs[check->run_count * 2] = first;
+    check->runs[check->run_count * 2 + 1] = last;
+    check->run_count++;
+    return 0;
+}
+
+static int in_current_chain(const check_context *check, uint32_t cluster)
+{
+    for (uint32_t i = 0; i < check->run_count; i++)
+    {
+        if (cluster >= check->runs[i * 2] && cluster <= check->runs[i * 2 + 1])
+            return 1;
+    }
+    return 0;
+}
+
+static int add_link(check_context *check, uint32_t cluster, const char *path)
+{
+    if (check->link_count == check->link_capacity)
+    {
+        uint32_t capacity = check->link_capacity ? check->link_capacity * 2 : 64;
+        cross_link *links = realloc(check->links, capacity * sizeof(cross_link));
+        if (!links)
+            return 1;
+        check->links = links;
+        check->link_capacity = capacity;
+    }
+    cross_link *link = &check->links[check->link_count];
+    link->cluster = cluster;
+    link->path = strdup(path);
+    link->owner = NULL;
+    if (!link->path)
+        return 1;
+    check->link_count++;
+    return 0;
+}
+
+/*
+ * claim the clusters of a chain run by run, its length in clusters going to length. Return non-zero if the chain is
+ * broken (cross-linked, cyclic, running into a free cluster or not ending with an end-of-chain marker).
+ */
+static int follow_chain(check_context *check, const char *path, uint32_t cluster, uint64_t *length)
+{
+    const fat_bitmap *bitmap = check->bitmap;
+    check->run_count = 0;
+    *length = 0;
+
+    for (;;)
+    {
+        if (!test_bit(bitmap->used, cluster))
+        {
+            fprintf(check->out, "%s: chain runs into free cluster %u\n", path, cluster);
+            check->entry_errors++;
+            return 1;
+        }
+
+        uint32_t last = fat_bitmap_run_last(bitmap, cluster);
+        uint32_t conflict = claim_range(check->visited, cluster, last);
+        if (conflict)
+        {
+            *length += conflict - cluster;
+            if (in_current_chain(check, conflict))
+            {
+                fprintf(check->out, "%s: chain loops back to cluster %u\n", path, conflict);
+                check->cycles++;
+            }
+            else if (add_link(check, conflict, path) != 0)
+                perror("Error");
+            return 1;
+        }
+
+        *length += last - cluster + 1;
+        if (add_run(check, cluster, last) != 0)
+        {
+            perror("Error");
+            return 1;
+        }
+
+        uint32_t next = fat_bitmap_jump(bitmap, last);
+        if (next == 0)
+        {
+            uint32_t value = fat_table_next(check->fat, last);
+            if (value < END_OF_CLUSTER_CHAIN)
+            {
+                fprintf(check->out, "%s: chain ends at cluster %u with entry 0x%08x\n", path, last, value);
+                check->entry_errors++;
+                return 1;
+            }
+            return 0;
+        }
+        cluster = next;
+    }
+}
+
+static int is_dot_entry(const walk_entry *entry)
+{
+    return strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0;
+}
+
+static int check_entry(const walk_entry *entry, const char *path, int depth, void *context)
+{
+    (void)depth;
+    check_context *check = context;
+    if (is_dot_entry(entry))
+        return 0;
+
+    uint32_t first_cluster = entry_first_cluster(&entry->entry);
+    int directory = (entry->entry.attributes & DIRECTORY_ATTRIBUTE) != 0;
+    uint32_t size = entry->entry.file_size;
+    if (first_cluster == 0)
+    {
+        if (!directory && size > 0)
+        {
+            fprintf(check->out, "%s: size of %u bytes but no cluster\n", path, size);
+            check->entry_errors++;
+        }
+        return 0;
+    }
+    if (first_cluster < 2 || first_cluster >= check->bitmap->end)
+    {
+        fprintf(check->out, "%s: first cluster %u is outside the data area\n", path, first_cluster);
+        check->entry_errors++;
+        return 0;
+    }
+
+    uint64_t length;
+    check->chains++;
+    if (follow_chain(check, path, first_cluster, &length) != 0)
+        return 0;
+
+    uint64_t needed = ((uint64_t)size + check->cluster_size - 1) / check->cluster_size;
+    if (directory && size != 0)
+    {
+        fprintf(check->out, "%s: directory with a size of %u bytes\n", path, size);
+        check->entry_errors++;
+    }
+    else if (!directory && length != needed)
+    {
+        fprintf(check->out, "%s: chain of %lu clusters, a size of %u bytes needs %lu\n", path, (unsigned long)length, size, (unsigned long)needed);
+        check->entry_errors++;
+    }
+    return 0;
+}
+
+static int compare_links(const void *a, const void *b)
+{
+    uint32_t x = ((const cross_link *)a)->cluster, y = ((const cross_link *)b)->cluster;
+    return (x > y) - (x < y);
+}
+
+/*
+ * give the cross-linked clusters of a chain that have no owner yet this chain as owner
+ */
+static void claim_links(check_context *check, const char *path, uint32_t cluster)
+{
+    const fat_bitmap *bitmap = check->bitmap;
+    uint64_t length = 0;
+    while (cluster >= 2 && cluster < bitmap->end && length < bitmap->end)
+    {
+        uint32_t last = fat_bitmap_run_last(bitmap, cluster);
+        uint32_t low = 0, high = check->link_count;
+        while (low < high)
+        {
+            uint32_t middle = low + (high - low) / 2;
+            if (check->links[middle].cluster < cluster)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        for (uint32_t i = low; i < check->link_count && check->links[i].cluster <= last; i++)
+        {
+            if (!check->links[i].owner)
+                check->links[i].owner = strdup(path);
+        }
+        length += last - cluster + 1;
+        cluster = fat_bitmap_jump(bitmap, last);
+    }
+}
+
+static int find_owners(const walk_entry *entry, const char *path, int depth, void *context)
+{
+    (void)depth;
+    if (!is_dot_entry(entry) && entry_first_cluster(&entry->entry) >= 2)
+        claim_links(context, path, entry_first_cluster(&entry->entry));
+    return 0;
+}
+
+/*
+ * mark the clusters of a lost chain as visited, up to its end or to a cluster already visited, and return their
+ * number
+ */
+static uint32_t mark_lost_chain(check_context *check, uint32_t cluster)
+{
+    const fat_bitmap *bitmap = check->bitmap;
+    uint32_t length = 0;
+    while (cluster >= 2 && cluster < bitmap->end && !test_bit(check->visited, cluster))
+    {
+        uint32_t last = fat_bitmap_run_last(bitmap, cluster);
+        for (; cluster <= last && !test_bit(check->visited, cluster); cluster++)
+        {
+            set_bit(check->visited, cluster);
+            length++;
+        }
+        if (cluster <= last)
+            break;
+        cluster = fat_bitmap_jump(bitmap, last);
+    }
+    return length;
+}
+
+/*
+ * report the allocated clusters no chain claimed, one line per lost chain, and return their number. Chains are
+ * followed from their head first; the clusters left then form cycles with no head, each reported from its lowest
+ * cluster.
+ */
+static uint64_t find_lost_chains(check_context *check, uint64_t *lost_clusters)
+{
+    const fat_bitmap *bitmap = check->bitmap;
+    uint32_t words = (bitmap->end + FAT_BITMAP_WORD_BITS - 1) / FAT_BITMAP_WORD_BITS;
+    *lost_clusters = 0;
+    uint64_t *pointed = calloc(words, sizeof(uint64_t));
+    if (!pointed)
+    {
+        perror("Error");
+        return 0;
+    }
+    for (uint32_t i = 0; i < bitmap->jump_count; i++)
+        set_bit(pointed, bitmap->jump_to[i]);
+
+    // bad clusters are allocated but belong to no chain
+    for (uint32_t word = 0; word < words; word++)
+    {
+        uint64_t lost = bitmap->used[word] & ~check->visited[word];
+        for (; lost; lost &= lost - 1)
+        {
+            uint32_t cluster = word * FAT_BITMAP_WORD_BITS + (uint32_t)__builtin_ctzll(lost);
+            if (fat_table_next(check->fat, cluster) == BAD_CLUSTER)
+                set_bit(check->visited, cluster);
+            else
+                (*lost_clusters)++;
+        }
+    }
+
+    uint64_t chains = 0;
+    for (int heads = 1; heads >= 0; heads--)
+    {
+        for (uint32_t word = 0; word < words; word++)
+        {
+            uint64_t lost = bitmap->used[word] & ~check->visited[word];
+            for (; lost; lost &= lost - 1)
+            {
+                uint32_t cluster = word * FAT_BITMAP_WORD_BITS + (uint32_t)__builtin_ctzll(lost);
+                // a chain head is pointed to neither by a jump nor by the cluster before it
+                int head = !test_bit(pointed, cluster) && test_bit(bitmap->run_end, cluster - 1);
+                if (test_bit(check->visited, cluster) || (heads && !head))
+                    continue;
+                uint32_t length = mark_lost_chain(check, cluster);
+                fprintf(check->out, "lost chain: cluster %u, %u clusters%s\n", cluster, length, heads ? "" : " (cycle)");
+                chains++;
+            }
+        }
+    }
+    free(pointed);
+    return chains;
+}
+
+int check_volume(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, FILE *out)
+{
+    int64_t differences = compare_fat_copies(fat, bs, geometry, out);
+    if (differences < 0)
+        return 1;
+
+    fat_bitmap bitmap;
+    if (fat_bitmap_build(fat, bs, &bitmap) != 0)
+        return 1;
+
+    walk_tree tree;
+    if (walk_tree_build(dev, fat, geometry, bs->root_cluster, thread_count, &tree) != 0)
+    {
+        fat_bitmap_free(&bitmap);
+        return 1;
+    }
+
+    check_context check;
+    memset(&check, 0, sizeof(check));
+    check.fat = fat;
+    check.bitmap = &bitmap;
+    check.cluster_size = (uint32_t)bs->sectors_per_cluster * bs->bytes_per_sector;
+    check.out = out;
+    uint32_t words = (bitmap.end + FAT_BITMAP_WORD_BITS - 1) / FAT_BITMAP_WORD_BITS;
+    check.visited = calloc(words, sizeof(uint64_t));
+    if (!check.visited)
+    {
+        perror("Error");
+        walk_tree_free(&tree);
+        fat_bitmap_free(&bitmap);
+        return 1;
+    }
+
+    // the reserved entries and the bits past the last cluster belong to nobody
+    set_bit(check.visited, 0);
+    set_bit(check.visited, 1);
+    for (uint32_t cluster = bitmap.end; cluster < words * FAT_BITMAP_WORD_BITS; cluster++)
+        set_bit(check.visited, cluster);
+
+    // the root directory has no entry of its own, its chain is claimed first
+    uint64_t length;
+    if (bs->root_cluster >= 2 && bs->root_cluster < bitmap.end)
+    {
+        check.chains++;
+        follow_chain(&check, "/", bs->root_cluster, &length);
+    }
+    else
+    {
+        fprintf(out, "/: root cluster %u is outside the data area\n", bs->root_cluster);
+        check.entry_errors++;
+    }
+    walk_tree_visit(&tree, check_entry, &check);
+
+    // a second walk names the first owner of every cross-linked cluster
+    if (check.link_count > 0)
+    {
+        qsort(check.links, check.link_count, sizeof(cross_link), compare_links);
+        claim_links(&check, "/", bs->root_cluster);
+        walk_tree_visit(&tree, find_owners, &check);
+    }
+    for (uint32_t i = 0; i < check.link_count; i++)
+    {
+        fprintf(out, "%s: cross-linked with %s at cluster %u\n", check.links[i].path, check.links[i].owner ? check.links[i].owner : "an unknown chain", check.links[i].cluster);
+        free(check.links[i].path);
+        free(check.links[i].owner);
+    }
+
+    uint64_t lost_clusters;
+    uint64_t lost_chains = find_lost_chains(&check, &lost_clusters);
+
+    fprintf(out, "\nFAT copies:         %u (%ld differing ranges)\n", bs->num_fats, (long)differences);
+    fprintf(out, "Chains:             %lu\n", (unsigned long)check.chains);
+    fprintf(out, "Cross-links:        %u\n", check.link_count);
+    fprintf(out, "Cycles:             %lu\n", (unsigned long)check.cycles);
+    fprintf(out, "Lost chains:        %lu (%lu clusters)\n", (unsigned long)lost_chains, (unsigned long)lost_clusters);
+    fprintf(out, "Entry errors:       %lu\n", (unsigned long)check.entry_errors);
+
+    int problems = differences > 0 || check.link_count > 0 || check.cycles > 0 || lost_clusters > 0 || check.entry_errors > 0;
+    fprintf(out, "%s\n", problems ? "Problems found" : "No problem found");
+
+    free(check.links);
+    free(check.runs);
+    free(check.visited);
+    walk_tree_free(&tree);
+    fat_bitmap_free(&bitmap);
+    return problems;
+}
@@ -0,0 +1,25 @@
+#ifndef FAT_CHECK_H
+#define FAT_CHECK_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+
+#define FAT_COMPARE_BLOCK 64 // bytes compared at once when locating the differences between two FAT copies
+
+/*
+ * check the consistency of a volume and print one line per problem found, then a summary:
+ * - ranges of entries where a FAT copy differs from the active one;
+ * - chains claiming a cluster already claimed by another entry (cross-links) or by themselves (cycles), found
+ *   with a visited bitmap while following every chain of the directory tree run by run;
+ * - allocated clusters reachable from no directory entry, grouped into lost chains by their head cluster (by their
+ *   lowest cluster for the cycles that have no head);
+ * - directory entries whose chain length does not match file_size, or whose chain starts outside the data area,
+ *   runs into a free cluster or ends without an end-of-chain marker.
+ * The FAT copies are read once sequentially and every cluster is visited a bounded number of times, so the check
+ * is linear in the FAT size. Return 1 if a problem was found or the volume could not be read, 0 otherwise.
+ */
+int check_volume(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, FILE *out);
+
+#endif
@@ -8,9 +8,34 @@
 #include "utils.h"
 #include "partition.h"
 #include "master_boot_record.h"
+#include "fat_cache.h"
+#include "extent.h"
 
-void print_file_content(FILE *disk_image, uint32_t cluster, const boot_sector *bs, const partition_entry *entry, int level, char** path_tokens, int num_tokens, int current_token, int* found);
+/*
+ * build the extent list of a file: its chain, limited to the number of clusters covering file_size
+ */
+int build_file_extents(fat_table *fat, const volume_geometry *geometry, const directory_table_entry *file, extent_list *list);
 
-char** tokenize_path(char* path, int* num_tokens);
+/*
+ * print the content of a file (file_size bytes) in hex with its ascii representation, offsets relative to the file start.
+ * Return 1, after printing the error, if the content cannot be read or written or the chain ends before file_size.
+ */
+int print_file_content(block_device *dev, fat_table *fat, const volume_geometry *geometry, const directory_table_entry *file);
+
+/*
+ * print the list of contiguous extents holding the content of a file. Return 1 if the chain is broken or shorter than
+ * the file.
+ */
+int print_file_extents(fat_table *fat, const volume_geometry *geometry, const directory_table_entry *file);
+
+#define MAX_PATH_TOKENS 100
+
+/*
+ * split an absolute path into lowercase components. The path is modified. Return NULL after printing the
+ * reason if the path is not valid.
+ */
+char **tokenize_path(char *path, int *num_tokens);
+
+void free_path_tokens(char **tokens, int num_tokens);
 
 #endif // __FILE_H__
\ No newline at end of file
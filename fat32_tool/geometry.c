@@ -0,0 +1,53 @@
+#include "geometry.h"
+
+/*
+ * log2 of a power of two, -1 for any other value
+ */
+static int log2_exact(uint32_t value)
+{
+    if (value == 0 || (value & (value - 1)) != 0)
+        return -1;
+    int shift = 0;
+    while ((value >> shift) != 1)
+        shift++;
+    return shift;
+}
+
+int geometry_validate(const boot_sector *bs, const partition_entry *entry)
+{
+    // directory entries must not straddle sectors
+    if (bs->bytes_per_sector < GEOMETRY_MIN_SECTOR_SIZE || bs->bytes_per_sector > GEOMETRY_MAX_SECTOR_SIZE ||
+        bs->bytes_per_sector % sizeof(directory_table_entry) != 0)
+        return 1;
+    if (bs->sectors_per_cluster == 0 || bs->num_fats == 0 || bs->fat_size_32 == 0 || bs->reserved_sectors_count == 0)
+        return 1;
+    if (bs->root_cluster < 2)
+        return 1;
+
+    // the FATs must end before the partition does
+    volume_geometry geometry;
+    geometry_init(&geometry, bs, entry);
+    return geometry.data_offset >= geometry.partition_end;
+}
+
+void geometry_init(volume_geometry *geometry, const boot_sector *bs, const partition_entry *entry)
+{
+    int cluster_shift = log2_exact((uint32_t)bs->sectors_per_cluster * bs->bytes_per_sector);
+
+    geometry->sector_size = bs->bytes_per_sector;
+    geometry->cluster_size = (uint32_t)bs->sectors_per_cluster * bs->bytes_per_sector;
+    geometry->kernel = cluster_shift >= 0 ? GEOMETRY_SHIFT : GEOMETRY_GENERIC;
+    geometry->cluster_shift = cluster_shift >= 0 ? (uint8_t)cluster_shift : 0;
+    geometry->cluster_mask = cluster_shift >= 0 ? geometry->cluster_size - 1 : 0;
+
+    geometry->partition_offset = (uint64_t)entry->start_lba * SECTOR_SIZE;
+    geometry->partition_end = geometry->partition_offset + (uint64_t)entry->total_sectors * SECTOR_SIZE;
+    geometry->fat_offset = geometry->partition_offset + geometry_sectors(geometry, bs->reserved_sectors_count);
+    geometry->fat_size = geometry_sectors(geometry, bs->fat_size_32);
+    geometry->data_offset = geometry->fat_offset + (uint64_t)bs->num_fats * geometry->fat_size;
+}
+
+const char *geometry_kernel_name(geometry_kernel kernel)
+{
+    return kernel == GEOMETRY_SHIFT ? "shift" : "generic";
+}
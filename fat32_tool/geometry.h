@@ -0,0 +1,101 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include "utils.h"
+#include "partition.h"
+
+#define GEOMETRY_MIN_SECTOR_SIZE 512
+#define GEOMETRY_MAX_SECTOR_SIZE 4096
+
+/*
+ * how the address arithmetic of a volume is done
+ */
+typedef enum geometry_kernel_t
+{
+    GEOMETRY_SHIFT,   // power-of-two cluster size: shifts and masks instead of divisions
+    GEOMETRY_GENERIC, // any other layout: divisions
+} geometry_kernel;
+
+/*
+ * byte layout of a FAT32 volume in the image. Sector counts of the boot sector are in bytes_per_sector units, while
+ * the LBAs of the partition entry are in SECTOR_SIZE units (disk_layout scales those of 4Kn partition tables).
+ */
+struct volume_geometry_t
+{
+    uint64_t partition_offset; // image offset of the boot sector
+    uint64_t partition_end;    // image offset of the end of the partition
+    uint64_t fat_offset;       // image offset of the first FAT copy
+    uint64_t fat_size;         // bytes of a FAT copy
+    uint64_t data_offset;      // image offset of cluster 2
+    uint32_t sector_size;
+    uint32_t cluster_size;
+    uint32_t cluster_mask;     // cluster_size - 1 with GEOMETRY_SHIFT
+    uint8_t cluster_shift;     // log2 of cluster_size with GEOMETRY_SHIFT
+    geometry_kernel kernel;
+};
+
+/*
+ * check the boot sector fields the address arithmetic relies on: sector size, non-null cluster, FAT and reserved
+ * area sizes, root cluster, and FATs ending inside the partition.
+ * extract_bs calls it, so geometry_init can then be used on any boot sector it returned.
+ * Return 1 if the geometry is invalid, 0 otherwise.
+ */
+int geometry_validate(const boot_sector *bs, const partition_entry *entry);
+
+/*
+ * compute the layout of a validated volume and pick its kernel
+ */
+void geometry_init(volume_geometry *geometry, const boot_sector *bs, const partition_entry *entry);
+
+/*
+ * name of a kernel, for the reports
+ */
+const char *geometry_kernel_name(geometry_kernel kernel);
+
+/*
+ * image offset of a data cluster. Multiplications cost as much as shifts, only the divisions below pick a kernel.
+ */
+static inline uint64_t geometry_cluster_offset(const volume_geometry *geometry, uint32_t cluster)
+{
+    return geometry->data_offset + ((uint64_t)cluster - 2) * geometry->cluster_size;
+}
+
+/*
+ * data cluster holding an image offset at or after data_offset
+ */
+static inline uint32_t geometry_offset_cluster(const volume_geometry *geometry, uint64_t offset)
+{
+    if (geometry->kernel == GEOMETRY_SHIFT)
+        return (uint32_t)((offset - geometry->data_offset) >> geometry->cluster_shift) + 2;
+    return (uint32_t)((offset - geometry->data_offset) / geometry->cluster_size) + 2;
+}
+
+/*
+ * position of an image offset at or after data_offset in its cluster
+ */
+static inline uint32_t geometry_offset_in_cluster(const volume_geometry *geometry, uint64_t offset)
+{
+    if (geometry->kernel == GEOMETRY_SHIFT)
+        return (uint32_t)(offset - geometry->data_offset) & geometry->cluster_mask;
+    return (uint32_t)((offset - geometry->data_offset) % geometry->cluster_size);
+}
+
+/*
+ * clusters needed to hold size bytes
+ */
+static inline uint64_t geometry_clusters(const volume_geometry *geometry, uint64_t size)
+{
+    if (geometry->kernel == GEOMETRY_SHIFT)
+        return (size + geometry->cluster_mask) >> geometry->cluster_shift;
+    return (size + geometry->cluster_size - 1) / geometry->cluster_size;
+}
+
+/*
+ * bytes of a number of volume sectors
+ */
+static inline uint64_t geometry_sectors(const volume_geometry *geometry, uint64_t sectors)
+{
+    return sectors * geometry->sector_size;
+}
+
+#endif
@@ -0,0 +1,386 @@
+#include "hash.h"
+#include "digest.h"
+#include "extent.h"
+#include "file.h"
+#include "walker.h"
+#include "work_pool.h"
+#include "geometry.h"
+
+#include <pthread.h>
+
+typedef struct hash_file_t
+{
+    char *path;
+    directory_table_entry entry;
+    uint64_t hashed; // bytes actually read
+    int failed;
+    digest_result result;
+} hash_file;
+
+typedef struct hash_chunk_t
+{
+    uint8_t *data; // owned by the chunk, NULL for the end of file marker
+    size_t size;
+    uint32_t file;
+} hash_chunk;
+
+/*
+ * bounded FIFO feeding one worker. Every chunk of a file goes to the same worker, so a file is hashed in order.
+ */
+typedef struct hash_queue_t
+{
+    hash_chunk items[HASH_QUEUE_DEPTH];
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} hash_queue;
+
+typedef struct hash_job_t
+{
+    hash_file *files;
+    uint32_t file_count;
+    uint32_t file_capacity;
+    hash_queue *queues;
+    int queue_count;
+    hash_queue *current; // queue of the file being read
+    uint32_t current_file;
+} hash_job;
+
+typedef struct hash_worker_t
+{
+    hash_job *job;
+    hash_queue *queue;
+} hash_worker;
+
+typedef struct partition_hasher_t
+{
+    block_device *dev;
+    uint64_t offset;
+    uint64_t size;
+    int failed;
+    digest_result result;
+} partition_hasher;
+
+static void queue_push(hash_queue *queue, const hash_chunk *chunk)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == HASH_QUEUE_DEPTH)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    queue->items[(queue->head + queue->count) % HASH_QUEUE_DEPTH] = *chunk;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ * return 0 once the queue is closed and drained
+ */
+static int queue_pop(hash_queue *queue, hash_chunk *chunk)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    int available = queue->count > 0;
+    if (available)
+    {
+        *chunk = queue->items[queue->head];
+        queue->head = (queue->head + 1) % HASH_QUEUE_DEPTH;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return available;
+}
+
+static void queue_close(hash_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ * the least loaded queue takes the next file
+ */
+static hash_queue *pick_queue(hash_job *job)
+{
+    hash_queue *best = &job->queues[0];
+    int best_count = HASH_QUEUE_DEPTH + 1;
+    for (int i = 0; i < job->queue_count; i++)
+    {
+        pthread_mutex_lock(&job->queues[i].lock);
+        int count = job->queues[i].count;
+        pthread_mutex_unlock(&job->queues[i].lock);
+        if (count < best_count)
+        {
+            best = &job->queues[i];
+            best_count = count;
+        }
+    }
+    return best;
+}
+
+static void *hash_worker_main(void *argument)
+{
+    hash_worker *worker = argument;
+    digest state;
+    hash_chunk chunk;
+    digest_init(&state);
+
+    while (queue_pop(worker->queue, &chunk))
+    {
+        if (chunk.data)
+        {
+            digest_update(&state, chunk.data, chunk.size);
+            free(chunk.data);
+            continue;
+        }
+        // end of file marker
+        digest_final(&state, &worker->job->files[chunk.file].result);
+        digest_init(&state);
+    }
+    return NULL;
+}
+
+static void *hash_partition_main(void *argument)
+{
+    partition_hasher *hasher = argument;
+    uint8_t *scratch = malloc(EXTENT_MAX_READ);
+    digest state;
+    digest_init(&state);
+
+    for (uint64_t done = 0; scratch && done < hasher->size;)
+    {
+        size_t size = hasher->size - done < EXTENT_MAX_READ ? (size_t)(hasher->size - done) : EXTENT_MAX_READ;
+        const void *data = block_device_get(hasher->dev, hasher->offset + done, size, scratch);
+        if (!data)
+        {
+            hasher->failed = 1;
+            break;
+        }
+        digest_update(&state, data, size);
+        done += size;
+    }
+    if (!scratch)
+        hasher->failed = 1;
+
+    digest_final(&state, &hasher->result);
+    free(scratch);
+    return NULL;
+}
+
+/*
+ * collect every file of the tree, in tree order
+ */
+static int collect_file(const walk_entry *entry, const char *path, int depth, void *context)
+{
+    hash_job *job = context;
+    (void)depth;
+    if (entry->entry.attributes & DIRECTORY_ATTRIBUTE)
+        return 0;
+
+    if (job->file_count == job->file_capacity)
+    {
+        uint32_t capacity = job->file_capacity ? job->file_capacity * 2 : 1024;
+        hash_file *files = realloc(job->files, capacity * sizeof(hash_file));
+        if (!files)
+            return 1;
+        job->files = files;
+        job->file_capacity = capacity;
+    }
+
+    hash_file *file = &job->files[job->file_count];
+    memset(file, 0, sizeof(*file));
+    file->path = strdup(path);
+    file->entry = entry->entry;
+    if (!file->path)
+        return 1;
+    job->file_count++;
+    return 0;
+}
+
+/*
+ * copy a chunk of file content into HASH_CHUNK_SIZE pieces for the worker of the file
+ */
+static int feed_chunk(const uint8_t *data, uint64_t position, size_t size, void *context)
+{
+    hash_job *job = context;
+    (void)position;
+
+    while (size > 0)
+    {
+        hash_chunk chunk = {NULL, size < HASH_CHUNK_SIZE ? size : HASH_CHUNK_SIZE, job->current_file};
+        chunk.data = malloc(chunk.size);
+        if (!chunk.data)
+        {
+            job->files[job->current_file].failed = 1;
+            return 1;
+        }
+        memcpy(chunk.data, data, chunk.size);
+        job->files[job->current_file].hashed += chunk.size;
+        queue_push(job->current, &chunk);
+        data += chunk.size;
+        size -= chunk.size;
+    }
+    return 0;
+}
+
+static void read_file(block_device *dev, fat_table *fat, const volume_geometry *geometry, hash_job *job, uint32_t index)
+{
+    hash_file *file = &job->files[index];
+    job->current = pick_queue(job);
+    job->current_file = index;
+
+    extent_list extents;
+    if (build_file_extents(fat, geometry, &file->entry, &extents) != 0)
+        file->failed = 1;
+    else
+    {
+        if (extent_list_read(dev, geometry, &extents, file->entry.file_size, feed_chunk, job) != 0)
+            file->failed = 1;
+        extent_list_free(&extents);
+    }
+    if (file->hashed != file->entry.file_size)
+        file->failed = 1;
+
+    hash_chunk end = {NULL, 0, index};
+    queue_push(job->current, &end);
+}
+
+static void free_files(hash_job *job)
+{
+    for (uint32_t i = 0; i < job->file_count; i++)
+        free(job->files[i].path);
+    free(job->files);
+}
+
+/*
+ * a NULL result prints - in the digest columns, for content that could not be read in full
+ */
+static void print_digest_line(FILE *out, const char *path, uint64_t size, const char *first_cluster, const digest_result *result)
+{
+    if (!result)
+    {
+        fprintf(out, "%s\t%lu\t%s\t-\t-\t-\n", path, (unsigned long)size, first_cluster);
+        return;
+    }
+
+    char md5[2 * MD5_DIGEST_SIZE + 1], sha1[2 * SHA1_DIGEST_SIZE + 1], sha256[2 * SHA256_DIGEST_SIZE + 1];
+    digest_hex(result->md5, sizeof(result->md5), md5);
+    digest_hex(result->sha1, sizeof(result->sha1), sha1);
+    digest_hex(result->sha256, sizeof(result->sha256), sha256);
+    fprintf(out, "%s\t%lu\t%s\t%s\t%s\t%s\n", path, (unsigned long)size, first_cluster, md5, sha1, sha256);
+}
+
+int hash_volume(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, int whole_partition, FILE *out)
+{
+    hash_job job;
+    memset(&job, 0, sizeof(job));
+
+    walk_tree tree;
+    if (walk_tree_build(dev, fat, geometry, bs->root_cluster, thread_count, &tree) != 0)
+        return 1;
+    int status = walk_tree_visit(&tree, collect_file, &job);
+    walk_tree_free(&tree);
+    if (status != 0)
+    {
+        perror("Error");
+        free_files(&job);
+        return 1;
+    }
+
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > WORK_POOL_MAX_THREADS)
+        thread_count = WORK_POOL_MAX_THREADS;
+
+    // the whole partition is hashed by its own thread, next to the file pipeline
+    partition_hasher partition = {dev, geometry->partition_offset, geometry->partition_end - geometry->partition_offset, 0, {{0}, {0}, {0}}};
+    pthread_t partition_thread;
+    int partition_started = whole_partition && pthread_create(&partition_thread, NULL, hash_partition_main, &partition) == 0;
+    if (whole_partition && !partition_started)
+        partition.failed = 1;
+
+    job.queues = calloc(thread_count, sizeof(hash_queue));
+    hash_worker *workers = calloc(thread_count, sizeof(hash_worker));
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    int started = 0;
+    if (job.queues && workers && threads)
+    {
+        for (; started < thread_count; started++)
+        {
+            hash_queue *queue = &job.queues[started];
+            pthread_mutex_init(&queue->lock, NULL);
+            pthread_cond_init(&queue->not_empty, NULL);
+            pthread_cond_init(&queue->not_full, NULL);
+            workers[started].job = &job;
+            workers[started].queue = queue;
+            if (pthread_create(&threads[started], NULL, hash_worker_main, &workers[started]) != 0)
+            {
+                pthread_cond_destroy(&queue->not_full);
+                pthread_cond_destroy(&queue->not_empty);
+                pthread_mutex_destroy(&queue->lock);
+                break;
+            }
+            job.queue_count++;
+        }
+    }
+
+    if (job.queue_count == 0)
+    {
+        perror("Error");
+        status = 1;
+    }
+    else
+    {
+        // read the files one after the other while the workers hash the previous chunks
+        for (uint32_t i = 0; i < job.file_count; i++)
+            read_file(dev, fat, geometry, &job, i);
+    }
+
+    for (int i = 0; i < job.queue_count; i++)
+        queue_close(&job.queues[i]);
+    for (int i = 0; i < job.queue_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        pthread_cond_destroy(&job.queues[i].not_full);
+        pthread_cond_destroy(&job.queues[i].not_empty);
+        pthread_mutex_destroy(&job.queues[i].lock);
+    }
+    if (partition_started)
+        pthread_join(partition_thread, NULL);
+
+    if (status == 0)
+    {
+        fprintf(out, "# path\tsize\tfirst_cluster\tmd5\tsha1\tsha256\n");
+        for (uint32_t i = 0; i < job.file_count; i++)
+        {
+            const hash_file *file = &job.files[i];
+            char first_cluster[16];
+            snprintf(first_cluster, sizeof(first_cluster), "%u", entry_first_cluster(&file->entry));
+            print_digest_line(out, file->path, file->entry.file_size, first_cluster, file->failed ? NULL : &file->result);
+            if (file->failed)
+            {
+                fprintf(stderr, "Error: only %lu of %u bytes of %s could be read.\n", (unsigned long)file->hashed, file->entry.file_size, file->path);
+                status = 1;
+            }
+        }
+        if (whole_partition && !partition.failed)
+            print_digest_line(out, "<partition>", partition.size, "-", &partition.result);
+        else if (whole_partition)
+        {
+            fprintf(stderr, "Error: the partition range could not be read.\n");
+            status = 1;
+        }
+    }
+
+    free(threads);
+    free(workers);
+    free(job.queues);
+    free_files(&job);
+    return status;
+}
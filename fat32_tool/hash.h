@@ -0,0 +1,21 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+
+#define HASH_CHUNK_SIZE (1024 * 1024) // bytes handed to a hash worker at once
+#define HASH_QUEUE_DEPTH 4            // chunks waiting per hash worker
+
+/*
+ * write a manifest line "path size first_cluster md5 sha1 sha256" (tab separated) for every file of the volume to
+ * out, in tree order. The main thread reads the files (through their FAT chain, up to file_size) and feeds
+ * thread_count hash workers through bounded queues so reading and hashing overlap. With whole_partition, the
+ * partition range (start_lba, total_sectors) is hashed by one more thread during the same run.
+ * Return non-zero if a file could not be read completely.
+ */
+int hash_volume(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, int whole_partition, FILE *out);
+
+#endif
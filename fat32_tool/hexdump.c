@@ -0,0 +1,207 @@
+#include "hexdump.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static char hex_pairs[256][3]; // "XX " for every byte value
+static char ascii[256];        // the byte itself if printable, '.' otherwise
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void build_tables(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        hex_pairs[i][0] = hex_digits[i >> 4];
+        hex_pairs[i][1] = hex_digits[i & 0x0F];
+        hex_pairs[i][2] = ' ';
+        ascii[i] = (i >= 0x20 && i <= 0x7E) ? (char)i : '.';
+    }
+}
+
+static void format_offset(char *out, uint32_t offset)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        out[i] = hex_digits[offset & 0x0F];
+        offset >>= 4;
+    }
+    out[8] = ':';
+    out[9] = ' ';
+}
+
+#ifdef __SSSE3__
+/*
+ * 16 bytes -> 48 characters "XX XX ... XX " with three byte shuffles of the hex digits
+ */
+static void format_hex16(char *out, const uint8_t *data)
+{
+    const __m128i lut = _mm_loadu_si128((const __m128i *)hex_digits);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i bytes = _mm_loadu_si128((const __m128i *)data);
+    __m128i high = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+    __m128i low = _mm_shuffle_epi8(lut, _mm_and_si128(bytes, nibble));
+    __m128i first = _mm_unpacklo_epi8(high, low);  // digits of bytes 0-7
+    __m128i second = _mm_unpackhi_epi8(high, low); // digits of bytes 8-15
+
+    // -1 selects zero, the spaces are or-ed in afterwards
+    const __m128i spaces0 = _mm_setr_epi8(0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0);
+    const __m128i spaces1 = _mm_setr_epi8(0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0);
+    const __m128i spaces2 = _mm_setr_epi8(' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ');
+    __m128i out0 = _mm_shuffle_epi8(first, _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10));
+    __m128i out1 = _mm_or_si128(_mm_shuffle_epi8(first, _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                                _mm_shuffle_epi8(second, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, -1, 2, 3, -1, 4, 5)));
+    __m128i out2 = _mm_shuffle_epi8(second, _mm_setr_epi8(-1, 6, 7, -1, 8, 9, -1, 10, 11, -1, 12, 13, -1, 14, 15, -1));
+
+    _mm_storeu_si128((__m128i *)out, _mm_or_si128(out0, spaces0));
+    _mm_storeu_si128((__m128i *)(out + 16), _mm_or_si128(out1, spaces1));
+    _mm_storeu_si128((__m128i *)(out + 32), _mm_or_si128(out2, spaces2));
+}
+#else
+static void format_hex16(char *out, const uint8_t *data)
+{
+    for (int i = 0; i < HEXDUMP_LINE_BYTES; i++)
+        memcpy(out + 3 * i, hex_pairs[data[i]], 3);
+}
+#endif
+
+#ifdef __SSE2__
+/*
+ * 16 bytes -> 16 ascii characters, non printable bytes replaced by '.'
+ */
+static void format_ascii16(char *out, const uint8_t *data)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i *)data);
+    // signed compares: bytes >= 0x80 are negative and fail the first test
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(0x1F)), _mm_cmplt_epi8(bytes, _mm_set1_epi8(0x7F)));
+    __m128i dots = _mm_andnot_si128(printable, _mm_set1_epi8('.'));
+    _mm_storeu_si128((__m128i *)out, _mm_or_si128(_mm_and_si128(printable, bytes), dots));
+}
+#else
+static void format_ascii16(char *out, const uint8_t *data)
+{
+    for (int i = 0; i < HEXDUMP_LINE_BYTES; i++)
+        out[i] = ascii[data[i]];
+}
+#endif
+
+/*
+ * format a line of count (at most 16) bytes, padding the hex column of a partial line so the ascii column stays aligned
+ */
+static size_t format_line(char *out, uint32_t offset, const uint8_t *data, size_t count)
+{
+    format_offset(out, offset);
+    char *hex = out + 10;
+    char *text = hex + 3 * HEXDUMP_LINE_BYTES + 3;
+
+    if (count == HEXDUMP_LINE_BYTES)
+    {
+        format_hex16(hex, data);
+        format_ascii16(text, data);
+    }
+    else
+    {
+        for (size_t i = 0; i < HEXDUMP_LINE_BYTES; i++)
+            memcpy(hex + 3 * i, i < count ? hex_pairs[data[i]] : "   ", 3);
+        for (size_t i = 0; i < count; i++)
+            text[i] = ascii[data[i]];
+    }
+
+    memcpy(hex + 3 * HEXDUMP_LINE_BYTES, " | ", 3);
+    text[count] = '\n';
+    return (size_t)(text + count + 1 - out);
+}
+
+static int flush(hexdump *dump)
+{
+    const char *data = dump->buffer;
+    while (dump->used > 0)
+    {
+        ssize_t n = write(dump->fd, data, dump->used);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        data += n;
+        dump->used -= n;
+    }
+    return 0;
+}
+
+static int emit_line(hexdump *dump, const uint8_t *data, size_t count)
+{
+    if (dump->used + HEXDUMP_LINE_LENGTH > HEXDUMP_BUFFER_SIZE && flush(dump) != 0)
+        return 1;
+    dump->used += format_line(dump->buffer + dump->used, (uint32_t)dump->offset, data, count);
+    dump->offset += count;
+    return 0;
+}
+
+int hexdump_init(hexdump *dump, int fd)
+{
+    // library users may start dumps on several threads at once
+    pthread_once(&tables_once, build_tables);
+
+    memset(dump, 0, sizeof(*dump));
+    dump->fd = fd;
+    dump->buffer = malloc(HEXDUMP_BUFFER_SIZE);
+    if (!dump->buffer)
+    {
+        perror("Error");
+        return 1;
+    }
+    return 0;
+}
+
+int hexdump_write(hexdump *dump, const uint8_t *data, size_t size)
+{
+    // complete the line left over by the previous call
+    if (dump->pending_count > 0)
+    {
+        size_t missing = HEXDUMP_LINE_BYTES - dump->pending_count;
+        size_t count = size < missing ? size : missing;
+        memcpy(dump->pending + dump->pending_count, data, count);
+        dump->pending_count += count;
+        data += count;
+        size -= count;
+        if (dump->pending_count < HEXDUMP_LINE_BYTES)
+            return 0;
+        if (emit_line(dump, dump->pending, HEXDUMP_LINE_BYTES) != 0)
+            return 1;
+        dump->pending_count = 0;
+    }
+
+    while (size >= HEXDUMP_LINE_BYTES)
+    {
+        if (emit_line(dump, data, HEXDUMP_LINE_BYTES) != 0)
+            return 1;
+        data += HEXDUMP_LINE_BYTES;
+        size -= HEXDUMP_LINE_BYTES;
+    }
+
+    memcpy(dump->pending, data, size);
+    dump->pending_count = size;
+    return 0;
+}
+
+int hexdump_finish(hexdump *dump)
+{
+    int status = 0;
+    if (dump->pending_count > 0)
+        status = emit_line(dump, dump->pending, dump->pending_count);
+    if (status == 0)
+        status = flush(dump);
+
+    free(dump->buffer);
+    dump->buffer = NULL;
+    return status;
+}
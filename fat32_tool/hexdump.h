@@ -0,0 +1,36 @@
+#ifndef HEXDUMP_H
+#define HEXDUMP_H
+
+#include "utils.h"
+
+#define HEXDUMP_BUFFER_SIZE (1024 * 1024) // output is flushed with one write() each time this fills up
+#define HEXDUMP_LINE_BYTES 16
+#define HEXDUMP_LINE_LENGTH 78 // "XXXXXXXX: " + 16 * "XX " + " | " + 16 ascii characters + '\n'
+
+/*
+ * hex + ascii dump writer: lines of 16 bytes prefixed with their offset from the start of the dump,
+ * formatted into a large buffer flushed with write()
+ */
+typedef struct hexdump_t
+{
+    int fd;
+    char *buffer;
+    size_t used;
+    uint64_t offset; // offset of the next line
+    uint8_t pending[HEXDUMP_LINE_BYTES]; // bytes of an incomplete line, waiting for the next chunk
+    size_t pending_count;
+} hexdump;
+
+int hexdump_init(hexdump *dump, int fd);
+
+/*
+ * append data to the dump. Full lines are formatted right away, a trailing partial line is kept for the next call.
+ */
+int hexdump_write(hexdump *dump, const uint8_t *data, size_t size);
+
+/*
+ * format the last partial line, flush the buffer and release it
+ */
+int hexdump_finish(hexdump *dump);
+
+#endif
@@ -0,0 +1,209 @@
+#include <errno.h>
+
+#include "locate.h"
+#include "partition.h"
+#include "fat_cache.h"
+#include "fat_analysis.h"
+#include "owner_map.h"
+#include "geometry.h"
+
+/*
+ * state of a partition, loaded on the first offset falling into it
+ */
+typedef struct located_partition_t
+{
+    int loaded;
+    int failed;
+    boot_sector bs;
+    volume_geometry geometry;
+    owner_map map;
+    fat_table fat; // only loaded to build the map or to tell free clusters from lost ones
+    int fat_loaded;
+} located_partition;
+
+typedef struct locate_context_t
+{
+    block_device *dev;
+    const char *image_path;
+    const disk_layout *layout;
+    located_partition *partitions; // parallel to layout->partitions
+    size_t fat_memory;
+    int thread_count;
+    int use_sidecar;
+} locate_context;
+
+static int load_fat(locate_context *locate, uint32_t index)
+{
+    located_partition *state = &locate->partitions[index];
+    if (state->fat_loaded)
+        return 0;
+    if (fat_table_load(locate->dev, &state->bs, &state->geometry, locate->fat_memory, &state->fat) != 0)
+    {
+        fprintf(stderr, "Error: cannot load the FAT of partition %d\n", locate->layout->partitions[index].number);
+        return 1;
+    }
+    state->fat_loaded = 1;
+    return 0;
+}
+
+/*
+ * read the boot sector and the reverse map of a partition, from the sidecar when it is up to date
+ */
+static int load_partition(locate_context *locate, uint32_t index)
+{
+    located_partition *state = &locate->partitions[index];
+    if (state->loaded)
+        return state->failed;
+    state->loaded = 1;
+    state->failed = 1;
+
+    const disk_partition *partition = &locate->layout->partitions[index];
+    const partition_entry *entry = &partition->entry;
+    if (extract_bs(locate->dev, entry, &state->bs) != 0)
+        return 1;
+    geometry_init(&state->geometry, &state->bs, entry);
+
+    char map_path[4096];
+    owner_map_sidecar_path(locate->image_path, partition->number, map_path, sizeof(map_path));
+    if (locate->use_sidecar && owner_map_open(map_path, locate->image_path, &state->bs, entry, &state->map) == 0)
+    {
+        state->failed = 0;
+        return 0;
+    }
+
+    if (load_fat(locate, index) != 0)
+        return 1;
+    fat_bitmap bitmap;
+    if (fat_bitmap_build(&state->fat, &state->bs, &bitmap) != 0)
+        return 1;
+    int status = owner_map_build(locate->dev, &state->fat, &state->bs, &state->geometry, &bitmap, locate->thread_count, &state->map);
+    fat_bitmap_free(&bitmap);
+    if (status != 0)
+        return 1;
+
+    if (locate->use_sidecar && owner_map_save(&state->map, locate->image_path, &state->bs, entry, map_path) != 0)
+        fprintf(stderr, "Warning: cannot write %s, the reverse map is kept in memory only\n", map_path);
+    state->failed = 0;
+    return 0;
+}
+
+/*
+ * index of the partition holding sector, -1 if none
+ */
+static int find_partition(const disk_layout *layout, uint64_t sector)
+{
+    for (uint32_t i = 0; i < layout->count; i++)
+    {
+        const disk_partition *partition = &layout->partitions[i];
+        if (sector >= partition->start_lba && sector - partition->start_lba < partition->total_sectors)
+            return (int)i;
+    }
+    return -1;
+}
+
+static int locate_offset(locate_context *locate, uint64_t offset, FILE *out)
+{
+    int index = find_partition(locate->layout, offset / SECTOR_SIZE);
+    if (index < 0)
+    {
+        fprintf(out, "%lu\t-\t-\tunpartitioned\t-\t-\n", (unsigned long)offset);
+        return 0;
+    }
+
+    const disk_partition *partition = &locate->layout->partitions[index];
+    if (partition->filesystem != FILESYSTEM_FAT32 || partition->entry.total_sectors == 0)
+    {
+        fprintf(out, "%lu\t%d\t-\tunsupported\t-\t-\n", (unsigned long)offset, partition->number);
+        return 0;
+    }
+    if (load_partition(locate, (uint32_t)index) != 0)
+    {
+        fprintf(stderr, "Error: cannot read partition %d\n", partition->number);
+        return 1;
+    }
+
+    located_partition *state = &locate->partitions[index];
+    const volume_geometry *geometry = &state->geometry;
+    if (offset < geometry->data_offset)
+    {
+        fprintf(out, "%lu\t%d\t-\t%s\t-\t-\n", (unsigned long)offset, partition->number, offset < geometry->fat_offset ? "reserved" : "fat");
+        return 0;
+    }
+
+    const owner_map *map = &state->map;
+    uint64_t cluster = geometry_offset_cluster(geometry, offset);
+    if (cluster >= map->cluster_end)
+    {
+        fprintf(out, "%lu\t%d\t-\tunused\t-\t-\n", (unsigned long)offset, partition->number);
+        return 0;
+    }
+
+    const owner_extent *owner = owner_map_find(map, (uint32_t)cluster);
+    if (!owner)
+    {
+        if (load_fat(locate, (uint32_t)index) != 0)
+            return 1;
+        int used = fat_table_next(&state->fat, (uint32_t)cluster) != 0;
+        fprintf(out, "%lu\t%d\t%lu\t%s\t-\t-\n", (unsigned long)offset, partition->number, (unsigned long)cluster, used ? "lost" : "unallocated");
+        return 0;
+    }
+
+    const owner_file *file = &map->files[owner->file];
+    uint64_t file_offset = (uint64_t)(owner->file_cluster + (cluster - owner->start_cluster)) * geometry->cluster_size + geometry_offset_in_cluster(geometry, offset);
+    const char *area = file->directory ? "directory" : file_offset < file->size ? "file" : "slack";
+    fprintf(out, "%lu\t%d\t%lu\t%s\t%s\t%lu\n", (unsigned long)offset, partition->number, (unsigned long)cluster, area, owner_map_path(map, owner->file), (unsigned long)file_offset);
+    return 0;
+}
+
+int locate_offsets(block_device *dev, const char *image_path, const disk_layout *layout, size_t fat_memory, int thread_count, int use_sidecar, const char *offsets_path, FILE *out)
+{
+    FILE *input = strcmp(offsets_path, "-") == 0 ? stdin : fopen(offsets_path, "r");
+    if (!input)
+    {
+        perror("Error");
+        return 1;
+    }
+
+    locate_context locate = {dev, image_path, layout, calloc(layout->count + 1, sizeof(located_partition)), fat_memory, thread_count, use_sidecar};
+    if (!locate.partitions)
+    {
+        perror("Error");
+        if (input != stdin)
+            fclose(input);
+        return 1;
+    }
+
+    int status = 0;
+    char line[LOCATE_LINE_MAX];
+    fprintf(out, "# offset\tpartition\tcluster\tarea\tpath\tfile_offset\n");
+    while (fgets(line, sizeof(line), input))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+
+        char *end;
+        errno = 0;
+        // decimal, or hexadecimal after 0x: a leading zero does not mean octal
+        int base = line[0] == '0' && (line[1] == 'x' || line[1] == 'X') ? 16 : 10;
+        unsigned long long offset = strtoull(line, &end, base);
+        if (errno != 0 || end == line || *end != '\0' || line[0] == '-')
+        {
+            fprintf(stderr, "Error: invalid offset %s\n", line);
+            status = 1;
+            continue;
+        }
+        status |= locate_offset(&locate, (uint64_t)offset, out);
+    }
+
+    if (input != stdin)
+        fclose(input);
+    for (uint32_t i = 0; i < layout->count; i++)
+    {
+        owner_map_free(&locate.partitions[i].map);
+        if (locate.partitions[i].fat_loaded)
+            fat_table_free(&locate.partitions[i].fat);
+    }
+    free(locate.partitions);
+    return status;
+}
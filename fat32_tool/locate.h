@@ -0,0 +1,22 @@
+#ifndef LOCATE_H
+#define LOCATE_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "disk_layout.h"
+
+#define LOCATE_LINE_MAX 256
+
+/*
+ * answer "which file owns this byte" for every image offset of offsets_path (one per line, decimal or 0x
+ * hexadecimal, - for stdin) with one "offset<tab>partition<tab>cluster<tab>area<tab>path<tab>file_offset" line,
+ * in input order. area is file, slack, directory, unallocated or lost for the data region of a FAT32 partition,
+ * reserved or fat before it, unused past its last cluster, unsupported for other partitions and unpartitioned
+ * outside every partition; - fills the columns that do not apply.
+ * The cluster reverse map of a FAT32 partition is built on first use and, if use_sidecar, loaded from or saved to
+ * <image>.p<partition_number>.owners so that later queries skip the tree walk. Return 1 if an offset could not be
+ * parsed or a partition could not be read, 0 otherwise.
+ */
+int locate_offsets(block_device *dev, const char *image_path, const disk_layout *layout, size_t fat_memory, int thread_count, int use_sidecar, const char *offsets_path, FILE *out);
+
+#endif
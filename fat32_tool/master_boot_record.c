@@ -1,7 +1,49 @@
 #include "master_boot_record.h"
 
-// print information on single partition (PART 1)
-static void print_partition_info(partition_entry *entry, int partition_number)
+const char *partition_type_name(uint8_t system_id)
+{
+	switch (system_id)
+	{
+	case 0x01:
+		return "FAT12";
+	case 0x04:
+	case 0x06:
+		return "FAT16";
+	case 0x05:
+		return "Extended";
+	case 0x07:
+		return "NTFS or exFAT";
+	case 0x0B:
+		return "FAT32 with CHS addressing";
+	case 0x0C:
+		return "FAT32 with LBA addressing";
+	case 0x0E:
+		return "FAT16 with LBA addressing";
+	case 0x0F:
+		return "Extended with LBA addressing";
+	case 0x82:
+		return "Linux swap";
+	case 0x83:
+		return "Linux";
+	case 0x85:
+		return "Linux extended";
+	case 0x8E:
+		return "Linux LVM";
+	case 0xEE:
+		return "GPT protective";
+	case 0xEF:
+		return "EFI system";
+	default:
+		return "unknown";
+	}
+}
+
+int is_extended_partition(uint8_t system_id)
+{
+	return system_id == 0x05 || system_id == 0x0F || system_id == 0x85;
+}
+
+void print_partition(const partition_entry *entry, int partition_number)
 {
 	uint8_t system_id = entry->system_id;
 	uint8_t start_sector = entry->start_sector & 0x3F;
@@ -13,7 +55,7 @@ static void print_partition_info(partition_entry *entry, int partition_number)
 	uint64_t size_bytes = (uint64_t)total_sectors * SECTOR_SIZE;				  // partition size
 
 	printf("Partition %d:\n", partition_number);
-	printf("  System ID:    0x%02x (FAT32 with LBA addressing)\n", system_id);
+	printf("  System ID:    0x%02x (%s)\n", system_id, partition_type_name(system_id));
 	printf("  Start Sector: %u\n", start_sector);
 	printf("  End Sector:   %u\n", end_sector);
 	printf("  Sector size:  %u bytes\n", SECTOR_SIZE);
@@ -23,30 +65,11 @@ static void print_partition_info(partition_entry *entry, int partition_number)
 	printf("  Size:         %u sectors (%ld bytes)\n", total_sectors, size_bytes);
 }
 
-int extract_mbr(FILE *disk_image, master_boot_record *mbr)
+int extract_mbr(block_device *dev, master_boot_record *mbr)
 {
-	if (fread(mbr, sizeof(*mbr), 1, disk_image) != 1)
-	{
-		perror("Error");
+	if (block_device_read(dev, 0, sizeof(*mbr), mbr) != 0)
 		return 1;
-	}
 
 	// Verify that the signature is 0xAA55
-	if (mbr->signature != 0xAA55)
-	{
-		fprintf(stderr, "Wrong Master Boot Record signature\n");
-		return 1;
-	}
-	return 0;
-}
-
-void print_partitions(master_boot_record *mbr)
-{
-	for (int i = 0; i < N_PARTITION; i++)
-	{
-		if (mbr->partition_table[i].system_id == PARTITION_TYPE)
-		{
-			print_partition_info(&mbr->partition_table[i], i + 1);
-		}
-	}
+	return mbr->signature != 0xAA55;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define MASTER_BOOT_RECORD_H
 
 #include "utils.h"
+#include "block_device.h"
 
 #pragma pack(push, 1) // without this, the compiler might (will?) insert padding and the code will not work.
 typedef struct partition_entry_t
@@ -29,13 +30,24 @@ typedef struct master_boot_record_t
 #pragma pack(pop)
 
 /*
- * extract master boot record from image file into structure
+ * extract master boot record from image file into structure. Return 1, without printing anything, if it cannot be
+ * read or its signature is wrong.
  */
-int extract_mbr(FILE *disk_image, master_boot_record *mbr);
+int extract_mbr(block_device *dev, master_boot_record *mbr);
 
 /*
- * print the partitions information as asked in the homework
+ * description of an MBR partition type
  */
-void print_partitions(master_boot_record *mbr);
+const char *partition_type_name(uint8_t system_id);
+
+/*
+ * return non-zero for the types of extended partitions, which hold an EBR chain of logical partitions
+ */
+int is_extended_partition(uint8_t system_id);
+
+/*
+ * print the information of a partition entry as asked in the homework
+ */
+void print_partition(const partition_entry *entry, int partition_number);
 
 #endif
\ No newline at end of file
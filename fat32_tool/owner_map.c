@@ -0,0 +1,325 @@
+#include "owner_map.h"
+#include "walker.h"
+#include "geometry.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct owner_build_t
+{
+    owner_map *map;
+    const fat_bitmap *bitmap;
+    int failed;
+} owner_build;
+
+static int add_file(owner_map *map, const char *path, uint32_t size, int directory)
+{
+    size_t length = strlen(path) + 1;
+    if (map->paths_size + length > map->paths_capacity)
+    {
+        uint64_t capacity = map->paths_capacity ? map->paths_capacity * 2 : 4096;
+        while (capacity < map->paths_size + length)
+            capacity *= 2;
+        char *grown = realloc(map->paths, capacity);
+        if (!grown)
+            return 1;
+        map->paths = grown;
+        map->paths_capacity = capacity;
+    }
+    if (map->file_count == map->file_capacity)
+    {
+        uint32_t capacity = map->file_capacity ? map->file_capacity * 2 : 256;
+        owner_file *grown = realloc(map->files, capacity * sizeof(owner_file));
+        if (!grown)
+            return 1;
+        map->files = grown;
+        map->file_capacity = capacity;
+    }
+
+    owner_file *file = &map->files[map->file_count++];
+    file->path_offset = map->paths_size;
+    file->size = size;
+    file->directory = (uint32_t)directory;
+    memcpy(map->paths + map->paths_size, path, length);
+    map->paths_size += length;
+    return 0;
+}
+
+static int add_extent(owner_map *map, uint32_t start_cluster, uint32_t length, uint32_t file, uint32_t file_cluster)
+{
+    if (map->extent_count == map->extent_capacity)
+    {
+        uint32_t capacity = map->extent_capacity ? map->extent_capacity * 2 : 1024;
+        owner_extent *grown = realloc(map->extents, capacity * sizeof(owner_extent));
+        if (!grown)
+            return 1;
+        map->extents = grown;
+        map->extent_capacity = capacity;
+    }
+    owner_extent *item = &map->extents[map->extent_count++];
+    item->start_cluster = start_cluster;
+    item->length = length;
+    item->file = file;
+    item->file_cluster = file_cluster;
+    return 0;
+}
+
+/*
+ * record a file and the runs of its chain. The walk ends after as many clusters as the volume holds, so a cyclic
+ * chain is recorded once around.
+ */
+static int add_chain(owner_build *build, const char *path, uint32_t first_cluster, uint32_t size, int directory)
+{
+    owner_map *map = build->map;
+    uint32_t file = map->file_count;
+    if (add_file(map, path, size, directory) != 0)
+        return 1;
+
+    uint64_t position = 0;
+    uint32_t cluster = first_cluster;
+    while (cluster >= 2 && cluster < build->bitmap->end && position < build->bitmap->end)
+    {
+        uint32_t last = fat_bitmap_run_last(build->bitmap, cluster);
+        if (add_extent(map, cluster, last - cluster + 1, file, (uint32_t)position) != 0)
+            return 1;
+        position += last - cluster + 1;
+        cluster = fat_bitmap_jump(build->bitmap, last);
+    }
+    return 0;
+}
+
+static int add_entry(const walk_entry *item, const char *path, int depth, void *context)
+{
+    (void)depth;
+    owner_build *build = context;
+    if (strcmp(item->name, ".") == 0 || strcmp(item->name, "..") == 0)
+        return 0;
+
+    const directory_table_entry *file = &item->entry;
+    int directory = (file->attributes & DIRECTORY_ATTRIBUTE) != 0;
+    uint32_t first_cluster = entry_first_cluster(file);
+    if (add_chain(build, path, first_cluster, directory ? 0 : file->file_size, directory) != 0)
+    {
+        build->failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static int compare_extents(const void *a, const void *b)
+{
+    const owner_extent *x = a, *y = b;
+    if (x->start_cluster != y->start_cluster)
+        return x->start_cluster < y->start_cluster ? -1 : 1;
+    return x->file < y->file ? -1 : x->file > y->file;
+}
+
+/*
+ * count the extents starting before the first cluster of every bucket, the extents being sorted
+ */
+static int fill_buckets(owner_map *map)
+{
+    map->bucket_count = (map->cluster_end >> OWNER_BUCKET_SHIFT) + 1;
+    map->buckets = malloc(((size_t)map->bucket_count + 1) * sizeof(uint32_t));
+    if (!map->buckets)
+        return 1;
+
+    uint32_t extent = 0;
+    for (uint32_t bucket = 0; bucket <= map->bucket_count; bucket++)
+    {
+        uint64_t first_cluster = (uint64_t)bucket << OWNER_BUCKET_SHIFT;
+        while (extent < map->extent_count && map->extents[extent].start_cluster < first_cluster)
+            extent++;
+        map->buckets[bucket] = extent;
+    }
+    return 0;
+}
+
+int owner_map_build(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, const fat_bitmap *bitmap, int thread_count, owner_map *map)
+{
+    memset(map, 0, sizeof(*map));
+    map->cluster_size = geometry->cluster_size;
+    map->cluster_end = bitmap->end;
+
+    walk_tree tree;
+    if (walk_tree_build(dev, fat, geometry, bs->root_cluster, thread_count, &tree) != 0)
+        return 1;
+
+    owner_build build = {map, bitmap, 0};
+    if (add_chain(&build, OWNER_ROOT_PATH, bs->root_cluster, 0, 1) != 0)
+        build.failed = 1;
+    else
+        walk_tree_visit(&tree, add_entry, &build);
+    walk_tree_free(&tree);
+
+    if (!build.failed)
+    {
+        qsort(map->extents, map->extent_count, sizeof(owner_extent), compare_extents);
+        build.failed = fill_buckets(map);
+    }
+    if (build.failed)
+    {
+        perror("Error");
+        owner_map_free(map);
+        return 1;
+    }
+    return 0;
+}
+
+void owner_map_sidecar_path(const char *image_path, int partition_number, char *map_path, size_t size)
+{
+    snprintf(map_path, size, "%s.p%d.owners", image_path, partition_number);
+}
+
+int owner_map_save(const owner_map *map, const char *image_path, const boot_sector *bs, const partition_entry *entry, const char *map_path)
+{
+    struct stat image;
+    if (stat(image_path, &image) != 0)
+        return 1;
+
+    owner_map_header header;
+    memset(&header, 0, sizeof(header));
+    sidecar_identity_init(&header.identity, OWNER_MAP_MAGIC, &image, bs, entry);
+    header.cluster_size = map->cluster_size;
+    header.cluster_end = map->cluster_end;
+    header.bucket_count = map->bucket_count;
+    header.extent_count = map->extent_count;
+    header.file_count = map->file_count;
+    header.paths_size = map->paths_size;
+
+    char temporary_path[4096 + 8];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", map_path);
+    int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 1;
+
+    int status = write_all(fd, &header, sizeof(header)) ||
+                 write_all(fd, map->files, (size_t)map->file_count * sizeof(owner_file)) ||
+                 write_all(fd, map->extents, (size_t)map->extent_count * sizeof(owner_extent)) ||
+                 write_all(fd, map->buckets, ((size_t)map->bucket_count + 1) * sizeof(uint32_t)) ||
+                 write_all(fd, map->paths, map->paths_size);
+    status = close(fd) != 0 || status;
+    if (status == 0)
+        status = rename(temporary_path, map_path) != 0;
+    else
+        unlink(temporary_path);
+    return status;
+}
+
+/*
+ * check that every index and offset of a mapped sidecar stays inside its arrays
+ */
+static int valid_arrays(const owner_map *map)
+{
+    if (map->paths_size == 0 || map->paths[map->paths_size - 1] != '\0')
+        return 0;
+    for (uint32_t i = 0; i <= map->bucket_count; i++)
+        if (map->buckets[i] > map->extent_count || (i > 0 && map->buckets[i] < map->buckets[i - 1]))
+            return 0;
+    for (uint32_t i = 0; i < map->extent_count; i++)
+        if (map->extents[i].file >= map->file_count)
+            return 0;
+    for (uint32_t i = 0; i < map->file_count; i++)
+        if (map->files[i].path_offset >= map->paths_size)
+            return 0;
+    return 1;
+}
+
+int owner_map_open(const char *map_path, const char *image_path, const boot_sector *bs, const partition_entry *entry, owner_map *map)
+{
+    memset(map, 0, sizeof(*map));
+
+    struct stat image;
+    if (stat(image_path, &image) != 0)
+        return 1;
+
+    int fd = open(map_path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(owner_map_header))
+    {
+        close(fd);
+        return 1;
+    }
+
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return 1;
+
+    // reject sidecars of another image, volume or version of the image, and truncated ones
+    const owner_map_header *header = mapping;
+    uint64_t expected_size = sizeof(owner_map_header) + ((uint64_t)header->bucket_count + 1) * sizeof(uint32_t) +
+                             (uint64_t)header->extent_count * sizeof(owner_extent) +
+                             (uint64_t)header->file_count * sizeof(owner_file) + header->paths_size;
+    if (!sidecar_identity_matches(&header->identity, OWNER_MAP_MAGIC, &image, bs, entry) ||
+        header->cluster_size != (uint32_t)bs->sectors_per_cluster * bs->bytes_per_sector ||
+        header->bucket_count != (header->cluster_end >> OWNER_BUCKET_SHIFT) + 1 ||
+        expected_size != (uint64_t)st.st_size)
+    {
+        munmap(mapping, st.st_size);
+        return 1;
+    }
+
+    // the arrays are only read, the casts drop the const of the read-only mapping
+    map->map = mapping;
+    map->map_size = st.st_size;
+    map->cluster_size = header->cluster_size;
+    map->cluster_end = header->cluster_end;
+    map->bucket_count = header->bucket_count;
+    map->extent_count = header->extent_count;
+    map->file_count = header->file_count;
+    map->paths_size = header->paths_size;
+    map->files = (owner_file *)(map->map + sizeof(owner_map_header));
+    map->extents = (owner_extent *)(map->files + header->file_count);
+    map->buckets = (uint32_t *)(map->extents + header->extent_count);
+    map->paths = (char *)(map->buckets + header->bucket_count + 1);
+    if (!valid_arrays(map))
+    {
+        owner_map_free(map);
+        return 1;
+    }
+    return 0;
+}
+
+const owner_extent *owner_map_find(const owner_map *map, uint32_t cluster)
+{
+    uint32_t bucket = cluster >> OWNER_BUCKET_SHIFT;
+    if (bucket >= map->bucket_count)
+        return NULL;
+
+    // last extent starting at or before cluster, which is at worst the last one of an earlier bucket
+    uint32_t low = map->buckets[bucket], high = map->buckets[bucket + 1];
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (map->extents[middle].start_cluster <= cluster)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == 0)
+        return NULL;
+
+    // runs sharing a cluster share their last cluster too, so no earlier extent can cover a cluster this one misses
+    const owner_extent *item = &map->extents[low - 1];
+    return cluster - item->start_cluster < item->length ? item : NULL;
+}
+
+void owner_map_free(owner_map *map)
+{
+    if (map->map)
+        munmap((void *)map->map, map->map_size);
+    else
+    {
+        free(map->extents);
+        free(map->files);
+        free(map->paths);
+        free(map->buckets);
+    }
+    memset(map, 0, sizeof(*map));
+}
@@ -0,0 +1,109 @@
+#ifndef OWNER_MAP_H
+#define OWNER_MAP_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+#include "fat_analysis.h"
+#include "sidecar.h"
+
+#define OWNER_ROOT_PATH "/" // path of the root directory, which has no entry of its own
+#define OWNER_MAP_MAGIC "F32OWN02"
+#define OWNER_BUCKET_SHIFT 6 // buckets[cluster >> OWNER_BUCKET_SHIFT] narrows a lookup to the extents of 64 clusters
+
+/*
+ * The sidecar file is laid out as: header | files | extents | buckets | paths, and is mmap-able as is: the header is
+ * a multiple of 8 bytes and each array is at least as aligned as the next one.
+ */
+#pragma pack(push, 1)
+typedef struct owner_map_header_t
+{
+    sidecar_identity identity; // the sidecar is only valid for the image and volume it was built from
+    uint32_t cluster_size;
+    uint32_t cluster_end;
+    uint32_t bucket_count;
+    uint32_t extent_count;
+    uint32_t file_count;
+    uint32_t reserved;
+    uint64_t paths_size;
+} owner_map_header;
+#pragma pack(pop)
+
+/*
+ * run of physically contiguous clusters of a chain, with its position in the chain
+ */
+typedef struct owner_extent_t
+{
+    uint32_t start_cluster;
+    uint32_t length;       // in clusters
+    uint32_t file;         // index in owner_map.files
+    uint32_t file_cluster; // index of start_cluster in the chain of the file
+} owner_extent;
+
+typedef struct owner_file_t
+{
+    uint64_t path_offset; // of the null-terminated path in owner_map.paths
+    uint32_t size;        // file_size, 0 for directories
+    uint32_t directory;
+} owner_file;
+
+/*
+ * reverse map from clusters to the files and directories whose chains hold them, as extents sorted by cluster.
+ * A cluster claimed by several chains (cross-link) is attributed to one of them.
+ */
+typedef struct owner_map_t
+{
+    owner_extent *extents;
+    uint32_t extent_count;
+    uint32_t extent_capacity;
+    owner_file *files;
+    uint32_t file_count;
+    uint32_t file_capacity;
+    char *paths;
+    uint64_t paths_size;
+    uint64_t paths_capacity;
+    uint32_t cluster_size;
+    uint32_t cluster_end; // one past the last data cluster
+    // buckets[b] is the number of extents starting before cluster b << OWNER_BUCKET_SHIFT, bucket_count + 1 entries
+    uint32_t *buckets;
+    uint32_t bucket_count;
+    const uint8_t *map; // sidecar mapping the arrays point into, NULL for a map built in memory
+    size_t map_size;
+} owner_map;
+
+/*
+ * build the map from one walk of the directory tree (on thread_count threads), the chains being followed run by
+ * run in the FAT bitmap of the volume
+ */
+int owner_map_build(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, const fat_bitmap *bitmap, int thread_count, owner_map *map);
+
+/*
+ * default sidecar location for a partition: <image>.p<partition_number>.owners
+ */
+void owner_map_sidecar_path(const char *image_path, int partition_number, char *map_path, size_t size);
+
+/*
+ * write the map to map_path, through a temporary file renamed at the end
+ */
+int owner_map_save(const owner_map *map, const char *image_path, const boot_sector *bs, const partition_entry *entry, const char *map_path);
+
+/*
+ * map a sidecar. Return 1 if it does not exist, is damaged or was built from another image, volume or image
+ * version.
+ */
+int owner_map_open(const char *map_path, const char *image_path, const boot_sector *bs, const partition_entry *entry, owner_map *map);
+
+/*
+ * extent holding cluster, NULL if no chain of the tree holds it
+ */
+const owner_extent *owner_map_find(const owner_map *map, uint32_t cluster);
+
+static inline const char *owner_map_path(const owner_map *map, uint32_t file)
+{
+    return map->paths + map->files[file].path_offset;
+}
+
+void owner_map_free(owner_map *map);
+
+#endif
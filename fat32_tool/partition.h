@@ -3,6 +3,9 @@
 
 #include "utils.h"
 #include "master_boot_record.h"
+#include "block_device.h"
+
+#include <time.h>
 
 #pragma pack(push, 1)
 typedef struct boot_sector_t
@@ -57,18 +60,55 @@ typedef struct directory_table_entry_t
 #pragma pack(pop)
 
 /*
- * extract boot sector from image file into structure
+ * first cluster of a directory entry, from its two 16-bit halves
+ */
+static inline uint32_t entry_first_cluster(const directory_table_entry *entry)
+{
+	return ((uint32_t)entry->first_cluster_high << 16) | entry->first_cluster_low;
+}
+
+typedef struct fat_table_t fat_table; // defined in fat_cache.h
+typedef struct volume_geometry_t volume_geometry; // defined in geometry.h
+
+/*
+ * write the lowercase "name.ext" form of a directory entry name into name (SHORT_NAME_MAX bytes), return its length
+ */
+size_t format_entry_name(const directory_table_entry *entry, char *name);
+
+/*
+ * FAT dates and times are local time: date bits 15-9 year since 1980, 8-5 month, 4-0 day; time bits 15-11 hour,
+ * 10-5 minute, 4-0 seconds / 2. Fill local (tm_isdst left to mktime), return 0 if the date is unset.
  */
-int extract_bs(FILE *disk_image, const partition_entry *entry, boot_sector *bs);
+int fat_decode_time(uint16_t date, uint16_t time, struct tm *local);
+
+/*
+ * why extract_bs rejected a boot sector
+ */
+typedef enum boot_sector_status_t
+{
+	BOOT_SECTOR_OK = 0,
+	BOOT_SECTOR_UNREADABLE,
+	BOOT_SECTOR_NOT_FAT32,        // the file system type is not FAT32
+	BOOT_SECTOR_INVALID_GEOMETRY, // fields the address arithmetic cannot use, see geometry_validate
+} boot_sector_status;
+
+/*
+ * extract boot sector from image file into structure, and check that its geometry is usable. Nothing is printed,
+ * the caller reports the status.
+ */
+boot_sector_status extract_bs(block_device *dev, const partition_entry *entry, boot_sector *bs);
+
+const char *boot_sector_strerror(boot_sector_status status);
 
 /*
  * print the boot sector information as asked in the homework
  */
-void print_bootsector(boot_sector *bs);
+void print_bootsector(const boot_sector *bs, FILE *out);
 
 /*
- *  print the directory/file tree structure by iterating through the clusters and directory entries recursively
+ *  print the directory/file tree structure, the directories being read on thread_count threads.
+ *  Return 1 if the tree could not be read, 0 otherwise.
  */
-void print_tree(FILE *disk_image, uint32_t cluster, const boot_sector *bs, const partition_entry *entry, int level);
+int print_tree(block_device *dev, fat_table *fat, uint32_t cluster, const volume_geometry *geometry, int thread_count, FILE *out);
 
 #endif
\ No newline at end of file
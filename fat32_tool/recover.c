@@ -0,0 +1,118 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "recover.h"
+#include "fat_analysis.h"
+#include "extract.h"
+#include "walker.h"
+#include "geometry.h"
+
+typedef struct recover_context_t
+{
+    block_device *dev;
+    const volume_geometry *geometry;
+    const fat_bitmap *bitmap;
+    const char *output_dir;
+    FILE *out;
+    uint64_t listed;
+    uint64_t recoverable;
+    uint64_t written;
+    int failed;
+} recover_context;
+
+/*
+ * state of the clusters a deleted file would occupy under the contiguous allocation assumption
+ */
+static const char *deleted_state(const recover_context *recover, const directory_table_entry *file, uint32_t first_cluster, uint32_t clusters)
+{
+    if (file->attributes & DIRECTORY_ATTRIBUTE)
+        return "directory";
+    if (clusters == 0)
+        return "empty";
+    if (first_cluster < 2 || first_cluster >= recover->bitmap->end || clusters > recover->bitmap->end - first_cluster)
+        return "invalid";
+    for (uint32_t cluster = first_cluster; cluster < first_cluster + clusters; cluster++)
+        if (recover->bitmap->used[cluster / FAT_BITMAP_WORD_BITS] & ((uint64_t)1 << (cluster % FAT_BITMAP_WORD_BITS)))
+            return "overwritten";
+    return NULL;
+}
+
+static int write_recovered(recover_context *recover, const walk_entry *item, uint32_t first_cluster, uint32_t clusters)
+{
+    char path[WALK_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%u_%s", recover->output_dir, first_cluster, item->name);
+    int out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0)
+    {
+        fprintf(stderr, "Error: cannot create %s\n", path);
+        return 1;
+    }
+
+    extent run = {first_cluster, clusters};
+    extent_list extents = {&run, 1, 1, clusters};
+    int status = extract_extents(recover->dev, recover->geometry, &extents, item->entry.file_size, out_fd);
+    if (close(out_fd) != 0)
+        status = 1;
+    if (status != 0)
+        fprintf(stderr, "Error: cannot write %s\n", path);
+    return status;
+}
+
+static int recover_entry(const walk_entry *item, const char *path, int depth, void *context)
+{
+    (void)depth;
+    recover_context *recover = context;
+    const directory_table_entry *file = &item->entry;
+    uint32_t first_cluster = entry_first_cluster(file);
+    uint32_t clusters = (uint32_t)geometry_clusters(recover->geometry, file->file_size);
+
+    const char *state = deleted_state(recover, file, first_cluster, clusters);
+    recover->listed++;
+    if (!state)
+    {
+        state = "recoverable";
+        recover->recoverable++;
+        if (recover->output_dir)
+        {
+            if (write_recovered(recover, item, first_cluster, clusters) != 0)
+                recover->failed = 1;
+            else
+                recover->written++;
+        }
+    }
+    fprintf(recover->out, "%s\t%u\t%u\t%s\n", path, file->file_size, first_cluster, state);
+    return 0;
+}
+
+int recover_deleted(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, const char *output_dir, FILE *out)
+{
+    fat_bitmap bitmap;
+    if (fat_bitmap_build(fat, bs, &bitmap) != 0)
+        return 1;
+
+    walk_tree tree;
+    if (walk_tree_build(dev, fat, geometry, bs->root_cluster, thread_count, &tree) != 0)
+    {
+        fat_bitmap_free(&bitmap);
+        return 1;
+    }
+
+    recover_context recover;
+    memset(&recover, 0, sizeof(recover));
+    recover.dev = dev;
+    recover.geometry = geometry;
+    recover.bitmap = &bitmap;
+    recover.output_dir = output_dir;
+    recover.out = out;
+
+    fprintf(out, "# path\tsize\tfirst_cluster\tstate\n");
+    walk_tree_visit_deleted(&tree, recover_entry, &recover);
+    fprintf(out, "# %lu deleted entries, %lu recoverable", (unsigned long)recover.listed, (unsigned long)recover.recoverable);
+    if (output_dir)
+        fprintf(out, ", %lu written to %s", (unsigned long)recover.written, output_dir);
+    fprintf(out, "\n");
+
+    walk_tree_free(&tree);
+    fat_bitmap_free(&bitmap);
+    return recover.failed;
+}
@@ -0,0 +1,20 @@
+#ifndef RECOVER_H
+#define RECOVER_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+
+/*
+ * list the deleted entries of every live directory as "path<tab>size<tab>first_cluster<tab>state" lines, the first
+ * character of their name, which FAT overwrites on deletion, shown as DELETED_NAME_CHAR. The content of a deleted
+ * file is assumed to be the file_size bytes stored contiguously from its first cluster, as FAT drivers allocate
+ * when space allows; state tells whether those clusters are all free (recoverable), partly reused (overwritten),
+ * outside the data area (invalid), or whether there is nothing to recover (empty, directory).
+ * If output_dir is not NULL, every recoverable file is written there as "<first_cluster>_<name>".
+ * Return 1 if the volume could not be read or a file could not be written, 0 otherwise.
+ */
+int recover_deleted(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, const char *output_dir, FILE *out);
+
+#endif
@@ -0,0 +1,421 @@
+#include "search.h"
+#include "fat_analysis.h"
+#include "owner_map.h"
+#include "work_pool.h"
+#include "geometry.h"
+
+#define AUTOMATON_ALPHABET 256
+
+typedef struct keyword_list_t
+{
+    char **items;
+    uint32_t count;
+    uint32_t capacity;
+    size_t longest;
+} keyword_list;
+
+/*
+ * Aho-Corasick automaton with every transition precomputed, so that the scan does one table lookup per byte
+ */
+typedef struct search_automaton_t
+{
+    int32_t *next;       // state * AUTOMATON_ALPHABET + byte -> state
+    int32_t *fail;       // longest proper suffix of the state that is also a state
+    int32_t *keyword;    // keyword spelled by the state, -1 if none
+    int32_t *dictionary; // nearest state on the fail chain spelling a keyword, -1 if none
+    uint8_t *reports;    // the state or its fail chain spells a keyword
+    uint8_t starts[AUTOMATON_ALPHABET]; // the byte leaves the root state, that is starts a keyword
+    uint32_t state_count;
+} search_automaton;
+
+typedef struct search_hit_t
+{
+    uint64_t offset; // from the start of the data region
+    uint32_t keyword;
+} search_hit;
+
+typedef struct search_worker_t
+{
+    uint8_t *scratch;
+    search_hit *hits;
+    uint64_t hit_count;
+    uint64_t hit_capacity;
+    int failed;
+} search_worker;
+
+typedef struct search_context_t
+{
+    block_device *dev;
+    const search_automaton *automaton;
+    const keyword_list *keywords;
+    const volume_geometry *geometry;
+    uint64_t data_start; // image offset of cluster 2
+    uint64_t data_size;
+    search_worker *workers;
+} search_context;
+
+static void free_keywords(keyword_list *keywords)
+{
+    for (uint32_t i = 0; i < keywords->count; i++)
+        free(keywords->items[i]);
+    free(keywords->items);
+}
+
+static int read_keywords(const char *path, keyword_list *keywords)
+{
+    memset(keywords, 0, sizeof(*keywords));
+    FILE *input = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!input)
+    {
+        perror("Error");
+        return 1;
+    }
+
+    char line[SEARCH_KEYWORD_MAX + 2];
+    int status = 0;
+    while (status == 0 && fgets(line, sizeof(line), input))
+    {
+        size_t length = strcspn(line, "\r\n");
+        if (line[length] == '\0' && !feof(input))
+        {
+            fprintf(stderr, "Error: keyword longer than %d bytes\n", SEARCH_KEYWORD_MAX);
+            status = 1;
+            break;
+        }
+        line[length] = '\0';
+        if (length == 0)
+            continue;
+
+        if (keywords->count == keywords->capacity)
+        {
+            uint32_t capacity = keywords->capacity ? keywords->capacity * 2 : 16;
+            char **grown = realloc(keywords->items, capacity * sizeof(char *));
+            if (!grown)
+            {
+                perror("Error");
+                status = 1;
+                break;
+            }
+            keywords->items = grown;
+            keywords->capacity = capacity;
+        }
+        keywords->items[keywords->count] = strdup(line);
+        if (!keywords->items[keywords->count])
+        {
+            perror("Error");
+            status = 1;
+            break;
+        }
+        keywords->count++;
+        if (length > keywords->longest)
+            keywords->longest = length;
+    }
+
+    if (input != stdin)
+        fclose(input);
+    if (status == 0 && keywords->count == 0)
+    {
+        fprintf(stderr, "Error: no keyword in %s\n", path);
+        status = 1;
+    }
+    if (status != 0)
+        free_keywords(keywords);
+    return status;
+}
+
+static void free_automaton(search_automaton *automaton)
+{
+    free(automaton->next);
+    free(automaton->fail);
+    free(automaton->keyword);
+    free(automaton->dictionary);
+    free(automaton->reports);
+}
+
+/*
+ * build the trie of the keywords, then complete it breadth first: the missing transitions of a state are those of
+ * its fail state, which is closer to the root and therefore already complete
+ */
+static int build_automaton(const keyword_list *keywords, search_automaton *automaton)
+{
+    uint64_t max_states = 1;
+    for (uint32_t i = 0; i < keywords->count; i++)
+        max_states += strlen(keywords->items[i]);
+
+    memset(automaton, 0, sizeof(*automaton));
+    automaton->next = malloc(max_states * AUTOMATON_ALPHABET * sizeof(int32_t));
+    automaton->fail = calloc(max_states, sizeof(int32_t));
+    automaton->keyword = malloc(max_states * sizeof(int32_t));
+    automaton->dictionary = malloc(max_states * sizeof(int32_t));
+    automaton->reports = calloc(max_states, 1);
+    int32_t *queue = malloc(max_states * sizeof(int32_t));
+    if (!automaton->next || !automaton->fail || !automaton->keyword || !automaton->dictionary || !automaton->reports || !queue)
+    {
+        perror("Error");
+        free(queue);
+        free_automaton(automaton);
+        return 1;
+    }
+    memset(automaton->next, 0xFF, max_states * AUTOMATON_ALPHABET * sizeof(int32_t));
+    memset(automaton->keyword, 0xFF, max_states * sizeof(int32_t));
+    memset(automaton->dictionary, 0xFF, max_states * sizeof(int32_t));
+
+    int32_t *next = automaton->next;
+    automaton->state_count = 1;
+    for (uint32_t i = 0; i < keywords->count; i++)
+    {
+        int32_t state = 0;
+        for (const uint8_t *byte = (const uint8_t *)keywords->items[i]; *byte; byte++)
+        {
+            int32_t *slot = &next[state * AUTOMATON_ALPHABET + *byte];
+            if (*slot < 0)
+                *slot = (int32_t)automaton->state_count++;
+            state = *slot;
+        }
+        // a repeated keyword is reported once, under its first line
+        if (automaton->keyword[state] < 0)
+            automaton->keyword[state] = (int32_t)i;
+    }
+
+    uint32_t head = 0, tail = 0;
+    for (int byte = 0; byte < AUTOMATON_ALPHABET; byte++)
+    {
+        if (next[byte] < 0)
+            next[byte] = 0;
+        else
+            queue[tail++] = next[byte];
+    }
+    for (int byte = 0; byte < AUTOMATON_ALPHABET; byte++)
+        automaton->starts[byte] = next[byte] != 0;
+    while (head < tail)
+    {
+        int32_t state = queue[head++];
+        int32_t fail = automaton->fail[state];
+        automaton->dictionary[state] = automaton->keyword[fail] >= 0 ? fail : automaton->dictionary[fail];
+        automaton->reports[state] = automaton->keyword[state] >= 0 || automaton->dictionary[state] >= 0;
+        for (int byte = 0; byte < AUTOMATON_ALPHABET; byte++)
+        {
+            int32_t *slot = &next[state * AUTOMATON_ALPHABET + byte];
+            if (*slot < 0)
+                *slot = next[fail * AUTOMATON_ALPHABET + byte];
+            else
+            {
+                automaton->fail[*slot] = next[fail * AUTOMATON_ALPHABET + byte];
+                queue[tail++] = *slot;
+            }
+        }
+    }
+    free(queue);
+    return 0;
+}
+
+static int add_hit(search_worker *worker, uint64_t offset, uint32_t keyword)
+{
+    if (worker->hit_count == worker->hit_capacity)
+    {
+        uint64_t capacity = worker->hit_capacity ? worker->hit_capacity * 2 : 256;
+        search_hit *grown = realloc(worker->hits, capacity * sizeof(search_hit));
+        if (!grown)
+            return 1;
+        worker->hits = grown;
+        worker->hit_capacity = capacity;
+    }
+    worker->hits[worker->hit_count].offset = offset;
+    worker->hits[worker->hit_count].keyword = keyword;
+    worker->hit_count++;
+    return 0;
+}
+
+/*
+ * scan one chunk, from longest - 1 bytes before it so that the hits ending in the chunk are all seen. A hit is
+ * recorded by the chunk holding its last byte, so the overlap never reports one twice.
+ */
+static void search_chunk_task(work_pool *pool, int worker_index, void *task)
+{
+    search_context *search = pool->context;
+    search_worker *worker = &search->workers[worker_index];
+    const search_automaton *automaton = search->automaton;
+    uint64_t start = *(const uint64_t *)task;
+    uint64_t end = search->data_size - start < SEARCH_CHUNK_SIZE ? search->data_size : start + SEARCH_CHUNK_SIZE;
+    uint64_t overlap = search->keywords->longest - 1;
+    uint64_t begin = start > overlap ? start - overlap : 0;
+    if (worker->failed)
+        return;
+
+    const uint8_t *data = block_device_get(search->dev, search->data_start + begin, (size_t)(end - begin), worker->scratch);
+    if (!data)
+    {
+        worker->failed = 1;
+        return;
+    }
+
+    const int32_t *next = automaton->next;
+    const uint8_t *reports = automaton->reports;
+    const uint8_t *starts = automaton->starts;
+    size_t size = (size_t)(end - begin);
+    size_t first_end = (size_t)(start - begin); // hits ending before this byte belong to the previous chunk
+    int32_t state = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        // the bytes starting no keyword keep the automaton in its root state, they are skipped without a transition
+        if (state == 0)
+        {
+            while (i < size && !starts[data[i]])
+                i++;
+            if (i == size)
+                break;
+        }
+        state = next[state * AUTOMATON_ALPHABET + data[i]];
+        if (!reports[state] || i < first_end)
+            continue;
+        for (int32_t match = automaton->keyword[state] >= 0 ? state : automaton->dictionary[state]; match >= 0; match = automaton->dictionary[match])
+        {
+            uint32_t keyword = (uint32_t)automaton->keyword[match];
+            uint64_t length = strlen(search->keywords->items[keyword]);
+            if (add_hit(worker, begin + i + 1 - length, keyword) != 0)
+            {
+                worker->failed = 1;
+                return;
+            }
+        }
+    }
+}
+
+static int compare_hits(const void *a, const void *b)
+{
+    const search_hit *x = a, *y = b;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return x->keyword < y->keyword ? -1 : x->keyword > y->keyword;
+}
+
+static void print_hit(const search_hit *hit, const search_context *search, const keyword_list *keywords, const owner_map *map, const fat_bitmap *bitmap, FILE *out)
+{
+    uint64_t image_offset = search->data_start + hit->offset;
+    uint32_t cluster = geometry_offset_cluster(search->geometry, image_offset);
+    const owner_extent *owner = owner_map_find(map, cluster);
+    if (!owner)
+    {
+        int used = (bitmap->used[cluster / FAT_BITMAP_WORD_BITS] >> (cluster % FAT_BITMAP_WORD_BITS)) & 1;
+        fprintf(out, "%lu\t%s\t%s\t-\t-\n", (unsigned long)image_offset, keywords->items[hit->keyword], used ? "lost" : "unallocated");
+        return;
+    }
+
+    const owner_file *file = &map->files[owner->file];
+    uint64_t file_offset = (uint64_t)(owner->file_cluster + (cluster - owner->start_cluster)) * map->cluster_size + geometry_offset_in_cluster(search->geometry, image_offset);
+    const char *area = file->directory ? "directory" : file_offset < file->size ? "file" : "slack";
+    fprintf(out, "%lu\t%s\t%s\t%s\t%lu\n", (unsigned long)image_offset, keywords->items[hit->keyword], area, owner_map_path(map, owner->file), (unsigned long)file_offset);
+}
+
+int search_volume(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, const char *keywords_path, FILE *out)
+{
+    keyword_list keywords;
+    if (read_keywords(keywords_path, &keywords) != 0)
+        return 1;
+
+    search_automaton automaton;
+    if (build_automaton(&keywords, &automaton) != 0)
+    {
+        free_keywords(&keywords);
+        return 1;
+    }
+
+    fat_bitmap bitmap;
+    owner_map map;
+    if (fat_bitmap_build(fat, bs, &bitmap) != 0)
+    {
+        free_automaton(&automaton);
+        free_keywords(&keywords);
+        return 1;
+    }
+    if (owner_map_build(dev, fat, bs, geometry, &bitmap, thread_count, &map) != 0)
+    {
+        fat_bitmap_free(&bitmap);
+        free_automaton(&automaton);
+        free_keywords(&keywords);
+        return 1;
+    }
+
+    search_context search;
+    search.dev = dev;
+    search.automaton = &automaton;
+    search.keywords = &keywords;
+    search.geometry = geometry;
+    search.data_start = geometry->data_offset;
+    search.data_size = (uint64_t)(bitmap.end - 2) * map.cluster_size;
+    if (search.data_start + search.data_size > dev->size)
+        search.data_size = dev->size > search.data_start ? dev->size - search.data_start : 0;
+
+    uint64_t chunk_count = (search.data_size + SEARCH_CHUNK_SIZE - 1) / SEARCH_CHUNK_SIZE;
+    int worker_count = thread_count > 1 ? thread_count : 1;
+    search.workers = calloc((size_t)worker_count, sizeof(search_worker));
+    uint64_t *starts = malloc(chunk_count * sizeof(uint64_t) + 1);
+    int status = !search.workers || !starts;
+    for (int i = 0; status == 0 && i < worker_count; i++)
+    {
+        search.workers[i].scratch = malloc(SEARCH_CHUNK_SIZE + keywords.longest);
+        status = search.workers[i].scratch == NULL;
+    }
+    if (status != 0)
+        perror("Error");
+
+    work_pool pool;
+    if (status == 0 && work_pool_init(&pool, worker_count, search_chunk_task, &search) == 0)
+    {
+        // the owner pops the most recent task, so the chunks are pushed from the end and read in image order
+        for (uint64_t i = chunk_count; i-- > 0;)
+        {
+            starts[i] = i * SEARCH_CHUNK_SIZE;
+            work_pool_push(&pool, 0, &starts[i]);
+        }
+        status = work_pool_run(&pool);
+        work_pool_free(&pool);
+    }
+    else
+        status = 1;
+
+    // merge the hits of every worker and print them in image order
+    uint64_t hit_count = 0;
+    for (int i = 0; search.workers && i < worker_count; i++)
+    {
+        status |= search.workers[i].failed;
+        hit_count += search.workers[i].hit_count;
+    }
+    search_hit *hits = status == 0 ? malloc(hit_count * sizeof(search_hit) + 1) : NULL;
+    if (status == 0 && !hits)
+    {
+        perror("Error");
+        status = 1;
+    }
+    if (status == 0)
+    {
+        uint64_t merged = 0;
+        for (int i = 0; i < worker_count; i++)
+        {
+            memcpy(hits + merged, search.workers[i].hits, search.workers[i].hit_count * sizeof(search_hit));
+            merged += search.workers[i].hit_count;
+        }
+        qsort(hits, hit_count, sizeof(search_hit), compare_hits);
+
+        fprintf(out, "# offset\tkeyword\tarea\tpath\tfile_offset\n");
+        for (uint64_t i = 0; i < hit_count; i++)
+            print_hit(&hits[i], &search, &keywords, &map, &bitmap, out);
+        fprintf(out, "# %lu hits for %u keywords in %lu bytes\n", (unsigned long)hit_count, keywords.count, (unsigned long)search.data_size);
+    }
+    else
+        fprintf(stderr, "Error: cannot search the data region\n");
+
+    free(hits);
+    for (int i = 0; search.workers && i < worker_count; i++)
+    {
+        free(search.workers[i].scratch);
+        free(search.workers[i].hits);
+    }
+    free(search.workers);
+    free(starts);
+    owner_map_free(&map);
+    fat_bitmap_free(&bitmap);
+    free_automaton(&automaton);
+    free_keywords(&keywords);
+    return status;
+}
@@ -0,0 +1,23 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+
+#define SEARCH_CHUNK_SIZE (16 * 1024 * 1024) // bytes of the data region scanned by one task
+#define SEARCH_KEYWORD_MAX 1024             // longest keyword accepted
+
+/*
+ * look for every keyword of keywords_path (one per line, - for stdin) in the whole data region of the volume and
+ * print one "offset<tab>keyword<tab>area<tab>path<tab>file_offset" line per hit, in image order. The keywords are
+ * compiled into an Aho-Corasick automaton that scans the region in SEARCH_CHUNK_SIZE tasks on thread_count
+ * threads; each task starts a keyword length early so that hits crossing a chunk or cluster boundary are found.
+ * A hit is attributed, through the cluster reverse map, to the file or directory holding its first byte (area
+ * file, slack past file_size, or directory), or labeled unallocated or lost (allocated but reachable from no
+ * entry). Return 1 if the keywords or the volume could not be read, 0 otherwise.
+ */
+int search_volume(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, const char *keywords_path, FILE *out);
+
+#endif
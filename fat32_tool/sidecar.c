@@ -0,0 +1,46 @@
+#include "sidecar.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+void sidecar_identity_init(sidecar_identity *identity, const char *magic, const struct stat *image, const boot_sector *bs, const partition_entry *entry)
+{
+    memset(identity, 0, sizeof(*identity));
+    memcpy(identity->magic, magic, sizeof(identity->magic));
+    identity->image_size = (uint64_t)image->st_size;
+    identity->image_mtime_sec = image->st_mtim.tv_sec;
+    identity->image_mtime_nsec = image->st_mtim.tv_nsec;
+    identity->volume_id = bs->volume_id;
+    identity->start_lba = entry->start_lba;
+}
+
+int sidecar_identity_matches(const sidecar_identity *identity, const char *magic, const struct stat *image, const boot_sector *bs, const partition_entry *entry)
+{
+    return memcmp(identity->magic, magic, sizeof(identity->magic)) == 0 &&
+           identity->image_size == (uint64_t)image->st_size &&
+           identity->image_mtime_sec == image->st_mtim.tv_sec &&
+           identity->image_mtime_nsec == image->st_mtim.tv_nsec &&
+           identity->volume_id == bs->volume_id &&
+           identity->start_lba == entry->start_lba;
+}
+
+int write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    while (size > 0)
+    {
+        ssize_t n = write(fd, bytes, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return 1;
+        if (n == 0)
+        {
+            errno = EIO;
+            return 1;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return 0;
+}
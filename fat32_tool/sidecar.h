@@ -0,0 +1,40 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include "utils.h"
+#include "partition.h"
+
+#include <sys/stat.h>
+
+/*
+ * Start of the header of every file derived from one volume of an image (directory index, reverse map, export
+ * checkpoint): the file is only valid for the image, version of the image and volume it was built from.
+ */
+#pragma pack(push, 1)
+typedef struct sidecar_identity_t
+{
+    char magic[8];
+    uint64_t image_size;
+    int64_t image_mtime_sec;
+    int64_t image_mtime_nsec;
+    uint32_t volume_id;
+    uint32_t start_lba;
+} sidecar_identity;
+#pragma pack(pop)
+
+/*
+ * fill identity for the volume of bs and entry in the image described by image (stat of the image file)
+ */
+void sidecar_identity_init(sidecar_identity *identity, const char *magic, const struct stat *image, const boot_sector *bs, const partition_entry *entry);
+
+/*
+ * return 1 if identity was written for this image, volume and format (magic), 0 if the file is stale or foreign
+ */
+int sidecar_identity_matches(const sidecar_identity *identity, const char *magic, const struct stat *image, const boot_sector *bs, const partition_entry *entry);
+
+/*
+ * write size bytes to fd, retrying short and interrupted writes. Return 1 on failure, with errno set by write.
+ */
+int write_all(int fd, const void *data, size_t size);
+
+#endif
@@ -0,0 +1,152 @@
+#include "stats.h"
+
+#include <pthread.h>
+#include <time.h>
+
+__thread stats_block *stats_local;
+
+static stats_block *blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// counters of the threads that have exited, under blocks_lock
+static uint64_t exited_counters[STAT_COUNTER_COUNT];
+static uint64_t exited_max_seek_distance;
+static int exited_threads;
+
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+
+// phases are timed by the main thread only
+static double phase_start[STAT_PHASE_COUNT];
+static double phase_seconds[STAT_PHASE_COUNT];
+
+static const char *const counter_names[STAT_COUNTER_COUNT] = {
+    "reads", "read_bytes", "maps", "map_bytes", "seeks", "seek_distance",
+    "lookups", "page_hits", "page_misses",
+    "hits", "misses", "prefetched"};
+
+static const char *const phase_names[STAT_PHASE_COUNT] = {
+    "mbr", "boot_sector", "fat_load", "tree_walk", "extraction"};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * destructor of block_key: unlink the block of an exiting thread and fold it into the exited totals
+ */
+static void retire_block(void *value)
+{
+    stats_block *block = value;
+    pthread_mutex_lock(&blocks_lock);
+    stats_block **link = &blocks;
+    while (*link != block)
+        link = &(*link)->next;
+    *link = block->next;
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++)
+        exited_counters[i] += block->counters[i];
+    if (block->max_seek_distance > exited_max_seek_distance)
+        exited_max_seek_distance = block->max_seek_distance;
+    exited_threads++;
+    pthread_mutex_unlock(&blocks_lock);
+    free(block);
+}
+
+static void create_block_key(void)
+{
+    pthread_key_create(&block_key, retire_block);
+}
+
+stats_block *stats_register(void)
+{
+    stats_block *block = calloc(1, sizeof(stats_block));
+    if (!block)
+        return NULL;
+
+    pthread_once(&block_key_once, create_block_key);
+    pthread_setspecific(block_key, block);
+    pthread_mutex_lock(&blocks_lock);
+    block->next = blocks;
+    blocks = block;
+    pthread_mutex_unlock(&blocks_lock);
+
+    stats_local = block;
+    return block;
+}
+
+void stats_access(uint64_t offset, size_t size, int mapped)
+{
+    stats_block *block = stats_local ? stats_local : stats_register();
+    if (!block)
+        return;
+
+    block->counters[mapped ? STAT_DEVICE_MAPS : STAT_DEVICE_READS]++;
+    block->counters[mapped ? STAT_DEVICE_MAP_BYTES : STAT_DEVICE_READ_BYTES] += size;
+
+    if (block->has_position && offset != block->next_offset)
+    {
+        uint64_t distance = offset > block->next_offset ? offset - block->next_offset : block->next_offset - offset;
+        block->counters[STAT_SEEKS]++;
+        block->counters[STAT_SEEK_DISTANCE] += distance;
+        if (distance > block->max_seek_distance)
+            block->max_seek_distance = distance;
+    }
+    block->next_offset = offset + size;
+    block->has_position = 1;
+}
+
+void stats_phase_begin(stat_phase phase)
+{
+    phase_start[phase] = now();
+}
+
+void stats_phase_end(stat_phase phase)
+{
+    phase_seconds[phase] += now() - phase_start[phase];
+}
+
+static void print_counters(FILE *out, const char *name, const uint64_t *totals, int first, int last)
+{
+    fprintf(out, "  \"%s\": {", name);
+    for (int i = first; i <= last; i++)
+        fprintf(out, "%s\"%s\": %lu", i == first ? "" : ", ", counter_names[i], (unsigned long)totals[i]);
+}
+
+void stats_print_json(FILE *out)
+{
+    uint64_t totals[STAT_COUNTER_COUNT];
+    pthread_mutex_lock(&blocks_lock);
+    memcpy(totals, exited_counters, sizeof(totals));
+    uint64_t max_seek_distance = exited_max_seek_distance;
+    int threads = exited_threads;
+    for (const stats_block *block = blocks; block; block = block->next)
+    {
+        for (int i = 0; i < STAT_COUNTER_COUNT; i++)
+            totals[i] += block->counters[i];
+        if (block->max_seek_distance > max_seek_distance)
+            max_seek_distance = block->max_seek_distance;
+        threads++;
+    }
+    pthread_mutex_unlock(&blocks_lock);
+
+    fprintf(out, "{\n  \"phases_ms\": {");
+    for (int i = 0; i < STAT_PHASE_COUNT; i++)
+        fprintf(out, "%s\"%s\": %.3f", i == 0 ? "" : ", ", phase_names[i], phase_seconds[i] * 1000.0);
+    fprintf(out, "},\n");
+
+    print_counters(out, "device", totals, STAT_DEVICE_READS, STAT_SEEK_DISTANCE);
+    fprintf(out, ", \"max_seek_distance\": %lu},\n", (unsigned long)max_seek_distance);
+
+    uint64_t page_accesses = totals[STAT_FAT_PAGE_HITS] + totals[STAT_FAT_PAGE_MISSES];
+    print_counters(out, "fat", totals, STAT_FAT_LOOKUPS, STAT_FAT_PAGE_MISSES);
+    fprintf(out, ", \"page_hit_rate\": %.4f},\n", page_accesses ? (double)totals[STAT_FAT_PAGE_HITS] / page_accesses : 0.0);
+
+    uint64_t cluster_accesses = totals[STAT_CLUSTER_CACHE_HITS] + totals[STAT_CLUSTER_CACHE_MISSES];
+    print_counters(out, "cluster_cache", totals, STAT_CLUSTER_CACHE_HITS, STAT_CLUSTER_CACHE_PREFETCHED);
+    fprintf(out, ", \"hit_rate\": %.4f},\n", cluster_accesses ? (double)totals[STAT_CLUSTER_CACHE_HITS] / cluster_accesses : 0.0);
+
+    fprintf(out, "  \"threads\": %d\n}\n", threads);
+}
@@ -0,0 +1,75 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "utils.h"
+
+typedef enum stat_counter_t
+{
+    STAT_DEVICE_READS,      // copies from the image into a buffer
+    STAT_DEVICE_READ_BYTES,
+    STAT_DEVICE_MAPS,       // zero-copy accesses to the mapped image
+    STAT_DEVICE_MAP_BYTES,
+    STAT_SEEKS,             // accesses not starting where the previous one of the same thread ended
+    STAT_SEEK_DISTANCE,     // sum of the distances of those seeks, in bytes
+    STAT_FAT_LOOKUPS,
+    STAT_FAT_PAGE_HITS,     // paged FAT only
+    STAT_FAT_PAGE_MISSES,
+    STAT_CLUSTER_CACHE_HITS, // clusters served from the cluster cache
+    STAT_CLUSTER_CACHE_MISSES,
+    STAT_CLUSTER_CACHE_PREFETCHED, // clusters read ahead
+    STAT_COUNTER_COUNT
+} stat_counter;
+
+typedef enum stat_phase_t
+{
+    STAT_PHASE_MBR,
+    STAT_PHASE_BOOT_SECTOR,
+    STAT_PHASE_FAT_LOAD,
+    STAT_PHASE_TREE_WALK,
+    STAT_PHASE_EXTRACTION,
+    STAT_PHASE_COUNT
+} stat_phase;
+
+/*
+ * counters of one thread. Each thread increments its own block without synchronization; the live blocks are
+ * linked in a global list and summed when the report is printed. When a thread exits, its block is folded into
+ * the totals of the exited threads and freed.
+ */
+typedef struct stats_block_t
+{
+    uint64_t counters[STAT_COUNTER_COUNT];
+    uint64_t max_seek_distance;
+    uint64_t next_offset; // end of the previous access
+    int has_position;
+    struct stats_block_t *next;
+} stats_block;
+
+extern __thread stats_block *stats_local;
+
+/*
+ * allocate and link the block of the calling thread, NULL if out of memory (the counts are then dropped)
+ */
+stats_block *stats_register(void);
+
+static inline void stats_add(stat_counter counter, uint64_t value)
+{
+    stats_block *block = stats_local ? stats_local : stats_register();
+    if (block)
+        block->counters[counter] += value;
+}
+
+/*
+ * count an access of size bytes at offset of the image, copied or mapped, and the seek that led to it
+ */
+void stats_access(uint64_t offset, size_t size, int mapped);
+
+void stats_phase_begin(stat_phase phase);
+
+void stats_phase_end(stat_phase phase);
+
+/*
+ * print the merged counters and the phase timers as a JSON object. Hit rates are 0 when there was no access.
+ */
+void stats_print_json(FILE *out);
+
+#endif
@@ -0,0 +1,395 @@
+#include "timeline.h"
+#include "walker.h"
+#include "work_pool.h"
+
+#include <pthread.h>
+
+#define RADIX_BUCKETS (1 << TIMELINE_RADIX_BITS)
+
+enum
+{
+    EVENT_CREATED,
+    EVENT_MODIFIED,
+    EVENT_ACCESSED,
+};
+
+static const char *const event_names[] = {"created", "modified", "accessed"};
+
+/*
+ * one timestamp: key holds the DOS date in its high half and the DOS time in its low half, so comparing keys
+ * compares times; reference holds the entry index above the 2 bits of the event type
+ */
+typedef struct timeline_event_t
+{
+    uint32_t key;
+    uint32_t reference;
+} timeline_event;
+
+typedef struct timeline_entry_t
+{
+    uint64_t path_offset; // in the path pool
+    uint32_t size;
+    uint8_t tenths; // hundredths of a second added to the creation time
+    uint8_t deleted;
+} timeline_entry;
+
+typedef struct timeline_context_t
+{
+    timeline_format format;
+    FILE *out;
+    int deleted; // the deleted entries are being visited
+    int failed;
+    timeline_event *events;
+    uint64_t event_count;
+    uint64_t event_capacity;
+    timeline_entry *entries;
+    uint32_t entry_count;
+    uint32_t entry_capacity;
+    char *paths; // the paths, each null-terminated
+    uint64_t path_size;
+    uint64_t path_capacity;
+} timeline_context;
+
+/*
+ * state shared by the threads of a radix sort. Each pass counts the digits of every slice of the events, turns the
+ * counts into the offsets where each slice writes each digit (digit-major, slice-minor, which keeps the sort
+ * stable), then scatters the slices.
+ */
+typedef struct radix_sort_t
+{
+    timeline_event *source;
+    timeline_event *target;
+    uint64_t count;
+    int thread_count;
+    uint64_t (*offsets)[RADIX_BUCKETS]; // per thread
+    int skip;                           // every event has the same digit, the pass would not move anything
+    timeline_event *sorted;
+    pthread_barrier_t barrier;
+    pthread_mutex_t lock;
+    pthread_cond_t start; // the threads wait until the number of threads that could be started is known
+    int ready;
+} radix_sort;
+
+typedef struct radix_worker_t
+{
+    radix_sort *sort;
+    int index;
+} radix_worker;
+
+static void *radix_sort_main(void *argument)
+{
+    radix_worker *worker = argument;
+    radix_sort *sort = worker->sort;
+    pthread_mutex_lock(&sort->lock);
+    while (!sort->ready)
+        pthread_cond_wait(&sort->start, &sort->lock);
+    pthread_mutex_unlock(&sort->lock);
+
+    uint64_t begin = sort->count * worker->index / sort->thread_count;
+    uint64_t end = sort->count * (worker->index + 1) / sort->thread_count;
+    timeline_event *source = sort->source;
+    timeline_event *target = sort->target;
+    uint64_t *offsets = sort->offsets[worker->index];
+
+    for (int shift = 0; shift < 32; shift += TIMELINE_RADIX_BITS)
+    {
+        memset(offsets, 0, RADIX_BUCKETS * sizeof(uint64_t));
+        for (uint64_t i = begin; i < end; i++)
+            offsets[(source[i].key >> shift) & (RADIX_BUCKETS - 1)]++;
+        pthread_barrier_wait(&sort->barrier);
+
+        if (worker->index == 0)
+        {
+            uint64_t offset = 0;
+            sort->skip = 0;
+            for (int digit = 0; digit < RADIX_BUCKETS; digit++)
+            {
+                uint64_t digit_start = offset;
+                for (int thread = 0; thread < sort->thread_count; thread++)
+                {
+                    uint64_t count = sort->offsets[thread][digit];
+                    sort->offsets[thread][digit] = offset;
+                    offset += count;
+                }
+                if (offset - digit_start == sort->count)
+                    sort->skip = 1;
+            }
+        }
+        pthread_barrier_wait(&sort->barrier);
+
+        if (sort->skip)
+            continue;
+        for (uint64_t i = begin; i < end; i++)
+            target[offsets[(source[i].key >> shift) & (RADIX_BUCKETS - 1)]++] = source[i];
+        timeline_event *swap = source;
+        source = target;
+        target = swap;
+        // the next pass counts what the other threads have just written
+        pthread_barrier_wait(&sort->barrier);
+    }
+
+    if (worker->index == 0)
+        sort->sorted = source;
+    return NULL;
+}
+
+/*
+ * sort the events by key. Return the sorted array, events or a new one (events is then freed), or NULL if out of
+ * memory (events is then left as it was).
+ */
+static timeline_event *sort_events(timeline_event *events, uint64_t count, int thread_count)
+{
+    if (count < TIMELINE_PARALLEL_MIN || thread_count < 1)
+        thread_count = 1;
+    if (thread_count > WORK_POOL_MAX_THREADS)
+        thread_count = WORK_POOL_MAX_THREADS;
+
+    radix_sort sort;
+    memset(&sort, 0, sizeof(sort));
+    sort.source = events;
+    sort.target = malloc(count * sizeof(timeline_event));
+    sort.count = count;
+    sort.offsets = calloc(thread_count, sizeof(*sort.offsets));
+    radix_worker *workers = calloc(thread_count, sizeof(radix_worker));
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    if (!sort.target || !sort.offsets || !workers || !threads)
+    {
+        free(sort.target);
+        free(sort.offsets);
+        free(workers);
+        free(threads);
+        return NULL;
+    }
+    pthread_mutex_init(&sort.lock, NULL);
+    pthread_cond_init(&sort.start, NULL);
+
+    // the calling thread sorts the first slice
+    sort.thread_count = 1;
+    for (int i = 1; i < thread_count; i++)
+    {
+        workers[i].sort = &sort;
+        workers[i].index = i;
+        if (pthread_create(&threads[i], NULL, radix_sort_main, &workers[i]) != 0)
+            break;
+        sort.thread_count++;
+    }
+    pthread_barrier_init(&sort.barrier, NULL, sort.thread_count);
+    pthread_mutex_lock(&sort.lock);
+    sort.ready = 1;
+    pthread_cond_broadcast(&sort.start);
+    pthread_mutex_unlock(&sort.lock);
+
+    workers[0].sort = &sort;
+    radix_sort_main(&workers[0]);
+    for (int i = 1; i < sort.thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_barrier_destroy(&sort.barrier);
+    pthread_cond_destroy(&sort.start);
+    pthread_mutex_destroy(&sort.lock);
+    free(sort.offsets);
+    free(workers);
+    free(threads);
+    free(sort.sorted == events ? sort.target : events);
+    return sort.sorted;
+}
+
+static int add_event(timeline_context *timeline, uint16_t date, uint16_t time, int type)
+{
+    if (date == 0)
+        return 0;
+    if (timeline->event_count == timeline->event_capacity)
+    {
+        uint64_t capacity = timeline->event_capacity ? timeline->event_capacity * 2 : 4096;
+        timeline_event *events = realloc(timeline->events, capacity * sizeof(timeline_event));
+        if (!events)
+            return 1;
+        timeline->events = events;
+        timeline->event_capacity = capacity;
+    }
+    timeline_event *event = &timeline->events[timeline->event_count++];
+    event->key = ((uint32_t)date << 16) | time;
+    event->reference = (timeline->entry_count << 2) | type;
+    return 0;
+}
+
+/*
+ * record an entry, its path and its events
+ */
+static int add_entry(timeline_context *timeline, const directory_table_entry *item, const char *path)
+{
+    if (timeline->entry_count == TIMELINE_MAX_ENTRIES)
+    {
+        fprintf(stderr, "Error: more than %u entries, the timeline cannot be built\n", TIMELINE_MAX_ENTRIES);
+        return 1;
+    }
+    if (timeline->entry_count == timeline->entry_capacity)
+    {
+        uint32_t capacity = timeline->entry_capacity ? timeline->entry_capacity * 2 : 1024;
+        timeline_entry *entries = realloc(timeline->entries, capacity * sizeof(timeline_entry));
+        if (!entries)
+            return 1;
+        timeline->entries = entries;
+        timeline->entry_capacity = capacity;
+    }
+
+    size_t length = strlen(path) + 1;
+    if (timeline->path_size + length > timeline->path_capacity)
+    {
+        uint64_t capacity = timeline->path_capacity ? timeline->path_capacity * 2 : 65536;
+        while (capacity < timeline->path_size + length)
+            capacity *= 2;
+        char *paths = realloc(timeline->paths, capacity);
+        if (!paths)
+            return 1;
+        timeline->paths = paths;
+        timeline->path_capacity = capacity;
+    }
+    memcpy(timeline->paths + timeline->path_size, path, length);
+
+    if (add_event(timeline, item->create_date, item->create_time, EVENT_CREATED) != 0 ||
+        add_event(timeline, item->write_date, item->write_time, EVENT_MODIFIED) != 0 ||
+        add_event(timeline, item->last_access_date, 0, EVENT_ACCESSED) != 0)
+        return 1;
+
+    timeline_entry *entry = &timeline->entries[timeline->entry_count++];
+    entry->path_offset = timeline->path_size;
+    entry->size = item->file_size;
+    entry->tenths = item->created_time_tenths;
+    entry->deleted = (uint8_t)timeline->deleted;
+    timeline->path_size += length;
+    return 0;
+}
+
+/*
+ * epoch seconds of a FAT timestamp, 0 if unset
+ */
+static long epoch_seconds(uint16_t date, uint16_t time)
+{
+    struct tm local;
+    if (!fat_decode_time(date, time, &local))
+        return 0;
+    time_t seconds = mktime(&local);
+    return seconds == (time_t)-1 ? 0 : (long)seconds;
+}
+
+/*
+ * Sleuth Kit body format: MD5|name|inode|mode|UID|GID|size|atime|mtime|ctime|crtime, FAT has no change time
+ */
+static void print_body_line(const timeline_context *timeline, const directory_table_entry *item, const char *path)
+{
+    uint32_t first_cluster = entry_first_cluster(item);
+    long created = epoch_seconds(item->create_date, item->create_time);
+    if (created)
+        created += item->created_time_tenths / 100;
+    fprintf(timeline->out, "0|%s%s|%u|%s|0|0|%u|%ld|%ld|0|%ld\n", path, timeline->deleted ? " (deleted)" : "", first_cluster,
+            item->attributes & DIRECTORY_ATTRIBUTE ? "d/drwxrwxrwx" : "r/rrwxrwxrwx", item->file_size,
+            epoch_seconds(item->last_access_date, 0), epoch_seconds(item->write_date, item->write_time), created);
+}
+
+static int visit_entry(const walk_entry *item, const char *path, int depth, void *context)
+{
+    timeline_context *timeline = context;
+    (void)depth;
+    if (strcmp(item->name, ".") == 0 || strcmp(item->name, "..") == 0)
+        return 0;
+
+    // the body format is one line per entry, mactime does the sorting
+    if (timeline->format == TIMELINE_BODYFILE)
+    {
+        print_body_line(timeline, &item->entry, path);
+        return 0;
+    }
+    if (add_entry(timeline, &item->entry, path) != 0)
+    {
+        if (timeline->entry_count < TIMELINE_MAX_ENTRIES)
+            perror("Error");
+        timeline->failed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * CSV quoting: every path is quoted and its quotes doubled
+ */
+static void print_quoted(FILE *out, const char *text)
+{
+    fputc('"', out);
+    for (; *text; text++)
+    {
+        if (*text == '"')
+            fputc('"', out);
+        fputc(*text, out);
+    }
+    fputc('"', out);
+}
+
+static void print_event(const timeline_context *timeline, const timeline_event *event)
+{
+    const timeline_entry *entry = &timeline->entries[event->reference >> 2];
+    int type = event->reference & 3;
+    struct tm local;
+    fat_decode_time((uint16_t)(event->key >> 16), (uint16_t)event->key, &local);
+
+    FILE *out = timeline->out;
+    fprintf(out, "%04d-%02d-%02d", local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+    if (type == EVENT_CREATED)
+        fprintf(out, " %02d:%02d:%02d.%02d", local.tm_hour, local.tm_min, local.tm_sec + entry->tenths / 100, entry->tenths % 100);
+    else if (type == EVENT_MODIFIED)
+        fprintf(out, " %02d:%02d:%02d", local.tm_hour, local.tm_min, local.tm_sec);
+    fprintf(out, ",%s,", event_names[type]);
+    print_quoted(out, timeline->paths + entry->path_offset);
+    fprintf(out, ",%u,%d\n", entry->size, entry->deleted);
+}
+
+int timeline_volume(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, timeline_format format, FILE *out)
+{
+    walk_tree tree;
+    if (walk_tree_build(dev, fat, geometry, bs->root_cluster, thread_count, &tree) != 0)
+        return 1;
+
+    timeline_context timeline;
+    memset(&timeline, 0, sizeof(timeline));
+    timeline.format = format;
+    timeline.out = out;
+    walk_tree_visit(&tree, visit_entry, &timeline);
+    timeline.deleted = 1;
+    if (!timeline.failed)
+        walk_tree_visit_deleted(&tree, visit_entry, &timeline);
+    walk_tree_free(&tree);
+
+    int status = timeline.failed;
+    if (format == TIMELINE_CSV && !status)
+    {
+        timeline_event *sorted = timeline.event_count ? sort_events(timeline.events, timeline.event_count, thread_count) : timeline.events;
+        if (timeline.event_count && !sorted)
+        {
+            perror("Error");
+            status = 1;
+        }
+        else
+        {
+            timeline.events = sorted;
+            fprintf(out, "time,event,path,size,deleted\n");
+            for (uint64_t i = 0; i < timeline.event_count; i++)
+                print_event(&timeline, &timeline.events[i]);
+        }
+    }
+
+    free(timeline.events);
+    free(timeline.entries);
+    free(timeline.paths);
+    return status;
+}
+
+int timeline_parse_format(const char *name, timeline_format *format)
+{
+    if (strcmp(name, "csv") == 0)
+        *format = TIMELINE_CSV;
+    else if (strcmp(name, "body") == 0)
+        *format = TIMELINE_BODYFILE;
+    else
+        return -1;
+    return 0;
+}
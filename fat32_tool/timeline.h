@@ -0,0 +1,35 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+
+#define TIMELINE_RADIX_BITS 8               // key bits sorted per pass
+#define TIMELINE_PARALLEL_MIN (1 << 16)     // fewer events are sorted on one thread
+#define TIMELINE_MAX_ENTRIES (1u << 30)     // entry indexes share 32 bits with the event type
+
+typedef enum timeline_format_t
+{
+    TIMELINE_CSV,      // one row per timestamp, sorted by time
+    TIMELINE_BODYFILE, // one line per entry in the Sleuth Kit body format, for mactime
+} timeline_format;
+
+/*
+ * print the timestamps of every live and deleted entry of the volume ("." and ".." excepted).
+ * CSV rows are "time,event,path,size,deleted" with event created, modified or accessed, the time as written by FAT
+ * (local time, to the hundredth of a second for creations, the day for accesses) and unset timestamps left out.
+ * The events are 8-byte records (packed DOS date and time, entry and event type) sorted by a parallel LSD radix
+ * sort on thread_count threads; the sort is stable, so events with the same time keep the tree order.
+ * Bodyfile lines carry the first cluster as inode and the times converted to epoch seconds with the local time zone.
+ * Return 1 if the volume could not be read, 0 otherwise.
+ */
+int timeline_volume(block_device *dev, fat_table *fat, const boot_sector *bs, const volume_geometry *geometry, int thread_count, timeline_format format, FILE *out);
+
+/*
+ * parse a format name ("csv" or "body"), return -1 if unknown
+ */
+int timeline_parse_format(const char *name, timeline_format *format);
+
+#endif
@@ -12,10 +12,12 @@
 #define N_PARTITION 4
 #define PARTITION_TYPE 0x0C // FAT32
 #define END_OF_CLUSTER_CHAIN 0x0FFFFFF8
+#define BAD_CLUSTER 0x0FFFFFF7
 #define FREE_ENTRY_NAME 0xE5 // means entry is deleted
 #define END_ENTRY_NAME 0 // means no more entries are present after the curent one
 #define VOLUME_LABEL_ATTRIBUTE 0x08 // means the entry is not a file or a directory
 #define DIRECTORY_ATTRIBUTE 0x10 // means the entry is a subdirectory
 #define SHORT_NAME_LENGTH 8
+#define SHORT_NAME_MAX 13 // "name.ext" with its terminating null byte
 
 #endif
\ No newline at end of file
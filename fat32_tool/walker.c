@@ -0,0 +1,396 @@
+#include "walker.h"
+#include "extent.h"
+#include "work_pool.h"
+#include "async_io.h"
+#include "geometry.h"
+
+typedef struct walk_context_t
+{
+    block_device *dev;
+    fat_table *fat;
+    const volume_geometry *geometry;
+    walk_tree *tree;
+    int read_failed; // a directory could not be read, already reported
+} walk_context;
+
+typedef struct directory_reader_t
+{
+    walk_directory *directory;
+    int failed;
+    int read_failed;
+    int done; // the end of the directory was reached, the clusters still queued are ignored
+} directory_reader;
+
+static walk_directory *new_directory(uint32_t cluster, walk_directory *parent)
+{
+    walk_directory *directory = calloc(1, sizeof(walk_directory));
+    if (directory)
+    {
+        directory->cluster = cluster;
+        directory->parent = parent;
+    }
+    return directory;
+}
+
+/*
+ * a subdirectory pointing back to one of its ancestors would make the walk endless
+ */
+static int is_ancestor(const walk_directory *directory, uint32_t cluster)
+{
+    for (; directory; directory = directory->parent)
+    {
+        if (directory->cluster == cluster)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * append an entry to a growing array, return NULL if out of memory
+ */
+static walk_entry *append_entry(walk_entry **entries, uint32_t *count, uint32_t *capacity)
+{
+    if (*count == *capacity)
+    {
+        uint32_t grown_capacity = *capacity ? *capacity * 2 : 16;
+        walk_entry *grown = realloc(*entries, grown_capacity * sizeof(walk_entry));
+        if (!grown)
+            return NULL;
+        *entries = grown;
+        *capacity = grown_capacity;
+    }
+    return &(*entries)[(*count)++];
+}
+
+/*
+ * append the visible and deleted entries of a chunk of directory clusters, return 1 once the end of the directory
+ * is reached
+ */
+static int read_directory_chunk(const uint8_t *data, uint64_t position, size_t size, void *context)
+{
+    directory_reader *reader = context;
+    walk_directory *directory = reader->directory;
+    (void)position;
+
+    const directory_table_entry *entries = (const directory_table_entry *)data;
+    size_t entry_count = size / sizeof(directory_table_entry);
+
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        if (entries[i].name[0] == END_ENTRY_NAME)
+            return 1;
+        // long name parts are flagged as volume labels
+        if (entries[i].attributes & VOLUME_LABEL_ATTRIBUTE)
+            continue;
+
+        int deleted = entries[i].name[0] == FREE_ENTRY_NAME;
+        walk_entry *item = deleted ? append_entry(&directory->deleted, &directory->deleted_count, &directory->deleted_capacity)
+                                   : append_entry(&directory->entries, &directory->count, &directory->capacity);
+        if (!item)
+        {
+            reader->failed = 1;
+            return 1;
+        }
+
+        item->entry = entries[i];
+        item->sub = NULL;
+        if (deleted)
+            item->entry.name[0] = DELETED_NAME_CHAR;
+        format_entry_name(&item->entry, item->name);
+        if (deleted)
+            item->entry.name[0] = FREE_ENTRY_NAME;
+    }
+    return 0;
+}
+
+/*
+ * report a directory whose clusters could not be read, which fails the walk
+ */
+static void report_read_error(walk_context *walk, const walk_directory *directory)
+{
+    fprintf(stderr, "Error: cannot read the directory at cluster %u\n", directory->cluster);
+    __atomic_store_n(&walk->read_failed, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * count a directory that has been read and create its subdirectories, in entry order. Return non-zero if one
+ * could not be allocated.
+ */
+static int link_subdirectories(walk_tree *tree, walk_directory *directory)
+{
+    __atomic_add_fetch(&tree->directory_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&tree->entry_count, directory->count, __ATOMIC_RELAXED);
+
+    int failed = 0;
+    for (uint32_t i = 0; i < directory->count; i++)
+    {
+        walk_entry *item = &directory->entries[i];
+        if (!(item->entry.attributes & DIRECTORY_ATTRIBUTE) || strcmp(item->name, ".") == 0 || strcmp(item->name, "..") == 0)
+            continue;
+
+        uint32_t cluster = entry_first_cluster(&item->entry);
+        if (is_ancestor(directory, cluster))
+            continue;
+
+        item->sub = new_directory(cluster, directory);
+        failed |= !item->sub;
+    }
+    return failed;
+}
+
+/*
+ * task of the pool: read one directory and push a task for each of its subdirectories
+ */
+static void walk_directory_task(work_pool *pool, int worker, void *task)
+{
+    walk_context *walk = pool->context;
+    walk_directory *directory = task;
+
+    extent_list clusters;
+    if (extent_list_build(walk->fat, directory->cluster, CHAIN_UNBOUNDED, &clusters) != 0)
+    {
+        __atomic_store_n(&pool->failed, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    directory_reader reader = {directory, 0, 0, 0};
+    reader.read_failed = extent_list_read(walk->dev, walk->geometry, &clusters, UINT64_MAX, read_directory_chunk, &reader);
+    extent_list_free(&clusters);
+    if (reader.read_failed)
+        report_read_error(walk, directory);
+    if (reader.read_failed || reader.failed || link_subdirectories(walk->tree, directory) != 0)
+    {
+        __atomic_store_n(&pool->failed, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    for (uint32_t i = 0; i < directory->count; i++)
+    {
+        if (directory->entries[i].sub)
+            work_pool_push(pool, worker, directory->entries[i].sub);
+    }
+}
+
+/*
+ * deliver a queued chunk of directory clusters to the reader of its directory. A failed read stops the walk.
+ */
+static int read_queued_chunk(const uint8_t *data, size_t size, void *context)
+{
+    directory_reader *reader = context;
+    if (!data)
+        reader->read_failed = 1;
+    else if (!reader->done)
+        reader->done = read_directory_chunk(data, 0, size, reader);
+    return reader->failed || reader->read_failed;
+}
+
+/*
+ * read the tree level by level: the clusters of every directory of a level are queued at once, so the device
+ * sees as many reads in flight as the engine allows, then the subdirectories they hold make the next level.
+ * The chunks of a directory are delivered in order, so its entries keep their on-disk order.
+ */
+static int walk_levels(walk_context *walk)
+{
+    uint32_t cluster_size = walk->geometry->cluster_size;
+    uint32_t clusters_per_read = WALK_QUEUED_READ / cluster_size ? WALK_QUEUED_READ / cluster_size : 1;
+    async_io io;
+    if (async_io_init(&io, walk->dev, ASYNC_IO_DEFAULT_DEPTH, (size_t)clusters_per_read * cluster_size) != 0)
+        return 1;
+
+    walk_directory **level = malloc(sizeof(walk_directory *));
+    uint32_t count = 1;
+    int failed = !level;
+    if (level)
+        level[0] = walk->tree->root;
+
+    while (count > 0 && !failed)
+    {
+        directory_reader *readers = calloc(count, sizeof(directory_reader));
+        failed = !readers;
+        for (uint32_t i = 0; i < count && !failed; i++)
+        {
+            readers[i].directory = level[i];
+            extent_list clusters;
+            if (extent_list_build(walk->fat, level[i]->cluster, CHAIN_UNBOUNDED, &clusters) != 0)
+            {
+                failed = 1;
+                break;
+            }
+            for (uint32_t j = 0; j < clusters.count && !failed; j++)
+            {
+                uint32_t cluster = clusters.items[j].start_cluster;
+                uint32_t end = cluster + clusters.items[j].length;
+                for (; cluster < end && !failed; cluster += clusters_per_read)
+                {
+                    uint32_t run = end - cluster < clusters_per_read ? end - cluster : clusters_per_read;
+                    failed = async_io_submit(&io, geometry_cluster_offset(walk->geometry, cluster), (size_t)run * cluster_size, read_queued_chunk, &readers[i]);
+                }
+            }
+            extent_list_free(&clusters);
+        }
+        async_io_drain(&io);
+        for (uint32_t i = 0; i < count && readers; i++)
+            if (readers[i].read_failed)
+            {
+                report_read_error(walk, level[i]);
+                failed = 1;
+            }
+
+        // the subdirectories of the level, in tree order
+        uint32_t next_count = 0;
+        for (uint32_t i = 0; i < count && !failed; i++)
+        {
+            failed = readers[i].failed || link_subdirectories(walk->tree, level[i]) != 0;
+            for (uint32_t j = 0; j < level[i]->count; j++)
+                next_count += level[i]->entries[j].sub != NULL;
+        }
+        free(readers);
+
+        walk_directory **next = failed || next_count == 0 ? NULL : malloc(next_count * sizeof(walk_directory *));
+        failed |= next_count > 0 && !next;
+        uint32_t filled = 0;
+        for (uint32_t i = 0; i < count && next; i++)
+            for (uint32_t j = 0; j < level[i]->count; j++)
+                if (level[i]->entries[j].sub)
+                    next[filled++] = level[i]->entries[j].sub;
+        free(level);
+        level = next;
+        count = next ? next_count : 0;
+    }
+
+    free(level);
+    async_io_free(&io);
+    return failed;
+}
+
+int walk_tree_build(block_device *dev, fat_table *fat, const volume_geometry *geometry, uint32_t root_cluster, int thread_count, walk_tree *tree)
+{
+    memset(tree, 0, sizeof(*tree));
+    tree->root = new_directory(root_cluster, NULL);
+    if (!tree->root)
+    {
+        perror("Error");
+        return 1;
+    }
+
+    walk_context walk = {dev, fat, geometry, tree, 0};
+    if (!dev->map && dev->queue != BLOCK_DEVICE_QUEUE_SYNC)
+    {
+        if (walk_levels(&walk) != 0)
+        {
+            if (!walk.read_failed)
+                fprintf(stderr, "Error: not enough memory to walk the directory tree\n");
+            walk_tree_free(tree);
+            return 1;
+        }
+        return 0;
+    }
+
+    work_pool pool;
+    if (work_pool_init(&pool, thread_count, walk_directory_task, &walk) != 0)
+    {
+        walk_tree_free(tree);
+        return 1;
+    }
+
+    work_pool_push(&pool, 0, tree->root);
+    int status = work_pool_run(&pool);
+    work_pool_free(&pool);
+
+    if (status != 0)
+    {
+        if (!walk.read_failed)
+            fprintf(stderr, "Error: not enough memory to walk the directory tree\n");
+        walk_tree_free(tree);
+    }
+    return status;
+}
+
+static int visit_directory(const walk_directory *directory, char *path, size_t length, int depth, walk_visitor visitor, void *context)
+{
+    for (uint32_t i = 0; i < directory->count; i++)
+    {
+        const walk_entry *item = &directory->entries[i];
+        size_t name_length = strlen(item->name);
+        if (length + 1 + name_length >= WALK_PATH_MAX)
+            continue;
+
+        path[length] = '/';
+        memcpy(path + length + 1, item->name, name_length + 1);
+
+        if (visitor(item, path, depth, context) != 0)
+            return 1;
+        if (item->sub && visit_directory(item->sub, path, length + 1 + name_length, depth + 1, visitor, context) != 0)
+            return 1;
+
+        path[length] = '\0';
+    }
+    return 0;
+}
+
+int walk_tree_visit(const walk_tree *tree, walk_visitor visitor, void *context)
+{
+    char path[WALK_PATH_MAX] = "";
+    if (!tree->root)
+        return 0;
+    return visit_directory(tree->root, path, 0, 0, visitor, context);
+}
+
+static int visit_deleted(const walk_directory *directory, char *path, size_t length, int depth, walk_visitor visitor, void *context)
+{
+    for (uint32_t i = 0; i < directory->deleted_count; i++)
+    {
+        const walk_entry *item = &directory->deleted[i];
+        size_t name_length = strlen(item->name);
+        if (length + 1 + name_length >= WALK_PATH_MAX)
+            continue;
+
+        path[length] = '/';
+        memcpy(path + length + 1, item->name, name_length + 1);
+        if (visitor(item, path, depth, context) != 0)
+            return 1;
+        path[length] = '\0';
+    }
+
+    for (uint32_t i = 0; i < directory->count; i++)
+    {
+        const walk_entry *item = &directory->entries[i];
+        size_t name_length = strlen(item->name);
+        if (!item->sub || length + 1 + name_length >= WALK_PATH_MAX)
+            continue;
+
+        path[length] = '/';
+        memcpy(path + length + 1, item->name, name_length + 1);
+        if (visit_deleted(item->sub, path, length + 1 + name_length, depth + 1, visitor, context) != 0)
+            return 1;
+        path[length] = '\0';
+    }
+    return 0;
+}
+
+int walk_tree_visit_deleted(const walk_tree *tree, walk_visitor visitor, void *context)
+{
+    char path[WALK_PATH_MAX] = "";
+    if (!tree->root)
+        return 0;
+    return visit_deleted(tree->root, path, 0, 0, visitor, context);
+}
+
+static void free_directory(walk_directory *directory)
+{
+    for (uint32_t i = 0; i < directory->count; i++)
+    {
+        if (directory->entries[i].sub)
+            free_directory(directory->entries[i].sub);
+    }
+    free(directory->entries);
+    free(directory->deleted);
+    free(directory);
+}
+
+void walk_tree_free(walk_tree *tree)
+{
+    if (tree->root)
+        free_directory(tree->root);
+    memset(tree, 0, sizeof(*tree));
+}
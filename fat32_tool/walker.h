@@ -0,0 +1,74 @@
+#ifndef WALKER_H
+#define WALKER_H
+
+#include "utils.h"
+#include "block_device.h"
+#include "partition.h"
+#include "fat_cache.h"
+
+#define WALK_PATH_MAX 4096
+#define WALK_QUEUED_READ (64 * 1024) // largest read of directory clusters queued by a level walk
+#define DELETED_NAME_CHAR '_' // shown in place of the first character of deleted names, which FAT overwrites
+
+typedef struct walk_directory_t walk_directory;
+
+/*
+ * entry of a directory (not a volume label), "." and ".." included among the visible ones
+ */
+typedef struct walk_entry_t
+{
+    directory_table_entry entry;
+    char name[SHORT_NAME_MAX];
+    walk_directory *sub; // content of the subdirectory, NULL for files, "." and ".."
+} walk_entry;
+
+struct walk_directory_t
+{
+    uint32_t cluster;
+    walk_directory *parent;
+    walk_entry *entries; // in on-disk order
+    uint32_t count;
+    uint32_t capacity;
+    walk_entry *deleted; // deleted entries, in on-disk order, never descended into
+    uint32_t deleted_count;
+    uint32_t deleted_capacity;
+};
+
+typedef struct walk_tree_t
+{
+    walk_directory *root;
+    uint64_t directory_count;
+    uint64_t entry_count;
+} walk_tree;
+
+/*
+ * callback of walk_tree_visit. path is the full path of the entry ("/dir/file.txt"), depth is 0 for the entries
+ * of the root directory. Returning non-zero stops the visit.
+ */
+typedef int (*walk_visitor)(const walk_entry *entry, const char *path, int depth, void *context);
+
+/*
+ * read the whole directory tree below root_cluster. A mapped image, or one read with BLOCK_DEVICE_QUEUE_SYNC, is
+ * read on thread_count threads: every directory is a task of a work-stealing pool and its subdirectories are
+ * pushed as new tasks. Otherwise the tree is read level by level from the calling thread, with the clusters of a
+ * whole level queued at once (async_io.h): thread_count is then unused and the reads bypass the cluster cache.
+ * Either way each directory keeps its entries in on-disk order so the result does not depend on scheduling.
+ * A directory that cannot be read is reported and fails the walk. Return 1 on failure, 0 otherwise.
+ */
+int walk_tree_build(block_device *dev, fat_table *fat, const volume_geometry *geometry, uint32_t root_cluster, int thread_count, walk_tree *tree);
+
+/*
+ * visit the tree depth-first in on-disk order, which is the order print_tree prints it in.
+ * Return non-zero if the visitor stopped the visit.
+ */
+int walk_tree_visit(const walk_tree *tree, walk_visitor visitor, void *context);
+
+/*
+ * visit the deleted entries of every directory of the tree (the deleted entries of a directory before those of its
+ * subdirectories), with the same path and depth convention as walk_tree_visit
+ */
+int walk_tree_visit_deleted(const walk_tree *tree, walk_visitor visitor, void *context);
+
+void walk_tree_free(walk_tree *tree);
+
+#endif
@@ -0,0 +1,195 @@
+#include "work_pool.h"
+
+#include <unistd.h>
+
+typedef struct worker_argument_t
+{
+    work_pool *pool;
+    int worker;
+} worker_argument;
+
+static int deque_push(work_deque *deque, void *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity)
+    {
+        // reclaim the slots freed by thieves before growing
+        if (deque->top > 0)
+        {
+            memmove(deque->tasks, deque->tasks + deque->top, (deque->bottom - deque->top) * sizeof(void *));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        }
+        if (deque->bottom == deque->capacity)
+        {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            void **tasks = realloc(deque->tasks, capacity * sizeof(void *));
+            if (!tasks)
+            {
+                pthread_mutex_unlock(&deque->lock);
+                return 1;
+            }
+            deque->tasks = tasks;
+            deque->capacity = capacity;
+        }
+    }
+    deque->tasks[deque->bottom++] = task;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+/*
+ * owner side: newest task first, it is the one whose data is most likely still in cache
+ */
+static void *deque_pop(work_deque *deque)
+{
+    void *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top)
+        task = deque->tasks[--deque->bottom];
+    if (deque->bottom == deque->top)
+        deque->top = deque->bottom = 0;
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+/*
+ * thief side: oldest task first, usually the root of the largest remaining subtree
+ */
+static void *deque_steal(work_deque *deque)
+{
+    void *task = NULL;
+    if (pthread_mutex_trylock(&deque->lock) != 0)
+        return NULL;
+    if (deque->bottom > deque->top)
+        task = deque->tasks[deque->top++];
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static void *worker_loop(void *argument)
+{
+    work_pool *pool = ((worker_argument *)argument)->pool;
+    int worker = ((worker_argument *)argument)->worker;
+
+    for (;;)
+    {
+        void *task = deque_pop(&pool->deques[worker]);
+        for (int i = 1; !task && i < pool->thread_count; i++)
+            task = deque_steal(&pool->deques[(worker + i) % pool->thread_count]);
+
+        if (task)
+        {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+            pool->function(pool, worker, task);
+            if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0)
+            {
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+            continue;
+        }
+
+        // queued is checked under idle_lock, which work_pool_push takes after raising it, so no wakeup is lost
+        pthread_mutex_lock(&pool->idle_lock);
+        while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) != 0 && __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) <= 0)
+        {
+            pool->sleeping++;
+            pthread_cond_wait(&pool->idle, &pool->idle_lock);
+            pool->sleeping--;
+        }
+        int done = __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (done)
+            break;
+    }
+    return NULL;
+}
+
+int work_pool_init(work_pool *pool, int thread_count, work_function function, void *context)
+{
+    memset(pool, 0, sizeof(*pool));
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > WORK_POOL_MAX_THREADS)
+        thread_count = WORK_POOL_MAX_THREADS;
+
+    pool->function = function;
+    pool->context = context;
+    pool->thread_count = thread_count;
+    pool->deques = calloc(thread_count, sizeof(work_deque));
+    if (!pool->deques)
+    {
+        perror("Error");
+        return 1;
+    }
+    for (int i = 0; i < thread_count; i++)
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    return 0;
+}
+
+void work_pool_push(work_pool *pool, int worker, void *task)
+{
+    // counted before it becomes visible, so pending cannot reach 0 while the task waits in a deque
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+    if (deque_push(&pool->deques[worker], task) != 0)
+    {
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&pool->failed, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->idle_lock);
+    if (pool->sleeping > 0)
+        pthread_cond_signal(&pool->idle);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+int work_pool_run(work_pool *pool)
+{
+    pthread_t threads[WORK_POOL_MAX_THREADS];
+    worker_argument arguments[WORK_POOL_MAX_THREADS];
+    int started = 1;
+
+    for (int i = 0; i < pool->thread_count; i++)
+    {
+        arguments[i].pool = pool;
+        arguments[i].worker = i;
+    }
+
+    // the calling thread is worker 0, fewer threads than asked is fine as long as one runs
+    for (int i = 1; i < pool->thread_count; i++, started++)
+    {
+        if (pthread_create(&threads[i], NULL, worker_loop, &arguments[i]) != 0)
+            break;
+    }
+    worker_loop(&arguments[0]);
+
+    for (int i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+    return pool->failed;
+}
+
+void work_pool_free(work_pool *pool)
+{
+    for (int i = 0; i < pool->thread_count; i++)
+    {
+        free(pool->deques[i].tasks);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->deques);
+    memset(pool, 0, sizeof(*pool));
+}
+
+int work_pool_default_threads(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
@@ -0,0 +1,64 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include "utils.h"
+
+#include <pthread.h>
+
+#define WORK_POOL_MAX_THREADS 256
+
+typedef struct work_pool_t work_pool;
+
+/*
+ * run one task. worker is the index of the calling thread, to push follow-up tasks on its own deque.
+ */
+typedef void (*work_function)(work_pool *pool, int worker, void *task);
+
+/*
+ * per-worker double ended queue: the owner pushes and pops at the bottom, thieves take from the top
+ */
+typedef struct work_deque_t
+{
+    void **tasks;
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+    pthread_mutex_t lock;
+} work_deque;
+
+struct work_pool_t
+{
+    work_function function;
+    void *context; // shared state of the tasks
+    int thread_count;
+    work_deque *deques;
+    long pending; // tasks pushed and not finished yet, the pool is done when it drops to 0
+    long queued;  // tasks pushed and not taken from a deque yet
+    int failed;   // set when a task could not be queued
+    // workers finding no task sleep on idle until a push or the end of the last task
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+    int sleeping;
+};
+
+int work_pool_init(work_pool *pool, int thread_count, work_function function, void *context);
+
+/*
+ * queue a task on the deque of a worker (0 from outside the pool)
+ */
+void work_pool_push(work_pool *pool, int worker, void *task);
+
+/*
+ * run the queued tasks and the ones they push on thread_count threads (the caller's included) until none is left.
+ * Return non-zero if a task could not be queued.
+ */
+int work_pool_run(work_pool *pool);
+
+void work_pool_free(work_pool *pool);
+
+/*
+ * number of threads to use by default: one per online processor
+ */
+int work_pool_default_threads(void);
+
+#endif